@@ -35,7 +35,12 @@ typedef struct
   struct sched_param __sp;
   int __policy;
   int __tcpgrp;
-  int __pad[15];
+  int __cgroup;
+  const void *__affinity;
+  size_t __affinity_size;
+  unsigned long int __nodemask;
+  int __mpol_mode;
+  int __pad[7];
 } posix_spawnattr_t;
 
 
@@ -61,6 +66,9 @@ typedef struct
 # define POSIX_SPAWN_USEVFORK		0x40
 # define POSIX_SPAWN_SETSID		0x80
 # define POSIX_SPAWN_TCSETPGROUP	0x100
+# define POSIX_SPAWN_SETCGROUP		0x200
+# define POSIX_SPAWN_SETAFFINITY	0x400
+# define POSIX_SPAWN_SETMEMPOLICY	0x800
 #endif
 
 
@@ -179,6 +187,32 @@ extern int posix_spawnattr_tcsetpgrp_np (posix_spawnattr_t *__attr, int fd)
 extern int posix_spawnattr_tcgetpgrp_np (const posix_spawnattr_t *
 					 __restrict __attr, int *fd)
      __THROW __nonnull ((1, 2));
+
+/* Place the spawned process into the cgroup v2 directory referred to by
+   CGROUP, an open file descriptor, before it runs the new program.  */
+extern int posix_spawnattr_setcgroup_np (posix_spawnattr_t *__attr,
+					 int __cgroup)
+     __THROW __nonnull ((1));
+
+/* Return the cgroup file descriptor in the attribute structure.  */
+extern int posix_spawnattr_getcgroup_np (const posix_spawnattr_t *
+					 __restrict __attr, int *__cgroup)
+     __THROW __nonnull ((1, 2));
+
+/* Set the CPU affinity mask of the spawned process, as sched_setaffinity
+   would.  The mask is not copied and must stay valid until the last
+   spawn that uses the attributes.  */
+extern int posix_spawnattr_setaffinity_np (posix_spawnattr_t *__attr,
+					   size_t __cpusetsize,
+					   const cpu_set_t *__cpuset)
+     __THROW __nonnull ((1, 3));
+
+/* Set the NUMA memory policy of the spawned process, as set_mempolicy
+   would, for the nodes in the bit mask NODEMASK.  */
+extern int posix_spawnattr_setmempolicy_np (posix_spawnattr_t *__attr,
+					    int __mode,
+					    unsigned long int __nodemask)
+     __THROW __nonnull ((1));
 #endif
 
 /* Initialize data structure for file attribute for `spawn' call.  */
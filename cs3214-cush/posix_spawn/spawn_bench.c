@@ -0,0 +1,181 @@
+/*
+ * spawn_bench - spawn latency against the size of the parent.
+ *
+ * Grows the heap of this process step by step, from 1 MB up to a
+ * maximum (4 GB by default), touching every page so that it is all
+ * resident.  At each size it times how long it takes to start a
+ * program, the way cush does:
+ *
+ *   posix_spawn  this directory's posix_spawn, with the attributes cush
+ *                uses for a foreground job (including the terminal, if
+ *                stdin is one), which shares the address space through
+ *                CLONE_VM|CLONE_VFORK
+ *   fork         fork() followed by exec, which copies the page tables
+ *                and so slows down as the parent grows; cush takes this
+ *                path for the cat helpers of -z mode only
+ *
+ * and prints the median time from the call until it returned in the
+ * parent, in microseconds.  Stops early if memory runs out.
+ *
+ * Usage: spawn_bench [-n iterations] [-m max_mb] [program]
+ */
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "spawn.h"
+
+extern char **environ;
+
+static double
+now_us(void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+compare_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static double
+median (double *v, int n)
+{
+  qsort (v, n, sizeof *v, compare_double);
+  return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/* Give the terminal back after a child took it */
+static void
+reclaim_terminal (int tty)
+{
+  if (tty != -1)
+    tcsetpgrp (tty, getpgrp ());
+}
+
+static double
+time_posix_spawn (posix_spawnattr_t *attr, char **argv, int tty)
+{
+  pid_t pid;
+  double start = now_us ();
+  int err = posix_spawn (&pid, argv[0], NULL, attr, argv, environ);
+  double elapsed = now_us () - start;
+  if (err != 0)
+    {
+      errno = err;
+      perror ("posix_spawn");
+      exit (1);
+    }
+  waitpid (pid, NULL, 0);
+  reclaim_terminal (tty);
+  return elapsed;
+}
+
+static double
+time_fork (char **argv)
+{
+  double start = now_us ();
+  pid_t pid = fork ();
+  if (pid == 0)
+    {
+      execv (argv[0], argv);
+      _exit (127);
+    }
+  double elapsed = now_us () - start;
+  if (pid == -1)
+    {
+      perror ("fork");
+      exit (1);
+    }
+  waitpid (pid, NULL, 0);
+  return elapsed;
+}
+
+int
+main (int ac, char *av[])
+{
+  int iterations = 50;
+  long max_mb = 4096;
+  int opt;
+
+  while ((opt = getopt (ac, av, "n:m:h")) > 0)
+    switch (opt)
+      {
+      case 'n':
+	iterations = atoi (optarg);
+	break;
+      case 'm':
+	max_mb = atol (optarg);
+	break;
+      default:
+	fprintf (stderr, "Usage: %s [-n iterations] [-m max_mb] [program]\n",
+		 av[0]);
+	return opt == 'h' ? 0 : 1;
+      }
+  if (iterations < 1)
+    iterations = 1;
+  char *argv[] = { optind < ac ? av[optind] : "/bin/true", NULL };
+
+  /* The attributes of a foreground job in cush.  */
+  int tty = isatty (STDIN_FILENO) ? STDIN_FILENO : -1;
+  short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+  posix_spawnattr_t attr;
+  posix_spawnattr_init (&attr);
+  sigset_t mask, sigdef;
+  sigemptyset (&mask);
+  sigemptyset (&sigdef);
+  sigaddset (&sigdef, SIGPIPE);
+  posix_spawnattr_setsigmask (&attr, &mask);
+  posix_spawnattr_setsigdefault (&attr, &sigdef);
+  posix_spawnattr_setpgroup (&attr, 0);
+  if (tty != -1)
+    {
+      /* The parent ends up in the background while a child has the
+	 terminal, and must not be stopped for taking it back.  */
+      signal (SIGTTOU, SIG_IGN);
+      flags |= POSIX_SPAWN_TCSETPGROUP;
+      posix_spawnattr_tcsetpgrp_np (&attr, tty);
+    }
+  posix_spawnattr_setflags (&attr, flags);
+
+  printf ("%10s %14s %14s\n", "heap_mb", "posix_spawn_us", "fork_us");
+  double samples[iterations];
+  long heap_mb = 0;
+  for (long mb = 1; mb <= max_mb; mb *= 2)
+    {
+      for (; heap_mb < mb; heap_mb++)
+	{
+	  /* Kept forever; touched so that it is resident.  */
+	  char *chunk = malloc (1 << 20);
+	  if (chunk == NULL)
+	    {
+	      fprintf (stderr, "out of memory at %ld MB\n", heap_mb);
+	      return 0;
+	    }
+	  memset (chunk, 1, 1 << 20);
+	}
+
+      for (int i = 0; i < iterations; i++)
+	samples[i] = time_posix_spawn (&attr, argv, tty);
+      double spawn_us = median (samples, iterations);
+      for (int i = 0; i < iterations; i++)
+	samples[i] = time_fork (argv);
+      double fork_us = median (samples, iterations);
+
+      printf ("%10ld %14.1f %14.1f\n", mb, spawn_us, fork_us);
+      fflush (stdout);
+    }
+
+  posix_spawnattr_destroy (&attr);
+  return 0;
+}
@@ -40,6 +40,7 @@
 #include <signal.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #define __pthread_setcancelstate pthread_setcancelstate
 #define __setpgid setpgid
 #define __getpgrp getpgrp
@@ -123,7 +124,13 @@ _Static_assert (sizeof (posix_spawnattr_t) == 336,
    third issue is done by a stack allocation in parent, and by using a
    field in struct spawn_args where the child can write an error
    code. CLONE_VFORK ensures that the parent does not run until the
-   child has either exec'ed successfully or exited.  */
+   child has either exec'ed successfully or exited.
+
+   Every spawn goes through this one clone call, whatever the attributes:
+   the process group, terminal, cgroup and placement settings are all
+   applied by the child in the shared address space.  There is no fork
+   fallback, so no page tables are copied and the cost of a spawn does
+   not grow with the size of the parent (see spawn_bench.c).  */
 
 
 /* The Unix standard contains a long explanation of the way to signal
@@ -249,6 +256,30 @@ __spawni_child (void *arguments)
     }
 #endif
 
+  /* Move into the cgroup, by writing our (own, i.e. 0) pid into its
+     cgroup.procs, before anything of the new program can run.  */
+  if ((attr->__flags & POSIX_SPAWN_SETCGROUP) != 0)
+    {
+      int procs = openat (attr->__cgroup, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+      if (procs < 0)
+	goto fail;
+      ssize_t n = write (procs, "0", 1);
+      __close_nocancel (procs);
+      if (n != 1)
+	goto fail;
+    }
+
+  /* Set the CPU affinity and the memory policy, so that the new
+     program starts out where it is meant to run.  */
+  if ((attr->__flags & POSIX_SPAWN_SETAFFINITY) != 0
+      && sched_setaffinity (0, attr->__affinity_size, attr->__affinity) != 0)
+    goto fail;
+
+  if ((attr->__flags & POSIX_SPAWN_SETMEMPOLICY) != 0
+      && syscall (SYS_set_mempolicy, attr->__mpol_mode, &attr->__nodemask,
+		  8 * sizeof attr->__nodemask + 1) != 0)
+    goto fail;
+
   if ((attr->__flags & POSIX_SPAWN_SETSID) != 0
       && __setsid () < 0)
     goto fail;
@@ -0,0 +1,217 @@
+/*
+ * cgroup v2 placement of jobs.
+ *
+ * Each limited job gets a cgroup of its own below one directory that
+ * belongs to the shell.  That directory has the cpu, memory and pids
+ * controllers enabled for its children, so it must be a cgroup the
+ * user may write, e.g. one delegated by systemd (systemd-run --user
+ * -p Delegate=yes), named by $CUSH_CGROUP.
+ */
+
+#define _GNU_SOURCE 1
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+
+#include "cgroup.h"
+
+static int base_fd = -1;        /* the shell's cgroup directory */
+
+static const char *
+base_path(void)
+{
+    const char *path = getenv("CUSH_CGROUP");
+    return path != NULL ? path : "/sys/fs/cgroup/cush";
+}
+
+/* Write 'value' into the file 'name' of the cgroup directory 'fd' */
+static int
+write_file(int fd, const char *name, const char *value)
+{
+    int file = openat(fd, name, O_WRONLY | O_CLOEXEC);
+    if (file == -1)
+        return -1;
+    ssize_t len = strlen(value);
+    ssize_t n = write(file, value, len);
+    int saved_errno = errno;
+    close(file);
+    errno = saved_errno;
+    return n == len ? 0 : -1;
+}
+
+bool
+cgroup_init(void)
+{
+    if (base_fd != -1)
+        return true;
+
+    // Make sure not to create directories on whatever else is mounted
+    // at the default location, e.g. the tmpfs of a cgroup v1 hierarchy.
+    const char *path = base_path();
+    char *parent = strdup(path);
+    char *slash = strrchr(parent, '/');
+    if (slash != NULL)
+        *(slash == parent ? slash + 1 : slash) = '\0';
+    struct statfs fs;
+    bool v2 = statfs(slash != NULL ? parent : ".", &fs) == 0 && fs.f_type == CGROUP2_SUPER_MAGIC;
+    free(parent);
+    if (!v2) {
+        fprintf(stderr, "cgroup %s: not below a cgroup v2 hierarchy; set CUSH_CGROUP\n", path);
+        return false;
+    }
+
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "cgroup %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    base_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd == -1) {
+        fprintf(stderr, "cgroup %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    // One at a time, so that a controller that is not available does
+    // not keep the others from being enabled.
+    static const char *controllers[] = { "+cpu", "+memory", "+pids" };
+    for (int i = 0; i < 3; i++) {
+        if (write_file(base_fd, "cgroup.subtree_control", controllers[i]) == -1)
+            fprintf(stderr, "cgroup %s: cannot enable %s: %s\n", path, controllers[i] + 1, strerror(errno));
+    }
+    return true;
+}
+
+int
+cgroup_create(const char *name)
+{
+    if (!cgroup_init())
+        return -1;
+
+    // A cgroup of the same name may be left over from a job whose
+    // cgroup could not be removed yet; it is empty, so reuse it.
+    if (mkdirat(base_fd, name, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "cgroup %s/%s: %s\n", base_path(), name, strerror(errno));
+        return -1;
+    }
+    int fd = openat(base_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        fprintf(stderr, "cgroup %s/%s: %s\n", base_path(), name, strerror(errno));
+    return fd;
+}
+
+void
+cgroup_remove(int fd, const char *name)
+{
+    close(fd);
+    unlinkat(base_fd, name, AT_REMOVEDIR);
+}
+
+int
+cgroup_move(int fd, pid_t pid)
+{
+    // Formatted by hand: this also runs in children between fork and exec.
+    char buf[16];
+    char *p = buf + sizeof buf;
+    *--p = '\0';
+    do {
+        *--p = '0' + pid % 10;
+        pid /= 10;
+    } while (pid > 0);
+    return write_file(fd, "cgroup.procs", p);
+}
+
+static bool
+apply_one(int fd, const char *file, long long value)
+{
+    if (value == CGROUP_UNSET)
+        return true;
+
+    char buf[32];
+    if (value == CGROUP_MAX)
+        snprintf(buf, sizeof buf, "max");
+    else
+        snprintf(buf, sizeof buf, "%lld", value);
+    if (write_file(fd, file, buf) == -1) {
+        fprintf(stderr, "cgroup: cannot set %s to %s: %s\n", file, buf, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool
+cgroup_apply(int fd, const struct cgroup_limits *limits)
+{
+    bool ok = apply_one(fd, "cpu.weight", limits->cpu_weight);
+    ok = apply_one(fd, "memory.max", limits->memory_max) && ok;
+    ok = apply_one(fd, "pids.max", limits->pids_max) && ok;
+    return ok;
+}
+
+/* Parse a limit value, with a K, M or G suffix if 'sizes' */
+static bool
+parse_value(const char *s, bool sizes, long long *value)
+{
+    if (strcmp(s, "max") == 0) {
+        *value = CGROUP_MAX;
+        return true;
+    }
+
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (end == s || errno != 0 || v < 0)
+        return false;
+    if (sizes && *end != '\0') {
+        const char *suffixes = "KMG";
+        const char *suffix = strchr(suffixes, *end);
+        if (suffix == NULL || end[1] != '\0')
+            return false;
+        v <<= 10 * (suffix - suffixes + 1);
+        end++;
+    }
+    if (*end != '\0')
+        return false;
+    *value = v;
+    return true;
+}
+
+bool
+cgroup_parse_limit(const char *arg, struct cgroup_limits *limits)
+{
+    if (strncmp(arg, "cpu=", 4) == 0)
+        return parse_value(arg + 4, false, &limits->cpu_weight)
+            && limits->cpu_weight != CGROUP_MAX
+            && limits->cpu_weight >= 1 && limits->cpu_weight <= 10000;
+    if (strncmp(arg, "mem=", 4) == 0)
+        return parse_value(arg + 4, true, &limits->memory_max);
+    if (strncmp(arg, "pids=", 5) == 0)
+        return parse_value(arg + 5, false, &limits->pids_max);
+    return false;
+}
+
+static void
+print_one(const char *key, long long value, const char **sep)
+{
+    if (value == CGROUP_UNSET)
+        return;
+    if (value == CGROUP_MAX)
+        printf("%s%s=max", *sep, key);
+    else
+        printf("%s%s=%lld", *sep, key, value);
+    *sep = " ";
+}
+
+void
+cgroup_print_limits(const struct cgroup_limits *limits)
+{
+    const char *sep = "";
+    print_one("cpu", limits->cpu_weight, &sep);
+    print_one("mem", limits->memory_max, &sep);
+    print_one("pids", limits->pids_max, &sep);
+    printf("%s\n", *sep ? "" : "none");
+}
@@ -0,0 +1,50 @@
+#ifndef __CGROUP_H
+#define __CGROUP_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Limits for the cgroup of a job.  A negative value leaves the limit
+ * as it is; CGROUP_MAX lifts it. */
+#define CGROUP_MAX (-2)
+#define CGROUP_UNSET (-1)
+
+struct cgroup_limits {
+    long long cpu_weight;       /* cpu.weight, 1 to 10000 */
+    long long memory_max;       /* memory.max, in bytes */
+    long long pids_max;         /* pids.max */
+};
+
+#define CGROUP_LIMITS_UNSET ((struct cgroup_limits) { CGROUP_UNSET, CGROUP_UNSET, CGROUP_UNSET })
+
+/* Open the shell's cgroup directory (from $CUSH_CGROUP, or
+ * /sys/fs/cgroup/cush), creating it if need be, and enable the
+ * controllers for its children.  Returns false, with an error printed,
+ * if there is no such cgroup v2 directory. */
+bool cgroup_init(void);
+
+/* Create the cgroup 'name' below the shell's cgroup directory.  Returns
+ * a file descriptor for its directory, or -1 with an error printed. */
+int cgroup_create(const char *name);
+
+/* Remove the cgroup 'name' whose directory 'fd' refers to.  The cgroup
+ * must have no processes left in it. */
+void cgroup_remove(int fd, const char *name);
+
+/* Move process 'pid' (0 for the caller) into a cgroup.  Returns 0, or
+ * -1 with errno set.  Only async-signal-safe calls are used. */
+int cgroup_move(int fd, pid_t pid);
+
+/* Write the limits that are set into a cgroup.  Returns false,
+ * with an error printed, if any could not be written. */
+bool cgroup_apply(int fd, const struct cgroup_limits *limits);
+
+/* Parse an argument of the form cpu=WEIGHT, mem=BYTES[KMG] or
+ * pids=NUM ("max" for no limit) into limits.  Returns false if it is
+ * none of these. */
+bool cgroup_parse_limit(const char *arg, struct cgroup_limits *limits);
+
+/* Print the limits that are set, as cgroup_parse_limit would take them */
+void cgroup_print_limits(const struct cgroup_limits *limits);
+
+#endif /* __CGROUP_H */
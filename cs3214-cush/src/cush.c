@@ -16,6 +16,17 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
 
 /* Since the handed out code contains a number of unused functions. */
 #pragma GCC diagnostic ignored "-Wunused-function"
@@ -25,25 +36,31 @@
 #include "shell-ast.h"
 #include "utils.h"
 #include "spawn.h"
+#include "path_cache.h"
+#include "history_store.h"
+#include "cgroup.h"
 
 extern char **environ;
 
 static int z_update_jid = -1;
 static int error_update_code = -1;
-static void handle_child_status(pid_t pid, int status);
+static void handle_child_status(pid_t pid, int status, const struct rusage *usage);
 static void iterate_over_command_line(struct ast_command_line *cmdline);
 static int iterate_over_pipeline(struct ast_pipeline *pipe, struct ast_command_line *cmdline);
-static void print_all_jobs(void);
+static void print_all_jobs(bool cpu_times);
 static void free_all_jobs(void);
-static struct job *job_with_jid(int jid);
 static void print_error_message(int termination_code);
 static int check_for_builtin(struct ast_command *cmd);
+static void free_command_cache(void);
 
 static void
 usage(char *progname)
 {
-    printf("Usage: %s -h\n"
-        " -h            print this help\n",
+    printf("Usage: %s -hz [-c command | script]\n"
+        " -h            print this help\n"
+        " -z            pass data through plain 'cat' stages with splice(2)\n"
+        " -c command    run the lines of command, then exit\n"
+        " script        run the lines of the file script, then exit\n",
         progname);
 
     exit(EXIT_SUCCESS);
@@ -67,6 +84,16 @@ enum job_status {
     DONE,           /* job finished execution and exited */
 };
 
+/* What is known about one process of a job, for "time" and "jobs -t" */
+struct stage_times {
+    const char *name;            /* argv[0] of its command */
+    long spawn_ns;               /* how long spawning it took, up to its exec */
+    struct timespec exec_at;     /* when it started running its program */
+    struct timespec exited_at;   /* when it was reaped */
+    struct rusage usage;         /* from wait4(), once reaped */
+    bool reaped;
+};
+
 struct job {
     struct list_elem elem;   /* Link element for jobs list. */
     struct ast_pipeline *pipe;  /* The pipeline of commands this job represents */
@@ -79,47 +106,201 @@ struct job {
     /* Add additional fields here if needed. */
     int termination_code; /* The identifier number for the error/command that terminated the job. */
     pid_t* child_pid_array; /* The pid's of the child processes occurring within a job */
+    int num_pids;           /* The number of entries in child_pid_array */
+    int *pidfds;            /* Their pidfds while they live, or -1 if none */
+    struct stage_times *times;  /* Their timing and resource usage */
+    struct timespec started;    /* When the shell began launching the job */
+    bool timed;             /* True if the user prefixed the pipeline with "time" */
+    char *cgroup;           /* The name of its cgroup, or NULL if none */
+    int cgroup_fd;          /* and a file descriptor for it */
     bool state_saved_previously;
 };
 
 /* Utility functions for job list management.
- * We use 2 data structures: 
- * (a) an array jid2job to quickly find a job based on its id
+ * We use 3 data structures: 
+ * (a) an array jid2job to quickly find a job based on its id, which
+ *     grows on demand, with a min-heap of the jids below its high
+ *     water mark that are free again, so the lowest free jid is
+ *     handed out in O(log n)
  * (b) a linked list to support iteration
+ * (c) a hash table pid2job to find the job of a child that changed status
  */
 #define MAXJOBS (1<<16)
 static struct list job_list;
 
-static struct job * jid2job[MAXJOBS];
+static struct job ** jid2job;
+static int jid2job_size;        /* slots in jid2job, and in free_jids */
+static int next_jid = 1;        /* lowest jid never handed out */
+static int * free_jids;         /* min-heap of the jids below next_jid not in use */
+static int num_free_jids;
 
 /* Return job corresponding to jid */
 static struct job * 
 get_job_from_jid(int jid)
 {
-    if (jid > 0 && jid < MAXJOBS && jid2job[jid] != NULL)
+    if (jid > 0 && jid < next_jid && jid2job[jid] != NULL)
         return jid2job[jid];
 
     return NULL;
 }
 
+/* Return a jid to the free set */
+static void
+free_jid(int jid)
+{
+    int i = num_free_jids++;
+    while (i > 0 && free_jids[(i - 1) / 2] > jid) {
+        free_jids[i] = free_jids[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    free_jids[i] = jid;
+}
+
+/* Take the lowest free jid, growing the table if all are in use */
+static int
+alloc_jid(void)
+{
+    if (num_free_jids > 0) {
+        int jid = free_jids[0];
+        int last = free_jids[--num_free_jids];
+        int i = 0;
+        for (;;) {
+            int c = 2 * i + 1;
+            if (c >= num_free_jids)
+                break;
+            if (c + 1 < num_free_jids && free_jids[c + 1] < free_jids[c])
+                c++;
+            if (free_jids[c] >= last)
+                break;
+            free_jids[i] = free_jids[c];
+            i = c;
+        }
+        free_jids[i] = last;
+        return jid;
+    }
+
+    if (next_jid == MAXJOBS)
+        return -1;
+
+    if (next_jid >= jid2job_size) {
+        int size = jid2job_size ? 2 * jid2job_size : 16;
+        jid2job = realloc(jid2job, size * sizeof *jid2job);
+        free_jids = realloc(free_jids, size * sizeof *free_jids);
+        if (jid2job == NULL || free_jids == NULL)
+            utils_fatal_error("realloc jid2job");
+        memset(jid2job + jid2job_size, 0, (size - jid2job_size) * sizeof *jid2job);
+        jid2job_size = size;
+    }
+    return next_jid++;
+}
+
+/* The pid2job hash table uses open addressing with linear probing.
+ * Deletion shifts later entries of a probe sequence back, so there
+ * are no tombstones and lookups stay short.  The table doubles once
+ * it is half full.  A pid is removed as soon as its process is reaped,
+ * since the kernel may then hand it out again.
+ */
+struct pid_entry {
+    pid_t pid;          /* 0 if the slot is empty */
+    struct job *job;
+};
+
+static struct pid_entry *pid2job;
+static size_t pid2job_size;     /* number of slots, a power of 2 */
+static size_t pid2job_count;    /* number of slots in use */
+
+static size_t
+pid_slot(pid_t pid)
+{
+    /* Fibonacci hashing spreads consecutive pids apart */
+    return ((uint32_t) pid * 2654435769u) & (pid2job_size - 1);
+}
+
+static void
+pid2job_insert(pid_t pid, struct job *job)
+{
+    if (2 * (pid2job_count + 1) > pid2job_size) {
+        struct pid_entry *old = pid2job;
+        size_t old_size = pid2job_size;
+
+        pid2job_size = old_size ? 2 * old_size : 64;
+        pid2job = calloc(pid2job_size, sizeof *pid2job);
+        if (pid2job == NULL)
+            utils_fatal_error("calloc pid2job");
+        pid2job_count = 0;
+        for (size_t i = 0; i < old_size; i++)
+            if (old[i].pid != 0)
+                pid2job_insert(old[i].pid, old[i].job);
+        free(old);
+    }
+
+    size_t i = pid_slot(pid);
+    while (pid2job[i].pid != 0 && pid2job[i].pid != pid)
+        i = (i + 1) & (pid2job_size - 1);
+    if (pid2job[i].pid == 0)
+        pid2job_count++;
+    pid2job[i] = (struct pid_entry) { pid, job };
+}
+
+/* Return the slot of pid, or -1 if it is not in the table */
+static ssize_t
+pid2job_find(pid_t pid)
+{
+    if (pid2job_size == 0)
+        return -1;
+
+    for (size_t i = pid_slot(pid); pid2job[i].pid != 0; i = (i + 1) & (pid2job_size - 1))
+        if (pid2job[i].pid == pid)
+            return i;
+    return -1;
+}
+
+/* Return the job that child pid belongs to, or NULL */
+static struct job *
+get_job_from_pid(pid_t pid)
+{
+    ssize_t i = pid2job_find(pid);
+    return i >= 0 ? pid2job[i].job : NULL;
+}
+
+/* Remove pid from the table if it belongs to job */
+static void
+pid2job_remove(pid_t pid, struct job *job)
+{
+    ssize_t hole = pid2job_find(pid);
+    if (hole < 0 || pid2job[hole].job != job)
+        return;
+
+    /* Move back every later entry of the run that the hole would
+     * otherwise cut off from its home slot. */
+    size_t mask = pid2job_size - 1;
+    for (size_t i = (hole + 1) & mask; pid2job[i].pid != 0; i = (i + 1) & mask) {
+        size_t home = pid_slot(pid2job[i].pid);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            pid2job[hole] = pid2job[i];
+            hole = i;
+        }
+    }
+    pid2job[hole].pid = 0;
+    pid2job_count--;
+}
+
 /* Add a new job to the job list */
 static struct job *
 add_job(struct ast_pipeline *pipe)
 {
     struct job * job = malloc(sizeof *job);
-    job->pipe = pipe;
+    job->pipe = ast_pipeline_ref(pipe);
     job->num_processes_alive = 0;
-    list_push_back(&job_list, &job->elem);
-    for (int i = 1; i < MAXJOBS; i++) {
-        if (jid2job[i] == NULL) {
-            jid2job[i] = job;
-            job->jid = i;
-            return job;
-        }
+    int jid = alloc_jid();
+    if (jid == -1) {
+        fprintf(stderr, "Maximum number of jobs exceeded\n");
+        abort();
     }
-    fprintf(stderr, "Maximum number of jobs exceeded\n");
-    abort();
-    return NULL;
+    list_push_back(&job_list, &job->elem);
+    jid2job[jid] = job;
+    job->jid = jid;
+    return job;
 }
 
 /* Delete a job.
@@ -133,7 +314,19 @@ delete_job(struct job *job)
     assert(jid != -1);
     jid2job[jid]->jid = -1;
     jid2job[jid] = NULL;
+    free_jid(jid);
+    for (int i = 0; i < job->num_pids; i++) {
+        pid2job_remove(job->child_pid_array[i], job);
+        if (job->pidfds[i] != -1)
+            close(job->pidfds[i]);
+    }
     free(job->child_pid_array);
+    free(job->pidfds);
+    free(job->times);
+    if (job->cgroup != NULL) {
+        cgroup_remove(job->cgroup_fd, job->cgroup);
+        free(job->cgroup);
+    }
     ast_pipeline_free(job->pipe);
     free(job);
 }
@@ -198,9 +391,98 @@ print_error_message(int termination_code) {
     }
 }
 
-/* Print a job */
+static double
+timespec_diff(const struct timespec *end, const struct timespec *start)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double
+timeval_secs(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* CPU time used so far by a process that has not been reaped, from /proc */
+static double
+live_cpu_time(pid_t pid)
+{
+    char path[32];
+    snprintf(path, sizeof path, "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+
+    // Fields 14 and 15 are utime and stime; skip past the command name,
+    // which may contain spaces, by way of its closing parenthesis.
+    char buf[1024];
+    unsigned long utime = 0, stime = 0;
+    size_t n = fread(buf, 1, sizeof buf - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    char *p = strrchr(buf, ')');
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return 0;
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* CPU time used so far by all processes of a job */
+static double
+job_cpu_time(struct job *job)
+{
+    double secs = 0;
+    for (int i = 0; i < job->num_pids; i++) {
+        struct stage_times *t = &job->times[i];
+        if (t->reaped)
+            secs += timeval_secs(&t->usage.ru_utime) + timeval_secs(&t->usage.ru_stime);
+        else
+            secs += live_cpu_time(job->child_pid_array[i]);
+    }
+    return secs;
+}
+
+/*
+ * Print what "time" reports for a job whose processes have all been
+ * reaped: the times and resource usage of each one, and of the job.
+ * Real time runs from exec to exit for a process, and from the start of
+ * the launch to the last exit for the job.
+ */
+static void
+print_job_times(struct job *job)
+{
+    fprintf(stderr, "%-12s %8s %8s %8s %9s %6s %6s %9s\n",
+            "stage", "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "spawn");
+
+    struct timespec last_exit = job->started;
+    double user = 0, sys = 0;
+    long maxrss = 0, nvcsw = 0, nivcsw = 0;
+    for (int i = 0; i < job->num_pids; i++) {
+        struct stage_times *t = &job->times[i];
+        if (!t->reaped)
+            continue;
+        struct rusage *ru = &t->usage;
+        fprintf(stderr, "%-12.12s %8.3f %8.3f %8.3f %8ldk %6ld %6ld %7.3fms\n",
+                t->name, timespec_diff(&t->exited_at, &t->exec_at),
+                timeval_secs(&ru->ru_utime), timeval_secs(&ru->ru_stime),
+                ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, t->spawn_ns / 1e6);
+
+        if (timespec_diff(&t->exited_at, &last_exit) > 0)
+            last_exit = t->exited_at;
+        user += timeval_secs(&ru->ru_utime);
+        sys += timeval_secs(&ru->ru_stime);
+        if (ru->ru_maxrss > maxrss)
+            maxrss = ru->ru_maxrss;
+        nvcsw += ru->ru_nvcsw;
+        nivcsw += ru->ru_nivcsw;
+    }
+    fprintf(stderr, "%-12s %8.3f %8.3f %8.3f %8ldk %6ld %6ld\n",
+            "total", timespec_diff(&last_exit, &job->started),
+            user, sys, maxrss, nvcsw, nivcsw);
+}
+
+/* Print a job, with the CPU time it used so far if cpu_times */
 static void
-print_job(struct job *job)
+print_job(struct job *job, bool cpu_times)
 {
 
     if(job->status ==  TERMINATED){ //check to see if job is terminated
@@ -212,7 +494,10 @@ print_job(struct job *job)
     else{
         printf("[%d]\t%s\t\t(", job->jid, get_status(job->status));
         print_cmdline(job->pipe);
-        printf(")\n");
+        if (cpu_times)
+            printf(")\t%.2fs cpu\n", job_cpu_time(job));
+        else
+            printf(")\n");
     }
 }
 
@@ -220,7 +505,7 @@ print_job(struct job *job)
  * Prints out every job in the list of jobs.
  */
 void 
-print_all_jobs()
+print_all_jobs(bool cpu_times)
 {
 
     struct list_elem *e = list_begin(&job_list);
@@ -230,8 +515,10 @@ print_all_jobs()
         // If the job status is terminated or done, then we'll need to delete
         // this job after we print it out. Otherwise, we can just iterate
         // normally.
-        print_job(current_job);
+        print_job(current_job, cpu_times);
         if (current_job->status == TERMINATED || current_job->status == DONE) {
+            if (current_job->timed)
+                print_job_times(current_job);
             e = list_remove(e);
             delete_job(current_job);
         } else {
@@ -255,51 +542,245 @@ free_all_jobs()
 }
 
 /*
- * Returns the job with the given jid.
+ * Job cgroups.  Once "limit -d" has set limits for new jobs, every job
+ * is started in a fresh cgroup of its own, with those limits; "limit
+ * jid" changes the limits of a running job, moving it into a cgroup
+ * first if it does not have one yet.  Each process is put into its
+ * cgroup by posix_spawn itself, before it runs its program.
  */
-static struct job *
-job_with_jid(int jid)
+static struct cgroup_limits new_job_limits = CGROUP_LIMITS_UNSET;
+static bool limit_new_jobs;
+static unsigned int cgroup_seq;
+
+/* Create a fresh cgroup, named into *name, with the limits for new jobs.
+ * A limit that cannot be set is reported, but the job still gets the
+ * cgroup, and whatever limits could be set. */
+static int
+new_job_cgroup(char **name)
 {
-    struct job * found_job = NULL;
-    for (struct list_elem * e = list_begin (&job_list); 
-        e != list_end (&job_list); 
-        e = list_next (e)) {
-        struct job *current_job = list_entry(e, struct job, elem);
-        if(current_job->jid == jid) {
-            found_job = current_job;
-            break;
+    if (asprintf(name, "job.%d.%u", getpid(), cgroup_seq++) == -1)
+        utils_fatal_error("asprintf failed");
+    int fd = cgroup_create(*name);
+    if (fd == -1) {
+        free(*name);
+        *name = NULL;
+        return -1;
+    }
+    cgroup_apply(fd, &new_job_limits);
+    return fd;
+}
+
+/* Move a running job that has no cgroup into a new one */
+static bool
+move_job_to_cgroup(struct job *job)
+{
+    job->cgroup_fd = new_job_cgroup(&job->cgroup);
+    if (job->cgroup_fd == -1)
+        return false;
+    for (int i = 0; i < job->num_pids; i++) {
+        if (job->times[i].reaped)
+            continue;
+        if (cgroup_move(job->cgroup_fd, job->child_pid_array[i]) == -1 && errno != ESRCH)
+            perror("limit: cgroup.procs");
+    }
+    return true;
+}
+
+/*
+ * limit                        print the limits for new jobs
+ * limit -d cpu=W mem=B pids=N  set the limits for new jobs
+ * limit jid cpu=W mem=B pids=N change the limits of a job
+ */
+static void
+limit_builtin(struct ast_command *cmd)
+{
+    if (cmd->argv[1] == NULL) {
+        cgroup_print_limits(&new_job_limits);
+        return;
+    }
+
+    struct cgroup_limits limits = CGROUP_LIMITS_UNSET;
+    for (char **arg = cmd->argv + 2; *arg != NULL; arg++) {
+        if (!cgroup_parse_limit(*arg, &limits)) {
+            printf("limit: bad limit %s; use cpu=1..10000, mem=BYTES[KMG] or pids=NUM\n", *arg);
+            return;
         }
     }
-    return found_job;
+
+    if (strcmp(cmd->argv[1], "-d") == 0) {
+        if (!cgroup_init())
+            return;
+        if (limits.cpu_weight != CGROUP_UNSET)
+            new_job_limits.cpu_weight = limits.cpu_weight;
+        if (limits.memory_max != CGROUP_UNSET)
+            new_job_limits.memory_max = limits.memory_max;
+        if (limits.pids_max != CGROUP_UNSET)
+            new_job_limits.pids_max = limits.pids_max;
+        limit_new_jobs = true;
+        return;
+    }
+
+    struct job * found_job = get_job_from_jid(atoi(cmd->argv[1]));
+    if (found_job == NULL) {
+        printf("limit %s: No such job\n", cmd->argv[1]);
+        return;
+    }
+    if (found_job->cgroup == NULL && !move_job_to_cgroup(found_job))
+        return;
+    cgroup_apply(found_job->cgroup_fd, &limits);
 }
 
 
 /*
- * Suggested SIGCHLD handler.
- *
+ * The shell never takes SIGCHLD as a signal.  It stays blocked for the
+ * shell's whole life and is read from sigchld_fd instead, at the two
+ * places where the shell waits: in wait_for_job, and at the prompt,
+ * where event_fd watches it alongside the terminal.
+ */
+static int sigchld_fd = -1;
+static int event_fd = -1;       /* epoll set over stdin and sigchld_fd */
+
+/* Block until a SIGCHLD is pending, and take it. */
+static void
+wait_for_sigchld(void)
+{
+    struct signalfd_siginfo info;
+    ssize_t n;
+
+    while ((n = read(sigchld_fd, &info, sizeof info)) == -1 && errno == EINTR)
+        continue;
+    if (n != sizeof info)
+        utils_fatal_error("read from signalfd failed");
+}
+
+/*
  * Call waitpid() to learn about any child processes that
  * have exited or changed status (been stopped, needed the
  * terminal, etc.)
- * Just record the information by updating the job list
- * data structures.  Since the call may be spurious (e.g.
- * an already pending SIGCHLD is delivered even though
- * a foreground process was already reaped), ignore when
- * waitpid returns -1.
- * Use a loop with WNOHANG since only a single SIGCHLD 
- * signal may be delivered for multiple children that have 
- * exited. All of them need to be reaped.
+ * Use a loop with WNOHANG since only a single SIGCHLD
+ * may be pending for multiple children that have
+ * exited. All of them need to be reaped.  The SIGCHLD
+ * may also be stale (its child was already reaped in an
+ * earlier pass), in which case waitpid finds nothing.
  */
 static void
-sigchld_handler(int sig, siginfo_t *info, void *_ctxt)
+reap_children(void)
 {
     pid_t child;
     int status;
+    struct rusage usage;
+
+    while ((child = wait4(-1, &status, WUNTRACED|WNOHANG, &usage)) > 0) {
+        handle_child_status(child, status, &usage);
+    }
+}
+
+/*
+ * Each job holds a pidfd for every one of its processes that is alive,
+ * where the kernel has pidfd_open(2), so that waiting for a foreground
+ * job looks at that job's processes only.  A pidfd refers to its
+ * process until closed, even once the pid is free for reuse, so the
+ * wait can never pick up some other process by mistake.
+ */
+static bool have_pidfds = true;
+
+static void
+open_pidfds(struct job *job)
+{
+    job->pidfds = malloc(job->num_pids * sizeof(int));
+    for (int i = 0; i < job->num_pids; i++) {
+        // The child cannot have been reaped yet, so its pid is still its own.
+        job->pidfds[i] = have_pidfds ? syscall(SYS_pidfd_open, job->child_pid_array[i], 0) : -1;
+        if (job->pidfds[i] == -1 && errno == ENOSYS)
+            have_pidfds = false;
+    }
+}
+
+/* Close the pidfd of pid, which exited */
+static void
+close_pidfd(struct job *job, pid_t pid)
+{
+    for (int i = 0; i < job->num_pids; i++) {
+        if (job->child_pid_array[i] == pid && job->pidfds[i] != -1) {
+            close(job->pidfds[i]);
+            job->pidfds[i] = -1;
+        }
+    }
+}
 
-    assert(sig == SIGCHLD);
+/* Record the exit time and resource usage of pid, which was reaped */
+static void
+record_stage_exit(struct job *job, pid_t pid, const struct rusage *usage)
+{
+    for (int i = 0; i < job->num_pids; i++) {
+        if (job->child_pid_array[i] == pid && !job->times[i].reaped) {
+            clock_gettime(CLOCK_MONOTONIC, &job->times[i].exited_at);
+            job->times[i].usage = *usage;
+            job->times[i].reaped = true;
+            return;
+        }
+    }
+}
+
+/* The wait status that waitpid() would have returned for info */
+static int
+wait_status(const siginfo_t *info)
+{
+    switch (info->si_code) {
+    case CLD_EXITED:
+        return W_EXITCODE(info->si_status, 0);
+    case CLD_DUMPED:
+        return W_EXITCODE(0, info->si_status) | WCOREFLAG;
+    case CLD_STOPPED:
+    case CLD_TRAPPED:
+        return W_STOPCODE(info->si_status);
+    default:
+        return W_EXITCODE(0, info->si_status);
+    }
+}
+
+/*
+ * Sleep until one of the job's processes exits or SIGCHLD comes in,
+ * then collect the status changes of the job's own processes.  A pidfd
+ * only becomes readable on exit, so a stop (^Z, SIGTTIN) still has to
+ * be noticed through SIGCHLD.  Other children are left to the reaping
+ * at the prompt.  Returns false if some process of the job has no
+ * pidfd, in which case nothing was waited for.
+ */
+static bool
+wait_for_job_pidfds(struct job *job)
+{
+    struct pollfd fds[job->num_pids + 1];
+    int nfds = 0;
+
+    fds[nfds++] = (struct pollfd) { .fd = sigchld_fd, .events = POLLIN };
+    for (int i = 0; i < job->num_pids; i++) {
+        if (job->pidfds[i] != -1)
+            fds[nfds++] = (struct pollfd) { .fd = job->pidfds[i], .events = POLLIN };
+    }
+    if (nfds - 1 < job->num_processes_alive)
+        return false;
+
+    while (poll(fds, nfds, -1) == -1) {
+        if (errno != EINTR)
+            utils_fatal_error("poll failed");
+    }
+    if (fds[0].revents & POLLIN)
+        wait_for_sigchld();
+
+    for (int i = 0; i < job->num_pids; i++) {
+        if (job->pidfds[i] == -1)
+            continue;
 
-    while ((child = waitpid(-1, &status, WUNTRACED|WNOHANG)) > 0) {
-        handle_child_status(child, status);
+        // The waitid system call, unlike its wrapper, reports rusage too.
+        siginfo_t info = { .si_pid = 0 };
+        struct rusage usage;
+        if (syscall(SYS_waitid, P_PIDFD, job->pidfds[i], &info, WEXITED|WSTOPPED|WNOHANG, &usage) == -1)
+            utils_fatal_error("waitid failed");
+        if (info.si_pid != 0)
+            handle_child_status(info.si_pid, wait_status(&info), &usage);
     }
+    return true;
 }
 
 /* Wait for all processes in this job to complete, or for
@@ -330,24 +811,15 @@ wait_for_job(struct job *job)
 {
     assert(signal_is_blocked(SIGCHLD));
 
+    // Where the job has pidfds, wait on those.  Otherwise fall back on
+    // sleeping in the signalfd: every status change of a child leaves a
+    // SIGCHLD pending, so this cannot miss the change that ends the wait,
+    // but each wakeup reaps every child that is ready, not just the job's.
     while (job->status == FOREGROUND && job->num_processes_alive > 0) {
-        int status;
-
-        pid_t child = waitpid(-1, &status, WUNTRACED);
-
-        // When called here, any error returned by waitpid indicates a logic
-        // bug in the shell.
-        // In particular, ECHILD "No child process" means that there has
-        // already been a successful waitpid() call that reaped the child, so
-        // there's likely a bug in handle_child_status where it failed to update
-        // the "job" status and/or num_processes_alive fields in the required
-        // fashion.
-        // Since SIGCHLD is blocked, there cannot be races where a child's exit
-        // was handled via the SIGCHLD signal handler.
-        if (child != -1)
-            handle_child_status(child, status);
-        else
-            utils_fatal_error("waitpid failed, see code for explanation");
+        if (!wait_for_job_pidfds(job)) {
+            wait_for_sigchld();
+            reap_children();
+        }
     }
 
     // If we reach this code, then either all of the processes in the job
@@ -370,6 +842,8 @@ wait_for_job(struct job *job)
     // but we're using the bg command to move the entire job
     // into the background.
     if (job->num_processes_alive < 1) {
+        if (job->timed)
+            print_job_times(job);
         list_remove(&job->elem);
         delete_job(job);
     }
@@ -377,28 +851,23 @@ wait_for_job(struct job *job)
 }
 
 static void
-handle_child_status(pid_t pid, int status)
+handle_child_status(pid_t pid, int status, const struct rusage *usage)
 {
     assert(signal_is_blocked(SIGCHLD));
 
     // Starts by getting the job that contains the process that
-    // just changed its status. Searches by PID.
-    struct job * found_job = NULL;
-    for (struct list_elem * e = list_begin (&job_list); 
-        e != list_end (&job_list); 
-        e = list_next (e)) {
-    
-        struct job *current_job = list_entry(e, struct job, elem);
-        int num_pids_to_search = list_size(&current_job->pipe->commands);
-        for (int i = 0; i < num_pids_to_search; i++) {
-            if (current_job->child_pid_array[i] == pid) {
-                found_job = current_job;
-            }
-        }
-        if (found_job != NULL) {
-            break;
-        }
+    // just changed its status, from the pid2job table.
+    struct job * found_job = get_job_from_pid(pid);
+    if (found_job == NULL) {
+        return;
+    }
 
+    // A process that exited or was killed will not be heard of again,
+    // and its pid may be reused.
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        pid2job_remove(pid, found_job);
+        close_pidfd(found_job, pid);
+        record_stage_exit(found_job, pid, usage);
     }
 
     // Now updates the status, termination code, process alive, and so on
@@ -452,215 +921,1073 @@ handle_child_status(pid_t pid, int status)
 void 
 iterate_over_command_line(struct ast_command_line *cmdline)
 {
-    for (struct list_elem * e = list_begin(&cmdline->pipes); e != list_end(&cmdline->pipes); ) {
-        
-        // Gets the current pipeline and then removes the node from the command_line list
-        // since we won't need to access the *full command line* after this point.
+    // The command line is left as parsed, so a cached one can be run again;
+    // a pipeline that becomes a job takes its own reference to the arena.
+    for (struct list_elem * e = list_begin(&cmdline->pipes); e != list_end(&cmdline->pipes); e = list_next(e)) {
         struct ast_pipeline *pipe = list_entry(e, struct ast_pipeline, elem);
-        e = list_remove(e);
-
-        // Now iterates over each command in that pipeline
-        int delete_pipeline = iterate_over_pipeline(pipe, cmdline);
-        
-        //If delete_pipeline is 1, then we were running a builtin, so we
-        // won't need the pipe later and can go ahead and free it now.
-        if (delete_pipeline == 1) {
-            ast_pipeline_free(pipe);
-        }
+        iterate_over_pipeline(pipe, cmdline);
     }
 }
 
 
-// Returns 1 if we need to free the pipeline after it returns.
-// (We only need to free pipelines when we've completed running a builtin command.)
-int
-iterate_over_pipeline(struct ast_pipeline *pipe, struct ast_command_line *cmdline)
+/*
+ * Spawn plans.  The spawn attributes and file actions of a pipeline
+ * depend only on its shape: how many commands it has, where it is
+ * redirected, which commands have stderr joined to stdout, and whether
+ * it runs in the background.  They are built once per shape and kept in
+ * a small cache, so that a script running the same kind of command line
+ * over and over does not set them up and tear them down for every job.
+ *
+ * The file actions name the pipe fds they were built with.  Since fds
+ * are handed out lowest first, the pipes of the next job of the same
+ * shape almost always come out with the same numbers; if not, the file
+ * actions are built again.
+ */
+#define SPAWN_PLAN_CACHE 8
+
+struct spawn_plan {
+    int length;                  /* number of commands */
+    bool bg_job;
+    char *iored_input;
+    char *iored_output;
+    bool append_to_output;
+    bool *dup_stderr_to_stdout;  /* one per command */
+
+    posix_spawnattr_t attr;      /* shared by all commands but for the pgroup */
+    posix_spawn_file_actions_t *actions;  /* one per command */
+    bool have_actions;
+    int (*pipes)[2];             /* the current job's pipes */
+    int (*built_pipes)[2];       /* the pipes the actions name */
+    unsigned long last_used;
+};
+
+static struct spawn_plan *spawn_plans[SPAWN_PLAN_CACHE];
+static unsigned long spawn_plan_clock;
+
+static bool
+strings_equal(const char *a, const char *b)
 {
-    
-    // Starts by blocking SIGCHLD until we're done adding children and managing the job.
-    // We do this to ensure that we don't handle the signals from finishing processes until
-    // after we've finished setting up the job. We don't need to check the return of signal_block
-    // because we don't care if it's already been blocked, so long as it is currently blocked.
-    signal_block(SIGCHLD);
+    return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
 
-    // Before we start dealing with piping and jobs, we want to confirm that we're not
-    // just running a builtin. Exit is a special case even among the builtins, as we
-    // need to clean our memory up before we exit directly from here. So we handle it separately.
-    struct ast_command *builtin_cmd = list_entry(list_begin(&pipe->commands), struct ast_command, elem);
-    if (strcmp(builtin_cmd->argv[0],"exit") == 0) {            
-        free_all_jobs();
-        ast_pipeline_free(pipe);
-        free(cmdline);
-        exit(0);
+/* Is plan the one for pipelines shaped like pipe? */
+static bool
+spawn_plan_matches(struct spawn_plan *plan, struct ast_pipeline *pipe)
+{
+    if (plan->length != list_size(&pipe->commands) || plan->bg_job != pipe->bg_job
+        || plan->append_to_output != pipe->append_to_output
+        || !strings_equal(plan->iored_input, pipe->iored_input)
+        || !strings_equal(plan->iored_output, pipe->iored_output))
+        return false;
+
+    int i = 0;
+    for (struct list_elem * e = list_begin(&pipe->commands);
+         e != list_end(&pipe->commands);
+         e = list_next(e), i++) {
+        struct ast_command *cmd = list_entry(e, struct ast_command, elem);
+        if (plan->dup_stderr_to_stdout[i] != cmd->dup_stderr_to_stdout)
+            return false;
     }
-    // Now checks for the other builtin commands.
-    if (check_for_builtin(builtin_cmd) == 1) {
-        signal_unblock(SIGCHLD);
-        return 1;
+    return true;
+}
+
+static void
+spawn_plan_destroy_actions(struct spawn_plan *plan)
+{
+    if (!plan->have_actions)
+        return;
+    for (int i = 0; i < plan->length; i++) {
+        if (posix_spawn_file_actions_destroy(&plan->actions[i])) {
+            perror("posix_spawn_file_actions_destroy");
+        }
     }
+    plan->have_actions = false;
+}
 
-    // Sets up some variables to use while setting up our child processes.
-    int child_count = 0;
-    pid_t pgid = 0;
-    int pipeline_length = list_size(&pipe->commands);
-    pid_t* child_pid_array = (pid_t*)malloc(pipeline_length * sizeof(pid_t));
+static void
+spawn_plan_free(struct spawn_plan *plan)
+{
+    spawn_plan_destroy_actions(plan);
+    posix_spawnattr_destroy(&plan->attr);
+    free(plan->iored_input);
+    free(plan->iored_output);
+    free(plan->dup_stderr_to_stdout);
+    free(plan->actions);
+    free(plan->pipes);
+    free(plan->built_pipes);
+    free(plan);
+}
 
-    // The length of the pipeline = #pipes needed - 1. So if we have 2 commands
-    // in the pipeline, we need one pipe. If we have only 1 command in the pipeline,
-    // then we need zero pipes. We must use malloc here because it's possible
-    // to dynamically allocate an array of length 0, but we cannot statically
-    // allocate an array in such a case.
+/* Build the file actions of every command for the current pipes.
+ * Returns false if one of them could not be set up. */
+static bool
+spawn_plan_build_actions(struct spawn_plan *plan)
+{
     const int READ_END = 0;
     const int WRITE_END = 1;
-    int (*pipes)[2] = malloc(sizeof(int[pipeline_length - 1][2]));
-    for (int i = 0; i < (pipeline_length - 1); i++) {
-        pipe2(pipes[i], O_CLOEXEC);
-    }
-
-    // Each iteration of the for loop is for a different command.
-    for (struct list_elem * e = list_begin(&pipe->commands); 
-         e != list_end(&pipe->commands); 
-         e = list_next(e)) {
-
-        // Gets the current command.
-        struct ast_command *cmd = list_entry(e, struct ast_command, elem);
 
-        // Set up variables and flags for use with posix_spawnp
+    spawn_plan_destroy_actions(plan);
+    for (int i = 0; i < plan->length; i++) {
+        posix_spawn_file_actions_t *actions = &plan->actions[i];
         int file_actions_status;
-        int spawn_attr_status;
-        sigset_t child_sigmask;
-        sigemptyset(&child_sigmask);
-        posix_spawn_file_actions_t child_file_attr;
-        posix_spawnattr_t child_spawn_attr;
-        if ((spawn_attr_status = posix_spawnattr_init(&child_spawn_attr))) {
-            perror("posix_spawnattr_init");
-            return 1;
-        }
-        if ((file_actions_status = posix_spawn_file_actions_init(&child_file_attr))) {
+        if ((file_actions_status = posix_spawn_file_actions_init(actions))) {
             perror("posix_spawn_file_actions_init");
-            return 1;
-        }
-        short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK;
-        if (!(pipe->bg_job)) {
-            flags = flags | POSIX_SPAWN_TCSETPGROUP;
-            spawn_attr_status = spawn_attr_status | posix_spawnattr_tcsetpgrp_np(&child_spawn_attr, termstate_get_tty_fd());
-        }
-
-        spawn_attr_status = spawn_attr_status | posix_spawnattr_setflags(&child_spawn_attr, flags);
-        spawn_attr_status = spawn_attr_status | posix_spawnattr_setpgroup(&child_spawn_attr, pgid);
-        spawn_attr_status = spawn_attr_status | posix_spawnattr_setsigmask(&child_spawn_attr, &child_sigmask);
-        if (spawn_attr_status) {
-            perror("spawn_attr_status");
-            return 1;
+            while (i-- > 0)
+                posix_spawn_file_actions_destroy(&plan->actions[i]);
+            return false;
         }
 
         // If we're the first command in the pipeline and we have an input file
-        if (child_count == 0 && pipe->iored_input != NULL) {
-            file_actions_status = file_actions_status | posix_spawn_file_actions_addopen(&child_file_attr, STDIN_FILENO, pipe->iored_input, O_RDONLY, 0);
+        if (i == 0 && plan->iored_input != NULL) {
+            file_actions_status = file_actions_status | posix_spawn_file_actions_addopen(actions, STDIN_FILENO, plan->iored_input, O_RDONLY, 0);
         }
         // If we're the last command in the pipeline and we have an output file
-        if (child_count == pipeline_length - 1 && pipe->iored_output != NULL) {
-            int oflags = (O_CREAT | O_WRONLY) | ((pipe->append_to_output) ? O_APPEND : O_TRUNC);
-            file_actions_status = posix_spawn_file_actions_addopen(&child_file_attr, STDOUT_FILENO, pipe->iored_output, oflags, S_IROTH | S_IWOTH | S_IRGRP | S_IWGRP | S_IRUSR | S_IWUSR);
-            if (!file_actions_status && cmd->dup_stderr_to_stdout) {
-                file_actions_status = posix_spawn_file_actions_adddup2(&child_file_attr, STDOUT_FILENO, STDERR_FILENO); 
+        if (i == plan->length - 1 && plan->iored_output != NULL) {
+            int oflags = (O_CREAT | O_WRONLY) | ((plan->append_to_output) ? O_APPEND : O_TRUNC);
+            file_actions_status = posix_spawn_file_actions_addopen(actions, STDOUT_FILENO, plan->iored_output, oflags, S_IROTH | S_IWOTH | S_IRGRP | S_IWGRP | S_IRUSR | S_IWUSR);
+            if (!file_actions_status && plan->dup_stderr_to_stdout[i]) {
+                file_actions_status = posix_spawn_file_actions_adddup2(actions, STDOUT_FILENO, STDERR_FILENO);
             }
         }
 
-        if (file_actions_status) {
-            perror("posix_spawn_file_actions_addopen");
-            return 1;
-        }
-
-        // If we're setting up piping and we're not the first command in the pipeline
+        // If we're not the first command in the pipeline
         // (i.e. we're getting our input from a pipe)
-        if (pipeline_length > 1 && child_count > 0) {
-            file_actions_status = posix_spawn_file_actions_adddup2(&child_file_attr, pipes[child_count - 1][READ_END], STDIN_FILENO);        
+        if (!file_actions_status && i > 0) {
+            file_actions_status = posix_spawn_file_actions_adddup2(actions, plan->pipes[i - 1][READ_END], STDIN_FILENO);
         }
-        // If we're setting up piping and we're not the last command in the pipeline
+        // If we're not the last command in the pipeline
         // (i.e. we're sending our output to a pipe)
-        if (pipeline_length > 1 && child_count < pipeline_length - 1) {
-            file_actions_status = posix_spawn_file_actions_adddup2(&child_file_attr, pipes[child_count][WRITE_END], STDOUT_FILENO);
-            if (!file_actions_status && cmd->dup_stderr_to_stdout) {
-                file_actions_status = posix_spawn_file_actions_adddup2(&child_file_attr, STDOUT_FILENO, STDERR_FILENO);
+        if (!file_actions_status && i < plan->length - 1) {
+            file_actions_status = posix_spawn_file_actions_adddup2(actions, plan->pipes[i][WRITE_END], STDOUT_FILENO);
+            if (!file_actions_status && plan->dup_stderr_to_stdout[i]) {
+                file_actions_status = posix_spawn_file_actions_adddup2(actions, STDOUT_FILENO, STDERR_FILENO);
             }
         }
 
         if (file_actions_status) {
-            perror("posix_spawn_file_actions_adddup2");
-            return 1;
+            perror("posix_spawn_file_actions_add");
+            for (; i >= 0; i--)
+                posix_spawn_file_actions_destroy(&plan->actions[i]);
+            return false;
         }
+    }
+    memcpy(plan->built_pipes, plan->pipes, sizeof(int[plan->length - 1][2]));
+    plan->have_actions = true;
+    return true;
+}
 
-        pid_t new_child_pid;
-        int posix_spawn_status = posix_spawnp(&new_child_pid, cmd->argv[0], &child_file_attr, &child_spawn_attr, cmd->argv, environ);
-        if (posix_spawn_status != 0) {
-            // We return 1 if the posix_spawnp failed as we won't be
-            // adding this pipeline to a running job.
-            termstate_sample();
-            termstate_give_terminal_back_to_shell();
-            perror("posix_spawnp");
-            signal_unblock(SIGCHLD);
-            for (int i = 0; i < (pipeline_length - 1); i++) {
-                int pipe1_result = close(pipes[i][READ_END]);
-                int pipe2_result = close(pipes[i][WRITE_END]);
-                if (pipe1_result == -1 || pipe2_result == -1) {
-                    perror("Error closing pipes");
-                }
-            }
-            if (posix_spawn_file_actions_destroy(&child_file_attr)) {
-                perror("posix_spawn_file_actions_destroy");
-            }
-            free(pipes);
-            free(child_pid_array);
-            return 1;
-        }
+/* A new plan for pipelines shaped like pipe, or NULL on failure */
+static struct spawn_plan *
+spawn_plan_create(struct ast_pipeline *pipe)
+{
+    struct spawn_plan *plan = calloc(1, sizeof *plan);
+    plan->length = list_size(&pipe->commands);
+    plan->bg_job = pipe->bg_job;
+    plan->iored_input = pipe->iored_input ? strdup(pipe->iored_input) : NULL;
+    plan->iored_output = pipe->iored_output ? strdup(pipe->iored_output) : NULL;
+    plan->append_to_output = pipe->append_to_output;
+    plan->dup_stderr_to_stdout = malloc(plan->length * sizeof(bool));
+    int i = 0;
+    for (struct list_elem * e = list_begin(&pipe->commands);
+         e != list_end(&pipe->commands);
+         e = list_next(e), i++) {
+        struct ast_command *cmd = list_entry(e, struct ast_command, elem);
+        plan->dup_stderr_to_stdout[i] = cmd->dup_stderr_to_stdout;
+    }
+    plan->actions = malloc(plan->length * sizeof(posix_spawn_file_actions_t));
+    plan->pipes = malloc(sizeof(int[plan->length - 1][2]));
+    plan->built_pipes = malloc(sizeof(int[plan->length - 1][2]));
+
+    int spawn_attr_status;
+    if ((spawn_attr_status = posix_spawnattr_init(&plan->attr))) {
+        perror("posix_spawnattr_init");
+        free(plan->iored_input);
+        free(plan->iored_output);
+        free(plan->dup_stderr_to_stdout);
+        free(plan->actions);
+        free(plan->pipes);
+        free(plan->built_pipes);
+        free(plan);
+        return NULL;
+    }
 
-        if (posix_spawn_file_actions_destroy(&child_file_attr)) {
-            perror("posix_spawn_file_actions_destroy");
-        }
+    sigset_t child_sigmask, child_sigdefault;
+    sigemptyset(&child_sigmask);
+    sigemptyset(&child_sigdefault);
+    sigaddset(&child_sigdefault, SIGPIPE);   /* the shell ignores it */
+    short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (!(plan->bg_job) && termstate_get_tty_fd() != -1) {
+        flags = flags | POSIX_SPAWN_TCSETPGROUP;
+        spawn_attr_status = spawn_attr_status | posix_spawnattr_tcsetpgrp_np(&plan->attr, termstate_get_tty_fd());
+    }
+    spawn_attr_status = spawn_attr_status | posix_spawnattr_setflags(&plan->attr, flags);
+    spawn_attr_status = spawn_attr_status | posix_spawnattr_setsigmask(&plan->attr, &child_sigmask);
+    spawn_attr_status = spawn_attr_status | posix_spawnattr_setsigdefault(&plan->attr, &child_sigdefault);
+    if (spawn_attr_status) {
+        perror("spawn_attr_status");
+        spawn_plan_free(plan);
+        return NULL;
+    }
+    return plan;
+}
 
-        // Adds the newly-spawned child's PID into the PID array the job will keep track of.
-        child_pid_array[child_count] = new_child_pid;
-        if (pgid == 0) {
-            pgid = new_child_pid;
+/* The cached plan for pipe, making it if need be and evicting
+ * the least recently used one if the cache is full. */
+static struct spawn_plan *
+get_spawn_plan(struct ast_pipeline *pipe)
+{
+    int victim = 0;
+    for (int i = 0; i < SPAWN_PLAN_CACHE; i++) {
+        struct spawn_plan *plan = spawn_plans[i];
+        if (plan != NULL && spawn_plan_matches(plan, pipe)) {
+            plan->last_used = ++spawn_plan_clock;
+            return plan;
         }
+        if (spawn_plans[victim] != NULL
+            && (plan == NULL || plan->last_used < spawn_plans[victim]->last_used))
+            victim = i;
+    }
 
-        child_count++; // Now increments the number of children we've successfully spawned.
+    struct spawn_plan *plan = spawn_plan_create(pipe);
+    if (plan == NULL)
+        return NULL;
+    if (spawn_plans[victim] != NULL)
+        spawn_plan_free(spawn_plans[victim]);
+    spawn_plans[victim] = plan;
+    plan->last_used = ++spawn_plan_clock;
+    return plan;
+}
 
+static void
+free_spawn_plans(void)
+{
+    for (int i = 0; i < SPAWN_PLAN_CACHE; i++) {
+        if (spawn_plans[i] != NULL)
+            spawn_plan_free(spawn_plans[i]);
+        spawn_plans[i] = NULL;
     }
+}
 
-    // Now close all of the pipes we created.
-    for (int i = 0; i < (pipeline_length - 1); i++) {
-        int pipe1_result = close(pipes[i][READ_END]);
-        int pipe2_result = close(pipes[i][WRITE_END]);
-        if (pipe1_result == -1 || pipe2_result == -1) {
-            perror("Error");
+/* Close the pipes of the plan's current job, but for ends already closed */
+static void
+spawn_plan_close_pipes(struct spawn_plan *plan, int npipes)
+{
+    for (int i = 0; i < npipes; i++) {
+        for (int end = 0; end < 2; end++) {
+            if (plan->pipes[i][end] != -1 && close(plan->pipes[i][end]) == -1) {
+                perror("Error closing pipes");
+            }
+            plan->pipes[i][end] = -1;
         }
     }
-    free(pipes);
-
-    // Adds the current pipeline to the jobs list as one new job
-    // Then updates the status of that job based on what the pipeline intends that job to be.
-    struct job *current_job = add_job(pipe);
-    current_job->num_processes_alive = child_count;
-    current_job->child_pid_array = child_pid_array;
-    current_job->termination_code = -1;
-    current_job->state_saved_previously = false;
-    if (pipe->bg_job) {
-        current_job->status = BACKGROUND;
-        printf("[%d] %d\n", current_job->jid, current_job->child_pid_array[0]);
-    } else {
-        current_job->status = FOREGROUND;
-        wait_for_job(current_job);
+}
+
+/* Make the pipes for a new job of plan's shape, and make sure the
+ * file actions name them.  Returns false if either failed. */
+static bool
+spawn_plan_open_pipes(struct spawn_plan *plan)
+{
+    int npipes = plan->length - 1;
+    for (int i = 0; i < npipes; i++) {
+        if (pipe2(plan->pipes[i], O_CLOEXEC) == -1) {
+            perror("pipe2");
+            spawn_plan_close_pipes(plan, i);
+            return false;
+        }
+    }
+
+    if (plan->have_actions
+        && memcmp(plan->pipes, plan->built_pipes, sizeof(int[npipes][2])) == 0)
+        return true;
+    if (!spawn_plan_build_actions(plan)) {
+        spawn_plan_close_pipes(plan, npipes);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Placement.  "pin CPUS pipeline" runs every process of the job on the
+ * CPUs in the list CPUS (e.g. 0-3,8), "pin -n NODE pipeline" on the CPUs
+ * of a NUMA node, with memory bound to that node, and "pin -s ..." puts
+ * each stage on a CPU of its own from the list, in turn.  posix_spawn
+ * applies it in the child before exec.
+ */
+struct placement {
+    cpu_set_t cpus;
+    bool spread;                /* one CPU of cpus per stage */
+    int node;                   /* the NUMA node to bind memory to, or -1 */
+};
+
+/* Parse a list of CPUs like 0-3,8 into set */
+static bool
+parse_cpu_list(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p = list;
+    do {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p)
+            return false;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p)
+                return false;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return false;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        p = end;
+    } while (*p++ == ',');
+    return p[-1] == '\0' || p[-1] == '\n';
+}
+
+/* The CPUs of NUMA node 'node', from sysfs */
+static bool
+node_cpus(int node, cpu_set_t *set)
+{
+    char path[64], list[4096];
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return false;
+    bool ok = fgets(list, sizeof list, f) != NULL && parse_cpu_list(list, set);
+    fclose(f);
+    return ok;
+}
+
+/*
+ * Parse "pin [-s] CPUS" or "pin [-s] -n NODE" at *argv, and advance
+ * *argv to the command that follows.  Returns false, with a message
+ * printed, if there is none or the arguments are bad.
+ */
+static bool
+parse_pin(char ***argv, struct placement *place)
+{
+    char **arg = *argv + 1;
+    place->spread = false;
+    place->node = -1;
+    if (*arg != NULL && strcmp(*arg, "-s") == 0) {
+        place->spread = true;
+        arg++;
+    }
+
+    bool ok;
+    if (*arg != NULL && strcmp(*arg, "-n") == 0) {
+        char *end;
+        arg++;
+        place->node = *arg != NULL ? strtol(*arg, &end, 10) : -1;
+        ok = *arg != NULL && *end == '\0' && place->node >= 0
+             && place->node < 8 * (int) sizeof(unsigned long)
+             && node_cpus(place->node, &place->cpus);
+    } else {
+        ok = *arg != NULL && parse_cpu_list(*arg, &place->cpus);
+    }
+    if (!ok || arg[1] == NULL) {
+        fprintf(stderr, "pin: usage: pin [-s] {CPUS | -n NODE} pipeline\n");
+        return false;
+    }
+    *argv = arg + 1;
+    return true;
+}
+
+/* The CPUs stage i of a job placed by 'place' may run on */
+static void
+stage_cpus(const struct placement *place, int i, cpu_set_t *set)
+{
+    if (!place->spread) {
+        *set = place->cpus;
+        return;
+    }
+
+    int n = i % CPU_COUNT(&place->cpus);
+    CPU_ZERO(set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &place->cpus) && n-- == 0) {
+            CPU_SET(cpu, set);
+            return;
+        }
+    }
+}
+
+/* Place the calling process as stage i, for a child that is not spawned */
+static int
+place_self(const struct placement *place, int i)
+{
+    cpu_set_t set;
+    stage_cpus(place, i, &set);
+    if (sched_setaffinity(0, sizeof set, &set) == -1)
+        return -1;
+    if (place->node != -1) {
+        unsigned long nodemask = 1UL << place->node;
+        return syscall(SYS_set_mempolicy, MPOL_BIND, &nodemask, 8 * sizeof nodemask + 1);
+    }
+    return 0;
+}
+
+/*
+ * Splice mode (-z).  A stage that is a plain 'cat', with nothing but
+ * file names (or '-') for arguments, is not exec'd.  The shell forks a
+ * helper for it instead, which moves the data with splice(2) where
+ * either side is a pipe and sendfile(2) where the input is a file, so
+ * the bytes are never copied through user space.  Anything else falls
+ * back to read and write.  The helper is a process of the job like any
+ * other, so job control works on it as usual.
+ */
+#define SPLICE_CHUNK (1 << 20)
+
+static bool splice_mode;
+
+static bool
+is_plain_cat(struct ast_command *cmd)
+{
+    if (strcmp(cmd->argv[0], "cat") != 0)
+        return false;
+    for (char **arg = cmd->argv + 1; *arg != NULL; arg++)
+        if ((*arg)[0] == '-' && (*arg)[1] != '\0')
+            return false;
+    return true;
+}
+
+/* Copy everything from in to out.  Returns false on an error. */
+static bool
+pass_through(int in, int out)
+{
+    enum { SPLICE, SENDFILE, COPY } method = SPLICE;
+    static char buf[1 << 16];
+
+    for (;;) {
+        ssize_t n;
+        switch (method) {
+        case SPLICE:
+            n = splice(in, NULL, out, NULL, SPLICE_CHUNK, SPLICE_F_MOVE);
+            if (n == -1 && errno == EINVAL) {
+                method = SENDFILE;
+                continue;
+            }
+            break;
+        case SENDFILE:
+            n = sendfile(out, in, NULL, SPLICE_CHUNK);
+            if (n == -1 && errno == EINVAL) {
+                method = COPY;
+                continue;
+            }
+            break;
+        default:
+            n = read(in, buf, sizeof buf);
+            for (ssize_t done = 0; n > 0 && done < n; ) {
+                ssize_t w = write(out, buf + done, n - done);
+                if (w == -1 && errno != EINTR)
+                    return false;
+                if (w > 0)
+                    done += w;
+            }
+            break;
+        }
+        if (n == 0)
+            return true;
+        if (n == -1 && errno != EINTR)
+            return false;
+    }
+}
+
+static void
+helper_error(const char *what, const char *name)
+{
+    const char *msg = strerror(errno);
+    dprintf(STDERR_FILENO, "%s: %s: %s\n", what, name, msg);
+}
+
+/* The body of a helper, with stdin and stdout set up; never returns */
+static void __attribute__((noreturn))
+run_cat_helper(struct ast_command *cmd)
+{
+    int status = 0;
+    char **files = cmd->argv + 1;
+    char *only_stdin[] = { "-", NULL };
+    if (*files == NULL)
+        files = only_stdin;
+
+    for (; *files != NULL; files++) {
+        int in = STDIN_FILENO;
+        if (strcmp(*files, "-") != 0 && (in = open(*files, O_RDONLY)) == -1) {
+            helper_error("cat", *files);
+            status = 1;
+            continue;
+        }
+        if (!pass_through(in, STDOUT_FILENO)) {
+            if (errno == EPIPE)
+                _exit(128 + SIGPIPE);
+            helper_error("cat", *files);
+            status = 1;
+        }
+        if (in != STDIN_FILENO)
+            close(in);
+    }
+    _exit(status);
+}
+
+/* Fork a helper for stage i, putting it into process group pgid (or a
+ * new one if 0).  Returns 0 or an error number, like posix_spawn().
+ * Unlike posix_spawn, which never copies the shell's address space,
+ * fork() copies its page tables, so this gets slower as the shell grows
+ * (see posix_spawn/spawn_bench.c); the helper has no program to exec,
+ * so it cannot run on a borrowed address space. */
+static int
+fork_cat_helper(struct spawn_plan *plan, struct ast_pipeline *pipe,
+                struct ast_command *cmd, int i, pid_t pgid, int cgroup_fd,
+                const struct placement *place, pid_t *pid)
+{
+    int length = plan->length;
+    pid_t child = fork();
+    if (child == -1)
+        return errno;
+    if (child > 0) {
+        // Either side may get to it first.
+        setpgid(child, pgid);
+        *pid = child;
+        return 0;
+    }
+
+    // Mimic what posix_spawn would have set up for the stage.
+    if (cgroup_fd != -1 && cgroup_move(cgroup_fd, 0) == -1) {
+        helper_error("cush", "cgroup.procs");
+        _exit(1);
+    }
+    if (place != NULL && place_self(place, i) == -1) {
+        helper_error("cush", "pin");
+        _exit(1);
+    }
+    setpgid(0, pgid);
+    if (!pipe->bg_job && pgid == 0 && termstate_get_tty_fd() != -1) {
+        signal_block(SIGTTOU);
+        tcsetpgrp(termstate_get_tty_fd(), getpid());
+    }
+    signal(SIGPIPE, SIG_DFL);
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+
+    int in = -1, out = -1;
+    if (i > 0)
+        in = plan->pipes[i - 1][0];
+    else if (pipe->iored_input != NULL && (in = open(pipe->iored_input, O_RDONLY)) == -1) {
+        helper_error("cush", pipe->iored_input);
+        _exit(1);
+    }
+    if (i < length - 1)
+        out = plan->pipes[i][1];
+    else if (pipe->iored_output != NULL) {
+        int oflags = (O_CREAT | O_WRONLY) | ((pipe->append_to_output) ? O_APPEND : O_TRUNC);
+        out = open(pipe->iored_output, oflags, S_IROTH | S_IWOTH | S_IRGRP | S_IWGRP | S_IRUSR | S_IWUSR);
+        if (out == -1) {
+            helper_error("cush", pipe->iored_output);
+            _exit(1);
+        }
+    }
+    // Larger pipes let each splice move more at once; this is only a
+    // hint, so failure does not matter.
+    if (i > 0)
+        fcntl(in, F_SETPIPE_SZ, SPLICE_CHUNK);
+    if (i < length - 1)
+        fcntl(out, F_SETPIPE_SZ, SPLICE_CHUNK);
+    if (in != -1)
+        dup2(in, STDIN_FILENO);
+    if (out != -1)
+        dup2(out, STDOUT_FILENO);
+    if (cmd->dup_stderr_to_stdout && (i < length - 1 || pipe->iored_output != NULL))
+        dup2(STDOUT_FILENO, STDERR_FILENO);
+
+    // Nothing is exec'd, so close-on-exec does not apply: the other ends
+    // must be closed by hand, or the readers would never see EOF.
+    for (int j = 0; j < length - 1; j++) {
+        close(plan->pipes[j][0]);
+        close(plan->pipes[j][1]);
+    }
+    if (in > STDERR_FILENO && i == 0)
+        close(in);
+    if (out > STDERR_FILENO && i == length - 1)
+        close(out);
+
+    run_cat_helper(cmd);
+}
+
+/*
+ * Launching the stages of a pipeline.  Each posix_spawn() returns only
+ * once its child has exec'd (or failed to), so a long pipeline would
+ * start up one stage at a time.  The first external stage, the leader,
+ * is spawned on its own, since the others join its process group; from
+ * PARALLEL_LAUNCH_MIN stages on, the rest are spawned by up to
+ * LAUNCH_THREADS threads at once.  Every stage still reports its own
+ * exec result.  Builtin stages are skipped; the shell runs them itself.
+ * Cat helpers (-z) are forked by the calling thread alone, first.
+ */
+#define PARALLEL_LAUNCH_MIN 4
+#define LAUNCH_THREADS 4
+
+struct launch {
+    struct spawn_plan *plan;
+    struct ast_pipeline *pipe;
+    struct ast_command **cmds;
+    bool *builtin;               /* stages the shell runs itself */
+    bool *helper;                /* stages run by a cat helper (-z) */
+    const char **paths;          /* from the PATH cache, or NULL */
+    pid_t *pids;                 /* 0 for builtin stages */
+    int *errors;                 /* posix_spawn's result for each stage */
+    struct timespec *exec_at;    /* when each stage was spawned */
+    long *spawn_ns;              /* and how long that took */
+    int cgroup_fd;               /* the job's cgroup, or -1 */
+    const struct placement *place;  /* where "pin" put it, or NULL */
+    int leader;                  /* the first external stage, or -1 */
+    int next_stage;              /* the next stage for a thread to take */
+};
+
+static int
+start_stage(struct launch *launch, int i)
+{
+    if (launch->helper[i]) {
+        pid_t pgid = i == launch->leader ? 0 : launch->pids[launch->leader];
+        return fork_cat_helper(launch->plan, launch->pipe, launch->cmds[i], i, pgid,
+                               launch->cgroup_fd, launch->place, &launch->pids[i]);
+    }
+
+    // A placed stage gets a copy of the attributes, as each stage may
+    // have CPUs of its own and the stages are spawned in parallel.
+    posix_spawnattr_t *attr = &launch->plan->attr;
+    posix_spawnattr_t placed_attr;
+    cpu_set_t cpus;
+    if (launch->place != NULL) {
+        placed_attr = *attr;
+        attr = &placed_attr;
+        short flags;
+        posix_spawnattr_getflags(attr, &flags);
+        flags |= POSIX_SPAWN_SETAFFINITY;
+        stage_cpus(launch->place, i, &cpus);
+        posix_spawnattr_setaffinity_np(attr, sizeof cpus, &cpus);
+        if (launch->place->node != -1) {
+            flags |= POSIX_SPAWN_SETMEMPOLICY;
+            posix_spawnattr_setmempolicy_np(attr, MPOL_BIND, 1UL << launch->place->node);
+        }
+        posix_spawnattr_setflags(attr, flags);
+    }
+
+    char **argv = launch->cmds[i]->argv;
+    posix_spawn_file_actions_t *actions = &launch->plan->actions[i];
+    if (launch->paths[i] != NULL)
+        return posix_spawn(&launch->pids[i], launch->paths[i], actions, attr, argv, environ);
+    return posix_spawnp(&launch->pids[i], argv[0], actions, attr, argv, environ);
+}
+
+/* Start stage i, timing it.  posix_spawn() returns once the child has
+ * exec'd, so its return marks the start of the stage's program. */
+static int
+spawn_stage(struct launch *launch, int i)
+{
+    struct timespec before;
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    int error = start_stage(launch, i);
+    clock_gettime(CLOCK_MONOTONIC, &launch->exec_at[i]);
+    launch->spawn_ns[i] = (launch->exec_at[i].tv_sec - before.tv_sec) * 1000000000L
+                          + (launch->exec_at[i].tv_nsec - before.tv_nsec);
+    return error;
+}
+
+static void *
+launch_thread(void *arg)
+{
+    struct launch *launch = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&launch->next_stage, 1, __ATOMIC_RELAXED)) < launch->plan->length)
+        if (!launch->builtin[i] && !launch->helper[i])
+            launch->errors[i] = spawn_stage(launch, i);
+    return NULL;
+}
+
+/* Spawn the external stages after the leader, into the leader's group */
+static void
+launch_followers(struct launch *launch)
+{
+    int first = launch->leader + 1;
+    int nstages = launch->plan->length - first;
+    if (nstages <= 0)
+        return;
+
+    // The helpers are forked before any launch thread exists: a child
+    // forked while other threads are inside posix_spawn() could find a
+    // libc lock held that no one is left to release.
+    for (int i = first; i < launch->plan->length; i++)
+        if (launch->helper[i])
+            launch->errors[i] = spawn_stage(launch, i);
+
+    posix_spawnattr_setpgroup(&launch->plan->attr, launch->pids[launch->leader]);
+    launch->next_stage = first;
+    if (nstages < PARALLEL_LAUNCH_MIN - 1) {
+        launch_thread(launch);
+        return;
+    }
+
+    int nthreads = nstages < LAUNCH_THREADS ? nstages : LAUNCH_THREADS;
+    pthread_t threads[LAUNCH_THREADS];
+    int started = 0;
+    // The calling thread takes stages too; it also picks up the slack
+    // if a thread cannot be created.
+    while (started < nthreads - 1 && pthread_create(&threads[started], NULL, launch_thread, launch) == 0)
+        started++;
+    launch_thread(launch);
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+}
+
+/*
+ * Spawn every external stage of the plan's pipeline.  Returns 0, or the
+ * error of the first stage that could not be spawned, after killing the
+ * stages that were.  A stale PATH cache entry (the file went away or
+ * changed) is dropped and the stage is tried again with a full PATH
+ * search.
+ */
+static int
+launch_pipeline(struct launch *launch)
+{
+    int length = launch->plan->length;
+    launch->leader = -1;
+    for (int i = 0; i < length; i++) {
+        launch->pids[i] = 0;
+        launch->errors[i] = 0;
+        launch->paths[i] = NULL;
+        if (launch->builtin[i])
+            continue;
+        if (!launch->helper[i])
+            launch->paths[i] = path_cache_lookup(launch->cmds[i]->argv[0]);
+        if (launch->leader == -1)
+            launch->leader = i;
+    }
+    if (launch->leader == -1)
+        return 0;
+
+    int leader = launch->leader;
+    posix_spawnattr_setpgroup(&launch->plan->attr, 0);
+
+    // The plan may be shared among jobs, but the cgroup is the job's own.
+    short flags;
+    posix_spawnattr_getflags(&launch->plan->attr, &flags);
+    if (launch->cgroup_fd != -1) {
+        flags |= POSIX_SPAWN_SETCGROUP;
+        posix_spawnattr_setcgroup_np(&launch->plan->attr, launch->cgroup_fd);
+    } else {
+        flags &= ~POSIX_SPAWN_SETCGROUP;
+    }
+    posix_spawnattr_setflags(&launch->plan->attr, flags);
+
+    launch->errors[leader] = spawn_stage(launch, leader);
+    if (launch->errors[leader] == 0)
+        launch_followers(launch);
+
+    for (int i = leader; i < length; i++) {
+        if (launch->errors[i] == 0)
+            continue;
+        if (launch->paths[i] != NULL && strchr(launch->cmds[i]->argv[0], '/') == NULL) {
+            path_cache_forget(launch->cmds[i]->argv[0]);
+            launch->paths[i] = NULL;
+            launch->errors[i] = spawn_stage(launch, i);
+        }
+        if (launch->errors[i] != 0) {
+            // Don't leave the stages that did start behind, untracked.
+            if (i > leader)
+                killpg(launch->pids[leader], SIGKILL);
+            return launch->errors[i];
+        }
+        if (i == leader) {
+            // The other stages were not spawned without a group to join.
+            launch_followers(launch);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Builtins as pipeline stages.  The shell runs them itself, with its own
+ * stdout moved onto the stage's pipe or redirection for the duration,
+ * while the external stages they feed are already running.  Only the
+ * builtins that just print make sense inside a pipeline; the job
+ * control ones may still be redirected when they stand alone.
+ */
+static const char *pipeline_builtins[] = { "jobs", "history", "hash", NULL };
+static const char *other_builtins[] = { "fg", "bg", "stop", "kill", "limit", NULL };
+
+static bool
+name_in(const char *name, const char **names)
+{
+    for (; *names != NULL; names++)
+        if (strcmp(name, *names) == 0)
+            return true;
+    return false;
+}
+
+static bool
+is_builtin(const char *name)
+{
+    return name_in(name, pipeline_builtins) || name_in(name, other_builtins);
+}
+
+/* Run builtin cmd with its stdout, and its stderr too for >& and |&,
+ * on fd out. */
+static void
+run_builtin_to(struct ast_command *cmd, int out)
+{
+    fflush(stdout);
+    fflush(stderr);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int saved_stderr = cmd->dup_stderr_to_stdout ? dup(STDERR_FILENO) : -1;
+    dup2(out, STDOUT_FILENO);
+    if (saved_stderr != -1)
+        dup2(out, STDERR_FILENO);
+
+    check_for_builtin(cmd);
+
+    // A write to a pipe whose reader is gone fails with EPIPE rather
+    // than raising SIGPIPE, which the shell ignores.
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    if (saved_stderr != -1) {
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stderr);
+    }
+}
+
+/* Run the builtin stages of a pipeline whose pipes the plan holds */
+static void
+run_builtin_stages(struct ast_pipeline *pipe, struct spawn_plan *plan,
+                   struct ast_command **cmds, bool *builtin)
+{
+    int length = plan->length;
+
+    // Let go of every pipe end but those the builtins write to, so that a
+    // builtin's reader seeing EOF, or the reader exiting, is not held up
+    // by the shell.
+    for (int i = 0; i < length - 1; i++) {
+        close(plan->pipes[i][0]);
+        plan->pipes[i][0] = -1;
+        if (!builtin[i]) {
+            close(plan->pipes[i][1]);
+            plan->pipes[i][1] = -1;
+        }
+    }
+
+    for (int i = 0; i < length; i++) {
+        if (!builtin[i])
+            continue;
+
+        // Builtins do not read stdin, but a missing input file is
+        // still an error.
+        if (i == 0 && pipe->iored_input != NULL) {
+            int in = open(pipe->iored_input, O_RDONLY | O_CLOEXEC);
+            if (in == -1) {
+                perror(pipe->iored_input);
+                continue;
+            }
+            close(in);
+        }
+
+        int out = STDOUT_FILENO;
+        if (i < length - 1 && builtin[i + 1]) {
+            // The next stage would never read the output.
+            out = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        } else if (i < length - 1) {
+            out = plan->pipes[i][1];
+        } else if (pipe->iored_output != NULL) {
+            int oflags = (O_CREAT | O_WRONLY | O_CLOEXEC) | ((pipe->append_to_output) ? O_APPEND : O_TRUNC);
+            out = open(pipe->iored_output, oflags, S_IROTH | S_IWOTH | S_IRGRP | S_IWGRP | S_IRUSR | S_IWUSR);
+        }
+        if (out == -1) {
+            perror(i < length - 1 ? "/dev/null" : pipe->iored_output);
+            continue;
+        }
+
+        run_builtin_to(cmds[i], out);
+        if (out != STDOUT_FILENO)
+            close(out);
+        if (i < length - 1 && out == plan->pipes[i][1])
+            plan->pipes[i][1] = -1;
+    }
+}
+
+// Returns 1 if no job was made for the pipeline (e.g. it was a builtin).
+int
+iterate_over_pipeline(struct ast_pipeline *pipe, struct ast_command_line *cmdline)
+{
+    
+    // SIGCHLD is always blocked, and children are only reaped where the shell
+    // waits for them, so none can be handled before its job has been set up.
+    assert(signal_is_blocked(SIGCHLD));
+
+    // Before we start dealing with piping and jobs, we want to confirm that we're not
+    // just running a builtin. Exit is a special case even among the builtins, as we
+    // need to clean our memory up before we exit directly from here. So we handle it separately.
+    struct ast_command *builtin_cmd = list_entry(list_begin(&pipe->commands), struct ast_command, elem);
+    if (strcmp(builtin_cmd->argv[0],"exit") == 0) {            
+        free_all_jobs();
+        free_spawn_plans();
+        free_command_cache();
+        ast_command_line_free(cmdline);
+        exit(0);
+    }
+
+    // Sets up some variables to use while setting up our child processes.
+    int pipeline_length = list_size(&pipe->commands);
+    struct ast_command *cmds[pipeline_length];
+    bool builtin[pipeline_length];
+    bool helper[pipeline_length];
+    int num_builtins = 0;
+    int i = 0;
+
+    // "time pipeline" and "pin ... pipeline" run the pipeline with its
+    // first command stripped of the prefixes; the tree itself is left
+    // alone so it can be run again.
+    struct ast_command first_cmd = *builtin_cmd;
+    bool timed = false;
+    struct placement place;
+    bool placed = false;
+    for (;;) {
+        if (strcmp(first_cmd.argv[0], "time") == 0) {
+            if (first_cmd.argv[1] == NULL) {
+                fprintf(stderr, "time: usage: time pipeline\n");
+                return 1;
+            }
+            timed = true;
+            first_cmd.argv++;
+        } else if (strcmp(first_cmd.argv[0], "pin") == 0) {
+            if (!parse_pin(&first_cmd.argv, &place))
+                return 1;
+            placed = true;
+        } else {
+            break;
+        }
+    }
+
+    for (struct list_elem * e = list_begin(&pipe->commands); 
+         e != list_end(&pipe->commands); 
+         e = list_next(e), i++) {
+        cmds[i] = list_entry(e, struct ast_command, elem);
+        if (i == 0 && first_cmd.argv != builtin_cmd->argv)
+            cmds[i] = &first_cmd;
+        builtin[i] = is_builtin(cmds[i]->argv[0]);
+        helper[i] = splice_mode && is_plain_cat(cmds[i]);
+        if (builtin[i]) {
+            num_builtins++;
+        }
+    }
+
+    // Now checks for the other builtin commands.  One that stands
+    // alone and is not redirected needs no setting up at all.
+    if (pipeline_length == 1 && builtin[0] && pipe->iored_input == NULL && pipe->iored_output == NULL) {
+        check_for_builtin(cmds[0]);
+        return 1;
+    }
+    for (i = 0; i < pipeline_length; i++) {
+        if (builtin[i] && pipeline_length > 1 && !name_in(cmds[i]->argv[0], pipeline_builtins)) {
+            fprintf(stderr, "%s: cannot be part of a pipeline\n", cmds[i]->argv[0]);
+            return 1;
+        }
+    }
+
+    struct spawn_plan *plan = get_spawn_plan(pipe);
+    if (plan == NULL || !spawn_plan_open_pipes(plan)) {
+        return 1;
+    }
+
+    pid_t* child_pid_array = (pid_t*)malloc(pipeline_length * sizeof(pid_t));
+    const char *paths[pipeline_length];
+    int errors[pipeline_length];
+    struct timespec exec_at[pipeline_length];
+    long spawn_ns[pipeline_length];
+    struct launch launch = {
+        .plan = plan, .pipe = pipe, .cmds = cmds,
+        .builtin = builtin, .helper = helper, .paths = paths,
+        .pids = child_pid_array, .errors = errors,
+        .exec_at = exec_at, .spawn_ns = spawn_ns,
+        .place = placed ? &place : NULL,
+    };
+    char *cgroup = NULL;
+    launch.cgroup_fd = limit_new_jobs && num_builtins < pipeline_length ? new_job_cgroup(&cgroup) : -1;
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int posix_spawn_status = launch_pipeline(&launch);
+    if (posix_spawn_status != 0) {
+        // We return 1 if the posix_spawnp failed as we won't be
+        // adding this pipeline to a running job.
+        termstate_sample();
+        termstate_give_terminal_back_to_shell();
+        errno = posix_spawn_status;
+        perror("posix_spawnp");
+        spawn_plan_close_pipes(plan, pipeline_length - 1);
+        free(child_pid_array);
+        if (cgroup != NULL) {
+            cgroup_remove(launch.cgroup_fd, cgroup);
+            free(cgroup);
+        }
+        return 1;
+    }
+
+    if (num_builtins > 0) {
+        run_builtin_stages(pipe, plan, cmds, builtin);
+    }
+
+    // Now close all of the pipes we created.
+    spawn_plan_close_pipes(plan, pipeline_length - 1);
+
+    // A pipeline of builtins only leaves no job behind.
+    if (num_builtins == pipeline_length) {
+        free(child_pid_array);
+        return 1;
+    }
+
+    // The job keeps track of its external processes only.
+    struct stage_times *times = calloc(pipeline_length, sizeof *times);
+    int child_count = 0;
+    for (i = 0; i < pipeline_length; i++) {
+        if (!builtin[i]) {
+            times[child_count] = (struct stage_times) {
+                .name = cmds[i]->argv[0], .spawn_ns = spawn_ns[i], .exec_at = exec_at[i],
+            };
+            child_pid_array[child_count++] = child_pid_array[i];
+        }
+    }
+
+    // Adds the current pipeline to the jobs list as one new job
+    // Then updates the status of that job based on what the pipeline intends that job to be.
+    struct job *current_job = add_job(pipe);
+    current_job->num_processes_alive = child_count;
+    current_job->child_pid_array = child_pid_array;
+    current_job->num_pids = child_count;
+    current_job->times = times;
+    current_job->started = started;
+    current_job->timed = timed;
+    current_job->cgroup = cgroup;
+    current_job->cgroup_fd = launch.cgroup_fd;
+    for (int i = 0; i < child_count; i++) {
+        pid2job_insert(child_pid_array[i], current_job);
+    }
+    open_pidfds(current_job);
+    current_job->termination_code = -1;
+    current_job->state_saved_previously = false;
+    if (pipe->bg_job) {
+        current_job->status = BACKGROUND;
+        printf("[%d] %d\n", current_job->jid, current_job->child_pid_array[0]);
+    } else {
+        current_job->status = FOREGROUND;
+        wait_for_job(current_job);
 
         // Once the current foreground process is done,
         // we can pass terminal ownership back to the shell.
         termstate_give_terminal_back_to_shell();
     }
 
-    // Once all of that is done, we can unblock SIGCHLD again.
-    signal_unblock(SIGCHLD);
-
     return 0;
 }
 
@@ -668,20 +1995,31 @@ static int
 check_for_builtin(struct ast_command *cmd) {
 
     if (strcmp(cmd->argv[0],"jobs") == 0) {
-        print_all_jobs();
+        print_all_jobs(cmd->argv[1] != NULL && strcmp(cmd->argv[1], "-t") == 0);
+        return 1;
+    }
+    if (strcmp(cmd->argv[0],"history") == 0) {
+        if (cmd->argv[1] != NULL && strcmp(cmd->argv[1], "-s") == 0) {
+            if (cmd->argv[2] != NULL)
+                history_store_search(cmd->argv[2]);
+            else
+                fprintf(stderr, "history: -s needs the text to search for\n");
+        } else {
+            history_store_print();
+        }
         return 1;
     }
-        if (strcmp(cmd->argv[0],"history") == 0) {
-        HISTORY_STATE *history_state = history_get_history_state();
-        for (int i = 0; i < history_state->length; i++) {
-            printf("%d  %s\n", (i + 1), history_state->entries[i]->line);
+    if (strcmp(cmd->argv[0],"hash") == 0) {
+        if (cmd->argv[1] != NULL && strcmp(cmd->argv[1], "-r") == 0) {
+            path_cache_clear();
+        } else {
+            path_cache_print();
         }
-        free(history_state);
         return 1;
     }
     if (strcmp(cmd->argv[0],"fg") == 0) {            
         // Start by getting the job with the given jid
-        struct job * found_job = job_with_jid(atoi(cmd->argv[1]));
+        struct job * found_job = get_job_from_jid(atoi(cmd->argv[1]));
         if (found_job == NULL) {
             printf("fg %s: No such job\n", cmd->argv[1]);
             return 1;
@@ -713,12 +2051,12 @@ check_for_builtin(struct ast_command *cmd) {
         return 1;
     }
     if (strcmp(cmd->argv[0],"bg") == 0) {
-        struct job * found_job = job_with_jid(atoi(cmd->argv[1]));
-        pid_t pgid_to_target = found_job->child_pid_array[0];
+        struct job * found_job = get_job_from_jid(atoi(cmd->argv[1]));
         if (found_job == NULL) {
             printf("bg %s: No such job\n", cmd->argv[1]);
             return 1;
         }
+        pid_t pgid_to_target = found_job->child_pid_array[0];
 
         if (found_job->status == BACKGROUND) {
             printf("bg: %s already in background\n", cmd->argv[1]);
@@ -733,7 +2071,7 @@ check_for_builtin(struct ast_command *cmd) {
         return 1;
     }
     if (strcmp(cmd->argv[0],"stop") == 0) {
-        struct job * found_job = job_with_jid(atoi(cmd->argv[1]));
+        struct job * found_job = get_job_from_jid(atoi(cmd->argv[1]));
         if (found_job == NULL) {
             printf("stop %s: No such job\n", cmd->argv[1]);
             return 1;
@@ -760,7 +2098,11 @@ check_for_builtin(struct ast_command *cmd) {
             return 1;
         }
         else if (length_of_argv < 3) {
-            struct job * found_job = job_with_jid(atoi(cmd->argv[1]));
+            struct job * found_job = get_job_from_jid(atoi(cmd->argv[1]));
+            if (found_job == NULL) {
+                printf("kill %s: No such job\n", cmd->argv[1]);
+                return 1;
+            }
             pid_t pgid_to_target = found_job->child_pid_array[0];
             int kill_status = killpg(pgid_to_target, SIGKILL);
             if(kill_status == 0){
@@ -771,7 +2113,11 @@ check_for_builtin(struct ast_command *cmd) {
             return 1;
         } else {
             int signal_to_send = atoi(cmd->argv[1] + 1); //this is to remove the dash from the signal
-            struct job * found_job = job_with_jid(atoi(cmd->argv[2]));
+            struct job * found_job = get_job_from_jid(atoi(cmd->argv[2]));
+            if (found_job == NULL) {
+                printf("kill %s: No such job\n", cmd->argv[2]);
+                return 1;
+            }
             pid_t pgid_to_target = found_job->child_pid_array[0];
             int kill_status = -1;
             //check to make sure we are using the common kill signals otherwise do not kill
@@ -826,56 +2172,268 @@ check_for_builtin(struct ast_command *cmd) {
             return 1;
         }
     }
+    if (strcmp(cmd->argv[0],"limit") == 0) {
+        limit_builtin(cmd);
+        return 1;
+    }
 
     
     return 0;
 }
 
+static char *input_line;        /* the line readline handed to line_handler */
+static bool input_done;
+
+static void
+line_handler(char *line)
+{
+    input_line = line;
+    input_done = true;
+    rl_callback_handler_remove();
+}
+
+/*
+ * Like readline(prompt), but reap children while the user types, so that
+ * background jobs are accounted for as soon as they change status.
+ * Uses readline's callback interface to feed it only the input that
+ * epoll says is there.
+ */
+static char *
+read_command_line(const char *prompt)
+{
+    // A foreground wait may have taken the SIGCHLD of children it left
+    // alone, so reap whatever is ready before sleeping.
+    reap_children();
+    if (event_fd == -1)         /* stdin cannot be polled, e.g. a file */
+        return readline(prompt);
+
+    input_line = NULL;
+    input_done = false;
+    rl_callback_handler_install(prompt, line_handler);
+    while (!input_done) {
+        struct epoll_event events[2];
+        int n = epoll_wait(event_fd, events, 2, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            utils_fatal_error("epoll_wait failed");
+        }
+
+        for (int i = 0; i < n && !input_done; i++) {
+            if (events[i].data.fd == sigchld_fd) {
+                wait_for_sigchld();
+                reap_children();
+            } else {
+                rl_callback_read_char();
+            }
+        }
+    }
+    return input_line;
+}
+
+/* Watch stdin and sigchld_fd with event_fd, if stdin can be watched */
+static void
+event_init(void)
+{
+    sigchld_fd = signal_open_fd(SIGCHLD);
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (event_fd == -1)
+        utils_fatal_error("epoll_create1 failed");
+
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.fd = sigchld_fd;
+    if (epoll_ctl(event_fd, EPOLL_CTL_ADD, sigchld_fd, &ev) == -1)
+        utils_fatal_error("epoll_ctl failed");
+
+    ev.data.fd = 0;
+    if (epoll_ctl(event_fd, EPOLL_CTL_ADD, 0, &ev) == -1) {
+        if (errno != EPERM)
+            utils_fatal_error("epoll_ctl failed");
+        close(event_fd);
+        event_fd = -1;
+    }
+}
+
+/*
+ * Command cache for batch mode.  Scripts tend to run the same lines over
+ * and over (loops unrolled by a generator, test drivers), so the parsed
+ * command line of each is kept, keyed by its text, and run again as is.
+ * Direct-mapped: a line evicts whatever was in its slot.
+ */
+#define COMMAND_CACHE_SIZE 256
+
+static struct cached_command {
+    char *line;
+    struct ast_command_line *cmdline;   /* holds a reference */
+} command_cache[COMMAND_CACHE_SIZE];
+
+static unsigned int
+hash_line(const char *line)
+{
+    unsigned int h = 2166136261u;
+    for (const char *p = line; *p; p++)
+        h = (h ^ (unsigned char) *p) * 16777619u;
+    return h;
+}
+
+/* Return a reference to the parsed form of line, or NULL if it does not parse */
+static struct ast_command_line *
+get_command_line(const char *line)
+{
+    struct cached_command *c = &command_cache[hash_line(line) % COMMAND_CACHE_SIZE];
+    if (c->line != NULL && strcmp(c->line, line) == 0)
+        return ast_command_line_ref(c->cmdline);
+
+    struct ast_command_line *cmdline = ast_parse_command_line((char *) line);
+    if (cmdline == NULL)
+        return NULL;
+
+    if (c->line != NULL) {
+        free(c->line);
+        ast_command_line_free(c->cmdline);
+    }
+    c->line = strdup(line);
+    c->cmdline = ast_command_line_ref(cmdline);
+    return cmdline;
+}
+
+static void
+free_command_cache(void)
+{
+    for (int i = 0; i < COMMAND_CACHE_SIZE; i++) {
+        struct cached_command *c = &command_cache[i];
+        if (c->line != NULL) {
+            free(c->line);
+            ast_command_line_free(c->cmdline);
+            c->line = NULL;
+        }
+    }
+}
+
+/* Report the jobs stopped by ^Z and the ones killed since the last report */
+static void
+report_job_updates(void)
+{
+    if (z_update_jid != -1) {
+        struct job * found_job = get_job_from_jid(z_update_jid);
+        printf("[%d]+\t%s\t\t(", found_job->jid, get_status(found_job->status));
+        print_cmdline(found_job->pipe);
+        printf(")\n");
+        z_update_jid = -1;
+    }
+
+    if (error_update_code != -1) {
+        print_error_message(error_update_code);
+        error_update_code = -1;
+    }
+}
+
+/*
+ * Batch mode: run the lines of script one after the other, without
+ * readline, history or a prompt.  Blank lines and comments (including
+ * a #! line) are skipped.
+ */
+static int
+run_script(FILE *script)
+{
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &size, script)) != -1) {
+        assert(signal_is_blocked(SIGCHLD));
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+
+        const char *p = line + strspn(line, " \t");
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        reap_children();
+        report_job_updates();
+
+        struct ast_command_line *cline = get_command_line(p);
+        if (cline == NULL)
+            continue;
+        iterate_over_command_line(cline);
+        ast_command_line_free(cline);
+
+        // Without a terminal stdout is fully buffered; keep the output
+        // of builtins in order with that of the commands that follow.
+        fflush(stdout);
+    }
+    free(line);
+
+    reap_children();
+    report_job_updates();
+    free_command_cache();
+    return 0;
+}
+
 int
 main(int ac, char *av[])
 {
     int opt;
 
     /* Process command-line arguments. See getopt(3) */
-    while ((opt = getopt(ac, av, "h")) > 0) {
+    const char *command = NULL;
+    while ((opt = getopt(ac, av, "hzc:")) > 0) {
         switch (opt) {
         case 'h':
             usage(av[0]);
             break;
+        case 'z':
+            splice_mode = true;
+            break;
+        case 'c':
+            command = optarg;
+            break;
+        }
+    }
+
+    FILE *script = NULL;
+    if (command != NULL) {
+        script = fmemopen((void *) command, strlen(command), "r");
+        if (script == NULL)
+            utils_fatal_error("fmemopen failed");
+    } else if (optind < ac) {
+        script = fopen(av[optind], "r");
+        if (script == NULL) {
+            perror(av[optind]);
+            exit(EXIT_FAILURE);
         }
     }
 
     list_init(&job_list);
-    signal_set_handler(SIGCHLD, sigchld_handler);
+    event_init();
+    // Builtins in a pipeline write into pipes from the shell itself.
+    signal(SIGPIPE, SIG_IGN);
+    if (script != NULL) {
+        // A script may well be run without a controlling terminal.
+        termstate_try_init();
+        int status = run_script(script);
+        fclose(script);
+        free_all_jobs();
+        free_spawn_plans();
+        return status;
+    }
     termstate_init(); // This handles saving the terminal termstate and the terminal's pgid
-    using_history(); // This handles initializing values for the command history
+    history_store_open(); // loads the tail of $CUSH_HISTFILE, if there is one
 
     /* Read/eval loop. */
     for (;;) {
 
-        /* If you fail this assertion, you were about to enter readline()
-         * while SIGCHLD is blocked.  This means that your shell would be
-         * unable to receive SIGCHLD signals, and thus would be unable to
-         * wait for background jobs that may finish while the
-         * shell is sitting at the prompt waiting for user input.
+        /* If you fail this assertion, SIGCHLD was unblocked somewhere.
+         * read_command_line() reaps background jobs that finish while
+         * the shell is sitting at the prompt by reading sigchld_fd, which
+         * only works while SIGCHLD stays blocked.
          */
-        assert(!signal_is_blocked(SIGCHLD));
+        assert(signal_is_blocked(SIGCHLD));
 
         /* Before we print the prompt, we need to check if there was
          * a process stopped by ^Z that we need to report.
          */
-        if (z_update_jid != -1) {
-            struct job * found_job = job_with_jid(z_update_jid);
-            printf("[%d]+\t%s\t\t(", found_job->jid, get_status(found_job->status));
-            print_cmdline(found_job->pipe);
-            printf(")\n");
-            z_update_jid = -1;
-        }
-
-        if (error_update_code != -1) {
-            print_error_message(error_update_code);
-            error_update_code = -1;
-        }
+        report_job_updates();
 
 
         /* If you fail this assertion, you were about to call readline()
@@ -888,7 +2446,7 @@ main(int ac, char *av[])
 
         /* Do not output a prompt unless shell's stdin is a terminal */
         char * prompt = isatty(0) ? build_prompt() : NULL;
-        char * cmdline = readline(prompt);
+        char * cmdline = read_command_line(prompt);
         free (prompt);
 
         if (cmdline == NULL)  /* User typed EOF */
@@ -908,8 +2466,6 @@ main(int ac, char *av[])
             continue;
         }
 
-        int where_in_history = where_history();
-        HIST_ENTRY *current_history_entry = history_get(where_in_history);
         struct ast_command_line * cline = ast_parse_command_line(expanded_cmdline);
         if (cline == NULL) {                  /* Error in command line */
             free (expanded_cmdline);
@@ -920,18 +2476,14 @@ main(int ac, char *av[])
             ast_command_line_free(cline);
             continue;
         }
-        if (where_in_history == 0 || (current_history_entry != NULL && strcmp(current_history_entry->line, expanded_cmdline) != 0)) {
-            add_history(expanded_cmdline);
-        }
+        history_store_add(expanded_cmdline);
         free (expanded_cmdline);
 
 
         iterate_over_command_line(cline);
 
-        // The below will free the command line itself
-        // Without freeing any of the pipes, since they may
-        // be needed elsewhere and should be freed at another time.
-        free(cline);
+        // The jobs made from it keep their own hold on the arena.
+        ast_command_line_free(cline);
     }
     return 0;
 }
\ No newline at end of file
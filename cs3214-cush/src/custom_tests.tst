@@ -1,3 +1,4 @@
 = Tests for Custom Features
 1 kill_simple_extension_test.py
-3 history_test.py
\ No newline at end of file
+3 history_test.py
+2 history_file_test.py
\ No newline at end of file
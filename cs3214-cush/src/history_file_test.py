@@ -0,0 +1,48 @@
+#!/usr/bin/python
+#
+# Tests that the history is kept in $CUSH_HISTFILE across restarts,
+# and that 'history -s' searches all of that file.
+#
+import atexit, os, tempfile
+from testutils import *
+
+histfd, histfile = tempfile.mkstemp()
+os.close(histfd)
+atexit.register(removefile, histfile)
+os.environ['CUSH_HISTFILE'] = histfile
+
+console = setup_tests()
+expect_prompt()
+
+#################################################################
+# Step 1. Check that commands are appended to the file, without
+# back-to-back duplicates.
+
+sendline("echo one")
+sendline("echo one")
+sendline("echo two")
+expect_prompt()
+expect_prompt()
+expect_prompt()
+assert open(histfile).read() == "echo one\necho two\n", "History is not appended to $CUSH_HISTFILE"
+
+#################################################################
+# Step 2. Check that a new shell picks up the last lines of a long
+# history, and that 'history -s' still finds the older ones.
+
+console.close(force=True)
+with open(histfile, "a") as f:
+    for i in range(5000):
+        f.write("cmd %d\n" % i)
+
+console = setup_tests()
+expect_prompt()
+
+run_builtin('history')
+expect_exact("1  cmd 4000\r\n", "The last lines of $CUSH_HISTFILE were not loaded")
+expect_exact("1000  cmd 4999\r\n1001  history", "The last lines of $CUSH_HISTFILE were not loaded")
+
+sendline("history -s two")
+expect_exact("echo two", "history -s does not search the whole history file")
+
+test_success()
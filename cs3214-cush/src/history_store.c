@@ -0,0 +1,147 @@
+/*
+ * Persistent command history.
+ *
+ * The history file is plain text, one command per line, and is only
+ * ever appended to, one write per line, so that shells sharing a file
+ * do not interleave their lines.  At startup the file is mapped and
+ * walked back from its end over the last HISTORY_LOAD lines only, which
+ * go into readline's history; a history of any length loads as fast as
+ * a short one.  The older lines stay on disk, where 'history -s' finds
+ * them by mapping the file again and scanning it with memmem().
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <readline/history.h>
+
+#include "history_store.h"
+#include "utils.h"
+
+#define HISTORY_LOAD 1000       /* lines of the file loaded at startup */
+
+static int hist_fd = -1;        /* the history file, open for appending */
+
+/* Map the history file as it is now.  Returns NULL if it is empty. */
+static char *
+map_file(size_t *len)
+{
+    struct stat st;
+    if (fstat(hist_fd, &st) == -1 || st.st_size == 0)
+        return NULL;
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, hist_fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    *len = st.st_size;
+    return map;
+}
+
+void
+history_store_open(void)
+{
+    using_history();
+    const char *path = getenv("CUSH_HISTFILE");
+    if (path == NULL || *path == '\0')
+        return;
+
+    hist_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (hist_fd == -1) {
+        utils_error("cannot open history file %s: ", path);
+        return;
+    }
+
+    size_t len;
+    char *map = map_file(&len);
+    if (map == NULL)
+        return;
+
+    /* Find the oldest of the last HISTORY_LOAD lines */
+    const char *end = map + len - (map[len - 1] == '\n');
+    const char *first = end;
+    for (int n = 0; n < HISTORY_LOAD && first > map; n++) {
+        const char *nl = memrchr(map, '\n', first - map - (n > 0));
+        first = nl != NULL ? nl + 1 : map;
+    }
+
+    for (const char *p = first; p < end; ) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            eol = end;
+        if (eol > p) {
+            char *line = strndup(p, eol - p);
+            add_history(line);
+            free(line);
+        }
+        p = eol + 1;
+    }
+    munmap(map, len);
+}
+
+void
+history_store_add(const char *line)
+{
+    HIST_ENTRY *last = history_length > 0 ? history_get(history_base + history_length - 1) : NULL;
+    if (last != NULL && strcmp(last->line, line) == 0)
+        return;
+
+    add_history(line);
+    if (hist_fd == -1 || strchr(line, '\n') != NULL)
+        return;
+
+    struct iovec iov[2] = {
+        { .iov_base = (void *) line, .iov_len = strlen(line) },
+        { .iov_base = "\n", .iov_len = 1 },
+    };
+    if (writev(hist_fd, iov, 2) == -1) {
+        utils_error("cannot write history file, no longer saving history: ");
+        close(hist_fd);
+        hist_fd = -1;
+    }
+}
+
+void
+history_store_print(void)
+{
+    HIST_ENTRY **list = history_list();
+    for (int i = 0; list != NULL && list[i] != NULL; i++)
+        printf("%d  %s\n", history_base + i, list[i]->line);
+}
+
+void
+history_store_search(const char *text)
+{
+    size_t len;
+    char *map = hist_fd != -1 ? map_file(&len) : NULL;
+    if (map == NULL) {
+        HIST_ENTRY **list = history_list();
+        for (int i = 0; list != NULL && list[i] != NULL; i++)
+            if (strstr(list[i]->line, text) != NULL)
+                printf("%s\n", list[i]->line);
+        return;
+    }
+
+    size_t textlen = strlen(text);
+    const char *end = map + len;
+    for (const char *p = map; p < end; ) {
+        const char *hit = memmem(p, end - p, text, textlen);
+        if (hit == NULL)
+            break;
+        /* p is at the start of a line, so the line of the hit starts at
+         * the last newline between them */
+        const char *bol = memrchr(p, '\n', hit - p);
+        bol = bol != NULL ? bol + 1 : p;
+        const char *eol = memchr(hit, '\n', end - hit);
+        if (eol == NULL)
+            eol = end;
+        printf("%.*s\n", (int) (eol - bol), bol);
+        p = eol + 1;
+    }
+    munmap(map, len);
+}
@@ -0,0 +1,21 @@
+#ifndef __HISTORY_STORE_H
+#define __HISTORY_STORE_H
+
+/* Keep the command history in the file named by $CUSH_HISTFILE, if it
+ * is set: load its last HISTORY_LOAD lines into readline's history,
+ * and append every line added from now on.  Without $CUSH_HISTFILE,
+ * the history lives in readline's memory only. */
+void history_store_open(void);
+
+/* Add 'line' to the history, unless it repeats the last entry */
+void history_store_add(const char *line);
+
+/* Print the history, numbered from 1, as for 'history' */
+void history_store_print(void);
+
+/* Print every line of the whole history file that contains 'text',
+ * oldest first, as for 'history -s text'.  Searches readline's history
+ * if there is no file. */
+void history_store_search(const char *text);
+
+#endif /* __HISTORY_STORE_H */
@@ -0,0 +1,192 @@
+/*
+ * A cache of PATH lookups, so that running a command from PATH does not
+ * probe every PATH directory each time.
+ *
+ * Entries live in a chained hash table keyed by command name.  The
+ * table remembers the value of PATH it was filled under; a lookup
+ * under any other PATH empties it first.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "path_cache.h"
+
+struct path_entry {
+    char *name;
+    char *path;
+    unsigned long hits;
+    struct path_entry *next;
+};
+
+static struct path_entry **table;
+static size_t table_size;       /* a power of 2, or 0 */
+static size_t num_entries;
+static char *cached_path;       /* the PATH the entries were found under */
+
+static size_t
+hash_name(const char *name)
+{
+    /* FNV-1a */
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *) name; *p; p++)
+        h = (h ^ *p) * 1099511628211ULL;
+    return h & (table_size - 1);
+}
+
+static struct path_entry *
+find_entry(const char *name)
+{
+    if (table_size == 0)
+        return NULL;
+    for (struct path_entry *e = table[hash_name(name)]; e != NULL; e = e->next)
+        if (strcmp(e->name, name) == 0)
+            return e;
+    return NULL;
+}
+
+static void
+grow_table(void)
+{
+    size_t old_size = table_size;
+    struct path_entry **old = table;
+
+    table_size = old_size ? 2 * old_size : 32;
+    table = calloc(table_size, sizeof *table);
+    for (size_t i = 0; i < old_size; i++) {
+        for (struct path_entry *e = old[i], *next; e != NULL; e = next) {
+            next = e->next;
+            size_t slot = hash_name(e->name);
+            e->next = table[slot];
+            table[slot] = e;
+        }
+    }
+    free(old);
+}
+
+static void
+insert_entry(const char *name, char *path)
+{
+    if (num_entries >= table_size)
+        grow_table();
+
+    struct path_entry *e = malloc(sizeof *e);
+    e->name = strdup(name);
+    e->path = path;
+    e->hits = 0;
+    size_t slot = hash_name(name);
+    e->next = table[slot];
+    table[slot] = e;
+    num_entries++;
+}
+
+/* Search PATH for an executable regular file 'name', as execvp() does.
+ * Returns a malloc'd path, or NULL. */
+static char *
+search_path(const char *path, const char *name)
+{
+    size_t namelen = strlen(name);
+    for (const char *dir = path; ; ) {
+        const char *end = strchrnul(dir, ':');
+        size_t dirlen = end - dir;
+
+        /* An empty entry means the current directory */
+        char *file = malloc(dirlen + namelen + 2);
+        if (dirlen == 0) {
+            memcpy(file, name, namelen + 1);
+        } else {
+            memcpy(file, dir, dirlen);
+            file[dirlen] = '/';
+            memcpy(file + dirlen + 1, name, namelen + 1);
+        }
+
+        struct stat st;
+        if (stat(file, &st) == 0 && S_ISREG(st.st_mode) && access(file, X_OK) == 0)
+            return file;
+        free(file);
+
+        if (*end == '\0')
+            return NULL;
+        dir = end + 1;
+    }
+}
+
+const char *
+path_cache_lookup(const char *name)
+{
+    if (strchr(name, '/') != NULL)
+        return name;
+
+    const char *path = getenv("PATH");
+    if (path == NULL)
+        path = "/bin:/usr/bin";
+    if (cached_path == NULL || strcmp(cached_path, path) != 0) {
+        path_cache_clear();
+        cached_path = strdup(path);
+    }
+
+    struct path_entry *e = find_entry(name);
+    if (e == NULL) {
+        char *file = search_path(path, name);
+        if (file == NULL)
+            return NULL;
+        insert_entry(name, file);
+        e = find_entry(name);
+    }
+    e->hits++;
+    return e->path;
+}
+
+void
+path_cache_forget(const char *name)
+{
+    if (table_size == 0)
+        return;
+    for (struct path_entry **pe = &table[hash_name(name)]; *pe != NULL; pe = &(*pe)->next) {
+        struct path_entry *e = *pe;
+        if (strcmp(e->name, name) == 0) {
+            *pe = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            num_entries--;
+            return;
+        }
+    }
+}
+
+void
+path_cache_clear(void)
+{
+    for (size_t i = 0; i < table_size; i++) {
+        for (struct path_entry *e = table[i], *next; e != NULL; e = next) {
+            next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+        table[i] = NULL;
+    }
+    num_entries = 0;
+    free(cached_path);
+    cached_path = NULL;
+}
+
+void
+path_cache_print(void)
+{
+    if (num_entries == 0) {
+        printf("hash: hash table empty\n");
+        return;
+    }
+    printf("hits\tcommand\n");
+    for (size_t i = 0; i < table_size; i++)
+        for (struct path_entry *e = table[i]; e != NULL; e = e->next)
+            printf("%4lu\t%s\n", e->hits, e->path);
+}
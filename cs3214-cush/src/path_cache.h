@@ -0,0 +1,19 @@
+#ifndef __PATH_CACHE_H
+#define __PATH_CACHE_H
+
+/* Return the executable that running 'name' would exec, searching PATH
+ * through a cache that is dropped whenever PATH changes.  Names with a
+ * slash are returned as they are.  Returns NULL if no executable was
+ * found; misses are not cached.  Not thread-safe. */
+const char *path_cache_lookup(const char *name);
+
+/* Forget the entry for 'name', e.g. after the file went away */
+void path_cache_forget(const char *name);
+
+/* Forget all entries, as for 'hash -r' */
+void path_cache_clear(void);
+
+/* Print the cached entries with their hit counts, as for 'hash' */
+void path_cache_print(void);
+
+#endif /* __PATH_CACHE_H */
@@ -10,14 +10,114 @@
 #include <sys/types.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 
 #include "shell-ast.h"
 
-/* Create new command structure.  Takes ownership of argv. */
+/* Chunks are sized for typical command lines; larger objects get a
+ * chunk of their own */
+#define ARENA_CHUNK 2048
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    max_align_t data[];
+};
+
+struct ast_arena {
+    struct arena_chunk *chunks; /* the first one is allocated along with the arena */
+    char *next, *end;           /* free space left in the newest chunk */
+    int refs;
+};
+
+static struct ast_arena *parse_arena;   /* the arena being parsed into */
+
+static struct arena_chunk *
+arena_add_chunk(struct ast_arena *arena, size_t size)
+{
+    struct arena_chunk *chunk = malloc(sizeof *chunk + size);
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    return chunk;
+}
+
+void
+ast_arena_begin_parse(void)
+{
+    assert(parse_arena == NULL);
+    struct ast_arena *arena = malloc(sizeof *arena + sizeof(struct arena_chunk) + ARENA_CHUNK);
+    struct arena_chunk *first = (struct arena_chunk *) (arena + 1);
+    first->next = NULL;
+    arena->chunks = first;
+    arena->next = (char *) first->data;
+    arena->end = arena->next + ARENA_CHUNK;
+    arena->refs = 0;
+    parse_arena = arena;
+}
+
+static void
+arena_release(struct ast_arena *arena)
+{
+    if (--arena->refs > 0)
+        return;
+
+    struct arena_chunk *first = (struct arena_chunk *) (arena + 1);
+    for (struct arena_chunk *c = arena->chunks, *next; c != first; c = next) {
+        next = c->next;
+        free(c);
+    }
+    free(arena);
+}
+
+void
+ast_arena_end_parse(struct ast_command_line *cmdline)
+{
+    struct ast_arena *arena = parse_arena;
+    parse_arena = NULL;
+    arena->refs = 1;    /* the parse's own, dropped below */
+    if (cmdline != NULL) {
+        arena->refs++;
+        cmdline->arena = arena;
+        for (struct list_elem * e = list_begin(&cmdline->pipes); 
+             e != list_end(&cmdline->pipes); 
+             e = list_next(e))
+            list_entry(e, struct ast_pipeline, elem)->arena = arena;
+    }
+    arena_release(arena);
+}
+
+void *
+ast_alloc(size_t size)
+{
+    struct ast_arena *arena = parse_arena;
+    assert(arena != NULL);
+    size = (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+    if (size > (size_t) (arena->end - arena->next)) {
+        if (size > ARENA_CHUNK / 4) {
+            // Don't give up the rest of the current chunk for a big object.
+            return arena_add_chunk(arena, size)->data;
+        }
+        struct arena_chunk *chunk = arena_add_chunk(arena, ARENA_CHUNK);
+        arena->next = (char *) chunk->data;
+        arena->end = arena->next + ARENA_CHUNK;
+    }
+    void *p = arena->next;
+    arena->next += size;
+    return p;
+}
+
+char *
+ast_strdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    return memcpy(ast_alloc(len), s, len);
+}
+
+/* Create new command structure.  argv must come from ast_alloc(). */
 struct ast_command * 
 ast_command_create(char ** argv, bool dup_stderr_to_stdout)
 {
-    struct ast_command *cmd = malloc(sizeof *cmd);
+    struct ast_command *cmd = ast_alloc(sizeof *cmd);
 
     cmd->argv = argv;
     cmd->dup_stderr_to_stdout = dup_stderr_to_stdout;
@@ -29,7 +129,7 @@ struct ast_pipeline * ast_pipeline_create(char *iored_input,
                                           char *iored_output, 
                                           bool append_to_output)
 {
-    struct ast_pipeline *pipe = malloc(sizeof *pipe);
+    struct ast_pipeline *pipe = ast_alloc(sizeof *pipe);
 
     list_init(&pipe->commands);
     pipe->iored_output = iored_output;
@@ -50,7 +150,7 @@ ast_pipeline_add_command(struct ast_pipeline *pipe, struct ast_command *cmd)
 struct ast_command_line *
 ast_command_line_create_empty(void)
 {
-    struct ast_command_line *cmdline = malloc(sizeof *cmdline);
+    struct ast_command_line *cmdline = ast_alloc(sizeof *cmdline);
 
     list_init(&cmdline->pipes);
     return cmdline;
@@ -128,42 +228,29 @@ ast_command_line_print(struct ast_command_line *cmdline)
     printf("==========================================\n");
 }
 
-/* Deallocation functions. */
-void 
-ast_command_line_free(struct ast_command_line *cmdline)
+struct ast_command_line *
+ast_command_line_ref(struct ast_command_line *cmdline)
 {
-    for (struct list_elem * e = list_begin(&cmdline->pipes); e != list_end(&cmdline->pipes); ) {
-        struct ast_pipeline *pipe = list_entry(e, struct ast_pipeline, elem);
-        e = list_remove(e);
-        ast_pipeline_free(pipe);
-    }
-    free(cmdline);
+    cmdline->arena->refs++;
+    return cmdline;
 }
 
-void 
-ast_pipeline_free(struct ast_pipeline *pipe)
+struct ast_pipeline *
+ast_pipeline_ref(struct ast_pipeline *pipe)
 {
-    for (struct list_elem * e = list_begin(&pipe->commands); e != list_end(&pipe->commands); ) {
-        struct ast_command *cmd = list_entry(e, struct ast_command, elem);
-        e = list_remove(e);
-        ast_command_free(cmd);
-    }
-    if (pipe->iored_input)
-        free(pipe->iored_input);
-
-    if (pipe->iored_output)
-        free(pipe->iored_output);
+    pipe->arena->refs++;
+    return pipe;
+}
 
-    free(pipe);
+/* Deallocation functions. */
+void 
+ast_command_line_free(struct ast_command_line *cmdline)
+{
+    arena_release(cmdline->arena);
 }
 
 void 
-ast_command_free(struct ast_command * cmd)
+ast_pipeline_free(struct ast_pipeline *pipe)
 {
-    char ** p = cmd->argv;
-    while (*p) {
-        free(*p++);
-    }
-    free(cmd->argv);
-    free(cmd);
+    arena_release(pipe->arena);
 }
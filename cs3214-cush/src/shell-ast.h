@@ -7,10 +7,12 @@
 struct ast_command;
 struct ast_pipeline;
 struct ast_command_line;
+struct ast_arena;
 
 /* A command line may contain multiple pipelines. */
 struct ast_command_line {
     struct list/* <ast_pipeline> */ pipes;        /* List of pipelines */
+    struct ast_arena *arena; /* Where it and everything in it lives */
 };
 
 /* A pipeline is a list of one or more commands. 
@@ -24,6 +26,7 @@ struct ast_pipeline {
                                 file 'iored_output' */
     bool append_to_output;   /* True if user typed >> to append */
     bool bg_job;             /* True if user entered & */
+    struct ast_arena *arena; /* The arena of its command line */
     struct list_elem elem;   /* Link element. */
 };
 
@@ -35,6 +38,28 @@ struct ast_command {
     struct list_elem elem;   /* Link element to link commands in pipeline. */
 };
 
+/*
+ * Each command line is parsed into one arena: all of its nodes, argv
+ * arrays and words are bump-allocated from it while it is being parsed.
+ * The parsed command line holds a reference to the arena, and so does
+ * whoever keeps one of its pipelines (e.g. a job) or keeps the command
+ * line itself some more (e.g. a cache); the arena is released in one go
+ * once all of them have let go.  The tree is never modified after
+ * parsing, so it may be executed any number of times.
+ */
+
+/* Start parsing a new command line; further allocations come from a
+ * new arena until ast_arena_end_parse() */
+void ast_arena_begin_parse(void);
+
+/* Done parsing.  Hands the arena's reference to cmdline, or releases
+ * the arena if cmdline is NULL (parse error). */
+void ast_arena_end_parse(struct ast_command_line *cmdline);
+
+/* Allocate from the arena of the command line being parsed */
+void * ast_alloc(size_t size);
+char * ast_strdup(const char *s);
+
 /* Create new command structure and initialize it */
 struct ast_command * ast_command_create(char ** argv,
                                         bool dup_stderr_to_stdout);
@@ -53,10 +78,14 @@ struct ast_command_line * ast_command_line_create_empty(void);
 /* Create a command line with a single pipeline */
 struct ast_command_line * ast_command_line_create(struct ast_pipeline *pipe);
 
-/* Deallocation functions */
+/* Take another reference to the arena of a command line or pipeline */
+struct ast_command_line * ast_command_line_ref(struct ast_command_line *);
+struct ast_pipeline * ast_pipeline_ref(struct ast_pipeline *);
+
+/* Deallocation functions.  These drop a reference; the memory itself
+ * goes once its arena has no references left. */
 void ast_command_line_free(struct ast_command_line *);
 void ast_pipeline_free(struct ast_pipeline *);
-void ast_command_free(struct ast_command *);
 
 /* Print functions */
 void ast_command_print(struct ast_command *cmd);
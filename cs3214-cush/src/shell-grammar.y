@@ -9,7 +9,8 @@
  * This is based on an assignment as an undergraduate in 1993 
  * as an undergraduate student at Technische Universitaet Berlin.
  *
- * Known bugs: leaks memory when parse errors occur.
+ * Everything is allocated from the command line's arena (see
+ * shell-ast.h), so nothing needs freeing when a parse error occurs.
  */
 %{
 #include <stdio.h>
@@ -28,14 +29,12 @@ int yylex(void);
 #define AMBOUT  "Ambiguous output redirect."
 
 #include "shell-ast.h"
-#include <obstack.h>
 #include <assert.h>
-
-#define obstack_chunk_alloc malloc
-#define obstack_chunk_free free
+#include <string.h>
 
 struct cmd_helper {
-    struct obstack words;   /* an obstack of char * to collect argv */
+    char **words;           /* collects argv, with room for a NULL */
+    int nwords, capacity;
     char *iored_input;
     char *iored_output;
     bool append_to_output;
@@ -50,21 +49,36 @@ struct pipe_helper {
 static struct pipe_helper *
 init_pipe()
 {
-    struct pipe_helper * pipe = calloc(1, sizeof *pipe);
+    struct pipe_helper * pipe = ast_alloc(sizeof *pipe);
     list_init(&pipe->commands);
     return pipe;
 }
 
+/* Append a word to argv.  Space outgrown stays in the arena. */
+static void
+add_word(struct cmd_helper *cmd, char *word)
+{
+    if (cmd->nwords + 1 >= cmd->capacity) {
+        cmd->capacity = cmd->capacity ? 2 * cmd->capacity : 8;
+        char **words = ast_alloc(cmd->capacity * sizeof *words);
+        if (cmd->nwords)
+            memcpy(words, cmd->words, cmd->nwords * sizeof *words);
+        cmd->words = words;
+    }
+    cmd->words[cmd->nwords++] = word;
+}
+
 /* Initialize cmd_helper and, optionally, set first argv */
 static struct cmd_helper *
 init_cmd(char *firstcmd, 
          char *iored_input, char *iored_output, 
          bool append_to_output, bool include_stderr)
 {
-    struct cmd_helper * cmd = malloc(sizeof *cmd);
-    obstack_init(&cmd->words);
+    struct cmd_helper * cmd = ast_alloc(sizeof *cmd);
+    cmd->words = NULL;
+    cmd->nwords = cmd->capacity = 0;
     if (firstcmd)
-        obstack_ptr_grow(&cmd->words, firstcmd);
+        add_word(cmd, firstcmd);
 
     cmd->iored_output = iored_output;
     cmd->iored_input = iored_input;
@@ -82,19 +96,11 @@ static void p_error(char *msg);
 static struct ast_command * 
 make_ast_command(struct cmd_helper *cmd)
 {
-    obstack_ptr_grow(&cmd->words, NULL);
-
-    int sz = obstack_object_size(&cmd->words);
-    char **argv = malloc(sz);
-    memcpy(argv, obstack_finish(&cmd->words), sz);
-    obstack_free(&cmd->words, NULL);
-
-    if (*argv == NULL) {
-        free(argv);
+    if (cmd->nwords == 0)
         return NULL; 
-    }
 
-    return ast_command_create(argv, cmd->redirect_stderr);
+    cmd->words[cmd->nwords] = NULL;
+    return ast_command_create(cmd->words, cmd->redirect_stderr);
 }
 
 static bool
@@ -114,8 +120,7 @@ add_to_pipeline(struct pipe_helper *pipe,
         if (cmd->iored_input) { p_error(AMBINP); return false; }
     }
 
-    int sz = obstack_object_size(&cmd->words);
-    if (sz == 0) { p_error(INVNUL); return false; }
+    if (cmd->nwords == 0) { p_error(INVNUL); return false; }
 
     list_push_back(&pipe->commands, &cmd->elem);
     return true;
@@ -200,9 +205,7 @@ ast_pipeline: pipeline {
                 struct cmd_helper * cmd = list_entry(e, struct cmd_helper, elem);
                 ast_pipeline_add_command($$, make_ast_command(cmd));
                 e = list_remove(e);
-                free(cmd);
             }
-            free(pipe);
         }
 
 pipeline: command {
@@ -230,25 +233,21 @@ command:   WORD {
 |		output
 |		command WORD {
             $$ = $1;
-            obstack_ptr_grow(&$$->words, $2);
+            add_word($$, $2);
 		}
 |		command input {
-            obstack_free(&$2->words, NULL);
             /* Error: ambiguous redirect 'a <b <c' */
             if ($1->iored_input)   { p_error(AMBINP); YYABORT; }
             $$ = $1; 
             $$->iored_input = $2->iored_input;
-            free($2);
 		}
 |		command output {
-            obstack_free(&$2->words, NULL);
             /* Error: ambiguous redirect 'a >b >c' */
             if ($1->iored_output) { p_error(AMBOUT); YYABORT; }
             $$ = $1; 
             $$->iored_output = $2->iored_output;
             $$->append_to_output = $2->append_to_output;
             $$->redirect_stderr = $2->redirect_stderr;
-            free($2);
 		}
 
 input:	'<' WORD { 
@@ -307,7 +306,11 @@ ast_parse_command_line(char * line)
     inputline = line;
     commandline = NULL;
 
+    ast_arena_begin_parse();
     int error = yyparse();
+    if (error)
+        commandline = NULL;
+    ast_arena_end_parse(commandline);
 
-    return error ? NULL : commandline;
+    return commandline;
 }
@@ -19,4 +19,8 @@ bool signal_unblock(int sig);
 /* Install signal handler for signal 'sig' */
 void signal_set_handler(int sig, sa_sigaction_t handler);
 
+/* Block signal 'sig' for good and return a signalfd to read it from
+ * instead.  Reads block until the signal is pending. */
+int signal_open_fd(int sig);
+
 #endif /* __SIGNAL_SUPPORT_H */
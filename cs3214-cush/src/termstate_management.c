@@ -12,6 +12,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <stdbool.h>
 
 #include "termstate_management.h"
 #include "utils.h"
@@ -21,6 +22,7 @@ static int terminal_fd = -1;           /* The controlling terminal */
 static struct termios saved_tty_state; /* The state of the terminal when shell
                                            was started. */
 static int shell_pgrp;          /* The pgrp of the shell when it started */
+static bool no_terminal;        /* termstate_try_init() found none */
 
 /* Initialize tty support. */
 void
@@ -40,11 +42,28 @@ termstate_init(void)
     termstate_sample();
 }
 
+/* Initialize tty support if there is a controlling terminal */
+bool
+termstate_try_init(void)
+{
+    int fd = open(ctermid(NULL), O_RDWR);
+    if (fd == -1) {
+        no_terminal = true;
+        shell_pgrp = getpgrp();
+        return false;
+    }
+    close(fd);
+    termstate_init();
+    return true;
+}
+
 /* Save current terminal settings.
  * This function is used when a job is suspended.*/
 void 
 termstate_save(struct termios *saved_tty_state)
 {
+    if (no_terminal)
+        return;
     int rc = tcgetattr(terminal_fd, saved_tty_state);
     if (rc == -1)
         utils_fatal_error("tcgetattr failed: ");
@@ -73,7 +92,7 @@ retry:
 int
 termstate_get_tty_fd(void)
 {
-    assert(terminal_fd != -1 || !!!"termstate_init() must be called");
+    assert(terminal_fd != -1 || no_terminal || !!!"termstate_init() must be called");
     return terminal_fd;
 }
 
@@ -90,6 +109,8 @@ termstate_get_tty_fd(void)
 void
 termstate_give_terminal_to(struct termios *pg_tty_state, pid_t pgrp)
 {
+    if (no_terminal)
+        return;
     signal_block(SIGTTOU);
     int rc = tcsetpgrp(termstate_get_tty_fd(), pgrp);
     if (rc == -1)
@@ -116,6 +137,8 @@ termstate_sample(void)
 pid_t
 termstate_get_current_terminal_owner(void)
 {
+    if (no_terminal)
+        return shell_pgrp;
     pid_t rc = tcgetpgrp(termstate_get_tty_fd());
     if (rc == -1)
         utils_fatal_error("tcgetpgrp: ");
@@ -1,11 +1,18 @@
 #ifndef __TERMSTATE_MANAGEMENT_H
 #define __TERMSTATE_MANAGEMENT_H
 
+#include <stdbool.h>
 #include <sys/types.h>
 
 /* Initialize tty support. */
 void termstate_init(void);
 
+/* Initialize tty support if there is a controlling terminal, and return
+ * whether there is.  Without one (e.g. a script run by a test harness)
+ * the functions below do nothing; termstate_get_tty_fd() returns -1 and
+ * the shell counts as owning the terminal. */
+bool termstate_try_init(void);
+
 /* Save current terminal settings.
  * This function should be called when a job is suspended and the
  * state should be saved for this job so it can be restored with
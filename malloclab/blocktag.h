@@ -0,0 +1,37 @@
+#ifndef __BLOCKTAG_H
+#define __BLOCKTAG_H
+/*
+ * blocktag.h - the boundary tag of mm.c's blocks, and the block sizes
+ *              that follow from it.  mkclasses includes it too, to
+ *              count requests in the block sizes mm.c gives them.
+ */
+#include <stddef.h>
+
+#include "config.h"
+
+#define ARENA_BITS 6 /* room for up to 64 arenas */
+
+struct boundary_tag
+{
+    size_t inuse : 1;          // inuse bit
+    size_t prev_inuse : 1;     // inuse bit of the previous block (headers only)
+    size_t mapped : 1;         // block has a mem_map() region of its own
+    size_t arena : ARENA_BITS; // index of the arena owning the block
+    size_t size : 55;          // size of block, in words
+                               // block size
+};
+
+#define WSIZE sizeof(struct boundary_tag) /* Word and header/footer size (bytes) */
+/* Minimum block size in words: a free block needs a header, its links and a footer */
+#ifdef USE_RBTREE
+#define MIN_BLOCK_SIZE_WORDS 6
+#else
+#define MIN_BLOCK_SIZE_WORDS 4
+#endif
+
+/* Size classes are computed in units of ALIGNMENT bytes, since every
+ * block size is a multiple of that. */
+#define UNIT_WORDS (ALIGNMENT / WSIZE)                       /* words per size unit */
+#define MIN_BLOCK_UNITS (MIN_BLOCK_SIZE_WORDS / UNIT_WORDS) /* smallest block, in units */
+
+#endif /* __BLOCKTAG_H */
@@ -1,5 +1,8 @@
 /* Routines for using cycle counter */
 
+/* Read the raw cycle counter (x86 only) */
+void access_counter(unsigned *hi, unsigned *lo);
+
 /* Start the counter */
 void start_counter();
 
@@ -74,7 +74,9 @@
 /* 
  * Maximum heap size in bytes 
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (1024*(1<<20))  /* 1024 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
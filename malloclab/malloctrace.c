@@ -0,0 +1,441 @@
+/*
+ * malloctrace.c - An LD_PRELOAD library that records the malloc, calloc,
+ *     realloc and free calls of a real process as a binary mdriver trace:
+ *
+ *         LD_PRELOAD=./libMallocTrace.so MDTRACE_FILE=app.bin <command>
+ *         ./mdriver -f app.bin
+ *
+ *     A "%p" in MDTRACE_FILE is replaced by the process id, so that
+ *     programs the traced one runs write traces of their own; the
+ *     default is mdtrace-%p.bin.
+ *
+ *     Live payload addresses are mapped to block ids, and the ids of
+ *     freed blocks are reused, so the trace needs no more ids than the
+ *     process ever had blocks live at once.  Each op is tagged with the
+ *     thread that made the call.  Ops are appended to one buffer under a
+ *     lock, so the trace keeps the order in which calls completed, and
+ *     the buffer is written out TRACE_BUFFER_OPS at a time.  The header
+ *     is filled in when the process exits.
+ *
+ *     Blocks the library did not see allocated (before it started, or
+ *     with memalign and friends) are not traced, and neither are their
+ *     frees.  Zero-byte requests are recorded as one-byte requests,
+ *     which mm_malloc can serve, and calloc() calls as CALLOC ops.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mdtrace.h"
+
+#define TRACE_BUFFER_OPS 8192           /* ops buffered between writes */
+#define DEFAULT_TRACE_FILE "mdtrace-%p.bin"
+#define LIVE_MIN_CAPACITY (1 << 16)     /* initial slots in the live table */
+#define BOOTSTRAP_SIZE 8192             /* for dlsym's allocations */
+
+/* The allocator we interpose on */
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_calloc)(size_t, size_t);
+
+/* Until the real functions are found, allocations (dlsym's own) come
+ * from here and are never freed. */
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static size_t bootstrap_used;
+static int resolving;
+
+/* Everything below is protected by trace_lock */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;               /* -1 while not tracing */
+static bintrace_header_t header;
+static traceop_t buffer[TRACE_BUFFER_OPS];
+static int buffered;
+
+/* Live blocks: an open-addressed table from payload address to block id.
+ * It and the free ids are mmap'd, so tracing never calls malloc. */
+struct live_entry {
+    void *ptr;                          /* NULL if the slot is empty */
+    int32_t id;
+};
+static struct live_entry *live;
+static size_t live_capacity;            /* a power of two */
+static size_t live_count;
+static int32_t *free_ids;               /* ids of freed blocks, for reuse */
+static size_t free_id_count;
+static size_t free_id_capacity;
+
+static int32_t next_thread = 1;         /* tag for the next thread seen */
+static __thread int32_t thread_tag;     /* 0 until the thread first calls in */
+
+static void resolve_real(void)
+{
+    resolving = 1;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    resolving = 0;
+    if (!real_malloc || !real_free || !real_realloc || !real_calloc) {
+        static const char msg[] = "malloctrace: could not find the real allocator\n";
+        write(2, msg, sizeof msg - 1);
+        abort();
+    }
+}
+
+static void *bootstrap_alloc(size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    if (size > BOOTSTRAP_SIZE - bootstrap_used)
+        return NULL;
+    void *p = bootstrap + bootstrap_used;
+    bootstrap_used += size;
+    return p;
+}
+
+static int is_bootstrap(void *p)
+{
+    return (char *)p >= bootstrap && (char *)p < bootstrap + BOOTSTRAP_SIZE;
+}
+
+/* mmap-backed growth for the bookkeeping arrays; returns NULL on failure */
+static void *grow_array(void *old, size_t old_bytes, size_t new_bytes)
+{
+    void *p = mmap(NULL, new_bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (old != NULL) {
+        memcpy(p, old, old_bytes);
+        munmap(old, old_bytes);
+    }
+    return p;
+}
+
+static size_t live_slot(void *ptr)
+{
+    uint64_t h = ((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ull;
+    return (h >> 32) & (live_capacity - 1);
+}
+
+static void stop_tracing(void)
+{
+    if (trace_fd >= 0)
+        close(trace_fd);
+    trace_fd = -1;
+}
+
+/* Rehash into a table twice the size; stops tracing if out of memory */
+static int live_grow(void)
+{
+    size_t old_capacity = live_capacity;
+    struct live_entry *old = live;
+    size_t capacity = old_capacity ? 2 * old_capacity : LIVE_MIN_CAPACITY;
+    struct live_entry *table = grow_array(NULL, 0, capacity * sizeof *table);
+    if (table == NULL) {
+        stop_tracing();
+        return -1;
+    }
+
+    live = table;
+    live_capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].ptr != NULL) {
+            size_t s = live_slot(old[i].ptr);
+            while (live[s].ptr != NULL)
+                s = (s + 1) & (live_capacity - 1);
+            live[s] = old[i];
+        }
+    }
+    if (old != NULL)
+        munmap(old, old_capacity * sizeof *old);
+    return 0;
+}
+
+static int live_insert(void *ptr, int32_t id)
+{
+    if (10 * (live_count + 1) > 7 * live_capacity && live_grow() < 0)
+        return -1;
+    size_t s = live_slot(ptr);
+    while (live[s].ptr != NULL)
+        s = (s + 1) & (live_capacity - 1);
+    live[s].ptr = ptr;
+    live[s].id = id;
+    live_count++;
+    return 0;
+}
+
+/* Remove ptr and return its id, or -1 if it is not live */
+static int32_t live_remove(void *ptr)
+{
+    if (live_capacity == 0)
+        return -1;
+    size_t s = live_slot(ptr);
+    while (live[s].ptr != ptr) {
+        if (live[s].ptr == NULL)
+            return -1;
+        s = (s + 1) & (live_capacity - 1);
+    }
+    int32_t id = live[s].id;
+
+    /* shift later entries of the probe run back into the hole */
+    size_t hole = s;
+    for (;;) {
+        s = (s + 1) & (live_capacity - 1);
+        if (live[s].ptr == NULL)
+            break;
+        size_t home = live_slot(live[s].ptr);
+        if (((s - home) & (live_capacity - 1)) >= ((s - hole) & (live_capacity - 1))) {
+            live[hole] = live[s];
+            hole = s;
+        }
+    }
+    live[hole].ptr = NULL;
+    live_count--;
+    return id;
+}
+
+static int32_t take_id(void)
+{
+    if (free_id_count > 0)
+        return free_ids[--free_id_count];
+    return header.num_ids++;
+}
+
+static void give_back_id(int32_t id)
+{
+    if (free_id_count == free_id_capacity) {
+        size_t capacity = free_id_capacity ? 2 * free_id_capacity : 4096;
+        int32_t *ids = grow_array(free_ids, free_id_capacity * sizeof *ids,
+                                  capacity * sizeof *ids);
+        if (ids == NULL)
+            return;     /* the id is just not reused */
+        free_ids = ids;
+        free_id_capacity = capacity;
+    }
+    free_ids[free_id_count++] = id;
+}
+
+static void flush_buffer(void)
+{
+    char *p = (char *)buffer;
+    size_t left = buffered * sizeof(traceop_t);
+    while (left > 0 && trace_fd >= 0) {
+        ssize_t n = write(trace_fd, p, left);
+        if (n < 0) {
+            stop_tracing();
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+    buffered = 0;
+}
+
+static void record(int32_t type, int32_t id, size_t size)
+{
+    if (thread_tag == 0)
+        thread_tag = __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED);
+
+    traceop_t *op = &buffer[buffered++];
+    op->type = type;
+    op->align_log2 = 0;
+    op->index = id;
+    op->size = size;
+    op->thread = thread_tag;
+    header.num_ops++;
+    if (buffered == TRACE_BUFFER_OPS)
+        flush_buffer();
+}
+
+/* Record that ptr was just allocated with size bytes, by an ALLOC or CALLOC */
+static void trace_alloc(int32_t type, void *ptr, size_t size)
+{
+    if (size > INT32_MAX)
+        return;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        int32_t id = take_id();
+        if (live_insert(ptr, id) == 0)
+            record(type, id, size ? size : 1);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* Record that ptr is about to be freed */
+static void trace_free(void *ptr)
+{
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        int32_t id = live_remove(ptr);
+        if (id >= 0) {
+            record(FREE, id, 0);
+            give_back_id(id);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void *malloc(size_t size)
+{
+    if (real_malloc == NULL) {
+        if (resolving)
+            return bootstrap_alloc(size);
+        resolve_real();
+    }
+
+    void *p = real_malloc(size);
+    if (p != NULL && trace_fd >= 0)
+        trace_alloc(ALLOC, p, size);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (real_calloc == NULL) {
+        if (resolving)
+            return bootstrap_alloc(nmemb * size);  /* static, so already zeroed */
+        resolve_real();
+    }
+
+    void *p = real_calloc(nmemb, size);
+    if (p != NULL && trace_fd >= 0)
+        trace_alloc(CALLOC, p, nmemb * size);
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL || is_bootstrap(ptr))
+        return;
+    if (real_free == NULL)
+        resolve_real();
+
+    /* record first: once freed, another thread may be handed ptr again */
+    if (trace_fd >= 0)
+        trace_free(ptr);
+    real_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return malloc(size);
+    if (real_realloc == NULL)
+        resolve_real();
+    if (is_bootstrap(ptr)) {
+        void *p = malloc(size);
+        if (p != NULL)
+            memcpy(p, ptr, size < BOOTSTRAP_SIZE - (size_t)((char *)ptr - bootstrap)
+                           ? size : BOOTSTRAP_SIZE - (size_t)((char *)ptr - bootstrap));
+        return p;
+    }
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (trace_fd < 0)
+        return real_realloc(ptr, size);
+
+    /* the lock is held across the call so that no one can be handed
+     * ptr before its entry is moved */
+    pthread_mutex_lock(&trace_lock);
+    void *p = real_realloc(ptr, size);
+    if (p != NULL && trace_fd >= 0) {
+        int32_t id = live_remove(ptr);
+        if (size > INT32_MAX) {
+            if (id >= 0) {
+                record(FREE, id, 0);
+                give_back_id(id);
+            }
+        } else if (id >= 0) {
+            if (live_insert(p, id) == 0)
+                record(REALLOC, id, size);
+        } else {
+            id = take_id();
+            if (live_insert(p, id) == 0)
+                record(ALLOC, id, size);
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return p;
+}
+
+/* a forked child stops tracing; the lock must not be inherited held */
+static void before_fork(void)
+{
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void after_fork_parent(void)
+{
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void after_fork_child(void)
+{
+    stop_tracing();
+    pthread_mutex_unlock(&trace_lock);
+}
+
+__attribute__((constructor))
+static void trace_start(void)
+{
+    if (real_malloc == NULL)
+        resolve_real();
+
+    /* expand %p in the file name */
+    const char *pattern = getenv("MDTRACE_FILE");
+    char path[4096];
+    size_t n = 0;
+    if (pattern == NULL || *pattern == '\0')
+        pattern = DEFAULT_TRACE_FILE;
+    for (const char *c = pattern; *c != '\0' && n < sizeof path - 16; c++) {
+        if (c[0] == '%' && c[1] == 'p') {
+            n += snprintf(path + n, sizeof path - n, "%d", (int)getpid());
+            c++;
+        } else
+            path[n++] = *c;
+    }
+    path[n] = '\0';
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("malloctrace: open");
+        return;
+    }
+
+    /* a placeholder header, completed in trace_finish() */
+    memcpy(header.magic, BINTRACE_MAGIC, sizeof header.magic);
+    header.weight = 1;
+    if (write(fd, &header, sizeof header) != sizeof header) {
+        perror("malloctrace: write");
+        close(fd);
+        return;
+    }
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+
+    pthread_mutex_lock(&trace_lock);
+    trace_fd = fd;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+__attribute__((destructor))
+static void trace_finish(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        flush_buffer();
+        if (trace_fd >= 0 && pwrite(trace_fd, &header, sizeof header, 0) != sizeof header)
+            perror("malloctrace: pwrite");
+        stop_tracing();
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
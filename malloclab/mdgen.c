@@ -0,0 +1,388 @@
+/*
+ * mdgen.c - synthetic workloads for mdriver.
+ *
+ * The generator keeps the set of blocks it has allocated and a min-heap
+ * of the op counts at which they are due to die.  Each op frees the
+ * block that is due, if there is one, and otherwise either grows a
+ * random live block with realloc or allocates a new one and draws its
+ * lifetime.  By Little's law the live set then settles at the allocation
+ * rate times the mean lifetime, so the mean is chosen to hit the target.
+ * Once the op budget is spent, the remaining blocks are freed.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mdgen.h"
+
+#define ZIPF_MAX_SIZES (1 << 20) /* zipf ranks are tabulated, so bound them */
+#define REALLOC_SPAN   16        /* realloc grows blocks to at most this many times the largest size */
+
+typedef struct {
+    long long death;             /* op count at which the block is freed */
+    int id;
+} death_t;
+
+struct mdgen {
+    mdgen_params_t p;
+    unsigned long long rng;
+    long long now;               /* ops generated so far */
+    double mean_life;
+    int max_size;                /* realloc's growth stops here */
+
+    double *zipf_cdf;            /* cumulative rank probabilities */
+    int zipf_n;
+
+    int *sizes;                  /* per id: its block's current size */
+    int *pos;                    /* per id: its slot in live[] */
+    int *live;                   /* ids of the live blocks, dense */
+    int nlive;
+    int *free_ids;               /* ids freed and available for reuse */
+    int nfree;
+    int num_ids, cap;
+
+    death_t *heap;
+    int nheap;
+};
+
+/*
+ * The shared defaults and parser
+ */
+static const mdgen_params_t defaults = {
+    .size_dist = GEN_SIZE_UNIFORM, .size_a = 1, .size_b = 1024, .size_c = 0,
+    .life_dist = GEN_LIFE_EXP,
+    .live_lo = 10000, .live_hi = 10000,
+    .realloc_p = 0, .realloc_growth = 2,
+    .ops = 10000000,
+    .seed = 1,
+    .touch = 0,
+};
+
+static const char *size_names[] = { "uniform", "zipf", "bimodal", "pow2" };
+static const char *life_names[] = { "exp", "uniform", "fixed" };
+
+static int lookup(const char *name, size_t len, const char **names, int n)
+{
+    for (int i = 0; i < n; i++)
+        if (strlen(names[i]) == len && strncmp(names[i], name, len) == 0)
+            return i;
+    return -1;
+}
+
+/* Read up to max colon-separated numbers; returns how many there were */
+static int parse_numbers(const char *s, const char *end, double *v, int max)
+{
+    int n = 0;
+    while (s < end && n < max) {
+        char *e;
+        v[n++] = strtod(s, &e);
+        if (e == s || (e < end && *e != ':'))
+            return -1;
+        s = e + (e < end);
+    }
+    return s < end ? -1 : n;
+}
+
+int mdgen_parse(const char *spec, mdgen_params_t *params, char *err, size_t errlen)
+{
+    *params = defaults;
+
+    const char *s = spec;
+    while (*s != '\0') {
+        const char *end = strchr(s, ',');
+        if (end == NULL)
+            end = s + strlen(s);
+        const char *eq = memchr(s, '=', end - s);
+        if (eq == NULL) {
+            snprintf(err, errlen, "expected key=value at \"%.*s\"", (int)(end - s), s);
+            return 0;
+        }
+
+        size_t keylen = eq - s;
+        const char *val = eq + 1;
+        double v[3] = { 0, 0, 0 };
+        int n, ok = 1;
+#define KEY(k) (keylen == strlen(k) && strncmp(s, k, keylen) == 0)
+        if (KEY("size")) {
+            const char *colon = memchr(val, ':', end - val);
+            int d = lookup(val, (colon ? colon : end) - val, size_names, 4);
+            n = colon ? parse_numbers(colon + 1, end, v, 3) : 0;
+            ok = d >= 0 && n >= 2 && v[0] >= 1 && v[1] >= v[0] && (n == 2 || d == GEN_SIZE_ZIPF || d == GEN_SIZE_BIMODAL);
+            if (ok) {
+                params->size_dist = d;
+                params->size_a = v[0];
+                params->size_b = v[1];
+                params->size_c = n == 3 ? v[2] : d == GEN_SIZE_ZIPF ? 1.0 : 0.5;
+                if (d == GEN_SIZE_BIMODAL)
+                    ok = params->size_c >= 0 && params->size_c <= 1;
+                if (d == GEN_SIZE_POW2)
+                    ok = (1 << (int)ceil(log2(v[0]))) <= v[1];
+            }
+        } else if (KEY("life")) {
+            params->life_dist = lookup(val, end - val, life_names, 3);
+            ok = params->life_dist >= 0;
+        } else if (KEY("live")) {
+            const char *dots = strstr(val, "..");
+            if (dots != NULL && dots < end) {
+                ok = parse_numbers(val, dots, v, 1) == 1 && parse_numbers(dots + 2, end, v + 1, 1) == 1;
+            } else {
+                ok = parse_numbers(val, end, v, 1) == 1;
+                v[1] = v[0];
+            }
+            ok = ok && v[0] >= 1 && v[1] >= v[0];
+            params->live_lo = v[0];
+            params->live_hi = v[1];
+        } else if (KEY("realloc")) {
+            n = parse_numbers(val, end, v, 2);
+            ok = n >= 1 && v[0] >= 0 && v[0] < 1 && (n == 1 || v[1] > 0);
+            params->realloc_p = v[0];
+            if (n == 2)
+                params->realloc_growth = v[1];
+        } else if (KEY("ops")) {
+            ok = parse_numbers(val, end, v, 1) == 1 && v[0] >= 1;
+            params->ops = v[0];
+        } else if (KEY("seed")) {
+            ok = parse_numbers(val, end, v, 1) == 1;
+            params->seed = v[0];
+        } else if (KEY("touch")) {
+            ok = parse_numbers(val, end, v, 1) == 1;
+            params->touch = v[0] != 0;
+        } else {
+            snprintf(err, errlen, "unknown key \"%.*s\"", (int)keylen, s);
+            return 0;
+        }
+#undef KEY
+        if (!ok) {
+            snprintf(err, errlen, "bad value in \"%.*s\"", (int)(end - s), s);
+            return 0;
+        }
+        s = *end ? end + 1 : end;
+    }
+    return 1;
+}
+
+void mdgen_describe(const mdgen_params_t *p, char *buf, size_t len)
+{
+    int n = snprintf(buf, len, "size=%s:%g:%g", size_names[p->size_dist], p->size_a, p->size_b);
+    if (p->size_dist == GEN_SIZE_ZIPF || p->size_dist == GEN_SIZE_BIMODAL)
+        n += snprintf(buf + n, len - n, ":%g", p->size_c);
+    snprintf(buf + n, len - n, " life=%s realloc=%g:%g ops=%lld seed=%llu%s",
+             life_names[p->life_dist], p->realloc_p, p->realloc_growth,
+             p->ops, p->seed, p->touch ? " touch=1" : "");
+}
+
+/*
+ * Random numbers: xorshift64*, which is plenty for picking sizes
+ */
+static unsigned long long next_random(mdgen_t *gen)
+{
+    gen->rng ^= gen->rng >> 12;
+    gen->rng ^= gen->rng << 25;
+    gen->rng ^= gen->rng >> 27;
+    return gen->rng * 0x2545F4914F6CDD1DULL;
+}
+
+/* uniform in [0, 1) */
+static double next_unit(mdgen_t *gen)
+{
+    return (next_random(gen) >> 11) * 0x1.0p-53;
+}
+
+static int sample_size(mdgen_t *gen)
+{
+    const mdgen_params_t *p = &gen->p;
+    int lo = p->size_a, hi = p->size_b;
+
+    switch (p->size_dist) {
+    case GEN_SIZE_UNIFORM:
+        return lo + (int)(next_unit(gen) * (hi - lo + 1));
+
+    case GEN_SIZE_ZIPF: {
+        double u = next_unit(gen);
+        int l = 0, r = gen->zipf_n - 1;
+        while (l < r) {
+            int m = (l + r) / 2;
+            if (gen->zipf_cdf[m] <= u)
+                l = m + 1;
+            else
+                r = m;
+        }
+        return lo + l;
+    }
+
+    case GEN_SIZE_BIMODAL:
+        return next_unit(gen) < p->size_c ? lo : hi;
+
+    case GEN_SIZE_POW2: {
+        int e_lo = ceil(log2(lo)), e_hi = floor(log2(hi));
+        return 1 << (e_lo + (int)(next_unit(gen) * (e_hi - e_lo + 1)));
+    }
+    }
+    return lo;
+}
+
+static long long sample_life(mdgen_t *gen)
+{
+    switch (gen->p.life_dist) {
+    case GEN_LIFE_EXP:
+        return -gen->mean_life * log(1 - next_unit(gen));
+    case GEN_LIFE_UNIFORM:
+        return 2 * gen->mean_life * next_unit(gen);
+    default:
+        return gen->mean_life;
+    }
+}
+
+/*
+ * The heap of deaths
+ */
+static void heap_push(mdgen_t *gen, long long death, int id)
+{
+    int i = gen->nheap++;
+    while (i > 0 && gen->heap[(i - 1) / 2].death > death) {
+        gen->heap[i] = gen->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    gen->heap[i] = (death_t) { death, id };
+}
+
+static int heap_pop(mdgen_t *gen)
+{
+    int id = gen->heap[0].id;
+    death_t last = gen->heap[--gen->nheap];
+    int i = 0;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= gen->nheap)
+            break;
+        if (c + 1 < gen->nheap && gen->heap[c + 1].death < gen->heap[c].death)
+            c++;
+        if (gen->heap[c].death >= last.death)
+            break;
+        gen->heap[i] = gen->heap[c];
+        i = c;
+    }
+    if (gen->nheap > 0)
+        gen->heap[i] = last;
+    return id;
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    if ((p = realloc(p, size)) == NULL) {
+        fprintf(stderr, "mdgen: out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/* Make room for one more id */
+static int new_id(mdgen_t *gen)
+{
+    if (gen->nfree > 0)
+        return gen->free_ids[--gen->nfree];
+
+    if (gen->num_ids == gen->cap) {
+        gen->cap = gen->cap ? 2 * gen->cap : 1024;
+        gen->sizes = xrealloc(gen->sizes, gen->cap * sizeof(int));
+        gen->pos = xrealloc(gen->pos, gen->cap * sizeof(int));
+        gen->live = xrealloc(gen->live, gen->cap * sizeof(int));
+        gen->free_ids = xrealloc(gen->free_ids, gen->cap * sizeof(int));
+        gen->heap = xrealloc(gen->heap, gen->cap * sizeof(death_t));
+    }
+    return gen->num_ids++;
+}
+
+static void retire_id(mdgen_t *gen, int id)
+{
+    int last = gen->live[--gen->nlive];
+    gen->live[gen->pos[id]] = last;
+    gen->pos[last] = gen->pos[id];
+    gen->free_ids[gen->nfree++] = id;
+}
+
+mdgen_t *mdgen_new(const mdgen_params_t *params, long live)
+{
+    mdgen_t *gen = xrealloc(NULL, sizeof(*gen));
+    memset(gen, 0, sizeof(*gen));
+    gen->p = *params;
+    gen->rng = (params->seed ^ 0x9E3779B97F4A7C15ULL) | 1;
+
+    /* a fraction a = (1-r)/(2-r) of ops allocate once the live set is steady */
+    double r = params->realloc_p;
+    gen->mean_life = live * (2 - r) / (1 - r);
+
+    double largest = params->size_b * REALLOC_SPAN;
+    gen->max_size = largest < (1 << 30) ? largest : (1 << 30);
+
+    if (params->size_dist == GEN_SIZE_ZIPF) {
+        long n = params->size_b - params->size_a + 1;
+        gen->zipf_n = n < ZIPF_MAX_SIZES ? n : ZIPF_MAX_SIZES;
+        gen->zipf_cdf = xrealloc(NULL, gen->zipf_n * sizeof(double));
+        double sum = 0;
+        for (int k = 0; k < gen->zipf_n; k++)
+            gen->zipf_cdf[k] = sum += pow(k + 1, -params->size_c);
+        for (int k = 0; k < gen->zipf_n; k++)
+            gen->zipf_cdf[k] /= sum;
+    }
+    return gen;
+}
+
+void mdgen_free(mdgen_t *gen)
+{
+    free(gen->zipf_cdf);
+    free(gen->sizes);
+    free(gen->pos);
+    free(gen->live);
+    free(gen->free_ids);
+    free(gen->heap);
+    free(gen);
+}
+
+int mdgen_num_ids(const mdgen_t *gen)
+{
+    return gen->num_ids;
+}
+
+int mdgen_next(mdgen_t *gen, traceop_t *op)
+{
+    op->thread = 0;
+    op->align_log2 = 0;
+
+    /* past the budget, free what is left in order of death */
+    if (gen->now >= gen->p.ops) {
+        if (gen->nheap == 0)
+            return 0;
+        op->type = FREE;
+        op->index = heap_pop(gen);
+        op->size = 0;
+        retire_id(gen, op->index);
+        return 1;
+    }
+    gen->now++;
+
+    if (gen->nheap > 0 && gen->heap[0].death <= gen->now) {
+        op->type = FREE;
+        op->index = heap_pop(gen);
+        op->size = 0;
+        retire_id(gen, op->index);
+    } else if (gen->nlive > 0 && next_unit(gen) < gen->p.realloc_p) {
+        int id = gen->live[next_random(gen) % gen->nlive];
+        double size = gen->sizes[id] * gen->p.realloc_growth;
+        op->type = REALLOC;
+        op->index = id;
+        op->size = size < 1 ? 1 : size > gen->max_size ? gen->max_size : size;
+        gen->sizes[id] = op->size;
+    } else {
+        int id = new_id(gen);
+        op->type = ALLOC;
+        op->index = id;
+        op->size = sample_size(gen);
+        gen->sizes[id] = op->size;
+        gen->pos[id] = gen->nlive;
+        gen->live[gen->nlive++] = id;
+        heap_push(gen, gen->now + 1 + sample_life(gen), id);
+    }
+    return 1;
+}
@@ -0,0 +1,56 @@
+/*
+ * mdgen.h - synthetic workloads for mdriver (see -G).
+ *
+ * A generator turns a handful of parameters into a stream of trace
+ * ops, one at a time, so that a workload can be far longer than any
+ * trace that would fit in memory.  The same parameters and seed always
+ * produce the same stream.
+ */
+#ifndef __MDGEN_H
+#define __MDGEN_H
+
+#include <stddef.h>
+#include "mdtrace.h"
+
+/* Distributions of request sizes */
+enum { GEN_SIZE_UNIFORM,  /* uniform:<lo>:<hi> */
+       GEN_SIZE_ZIPF,     /* zipf:<lo>:<hi>[:<s>], small sizes most likely */
+       GEN_SIZE_BIMODAL,  /* bimodal:<a>:<b>[:<p>], <a> with probability <p> */
+       GEN_SIZE_POW2 };   /* pow2:<lo>:<hi>, powers of two in between */
+
+/* Distributions of block lifetimes, measured in ops */
+enum { GEN_LIFE_EXP,      /* exponential: most blocks die young */
+       GEN_LIFE_UNIFORM,  /* uniform between 0 and twice the mean */
+       GEN_LIFE_FIXED };  /* every block lives exactly the mean */
+
+typedef struct {
+    int size_dist;
+    double size_a, size_b, size_c;   /* the distribution's parameters */
+    int life_dist;
+    long live_lo, live_hi;           /* live=<n> or live=<lo>..<hi> */
+    double realloc_p;                /* chance an op grows a live block */
+    double realloc_growth;           /* by this factor */
+    long long ops;                   /* ops before the final frees */
+    unsigned long long seed;
+    int touch;                       /* write each block's bytes on alloc */
+} mdgen_params_t;
+
+typedef struct mdgen mdgen_t;
+
+/* Parse a comma-separated list of key=value settings on top of the
+ * defaults; returns 0 and a message in err if it cannot. */
+int mdgen_parse(const char *spec, mdgen_params_t *params, char *err, size_t errlen);
+
+/* Describe the parameters, for a report heading */
+void mdgen_describe(const mdgen_params_t *params, char *buf, size_t len);
+
+/* Start a stream that keeps about live blocks allocated at a time */
+mdgen_t *mdgen_new(const mdgen_params_t *params, long live);
+void mdgen_free(mdgen_t *gen);
+
+/* The next op, or 0 once every block has been freed.  Indices are reused
+ * once freed and stay below mdgen_num_ids(). */
+int mdgen_next(mdgen_t *gen, traceop_t *op);
+int mdgen_num_ids(const mdgen_t *gen);
+
+#endif /* __MDGEN_H */
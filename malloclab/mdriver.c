@@ -7,6 +7,7 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE /* pthread_setaffinity_np */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -18,12 +19,27 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <poll.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
 #include "config.h"
+#include "tree.h"
+#include "mdtrace.h"
+#include "mdgen.h"
+#include "perfctr.h"
+
+/* Not every package has these; see mm_alloc_op() */
+#pragma weak mm_calloc
+#pragma weak mm_memalign
 
 /**********************
  * Constants and macros
@@ -33,6 +49,15 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define RANGE_CHUNK 4096 /* range records malloc'd at a time */
+#define NUM_OP_TYPES   5 /* ALLOC, FREE, REALLOC, CALLOC and MEMALIGN, see mdtrace.h */
+#define LAT_SUB_BITS   2 /* latency buckets per power of two, log2 */
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+#define MT_REPEATS     2 /* runs averaged for a -m measurement */
+#define SWEEP_REPEATS  5 /* runs per -M point; the median counts */
+#define XFER_RING_SLOTS 64 /* blocks in flight from a -x producer to its consumer */
+#define XFER_WINDOW    64 /* blocks a -x scatter thread may have in flight */
+#define GEN_BATCH    4096 /* ops a -G workload generates between timings */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 static bool
@@ -48,15 +73,24 @@ IS_ALIGNED(void *p) {
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    RB_ENTRY(range_t) node;  /* links live ranges into a range set */
+    struct range_t *next;  /* next free record in the pool */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/* A chunk of range records; the set carves its records from these */
+typedef struct range_chunk_t {
+    struct range_chunk_t *next;
+    range_t records[RANGE_CHUNK];
+} range_chunk_t;
+
+/* The live ranges of a run, ordered by lo, so that overlap checks and
+ * removals take O(log n).  Removed records go back to the pool. */
+RB_HEAD(range_tree, range_t);
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
+    struct range_tree live;  /* ranges of the blocks allocated now */
+    range_t *free;           /* records ready for reuse */
+    range_chunk_t *chunks;   /* everything ever allocated for the pool */
+} range_set_t;
 
 /* Holds the information for one trace file*/
 typedef struct {
@@ -66,10 +100,59 @@ typedef struct {
     int weight;          /* weight for this trace (unused) */
     double multiplier;   /* multiply sizes by this amount */
     traceop_t *ops;      /* array of requests */
+    int shared_ops;      /* ops belongs to the trace this one was copied from */
+    void *map;           /* mapping of a binary trace file that ops points into */
+    size_t map_size;     /* ... and its length */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 } trace_t;
 
+/* A histogram of the cycles one kind of op took: exact below
+ * 1 << LAT_SUB_BITS, then 1 << LAT_SUB_BITS buckets per power of two */
+typedef struct {
+    double count;    /* ops timed */
+    double max;      /* slowest one, in cycles */
+    unsigned long buckets[LAT_BUCKETS];
+} latency_t;
+
+/* One point of a -M sweep: the trace run by nthreads threads at once */
+typedef struct {
+    int nthreads;
+    double secs;     /* median over SWEEP_REPEATS runs */
+    double util;     /* nthreads times the trace's peak live bytes, over the heap */
+} sweep_point_t;
+
+/* The cross-thread workloads of -x, in which blocks are freed by
+ * other threads than the ones that allocated them */
+enum { XFER_HANDOFF,   /* producers pass every block to a consumer of their own */
+       XFER_SCATTER,   /* every thread passes every block to a random thread */
+       NUM_XFER };
+
+/* Results of one cross-thread workload */
+typedef struct {
+    double ops;      /* mallocs and frees, over all threads */
+    double secs;
+    double peak;     /* largest heap footprint, in bytes */
+} xfer_stats_t;
+
+/* One point of a -G workload: the generated stream at one live-set size */
+typedef struct {
+    long live;       /* blocks the generator aims to keep allocated */
+    int valid;
+    double ops;      /* including the frees at the end */
+    double secs;     /* in mm calls only, not in the generator */
+    double max_live; /* largest live payload, in bytes */
+    double peak;     /* largest heap footprint, in bytes */
+} synth_point_t;
+
+/* One sample of a -p heap profile */
+typedef struct {
+    int op;          /* ops run before it was taken */
+    double live;     /* payload bytes the trace had allocated */
+    double probes;   /* free blocks looked at per fit since the last sample */
+    struct heap_profile heap;
+} profile_sample_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -79,16 +162,56 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double live_util; /* live bytes over footprint, averaged across the trace's ops */
+
+    /* defined only if the package reports thread cache statistics */
+    double cache_hits;   /* mallocs served from a per-thread cache */
+    double cache_misses; /* mallocs that went to the shared heap */
+
+    /* with -L, one histogram per op type; NULL otherwise */
+    latency_t *latency;
+
+    /* with -P, NUM_PERFCTRS hardware counts for one run, negative if
+     * unavailable; NULL otherwise */
+    double *counters;
+
+    /* with -p, the heap profile taken every so many ops */
+    profile_sample_t *profile;
+    int num_profile;
+
+    /* with -M, the points of the thread count sweep */
+    sweep_point_t *sweep;
+    int num_sweep;
+
+    /* with -x, the cross-thread workloads run on the trace's sizes */
+    int xfer_threads;    /* 0 if not run */
+    xfer_stats_t xfer[NUM_XFER];
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* What a -j worker sends back: one pass over a trace at one multiplier */
+typedef struct {
+    int tracenum;
+    double multiplier;
+    int errors;          /* errors the worker found */
+    int peak_live;       /* eval_mm_util()'s high water mark */
+    stats_t stats;       /* its pointers are not meaningful */
+    latency_t latency[NUM_OP_TYPES];
+    double counters[NUM_PERFCTRS];
+} pass_result_t;
+
 /********************
  * Global variables
  *******************/
 int verbose = 0;        /* global flag for verbose output */
+static int check_interval = 0; /* run mm_checkheap() every this many ops (-c), 0 for never */
 static int errors = 0;  /* number of errs found when running student malloc */
 
+/* Names of the op types, for reports */
+static const char *op_names[NUM_OP_TYPES] = { "malloc", "free", "realloc", "calloc", "memalign" };
+static const char *xfer_names[NUM_XFER] = { "handoff", "scatter" };
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -102,44 +225,76 @@ static char *default_tracefiles[] = {
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size, 
+/* these functions manipulate range sets */
+static void init_ranges(range_set_t *ranges);
+static int add_range(range_set_t *ranges, char *lo, int size, 
                      int tracenum, int opnum);
 static __thread int check_heap_bounds;  /* if off, do not check if ranges are within heap bounds */
-static void remove_range(range_t **ranges, char *lo);
-static void clear_ranges(range_t **ranges);
+static void remove_range(range_set_t *ranges, char *lo);
+static void clear_ranges(range_set_t *ranges);
+static void free_ranges(range_set_t *ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename, int verbose);
+static void map_bintrace(trace_t *trace, FILE *tracefile, char *path);
+static void write_bintrace(trace_t *trace, char *filename);
+static trace_t *copy_trace(const trace_t *shared);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
 static void eval_libc_speed(void *ptr);
+static void *libc_alloc_op(const traceop_t *op, int size);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int reset_heap(int tracenum);
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_valid(trace_t *trace, int tracenum, range_set_t *ranges);
+static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_set_t *ranges);
+static void *mm_alloc_op(const traceop_t *op, int size);
 struct single_run_args_for_valid {
-    char * tracefilename;
+    const trace_t *trace;   /* ops shared by all threads */
     int tracenum;
     pthread_barrier_t *go;
+    int cpu;                /* CPU to pin the thread to, or -1 */
+    struct timeval *start;  /* when the threads were let go (speed runs) */
 };
 struct thread_run_result {
     double secs;            // number of seconds used
     int heapsize;      // size to which memlib heap grew
 };
 static void * eval_mm_valid_single(void *);
-static int eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_util(trace_t *trace, int tracenum, range_set_t *ranges, double *live_util);
 static void eval_mm_speed(void *ptr);
 static void eval_mm_speed_inner(void *ptr);
 static void * eval_mm_speed_single(void *_args);
+static int eval_mm_valid_threads(const trace_t *trace, int tracenum, int nthreads);
+static double eval_mm_speed_threads(const trace_t *trace, int tracenum, int nthreads,
+                                    const int *cpus, int ncpus, long *heapsize);
+static void eval_mm_sweep(const trace_t *trace, int tracenum, int max_threads,
+                          int max_total_size, stats_t *stats);
+static void eval_mm_xfer(const trace_t *trace, int tracenum, int nthreads, stats_t *stats);
+static void eval_mm_latency(trace_t *trace, latency_t *latency);
+static void eval_mm_counters(trace_t *trace, double *counters);
+static void eval_mm_profile(trace_t *trace, int interval, stats_t *stats);
+static void eval_mm_pass(trace_t *trace, int tracenum, range_set_t *ranges,
+                         stats_t *stats, int *peak_live);
+static void eval_mm_parallel(int jobs, char **tracefiles, int num_tracefiles,
+                             const double *multipliers, int n_multipliers,
+                             range_set_t *ranges, stats_t *stats, int *peak_live);
+static int eval_mm_synthetic(const mdgen_params_t *params, long live, synth_point_t *pt);
+static int run_synthetic(const char *spec);
 
 /* Various helper routines */
 static void printresults(int n, char ** tracefiles, stats_t *stats);
 static void printresults_as_json(FILE *json, int n, char ** tracefiles, stats_t *stats);
+static void printcachestats(int n, char ** tracefiles, stats_t *stats);
+static void printlatency(int n, char ** tracefiles, stats_t *stats);
+static void printcounters(int n, char ** tracefiles, stats_t *stats);
+static void printprofile(int n, char ** tracefiles, stats_t *stats);
+static void printsweep(int n, char ** tracefiles, stats_t *stats);
+static void printxfer(int n, char ** tracefiles, stats_t *stats);
+static void printsynthetic(const synth_point_t *pts, int n);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -162,7 +317,7 @@ int main(int argc, char **argv)
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
+    range_set_t ranges;        /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
 
@@ -170,8 +325,16 @@ int main(int argc, char **argv)
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int nthreads = 0;    /* If set to > 0, number of threads for multi-threaded testing. */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
-    int use_mmap = 0;    /* If set, have memlib use mmap() instead malloc() */
+    int use_mmap = 0;    /* If set, the MEM_* mode memlib uses instead of malloc() (-n, -H) */
     int vary_size = 0;   /* If set, run each trace multiple times with varied sizes */
+    char *bintrace = NULL; /* If set, convert the -f trace to this binary file (-b) */
+    int measure_latency = 0; /* If set, time each op of mm malloc (-L) */
+    int measure_counters = 0; /* If set, read the hardware counters around mm malloc (-P) */
+    int profile_interval = 0; /* If set, take a heap profile every this many ops (-p) */
+    int sweep_threads = -1;  /* If >= 0, sweep thread counts up to this (-M) */
+    int xfer_threads = 0;    /* If set, run the cross-thread workloads with this many (-x) */
+    char *gen_spec = NULL;   /* If set, run this synthetic workload instead of traces (-G) */
+    int parallel_jobs = -1;  /* If >= 0, run the passes over the traces in this many processes (-j) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput = 0, p1, p2, perfindex;
@@ -180,13 +343,16 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "nf:t:hvVgalm:s")) != EOF) {
+    while ((c = getopt(argc, argv, "nHf:t:hvVgalm:sc:b:LPp:M:x:G:j:")) != EOF) {
         switch (c) {
         case 's':
             vary_size = 1;
             break;
         case 'n':
-            use_mmap = 1;
+            use_mmap = MEM_MMAP_FIXED;
+            break;
+        case 'H':
+            use_mmap = MEM_HUGEPAGE;
             break;
         case 'g': /* Generate summary info for the autograder */
             autograder = 1;
@@ -221,6 +387,45 @@ int main(int argc, char **argv)
         case 'm': /* Include multi-threaded testing */
             nthreads = atoi(optarg);
             break;
+        case 'c': /* Check the heap every so many ops while validating */
+            check_interval = atoi(optarg);
+            break;
+        case 'b': /* Convert the trace to the binary format */
+            bintrace = optarg;
+            break;
+        case 'L': /* Histogram the latency of each op */
+            measure_latency = 1;
+            break;
+        case 'P': /* Read the hardware performance counters */
+            measure_counters = 1;
+            break;
+        case 'p': /* Profile the heap every so many ops */
+            profile_interval = atoi(optarg);
+            if (profile_interval <= 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'M': /* Sweep thread counts, 0 for up to one per CPU */
+            sweep_threads = atoi(optarg);
+            break;
+        case 'x': /* Free blocks in other threads than allocated them */
+            xfer_threads = atoi(optarg);
+            if (xfer_threads < 2) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'G': /* Generate a synthetic workload */
+            gen_spec = optarg;
+            break;
+        case 'j': /* Run the traces in parallel, 0 for one process per CPU */
+            parallel_jobs = atoi(optarg);
+            if (parallel_jobs < 0) {
+                usage();
+                exit(1);
+            }
+            break;
         case 'h': /* Print this message */
             usage();
             exit(0);
@@ -229,9 +434,21 @@ int main(int argc, char **argv)
             exit(1);
         }
     }
-        
-    /* 
-     * Check and print team info 
+
+    /* Only convert the trace, if asked to */
+    if (bintrace != NULL) {
+        if (num_tracefiles != 1) {
+            usage();
+            exit(1);
+        }
+        trace = read_trace(tracedir, tracefiles[0], verbose > 1);
+        write_bintrace(trace, bintrace);
+        free_trace(trace);
+        exit(0);
+    }
+
+    /*
+     * Check and print team info
      */
     if (team_check) {
         /* Students must fill in their team information */
@@ -256,6 +473,12 @@ int main(int argc, char **argv)
             printf("Member 2 :%s:%s\n", team.name2, team.id2);
     }
 
+    /* Only run the synthetic workload, if asked to */
+    if (gen_spec != NULL) {
+        mem_init(use_mmap);
+        exit(run_synthetic(gen_spec) ? 0 : 1);
+    }
+
     /* 
      * If no -f command line arg, then use the entire set of tracefiles 
      * defined in default_traces[]
@@ -316,8 +539,17 @@ int main(int argc, char **argv)
     
     /* Initialize the simulated memory system in memlib.c */
     mem_init(use_mmap); 
+    init_ranges(&ranges);
 
-    int max_total_size = 0;
+    if (measure_counters && perfctr_open() == 0) {
+        printf("No hardware performance counters available, ignoring -P\n");
+        measure_counters = 0;
+    }
+
+    if (profile_interval && !mm_heap_profile) {
+        printf("mm.c was built without -DHEAP_PROFILE, ignoring -p\n");
+        profile_interval = 0;
+    }
 
     double * size_multipliers;
     int n_multipliers;
@@ -331,40 +563,44 @@ int main(int argc, char **argv)
         n_multipliers = 1;
     }
 
+    /* The peak live bytes of each trace at its own sizes */
+    int *peak_live = calloc(num_tracefiles, sizeof(int));
+    if (peak_live == NULL)
+        unix_error("peak_live calloc in main failed");
+
+    for (i=0; i < num_tracefiles; i++) {
+        mm_stats[i].valid = 1;
+        if (measure_latency &&
+            (mm_stats[i].latency = calloc(NUM_OP_TYPES, sizeof(latency_t))) == NULL)
+            unix_error("latency calloc in main failed");
+        if (measure_counters &&
+            (mm_stats[i].counters = calloc(NUM_PERFCTRS, sizeof(double))) == NULL)
+            unix_error("counters calloc in main failed");
+    }
+    if (parallel_jobs >= 0)
+        eval_mm_parallel(parallel_jobs, tracefiles, num_tracefiles, size_multipliers,
+                         n_multipliers, &ranges, mm_stats, peak_live);
+
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
         trace = read_trace(tracedir, tracefiles[i], verbose > 1);
         mm_stats[i].ops = trace->num_ops;
-        mm_stats[i].valid = 1;
-        mm_stats[i].util = 0.0;
-        mm_stats[i].secs = 0.0;
-        for (int mi = 0; mi < n_multipliers; mi++) {
+        for (int mi = 0; parallel_jobs < 0 && mi < n_multipliers; mi++) {
             trace->multiplier = size_multipliers[mi];
             if (verbose > 1 && vary_size)
                 printf("Using trace multiplier: %f\n", size_multipliers[mi]);
-
-            if (verbose > 1)
-                printf("Checking mm_malloc for correctness, ");
-
-            check_heap_bounds = 1;
-            int thisrunvalid = eval_mm_valid(trace, i, &ranges);
-            if (!thisrunvalid)
-                mm_stats[i].valid = 0;
-
-            if (mm_stats[i].valid) {
-                if (verbose > 1)
-                    printf("efficiency, ");
-
-                int hwm = eval_mm_util(trace, i, &ranges);
-                if (size_multipliers[mi] == 1.0)    // record max high water mark
-                    max_total_size = hwm;
-                mm_stats[i].util += ((double)hwm / (double)mem_heapsize());
-                if (verbose > 1)
-                    printf("and performance.\n");
-                mm_stats[i].secs += fsecs(eval_mm_speed, trace);
-            }
+            eval_mm_pass(trace, i, &ranges, &mm_stats[i], &peak_live[i]);
         }
+        int max_total_size = peak_live[i];
         mm_stats[i].util /= n_multipliers;
+        if (profile_interval && mm_stats[i].valid) {
+            trace->multiplier = 1.0;
+            eval_mm_profile(trace, profile_interval, &mm_stats[i]);
+        }
+        if (mm_stats[i].counters != NULL)
+            for (int c = 0; c < NUM_PERFCTRS; c++)
+                mm_stats[i].counters[c] /= n_multipliers;
+        mm_stats[i].live_util /= n_multipliers;
         mm_stats[i].secs /= n_multipliers;
 
         /* Test multithreaded behavior */
@@ -374,32 +610,7 @@ int main(int argc, char **argv)
             stats_t * ms = &mm_stats[i+num_tracefiles];
             ms->ops = trace->num_ops * nthreads;
 
-            struct single_run_args_for_valid args[nthreads];
-            pthread_t threads[nthreads];
-            pthread_barrier_t go;
-            if (pthread_barrier_init(&go, NULL, nthreads)) {
-                perror("pthread_barrier_init");
-                abort();
-            }
-            reset_heap(i);
-
-            for (int j = 0; j < nthreads; j++) {
-                args[j].go = &go;
-                args[j].tracefilename = tracefiles[i];
-                args[j].tracenum = i;
-                if (pthread_create(threads + j, NULL, eval_mm_valid_single, args + j))
-                    perror("pthread_create"), exit(-1);
-            }
-
-            ms->valid = 1;
-            for (int j = 0; j < nthreads; j++) {
-                uintptr_t this_run_valid;
-                if (pthread_join(threads[j], (void **)&this_run_valid))
-                    perror("pthread_join"), exit(-1);
-
-                if (!this_run_valid)
-                    ms->valid = 0;
-            }
+            ms->valid = eval_mm_valid_threads(trace, i, nthreads);
             if (verbose > 1)
                 printf("Result appears to be valid.\n");
 
@@ -408,37 +619,41 @@ int main(int argc, char **argv)
             } else {
                 // we know max_total_size, the total amount of heap memory may vary.
                 // benchmark it a few times and take the average of utilization and speed.
-                const int REPEATS = 2;
                 long heap_size_avg = 0;
                 double runtime_avg = 0.0;
-                for (int k = 0; k < REPEATS; k++) {
-                    reset_heap(i);
-
-                    for (int j = 0; j < nthreads; j++) {
-                        args[j].go = &go;
-                        args[j].tracefilename = tracefiles[i];
-                        args[j].tracenum = i;
-                        if (pthread_create(threads + j, NULL, eval_mm_speed_single, args + j))
-                            perror("pthread_create"), exit(-1);
-                    }
-
-                    for (int j = 0; j < nthreads; j++) {
-                        struct thread_run_result *r;
-                        if (pthread_join(threads[j], (void **) &r))
-                            perror("pthread_join"), exit(-1);
-                        if (r) {
-                            runtime_avg += r->secs;
-                            heap_size_avg += r->heapsize;
-                            free(r);
-                        }
-                    }
+                for (int k = 0; k < MT_REPEATS; k++) {
+                    long heapsize;
+                    runtime_avg += eval_mm_speed_threads(trace, i, nthreads, NULL, 0, &heapsize);
+                    heap_size_avg += heapsize;
                 }
-                runtime_avg /= REPEATS;
-                heap_size_avg /= REPEATS;
+                runtime_avg /= MT_REPEATS;
+                heap_size_avg /= MT_REPEATS;
                 ms->util = ((double)nthreads * max_total_size) / heap_size_avg;
                 ms->secs = runtime_avg;
+
+                /* counters cover the last repeat only */
+                if (mm_thread_cache_stats) {
+                    unsigned long hits, misses;
+                    mm_thread_cache_stats(&hits, &misses);
+                    ms->cache_hits = hits;
+                    ms->cache_misses = misses;
+                }
             }
         }
+
+        /* Sweep thread counts */
+        if (sweep_threads >= 0 && mm_stats[i].valid) {
+            if (verbose > 1)
+                printf("Sweeping thread counts\n");
+            eval_mm_sweep(trace, i, sweep_threads, max_total_size, &mm_stats[i]);
+        }
+
+        /* Cross-thread frees */
+        if (xfer_threads && mm_stats[i].valid) {
+            if (verbose > 1)
+                printf("Running cross-thread workloads\n");
+            eval_mm_xfer(trace, i, xfer_threads, &mm_stats[i]);
+        }
         free_trace(trace);
     }
 
@@ -449,10 +664,46 @@ int main(int argc, char **argv)
         printf("\n");
     }
 
+    if (measure_latency) {
+        printf("Latency of mm malloc ops, in cycles:\n");
+        printlatency(num_tracefiles, tracefiles, mm_stats);
+        printf("\n");
+    }
+
+    if (measure_counters) {
+        printf("Hardware counters per op of mm malloc:\n");
+        printcounters(num_tracefiles, tracefiles, mm_stats);
+        printf("\n");
+        perfctr_close();
+    }
+
+    if (profile_interval) {
+        printf("Fragmentation of mm malloc's heap, every %d ops:\n", profile_interval);
+        printprofile(num_tracefiles, tracefiles, mm_stats);
+        printf("\n");
+    }
+
+    if (sweep_threads >= 0) {
+        printf("Scalability of mm malloc:\n");
+        printsweep(num_tracefiles, tracefiles, mm_stats);
+        printf("\n");
+    }
+
+    if (xfer_threads) {
+        printf("Results for cross-thread frees with %d threads:\n", xfer_threads);
+        printxfer(num_tracefiles, tracefiles, mm_stats);
+        printf("\n");
+    }
+
     if (nthreads && verbose) {
         printf("\nResults for multi-threaded mm malloc:\n");
         printresults(num_tracefiles, tracefiles, mm_stats+num_tracefiles);
         printf("\n");
+        if (mm_thread_cache_stats) {
+            printf("Thread cache statistics:\n");
+            printcachestats(num_tracefiles, tracefiles, mm_stats+num_tracefiles);
+            printf("\n");
+        }
     }
 
     /* 
@@ -547,13 +798,31 @@ open_jsonfile(const char * filename_mask)
  * range list to detect any overlapping allocated blocks.
  ****************************************************************/
 
+/* Ranges are ordered by their low address; live ones never overlap */
+static int range_cmp(range_t *a, range_t *b)
+{
+    return a->lo < b->lo ? -1 : a->lo > b->lo;
+}
+
+RB_GENERATE_STATIC(range_tree, range_t, node, range_cmp);
+
+/*
+ * init_ranges - start an empty range set with an empty pool
+ */
+static void init_ranges(range_set_t *ranges)
+{
+    RB_INIT(&ranges->live);
+    ranges->free = NULL;
+    ranges->chunks = NULL;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range set. 
  */
-static int add_range(range_t **ranges, char *lo, int size, 
+static int add_range(range_set_t *ranges, char *lo, int size, 
                      int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
@@ -570,71 +839,106 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
+    /* The payload must lie within the extent of the heap, or of a mapped region */
     if (check_heap_bounds && (
         (lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi()))) {
+        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_is_mapped(lo, hi)) {
         sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
                 lo, hi, mem_heap_lo(), mem_heap_hi());
         malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p->hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-            sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-                    lo, hi, p->lo, p->hi);
-            malloc_error(tracenum, opnum, msg);
-            return 0;
-        }
+    /* 
+     * The payload must not overlap any other payloads.  Since the live
+     * ranges are disjoint, only the first one starting at or after lo
+     * and the one before it can.
+     */
+    range_t key = { .lo = lo };
+    range_t *next = RB_NFIND(range_tree, &ranges->live, &key);
+    range_t *prev = next != NULL ? RB_PREV(range_tree, &ranges->live, next)
+                                 : RB_MAX(range_tree, &ranges->live);
+    if (next != NULL && next->lo <= hi)
+        p = next;
+    else if (prev != NULL && prev->hi >= lo)
+        p = prev;
+    else
+        p = NULL;
+    if (p != NULL) {
+        sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+                lo, hi, p->lo, p->hi);
+        malloc_error(tracenum, opnum, msg);
+        return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by taking a range record from the pool and adding it to the set.
      */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-        unix_error("malloc error in add_range");
-    p->next = *ranges;
+    if (ranges->free == NULL) {
+        range_chunk_t *chunk = malloc(sizeof(range_chunk_t));
+        if (chunk == NULL)
+            unix_error("malloc error in add_range");
+        chunk->next = ranges->chunks;
+        ranges->chunks = chunk;
+        for (int i = 0; i < RANGE_CHUNK; i++) {
+            chunk->records[i].next = ranges->free;
+            ranges->free = &chunk->records[i];
+        }
+    }
+    p = ranges->free;
+    ranges->free = p->next;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    RB_INSERT(range_tree, &ranges->live, p);
     return 1;
 }
 
 /* 
  * remove_range - Free the range record of block whose payload starts at lo 
  */
-static void remove_range(range_t **ranges, char *lo)
+static void remove_range(range_set_t *ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
+    range_t key = { .lo = lo };
+    range_t *p = RB_FIND(range_tree, &ranges->live, &key);
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-            *prevpp = p->next;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    if (p != NULL) {
+        RB_REMOVE(range_tree, &ranges->live, p);
+        p->next = ranges->free;
+        ranges->free = p;
     }
 }
 
 /*
- * clear_ranges - free all of the range records for a trace 
+ * clear_ranges - return all of the range records for a trace to the pool
  */
-static void clear_ranges(range_t **ranges)
+static void clear_ranges(range_set_t *ranges)
 {
     range_t *p;
     range_t *pnext;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    for (p = RB_MIN(range_tree, &ranges->live);  p != NULL;  p = pnext) {
+        pnext = RB_NEXT(range_tree, &ranges->live, p);
+        p->next = ranges->free;
+        ranges->free = p;
     }
-    *ranges = NULL;
+    RB_INIT(&ranges->live);
+}
+
+/*
+ * free_ranges - give the pool of a range set back to malloc
+ */
+static void free_ranges(range_set_t *ranges)
+{
+    range_chunk_t *chunk;
+    range_chunk_t *next;
+
+    for (chunk = ranges->chunks;  chunk != NULL;  chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    init_ranges(ranges);
 }
 
 
@@ -672,6 +976,20 @@ static trace_t *read_trace(char *tracedir, char *filename, int verbose)
         snprintf(msg, sizeof msg, "Could not open %s in read_trace", path);
         unix_error(msg);
     }
+
+    /* Binary traces are mapped rather than parsed */
+    char magic[sizeof BINTRACE_MAGIC - 1];
+    if (fread(magic, 1, sizeof magic, tracefile) == sizeof magic &&
+        memcmp(magic, BINTRACE_MAGIC, sizeof magic) == 0) {
+        map_bintrace(trace, tracefile, path);
+        fclose(tracefile);
+        return trace;
+    }
+    rewind(tracefile);
+    trace->shared_ops = 0;
+    trace->map = NULL;
+    trace->map_size = 0;
+
     int rc;
     rc = fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
     if (rc != 1) abort();
@@ -718,17 +1036,40 @@ static trace_t *read_trace(char *tracedir, char *filename, int verbose)
             trace->ops[op_index].size = size;
             max_index = (index > max_index) ? index : max_index;
             break;
+        case 'c':
+            rc = fscanf(tracefile, "%u %u", &index, &size);
+            assert (rc == 2);
+            trace->ops[op_index].type = CALLOC;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 'm': {
+            unsigned alignment;
+            rc = fscanf(tracefile, "%u %u %u", &index, &alignment, &size);
+            assert (rc == 3 && alignment != 0 && (alignment & (alignment - 1)) == 0);
+            trace->ops[op_index].type = MEMALIGN;
+            trace->ops[op_index].align_log2 = __builtin_ctz(alignment);
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        }
         case 'f':
             rc = fscanf(tracefile, "%ud", &index);
             assert (rc == 1);
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
+            trace->ops[op_index].size = 0;
             break;
         default:
             printf("Bogus type character (%c) in tracefile %s\n", 
                    type[0], path);
             exit(1);
         }
+        if (trace->ops[op_index].type != MEMALIGN)
+            trace->ops[op_index].align_log2 = 0;
+        trace->ops[op_index].thread = 0;
         op_index++;
         
     }
@@ -739,13 +1080,112 @@ static trace_t *read_trace(char *tracedir, char *filename, int verbose)
     return trace;
 }
 
+/*
+ * map_bintrace - map the ops of a binary trace read-only into trace;
+ *     the file is open and positioned past the magic number
+ */
+static void map_bintrace(trace_t *trace, FILE *tracefile, char *path)
+{
+    char msg[MAXLINE + 100];
+    struct stat st;
+
+    if (fstat(fileno(tracefile), &st) < 0)
+        unix_error("fstat failed in map_bintrace");
+    trace->map_size = st.st_size;
+    trace->map = mmap(NULL, trace->map_size, PROT_READ, MAP_PRIVATE, fileno(tracefile), 0);
+    if (trace->map == MAP_FAILED)
+        unix_error("mmap failed in map_bintrace");
+
+    const bintrace_header_t *hdr = trace->map;
+    if (trace->map_size < sizeof *hdr || hdr->num_ops < 0 || hdr->num_ids < 0 ||
+        (trace->map_size - sizeof *hdr) / sizeof(traceop_t) < (size_t)hdr->num_ops) {
+        snprintf(msg, sizeof msg, "Binary trace %s is truncated", path);
+        app_error(msg);
+    }
+    trace->sugg_heapsize = hdr->sugg_heapsize;
+    trace->num_ids = hdr->num_ids;
+    trace->num_ops = hdr->num_ops;
+    trace->weight = hdr->weight;
+    trace->ops = (traceop_t *)(hdr + 1);
+    trace->shared_ops = 0;
+
+    /* ops are read straight from the file, so they can't be trusted */
+    for (int i = 0; i < trace->num_ops; i++) {
+        const traceop_t *op = &trace->ops[i];
+        if (op->type < ALLOC || op->type > MEMALIGN || op->align_log2 > 30 ||
+            op->index < 0 || op->index >= trace->num_ids || op->size < 0 ||
+            op->thread < 0) {
+            snprintf(msg, sizeof msg, "Bogus op %d in binary trace %s", i, path);
+            app_error(msg);
+        }
+    }
+
+    if ((trace->blocks = 
+         (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+        unix_error("malloc 3 failed in map_bintrace");
+    if ((trace->block_sizes = 
+         (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+        unix_error("malloc 4 failed in map_bintrace");
+}
+
+/*
+ * write_bintrace - write trace to filename in the binary format
+ */
+static void write_bintrace(trace_t *trace, char *filename)
+{
+    FILE *out;
+    bintrace_header_t hdr = {
+        .sugg_heapsize = trace->sugg_heapsize,
+        .num_ids = trace->num_ids,
+        .num_ops = trace->num_ops,
+        .weight = trace->weight,
+    };
+    memcpy(hdr.magic, BINTRACE_MAGIC, sizeof hdr.magic);
+
+    if ((out = fopen(filename, "wb")) == NULL)
+        unix_error("Could not open binary trace for writing");
+    if (fwrite(&hdr, sizeof hdr, 1, out) != 1 ||
+        fwrite(trace->ops, sizeof(traceop_t), trace->num_ops, out) != (size_t)trace->num_ops ||
+        fclose(out) != 0)
+        unix_error("Could not write binary trace");
+}
+
+/*
+ * copy_trace - make a trace that shares the ops of another but has
+ *              block arrays of its own, for one thread to replay
+ */
+static trace_t *copy_trace(const trace_t *shared)
+{
+    trace_t *trace;
+
+    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+        unix_error("malloc 1 failed in copy_trace");
+    *trace = *shared;
+    trace->multiplier = 1.0;
+    trace->shared_ops = 1;
+    trace->map = NULL;
+    trace->map_size = 0;
+
+    if ((trace->blocks = 
+         (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+        unix_error("malloc 3 failed in copy_trace");
+    if ((trace->block_sizes = 
+         (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+        unix_error("malloc 4 failed in copy_trace");
+    return trace;
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated in read_trace(), unless
+ *              the ops are mapped or shared with another trace.
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map != NULL)   /* free the three arrays... */
+        munmap(trace->map, trace->map_size);
+    else if (!trace->shared_ops)
+        free(trace->ops);
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
@@ -770,10 +1210,270 @@ reset_heap(int tracenum)
     return 1;
 }
 
+/*
+ * mm_alloc_op - carry out an ALLOC, CALLOC or MEMALIGN op of size bytes
+ *     with the mm package.  Packages other than mm.c need not have
+ *     mm_calloc() and mm_memalign(); their ops then go to mm_malloc(),
+ *     cleared for a CALLOC and without the alignment for a MEMALIGN.
+ */
+static void *mm_alloc_op(const traceop_t *op, int size)
+{
+    char *p;
+
+    switch (op->type) {
+    case CALLOC:
+        if (mm_calloc != NULL)
+            return mm_calloc(1, size);
+        if ((p = mm_malloc(size)) != NULL)
+            memset(p, 0, size);
+        return p;
+    case MEMALIGN:
+        if (mm_memalign != NULL)
+            return mm_memalign((size_t)1 << op->align_log2, size);
+        return mm_malloc(size);
+    default:
+        return mm_malloc(size);
+    }
+}
+
+/*
+ * eval_mm_pass - Check the trace at its current multiplier, then measure
+ *     its utilization and speed, adding the results into stats.  At a
+ *     multiplier of 1, its peak live bytes go into *peak_live.
+ */
+static void eval_mm_pass(trace_t *trace, int tracenum, range_set_t *ranges,
+                         stats_t *stats, int *peak_live)
+{
+    if (verbose > 1)
+        printf("Checking mm_malloc for correctness, ");
+
+    check_heap_bounds = 1;
+    if (!eval_mm_valid(trace, tracenum, ranges))
+        stats->valid = 0;
+    if (!stats->valid)
+        return;
+
+    if (verbose > 1)
+        printf("efficiency, ");
+    double live_util;
+    int hwm = eval_mm_util(trace, tracenum, ranges, &live_util);
+    if (trace->multiplier == 1.0)
+        *peak_live = hwm;
+    stats->util += ((double)hwm / (double)mem_peak_footprint());
+    stats->live_util += live_util;
+
+    if (verbose > 1)
+        printf("and performance.\n");
+    stats->secs += fsecs(eval_mm_speed, trace);
+    if (stats->latency != NULL)
+        eval_mm_latency(trace, stats->latency);
+    if (stats->counters != NULL)
+        eval_mm_counters(trace, stats->counters);
+}
+
+/*
+ * pass_cpus - the CPUs that -j workers are pinned to, one each: the
+ *     isolated ones (isolcpus=) if the kernel has any, else all that
+ *     we may run on.  Returns how many there are.
+ */
+static int pass_cpus(int *cpus)
+{
+    int ncpus = 0;
+    FILE *f = fopen("/sys/devices/system/cpu/isolated", "r");
+    if (f != NULL) {
+        int lo, hi;
+        while (ncpus < CPU_SETSIZE && fscanf(f, "%d", &lo) == 1) {
+            hi = lo;
+            if (fscanf(f, "-%d", &hi) != 1)
+                hi = lo;
+            for (int c = lo; c <= hi && ncpus < CPU_SETSIZE; c++)
+                cpus[ncpus++] = c;
+            if (fgetc(f) != ',')
+                break;
+        }
+        fclose(f);
+    }
+    if (ncpus > 0)
+        return ncpus;
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof allowed, &allowed) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &allowed))
+                cpus[ncpus++] = c;
+    }
+    if (ncpus == 0)
+        cpus[ncpus++] = 0;
+    return ncpus;
+}
+
+/*
+ * run_pass - the body of a -j worker: one pass over trace number
+ *     tracenum at one multiplier, pinned to cpu, its results written
+ *     to fd.  Its heap is the copy of memlib's it got from fork().
+ */
+static void run_pass(char *tracefile, int tracenum, double multiplier, int cpu,
+                     range_set_t *ranges, int latency, int counters, int fd)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof set, &set);
+
+    pass_result_t *r = calloc(1, sizeof *r);
+    if (r == NULL)
+        unix_error("calloc in run_pass failed");
+    r->tracenum = tracenum;
+    r->multiplier = multiplier;
+    r->stats.valid = 1;
+    if (latency)
+        r->stats.latency = r->latency;
+    if (counters) {
+        /* the parent's count the parent only */
+        perfctr_close();
+        perfctr_open();
+        r->stats.counters = r->counters;
+    }
+
+    trace_t *trace = read_trace(tracedir, tracefile, verbose > 1);
+    trace->multiplier = multiplier;
+    r->stats.ops = trace->num_ops;
+    eval_mm_pass(trace, tracenum, ranges, &r->stats, &r->peak_live);
+    r->errors = errors;
+
+    for (size_t done = 0; done < sizeof *r; ) {
+        ssize_t n = write(fd, (char *)r + done, sizeof *r - done);
+        if (n <= 0)
+            _exit(1);
+        done += n;
+    }
+    fflush(stdout);
+    _exit(0);
+}
+
+/*
+ * merge_pass - add what a -j worker found into the stats of its trace,
+ *     the way eval_mm_pass() adds up the passes of a sequential run
+ */
+static void merge_pass(const pass_result_t *r, stats_t *stats, int *peak_live)
+{
+    stats_t *into = &stats[r->tracenum];
+
+    errors += r->errors;
+    into->ops = r->stats.ops;
+    if (!r->stats.valid)
+        into->valid = 0;
+    into->util += r->stats.util;
+    into->live_util += r->stats.live_util;
+    into->secs += r->stats.secs;
+    if (r->multiplier == 1.0)
+        peak_live[r->tracenum] = r->peak_live;
+
+    if (into->latency != NULL) {
+        for (int t = 0; t < NUM_OP_TYPES; t++) {
+            latency_t *l = &into->latency[t];
+            const latency_t *from = &r->latency[t];
+            l->count += from->count;
+            if (from->max > l->max)
+                l->max = from->max;
+            for (int b = 0; b < LAT_BUCKETS; b++)
+                l->buckets[b] += from->buckets[b];
+        }
+    }
+    if (into->counters != NULL) {
+        for (int c = 0; c < NUM_PERFCTRS; c++)
+            into->counters[c] = r->counters[c] < 0 || into->counters[c] < 0 ?
+                -1 : into->counters[c] + r->counters[c];
+    }
+}
+
+/*
+ * eval_mm_parallel - Run the pass of every trace at every multiplier
+ *     in a process of its own, at most jobs at a time (0 for as many as
+ *     there are CPUs), each on a CPU of its own, so that the timings do
+ *     not disturb one another.  A worker that dies fails its trace.
+ */
+static void eval_mm_parallel(int jobs, char **tracefiles, int num_tracefiles,
+                             const double *multipliers, int n_multipliers,
+                             range_set_t *ranges, stats_t *stats, int *peak_live)
+{
+    int cpus[CPU_SETSIZE];
+    int ncpus = pass_cpus(cpus);
+    if (jobs == 0 || jobs > ncpus)
+        jobs = ncpus;
+
+    struct pollfd *fds = calloc(jobs, sizeof *fds);
+    pid_t *pids = calloc(jobs, sizeof *pids);
+    int *passes = calloc(jobs, sizeof *passes);
+    pass_result_t *r = malloc(sizeof *r);
+    if (fds == NULL || pids == NULL || passes == NULL || r == NULL)
+        unix_error("calloc in eval_mm_parallel failed");
+    for (int s = 0; s < jobs; s++)
+        fds[s].fd = -1;
+
+    int npasses = num_tracefiles * n_multipliers, next = 0, running = 0;
+    while (next < npasses || running > 0) {
+        for (int s = 0; s < jobs && next < npasses; s++) {
+            if (fds[s].fd >= 0)
+                continue;
+            int pipefd[2];
+            if (pipe(pipefd) < 0)
+                unix_error("pipe in eval_mm_parallel failed");
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid < 0)
+                unix_error("fork in eval_mm_parallel failed");
+            if (pid == 0) {
+                close(pipefd[0]);
+                run_pass(tracefiles[next / n_multipliers], next / n_multipliers,
+                         multipliers[next % n_multipliers], cpus[s], ranges,
+                         stats[0].latency != NULL, stats[0].counters != NULL, pipefd[1]);
+            }
+            close(pipefd[1]);
+            fds[s].fd = pipefd[0];
+            fds[s].events = POLLIN;
+            pids[s] = pid;
+            passes[s] = next++;
+            running++;
+        }
+
+        /* a worker writes its results just before it exits */
+        if (poll(fds, jobs, -1) < 0)
+            unix_error("poll in eval_mm_parallel failed");
+        for (int s = 0; s < jobs; s++) {
+            if (fds[s].fd < 0 || fds[s].revents == 0)
+                continue;
+            size_t done = 0;
+            ssize_t n;
+            while (done < sizeof *r && (n = read(fds[s].fd, (char *)r + done, sizeof *r - done)) > 0)
+                done += n;
+            close(fds[s].fd);
+            fds[s].fd = -1;
+            int status;
+            waitpid(pids[s], &status, 0);
+            running--;
+
+            int tracenum = passes[s] / n_multipliers;
+            if (done == sizeof *r && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                merge_pass(r, stats, peak_live);
+            } else {
+                printf("ERROR [trace %d]: the worker for %s at multiplier %.2f died\n",
+                       tracenum, tracefiles[tracenum], multipliers[passes[s] % n_multipliers]);
+                errors++;
+                stats[tracenum].valid = 0;
+            }
+        }
+    }
+    free(fds);
+    free(pids);
+    free(passes);
+    free(r);
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
+static int eval_mm_valid(trace_t *trace, int tracenum, range_set_t *ranges)
 {
     if (!reset_heap(tracenum))
         return 0;
@@ -781,7 +1481,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     return eval_mm_valid_inner(trace, tracenum, ranges);
 }
 
-static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_t **ranges)
+static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_set_t *ranges)
 {
     int i, j;
     int index;
@@ -803,9 +1503,11 @@ static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_t **ranges)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
 
             /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL) {
+            if ((p = mm_alloc_op(&trace->ops[i], size)) == NULL) {
                 malloc_error(tracenum, i, "mm_malloc failed.");
                 return 0;
             }
@@ -817,6 +1519,20 @@ static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_t **ranges)
              */ 
             if (add_range(ranges, p, size, tracenum, i) == 0)
                 return 0;
+
+            if (trace->ops[i].type == CALLOC) {
+                for (j = 0; j < size; j++) {
+                    if (p[j] != 0) {
+                        malloc_error(tracenum, i, "mm_calloc did not zero the block");
+                        return 0;
+                    }
+                }
+            }
+            if (trace->ops[i].type == MEMALIGN && mm_memalign != NULL &&
+                (uintptr_t)p % ((uintptr_t)1 << trace->ops[i].align_log2) != 0) {
+                malloc_error(tracenum, i, "mm_memalign returned a misaligned block");
+                return 0;
+            }
             
             /* ADDED: cgw
              * fill range with low byte of index.  This will be used later
@@ -854,7 +1570,7 @@ static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_t **ranges)
             oldsize = trace->block_sizes[index];
             if (size < oldsize) oldsize = size;
             for (j = 0; j < oldsize; j++) {
-              if (newp[j] != (index & 0xFF)) {
+              if ((unsigned char)newp[j] != (index & 0xFF)) {
                 malloc_error(tracenum, i, "mm_realloc did not preserve the "
                              "data from old block");
                 return 0;
@@ -879,6 +1595,13 @@ static int eval_mm_valid_inner(trace_t *trace, int tracenum, range_t **ranges)
             app_error("Nonexistent request type in eval_mm_valid");
         }
 
+        /* Have the package check its own heap every check_interval ops */
+        if (check_interval > 0 && (i % check_interval == check_interval - 1 ||
+                                   i == trace->num_ops - 1)
+            && mm_checkheap(0) != 0) {
+            malloc_error(tracenum, i, "mm_checkheap found the heap inconsistent.");
+            return 0;
+        }
     }
 
     /* As far as we know, this is a valid malloc package */
@@ -890,19 +1613,20 @@ eval_mm_valid_single(void *_args)
 {
     struct single_run_args_for_valid * args = _args;
 
-    /* read our own copy of this trace */
-    trace_t * trace = read_trace(tracedir, args->tracefilename, 0);
+    /* our own blocks for the shared ops */
+    trace_t * trace = copy_trace(args->trace);
 
     // let threads start at approximately the same moment to increase chance
     // of concurrency-related failures if proper synchronization is not used.
     if (pthread_barrier_wait(args->go) == PTHREAD_BARRIER_SERIAL_THREAD) {
         ;
     }
-    range_t *ranges = NULL;
+    range_set_t ranges;
+    init_ranges(&ranges);
     check_heap_bounds = 0;
     intptr_t isvalid = eval_mm_valid_inner(trace, args->tracenum, &ranges);
     assert (sizeof(int) <= sizeof(void*));
-    clear_ranges(&ranges);
+    free_ranges(&ranges);
     free_trace(trace);
     return (void *) isvalid;
 }
@@ -911,21 +1635,28 @@ eval_mm_valid_single(void *_args)
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
- *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   Utilization is the ratio hwm/footprint, where footprint is the
+ *   peak of the heap size plus the bytes in mem_map() regions while
+ *   running the student's malloc package on the trace.  Note that our
+ *   implementation of mem_sbrk() doesn't allow the students to
+ *   decrement the brk pointer, so without mem_map() this is the size
+ *   of the heap at the end of the run.
+ *
+ *   Since a package may also give memory back, *live_util is set to
+ *   the sum over all ops of the live bytes, divided by the sum of the
+ *   footprint after each op: how well it tracks what is live, not
+ *   just how well it handles the peak.
  *   
  *   Changed to return max_total_size
  */
-static int eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static int eval_mm_util(trace_t *trace, int tracenum, range_set_t *ranges, double *live_util)
 {   
     int i;
     int index;
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
+    double live_sum = 0, footprint_sum = 0;
     char *p;
     char *newp, *oldp;
 
@@ -938,10 +1669,12 @@ static int eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case CALLOC:
+        case MEMALIGN:
             index = trace->ops[i].index;
             size = max(0, (int)(trace->multiplier * trace->ops[i].size));
 
-            if ((p = mm_malloc(size)) == NULL) 
+            if ((p = mm_alloc_op(&trace->ops[i], size)) == NULL) 
                 app_error("mm_malloc failed in eval_mm_util");
             
             /* Remember region and size */
@@ -996,8 +1729,11 @@ static int eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
             app_error("Nonexistent request type in eval_mm_util");
 
         }
+        live_sum += total_size;
+        footprint_sum += mem_footprint();
     }
 
+    *live_util = footprint_sum > 0 ? live_sum / footprint_sum : 0;
     return max_total_size;
 }
 
@@ -1005,36 +1741,555 @@ static void *
 eval_mm_speed_single(void *_args)
 {
     struct single_run_args_for_valid * args = _args;
-    struct timeval stv, etv;
+    struct timeval etv;
 
-    /* read our own copy of this trace */
-    trace_t * trace = read_trace(tracedir, args->tracefilename, 0);
+    if (args->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(args->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    }
+
+    /* our own blocks for the shared ops */
+    trace_t * trace = copy_trace(args->trace);
 
     // we start the clock here to avoid accounting for thread startup overhead
-    pthread_barrier_wait(args->go);
-    gettimeofday(&stv, NULL);
+    if (pthread_barrier_wait(args->go) == PTHREAD_BARRIER_SERIAL_THREAD)
+        gettimeofday(args->start, NULL);
     eval_mm_speed_inner(trace);
-    gettimeofday(&etv,NULL);
-    free_trace(trace);
+    // the clock stops once the last thread is done
     if (pthread_barrier_wait(args->go) == PTHREAD_BARRIER_SERIAL_THREAD) {
+        gettimeofday(&etv,NULL);
+        free_trace(trace);
         struct thread_run_result *r = malloc(sizeof (*r));
-        r->secs = (etv.tv_sec - stv.tv_sec) + 1E-6*(etv.tv_usec-stv.tv_usec);
-        r->heapsize = mem_heapsize();
+        r->secs = (etv.tv_sec - args->start->tv_sec) + 1E-6*(etv.tv_usec - args->start->tv_usec);
+        r->heapsize = mem_peak_footprint();
         return r;
-    } else
+    } else {
+        free_trace(trace);
         return NULL;
+    }
 }
 
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * eval_mm_valid_threads - Check the trace with nthreads threads
+ *     running it at once on one heap, each on its own blocks.
  */
-static void eval_mm_speed(void *ptr)
+static int eval_mm_valid_threads(const trace_t *trace, int tracenum, int nthreads)
 {
-    /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
-    if (mm_init() < 0) 
-        app_error("mm_init failed in eval_mm_speed");
+    struct single_run_args_for_valid args[nthreads];
+    pthread_t threads[nthreads];
+    pthread_barrier_t go;
+    int valid = 1;
+
+    if (pthread_barrier_init(&go, NULL, nthreads)) {
+        perror("pthread_barrier_init");
+        abort();
+    }
+    reset_heap(tracenum);
+
+    for (int j = 0; j < nthreads; j++) {
+        args[j].go = &go;
+        args[j].trace = trace;
+        args[j].tracenum = tracenum;
+        args[j].cpu = -1;
+        args[j].start = NULL;
+        if (pthread_create(threads + j, NULL, eval_mm_valid_single, args + j))
+            perror("pthread_create"), exit(-1);
+    }
+
+    for (int j = 0; j < nthreads; j++) {
+        uintptr_t this_run_valid;
+        if (pthread_join(threads[j], (void **)&this_run_valid))
+            perror("pthread_join"), exit(-1);
+
+        if (!this_run_valid)
+            valid = 0;
+    }
+    pthread_barrier_destroy(&go);
+    return valid;
+}
+
+/*
+ * eval_mm_speed_threads - Time nthreads threads running the trace at
+ *     once on a fresh heap.  Thread j is pinned to cpus[j % ncpus],
+ *     unless cpus is NULL.  Returns the seconds between the threads'
+ *     start and the last one's end, and stores the peak footprint.
+ */
+static double eval_mm_speed_threads(const trace_t *trace, int tracenum, int nthreads,
+                                    const int *cpus, int ncpus, long *heapsize)
+{
+    struct single_run_args_for_valid args[nthreads];
+    pthread_t threads[nthreads];
+    pthread_barrier_t go;
+    struct timeval start;
+    double secs = 0;
+
+    if (pthread_barrier_init(&go, NULL, nthreads)) {
+        perror("pthread_barrier_init");
+        abort();
+    }
+    reset_heap(tracenum);
+
+    for (int j = 0; j < nthreads; j++) {
+        args[j].go = &go;
+        args[j].trace = trace;
+        args[j].tracenum = tracenum;
+        args[j].cpu = cpus != NULL ? cpus[j % ncpus] : -1;
+        args[j].start = &start;
+        if (pthread_create(threads + j, NULL, eval_mm_speed_single, args + j))
+            perror("pthread_create"), exit(-1);
+    }
+
+    *heapsize = 0;
+    for (int j = 0; j < nthreads; j++) {
+        struct thread_run_result *r;
+        if (pthread_join(threads[j], (void **) &r))
+            perror("pthread_join"), exit(-1);
+        if (r) {
+            secs = r->secs;
+            *heapsize = r->heapsize;
+            free(r);
+        }
+    }
+    pthread_barrier_destroy(&go);
+    return secs;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * eval_mm_sweep - Run the trace with 1, 2, 4, ... threads, up to
+ *     max_threads or, if that is 0, one per CPU we may run on.  Each
+ *     thread is pinned to a CPU of its own while there are enough.
+ *     Every point is checked once, then timed SWEEP_REPEATS times.
+ */
+static void eval_mm_sweep(const trace_t *trace, int tracenum, int max_threads,
+                          int max_total_size, stats_t *stats)
+{
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], ncpus = 0;
+
+    if (sched_getaffinity(0, sizeof allowed, &allowed) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &allowed))
+                cpus[ncpus++] = c;
+    }
+    if (ncpus == 0)
+        cpus[ncpus++] = 0;
+    if (max_threads <= 0)
+        max_threads = ncpus;
+
+    stats->sweep = calloc(max_threads, sizeof(sweep_point_t));
+    if (stats->sweep == NULL)
+        unix_error("sweep calloc failed");
+    stats->num_sweep = 0;
+
+    for (int n = 1; ; n = 2 * n < max_threads ? 2 * n : max_threads) {
+        if (!eval_mm_valid_threads(trace, tracenum, n)) {
+            printf("Result is not valid with %d threads, ending the sweep.\n", n);
+            break;
+        }
+
+        double secs[SWEEP_REPEATS];
+        long heapsize = 0;
+        for (int k = 0; k < SWEEP_REPEATS; k++)
+            secs[k] = eval_mm_speed_threads(trace, tracenum, n, cpus, ncpus, &heapsize);
+        qsort(secs, SWEEP_REPEATS, sizeof secs[0], cmp_double);
+
+        sweep_point_t *pt = &stats->sweep[stats->num_sweep++];
+        pt->nthreads = n;
+        pt->secs = secs[SWEEP_REPEATS / 2];
+        pt->util = heapsize > 0 ? ((double)n * max_total_size) / heapsize : 0;
+        if (n == max_threads)
+            break;
+    }
+}
+
+/*
+ * The -x workloads.  They take their request sizes from the trace's
+ * mallocs and reallocs, in order, but none of its frees: every block
+ * is freed by some other thread than the one that allocated it.
+ */
+
+/* A single-producer, single-consumer ring of blocks */
+typedef struct {
+    unsigned long head __attribute__((aligned(64)));  /* written by the producer */
+    unsigned long tail __attribute__((aligned(64)));  /* written by the consumer */
+    char *slots[XFER_RING_SLOTS];
+} xfer_ring_t;
+
+/* A block on its way to another thread in the scatter workload */
+typedef struct xfer_block {
+    struct xfer_block *next;   /* links an inbox */
+    int sender;                /* thread that allocated it */
+} xfer_block_t;
+
+struct xfer_args {
+    const int *sizes;       /* request sizes, shared by all threads */
+    int num_sizes;
+    int self;               /* this thread's number */
+    int nthreads;
+    xfer_ring_t *ring;      /* handoff: the ring to or from the pair's partner */
+    xfer_block_t **inboxes; /* scatter: blocks sent to each thread */
+    int *in_flight;         /* scatter: blocks each thread sent that are not freed yet */
+    int *done;              /* scatter: threads that have sent all their blocks */
+    pthread_barrier_t *go;
+    struct timeval *start, *end;
+};
+
+static void ring_push(xfer_ring_t *ring, char *p)
+{
+    unsigned long head = ring->head;
+    while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == XFER_RING_SLOTS)
+        sched_yield();
+    ring->slots[head % XFER_RING_SLOTS] = p;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static char *ring_pop(xfer_ring_t *ring)
+{
+    unsigned long tail = ring->tail;
+    while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+        sched_yield();
+    char *p = ring->slots[tail % XFER_RING_SLOTS];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+/* Push a block onto an inbox, a lock-free stack */
+static void inbox_push(xfer_block_t **inbox, xfer_block_t *b)
+{
+    xfer_block_t *head = __atomic_load_n(inbox, __ATOMIC_RELAXED);
+    do
+        b->next = head;
+    while (!__atomic_compare_exchange_n(inbox, &head, b, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Free everything in a scatter thread's inbox */
+static void inbox_drain(struct xfer_args *args)
+{
+    xfer_block_t *b = __atomic_exchange_n(&args->inboxes[args->self], NULL, __ATOMIC_ACQUIRE);
+    while (b != NULL) {
+        xfer_block_t *next = b->next;
+        __atomic_fetch_sub(&args->in_flight[b->sender], 1, __ATOMIC_RELAXED);
+        mm_free(b);
+        b = next;
+    }
+}
+
+/* Start and stop the clock for all threads, as eval_mm_speed_single does */
+static void xfer_start(struct xfer_args *args)
+{
+    if (pthread_barrier_wait(args->go) == PTHREAD_BARRIER_SERIAL_THREAD)
+        gettimeofday(args->start, NULL);
+}
+
+static void xfer_stop(struct xfer_args *args)
+{
+    if (pthread_barrier_wait(args->go) == PTHREAD_BARRIER_SERIAL_THREAD)
+        gettimeofday(args->end, NULL);
+}
+
+/* Handoff: even threads allocate, and their odd partners free */
+static void *xfer_handoff_thread(void *_args)
+{
+    struct xfer_args *args = _args;
+
+    xfer_start(args);
+    if (args->self % 2 == 0) {
+        for (int k = 0; k < args->num_sizes; k++) {
+            char *p = mm_malloc(args->sizes[k]);
+            if (p == NULL)
+                app_error("mm_malloc error in xfer_handoff_thread");
+            p[0] = k & 0xFF;
+            ring_push(args->ring, p);
+        }
+        ring_push(args->ring, NULL);
+    } else {
+        char *p;
+        for (int k = 0; (p = ring_pop(args->ring)) != NULL; k++) {
+            if ((unsigned char)p[0] != (k & 0xFF))
+                app_error("block changed on its way between threads in xfer_handoff_thread");
+            mm_free(p);
+        }
+    }
+    xfer_stop(args);
+    return NULL;
+}
+
+/* Scatter: every thread allocates, sends each block to a random
+ * thread, and frees what was sent to it whenever it has XFER_WINDOW
+ * blocks of its own in flight */
+static void *xfer_scatter_thread(void *_args)
+{
+    struct xfer_args *args = _args;
+    unsigned long long rand = 0x9E3779B97F4A7C15ULL * (args->self + 1);
+
+    xfer_start(args);
+    for (int k = 0; k < args->num_sizes; k++) {
+        while (__atomic_load_n(&args->in_flight[args->self], __ATOMIC_RELAXED) >= XFER_WINDOW) {
+            inbox_drain(args);
+            sched_yield();
+        }
+
+        xfer_block_t *b = mm_malloc(max(args->sizes[k], sizeof(xfer_block_t)));
+        if (b == NULL)
+            app_error("mm_malloc error in xfer_scatter_thread");
+        b->sender = args->self;
+        __atomic_fetch_add(&args->in_flight[args->self], 1, __ATOMIC_RELAXED);
+
+        rand ^= rand << 13;
+        rand ^= rand >> 7;
+        rand ^= rand << 17;
+        inbox_push(&args->inboxes[rand % args->nthreads], b);
+    }
+
+    /* keep freeing until nobody sends any more, then free the rest */
+    __atomic_fetch_add(args->done, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(args->done, __ATOMIC_ACQUIRE) < args->nthreads) {
+        inbox_drain(args);
+        sched_yield();
+    }
+    inbox_drain(args);
+    xfer_stop(args);
+    return NULL;
+}
+
+/*
+ * eval_mm_xfer - Run both cross-thread workloads with nthreads threads
+ *     on fresh heaps, MT_REPEATS times each, and average the results.
+ *     Handoff uses nthreads / 2 producer/consumer pairs.
+ */
+static void eval_mm_xfer(const trace_t *trace, int tracenum, int nthreads, stats_t *stats)
+{
+    void *(*workers[NUM_XFER])(void *) = { xfer_handoff_thread, xfer_scatter_thread };
+    int num_sizes = 0;
+    int *sizes = malloc(trace->num_ops * sizeof(int));
+    if (sizes == NULL)
+        unix_error("sizes malloc in eval_mm_xfer failed");
+    for (int k = 0; k < trace->num_ops; k++)
+        if (trace->ops[k].type != FREE)
+            sizes[num_sizes++] = max(1, trace->ops[k].size);
+
+    stats->xfer_threads = nthreads;
+    for (int w = 0; w < NUM_XFER; w++) {
+        int n = w == XFER_HANDOFF ? nthreads & ~1 : nthreads;
+        struct xfer_args args[n];
+        pthread_t threads[n];
+        xfer_ring_t *rings = calloc(n / 2, sizeof(xfer_ring_t));
+        xfer_block_t **inboxes = calloc(n, sizeof(xfer_block_t *));
+        int *in_flight = calloc(n, sizeof(int));
+        int done;
+        pthread_barrier_t go;
+        struct timeval start, end;
+        xfer_stats_t *xs = &stats->xfer[w];
+
+        if (rings == NULL || inboxes == NULL || in_flight == NULL)
+            unix_error("calloc in eval_mm_xfer failed");
+        if (pthread_barrier_init(&go, NULL, n)) {
+            perror("pthread_barrier_init");
+            abort();
+        }
+
+        xs->ops = 2.0 * num_sizes * (w == XFER_HANDOFF ? n / 2 : n);
+        for (int k = 0; k < MT_REPEATS; k++) {
+            reset_heap(tracenum);
+            memset(rings, 0, (n / 2) * sizeof(xfer_ring_t));
+            done = 0;
+            for (int j = 0; j < n; j++) {
+                args[j] = (struct xfer_args) {
+                    .sizes = sizes, .num_sizes = num_sizes, .self = j, .nthreads = n,
+                    .ring = &rings[j / 2], .inboxes = inboxes, .in_flight = in_flight,
+                    .done = &done, .go = &go, .start = &start, .end = &end
+                };
+                if (pthread_create(threads + j, NULL, workers[w], args + j))
+                    perror("pthread_create"), exit(-1);
+            }
+            for (int j = 0; j < n; j++)
+                if (pthread_join(threads[j], NULL))
+                    perror("pthread_join"), exit(-1);
+
+            xs->secs += (end.tv_sec - start.tv_sec) + 1E-6*(end.tv_usec - start.tv_usec);
+            xs->peak += mem_peak_footprint();
+        }
+        xs->secs /= MT_REPEATS;
+        xs->peak /= MT_REPEATS;
+
+        pthread_barrier_destroy(&go);
+        free(rings);
+        free(inboxes);
+        free(in_flight);
+    }
+    free(sizes);
+}
+
+/*
+ * eval_mm_synthetic - Run a -G workload that keeps about live blocks
+ *    allocated.  Ops are generated GEN_BATCH at a time, and only the
+ *    time spent running them counts.
+ */
+static int eval_mm_synthetic(const mdgen_params_t *params, long live, synth_point_t *pt)
+{
+    traceop_t batch[GEN_BATCH];
+    char **blocks = NULL;
+    int *sizes = NULL;
+    int cap = 0;
+    long total_size = 0;
+    struct timespec t0, t1;
+
+    memset(pt, 0, sizeof(*pt));
+    pt->live = live;
+    pt->valid = 1;
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_synthetic");
+
+    mdgen_t *gen = mdgen_new(params, live);
+    for (;;) {
+        int n = 0;
+        while (n < GEN_BATCH && mdgen_next(gen, &batch[n]))
+            n++;
+        if (n == 0)
+            break;
+        if (mdgen_num_ids(gen) > cap) {
+            cap = 2 * mdgen_num_ids(gen);
+            blocks = realloc(blocks, cap * sizeof(char *));
+            sizes = realloc(sizes, cap * sizeof(int));
+            if (blocks == NULL || sizes == NULL)
+                unix_error("realloc in eval_mm_synthetic failed");
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (int i = 0; i < n; i++) {
+            const traceop_t *op = &batch[i];
+            char *p;
+            switch (op->type) {
+            case ALLOC:
+                p = mm_malloc(op->size);
+                break;
+            case REALLOC:
+                p = mm_realloc(blocks[op->index], op->size);
+                break;
+            default:
+                mm_free(blocks[op->index]);
+                continue;
+            }
+            if (p == NULL || !IS_ALIGNED(p)) {
+                printf("ERROR [-G live %ld, op %.0f]: mm_%s returned %p\n",
+                       live, pt->ops + i, op_names[op->type], p);
+                errors++;
+                pt->valid = 0;
+                goto out;
+            }
+            if (params->touch)
+                memset(p, 0, op->size);
+            blocks[op->index] = p;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        pt->secs += (t1.tv_sec - t0.tv_sec) + 1E-9*(t1.tv_nsec - t0.tv_nsec);
+
+        /* live bytes can only peak right after an allocation, so
+         * replaying the batch's sizes finds the peak exactly */
+        for (int i = 0; i < n; i++) {
+            const traceop_t *op = &batch[i];
+            if (op->type == FREE) {
+                total_size -= sizes[op->index];
+                continue;
+            }
+            total_size += op->size - (op->type == REALLOC ? sizes[op->index] : 0);
+            sizes[op->index] = op->size;
+            if (total_size > pt->max_live)
+                pt->max_live = total_size;
+        }
+        pt->ops += n;
+    }
+    pt->peak = mem_peak_footprint();
+out:
+    mdgen_free(gen);
+    free(blocks);
+    free(sizes);
+    return pt->valid;
+}
+
+/*
+ * run_synthetic - Run the -G workload at each of its live-set sizes,
+ *    doubling from the smallest, then report it
+ */
+static int run_synthetic(const char *spec)
+{
+    mdgen_params_t params;
+    char err[MAXLINE];
+    if (!mdgen_parse(spec, &params, err, sizeof err)) {
+        fprintf(stderr, "mdriver: -G: %s\n", err);
+        return 0;
+    }
+
+    int n = 0;
+    for (long live = params.live_lo; ; live = live * 2 < params.live_hi ? live * 2 : params.live_hi) {
+        n++;
+        if (live == params.live_hi)
+            break;
+    }
+    synth_point_t *pts = calloc(n, sizeof(synth_point_t));
+    if (pts == NULL)
+        unix_error("pts calloc in run_synthetic failed");
+
+    int valid = 1;
+    long live = params.live_lo;
+    for (int k = 0; k < n; k++, live = live * 2 < params.live_hi ? live * 2 : params.live_hi) {
+        if (verbose > 1)
+            printf("Running the workload with %ld live blocks\n", live);
+        valid &= eval_mm_synthetic(&params, live, &pts[k]);
+    }
+
+    char desc[MAXLINE];
+    mdgen_describe(&params, desc, sizeof desc);
+    printf("Results for mm malloc on %s:\n", desc);
+    printsynthetic(pts, n);
+
+    FILE *json = open_jsonfile("results.%d.json");
+    fprintf(json, "{");
+    fprintf(json, " \"version\": \"1.1\",\n");
+#ifdef THREAD_SAFE
+    fprintf(json, " \"THREAD_SAFE\": true,\n");
+#else
+    fprintf(json, " \"THREAD_SAFE\": false,\n");
+#endif
+    fprintf(json, " \"synthetic\": { \"workload\": \"%s\", \"points\": [", desc);
+    for (int k = 0; k < n; k++) {
+        const synth_point_t *pt = &pts[k];
+        fprintf(json, "%s{ \"live\": %ld, \"valid\": %s", k > 0 ? ",\n  " : " ",
+                pt->live, pt->valid ? "true" : "false");
+        if (pt->valid)
+            fprintf(json, ", \"ops\": %.0f, \"secs\": %f, \"Kops\": %f, "
+                    "\"max_live\": %.0f, \"peak_heap\": %.0f, \"util\": %f",
+                    pt->ops, pt->secs, (pt->ops/1e3)/pt->secs,
+                    pt->max_live, pt->peak, 100.0 * pt->max_live / pt->peak);
+        fprintf(json, " }");
+    }
+    fprintf(json, " ] }\n}");
+    fclose(json);
+
+    free(pts);
+    return valid;
+}
+
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package.
+ */
+static void eval_mm_speed(void *ptr)
+{
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+        app_error("mm_init failed in eval_mm_speed");
 
     eval_mm_speed_inner(ptr);
 }
@@ -1051,9 +2306,11 @@ static void eval_mm_speed_inner(void *ptr)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case CALLOC:
+        case MEMALIGN:
             index = trace->ops[i].index;
             size = max(0, (int)(trace->multiplier * trace->ops[i].size));
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = mm_alloc_op(&trace->ops[i], size)) == NULL)
                 app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
@@ -1078,6 +2335,221 @@ static void eval_mm_speed_inner(void *ptr)
         }
 }
 
+/*
+ * read_cycles - the cycle counter as one number
+ */
+static inline unsigned long long read_cycles(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned hi, lo;
+    access_counter(&hi, &lo);
+    return ((unsigned long long)hi << 32) | lo;
+#else
+    struct timespec ts;   /* no cycle counter here; count nanoseconds */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/* Histogram bucket for an op that took cycles */
+static int latency_bucket(unsigned long long cycles)
+{
+    if (cycles < (1 << LAT_SUB_BITS))
+        return cycles;
+    int log2 = 63 - __builtin_clzll(cycles);
+    int sub = (cycles >> (log2 - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1);
+    return ((log2 - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + sub;
+}
+
+/* Largest number of cycles that falls into bucket b */
+static double latency_bucket_top(int b)
+{
+    if (b < (1 << LAT_SUB_BITS))
+        return b;
+    int log2 = (b >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    int sub = b & ((1 << LAT_SUB_BITS) - 1);
+    double step = (double)(1ULL << (log2 - LAT_SUB_BITS));
+    return ((1 << LAT_SUB_BITS) + sub + 1) * step - 1;
+}
+
+/*
+ * eval_mm_latency - Run the trace once more on a fresh heap, timing
+ *     every op with the cycle counter, and add the times to the op
+ *     types' histograms.  This is a pass of its own so that reading
+ *     the counter does not slow down the throughput measurement.  The
+ *     cost of reading the counter itself is subtracted.
+ */
+static void eval_mm_latency(trace_t *trace, latency_t *latency)
+{
+    int i, index, size;
+    unsigned long long start, cycles, overhead = ~0ULL;
+    char *p;
+
+    /* the least a back-to-back pair of reads takes */
+    for (i = 0; i < 1000; i++) {
+        start = read_cycles();
+        cycles = read_cycles() - start;
+        if (cycles < overhead)
+            overhead = cycles;
+    }
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        int type = trace->ops[i].type;
+        index = trace->ops[i].index;
+        size = max(0, (int)(trace->multiplier * trace->ops[i].size));
+
+        start = read_cycles();
+        switch (type) {
+        case ALLOC:
+        case CALLOC:
+        case MEMALIGN:
+            p = mm_alloc_op(&trace->ops[i], size);
+            break;
+        case REALLOC:
+            p = mm_realloc(trace->blocks[index], size);
+            break;
+        case FREE:
+            mm_free(trace->blocks[index]);
+            p = NULL;
+            break;
+        default:
+            app_error("Nonexistent request type in eval_mm_latency");
+        }
+        cycles = read_cycles() - start;
+
+        if (type != FREE) {
+            if (p == NULL)
+                app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+        }
+        cycles = cycles > overhead ? cycles - overhead : 0;
+        latency_t *l = &latency[type];
+        l->count++;
+        l->buckets[latency_bucket(cycles)]++;
+        if (cycles > l->max)
+            l->max = cycles;
+    }
+}
+
+/* The number of cycles under which a fraction q of the ops ended */
+/*
+ * eval_mm_counters - Run the trace once more on a fresh heap with the
+ *     hardware counters on, and add their counts to counters.  Like
+ *     eval_mm_latency, this is a pass of its own; the counters are
+ *     started once, so the run itself is as fast as eval_mm_speed's.
+ */
+static void eval_mm_counters(trace_t *trace, double *counters)
+{
+    double counts[NUM_PERFCTRS];
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_counters");
+
+    perfctr_start();
+    eval_mm_speed_inner(trace);
+    perfctr_stop(counts);
+
+    for (int c = 0; c < NUM_PERFCTRS; c++)
+        counters[c] = counts[c] < 0 || counters[c] < 0 ? -1 : counters[c] + counts[c];
+}
+
+/*
+ * eval_mm_profile - Run the trace once more on a fresh heap, taking a
+ *     heap profile before the first op, every interval ops after
+ *     that, and after the last op.
+ */
+static void eval_mm_profile(trace_t *trace, int interval, stats_t *stats)
+{
+    int i, index, size, cap = 0;
+    double live = 0;
+    unsigned long calls = 0, probes = 0;
+    char *p;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_profile");
+
+    stats->num_profile = 0;
+    for (i = 0; i <= trace->num_ops; i++) {
+        if (i % interval == 0 || i == trace->num_ops) {
+            if (stats->num_profile == cap) {
+                cap = cap ? 2 * cap : 64;
+                stats->profile = realloc(stats->profile, cap * sizeof(profile_sample_t));
+                if (stats->profile == NULL)
+                    unix_error("profile realloc in eval_mm_profile failed");
+            }
+            profile_sample_t *ps = &stats->profile[stats->num_profile++];
+            ps->op = i;
+            ps->live = live;
+            mm_heap_profile(&ps->heap);
+            ps->probes = ps->heap.fit_calls > calls ?
+                (double)(ps->heap.fit_probes - probes) / (ps->heap.fit_calls - calls) : 0;
+            calls = ps->heap.fit_calls;
+            probes = ps->heap.fit_probes;
+        }
+        if (i == trace->num_ops)
+            break;
+
+        index = trace->ops[i].index;
+        size = max(0, (int)(trace->multiplier * trace->ops[i].size));
+        switch (trace->ops[i].type) {
+        case ALLOC:
+        case CALLOC:
+        case MEMALIGN:
+            if ((p = mm_alloc_op(&trace->ops[i], size)) == NULL)
+                app_error("mm_malloc error in eval_mm_profile");
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            live += size;
+            break;
+        case REALLOC:
+            if ((p = mm_realloc(trace->blocks[index], size)) == NULL)
+                app_error("mm_realloc error in eval_mm_profile");
+            live += (double)size - trace->block_sizes[index];
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            break;
+        case FREE:
+            mm_free(trace->blocks[index]);
+            live -= trace->block_sizes[index];
+            break;
+        default:
+            app_error("Nonexistent request type in eval_mm_profile");
+        }
+    }
+}
+
+/* Free bytes outside the largest free block, as a fraction of all free bytes */
+static double external_frag(const struct heap_profile *h)
+{
+    return h->free_total > 0 ? 1.0 - (double)h->largest_free / h->free_total : 0;
+}
+
+/* Bytes of allocated blocks beyond what was asked for, as a fraction of them */
+static double internal_frag(const profile_sample_t *ps)
+{
+    return ps->heap.used_bytes > 0 ? 1.0 - ps->live / ps->heap.used_bytes : 0;
+}
+
+static double latency_quantile(const latency_t *l, double q)
+{
+    double seen = 0;
+
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += l->buckets[b];
+        if (seen >= q * l->count) {
+            double top = latency_bucket_top(b);
+            return top < l->max ? top : l->max;
+        }
+    }
+    return l->max;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1093,8 +2565,10 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* malloc */
+        case CALLOC:
+        case MEMALIGN:
             size = max(0, (int)(trace->multiplier * trace->ops[i].size));
-            if ((p = malloc(size)) == NULL) {
+            if ((p = libc_alloc_op(&trace->ops[i], size)) == NULL) {
                 malloc_error(tracenum, i, "libc malloc failed");
                 unix_error("System message");
             }
@@ -1123,6 +2597,21 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
     return 1;
 }
 
+/*
+ * libc_alloc_op - mm_alloc_op() for libc malloc
+ */
+static void *libc_alloc_op(const traceop_t *op, int size)
+{
+    switch (op->type) {
+    case CALLOC:
+        return calloc(1, size);
+    case MEMALIGN:
+        return aligned_alloc((size_t)1 << op->align_log2, size);
+    default:
+        return malloc(size);
+    }
+}
+
 /* 
  * eval_libc_speed - This is the function that is used by fcyc() to
  *    measure the running time of the libc malloc package on the set
@@ -1138,9 +2627,11 @@ static void eval_libc_speed(void *ptr)
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
         case ALLOC: /* malloc */
+        case CALLOC:
+        case MEMALIGN:
             index = trace->ops[i].index;
             size = max(0, (int)(trace->multiplier * trace->ops[i].size));
-            if ((p = malloc(size)) == NULL)
+            if ((p = libc_alloc_op(&trace->ops[i], size)) == NULL)
                 unix_error("malloc failed in eval_libc_speed");
             trace->blocks[index] = p;
             break;
@@ -1169,6 +2660,13 @@ static void eval_libc_speed(void *ptr)
  ************************************/
 
 
+/* Throughput of point k of a sweep, over all of its threads */
+static double sweep_kops(const stats_t *stats, int k)
+{
+    const sweep_point_t *pt = &stats->sweep[k];
+    return (stats->ops * pt->nthreads / 1e3) / pt->secs;
+}
+
 /*
  * printresults - prints a performance summary for some malloc package
  */
@@ -1178,51 +2676,64 @@ static void printresults(int n, char ** tracefiles, stats_t *stats)
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double live_util = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%22s%5s%5s%8s%10s%6s\n", 
-           "trace", " name", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%22s%5s%5s%5s%8s%10s%6s\n", 
+           "trace", " name", " valid", "util", "live", "ops", "secs", "Kops");
     for (i=0; i < n; i++) {
         if (stats[i].valid) {
-            printf("%2d%25s%5s%5.0f%%%8.0f%10.6f%6.0f\n", 
+            /* live utilization is only measured for single-threaded runs */
+            char live[8] = "-";
+            if (stats[i].live_util > 0)
+                snprintf(live, sizeof live, "%.0f%%", stats[i].live_util*100.0);
+            printf("%2d%25s%5s%5.0f%%%5s%8.0f%10.6f%6.0f\n", 
                    i,
                    tracefiles[i],
                    "yes",
                    stats[i].util*100.0,
+                   live,
                    stats[i].ops,
                    stats[i].secs,
                    (stats[i].ops/1e3)/stats[i].secs);
             secs += stats[i].secs;
             ops += stats[i].ops;
             util += stats[i].util;
+            live_util += stats[i].live_util;
         }
         else {
-            printf("%2d%25s%5s%6s%8s%10s%6s\n", 
+            printf("%2d%25s%5s%6s%5s%8s%10s%6s\n", 
                    i,
                    tracefiles[i],
                    "no",
                    "-",
                    "-",
                    "-",
+                   "-",
                    "-");
         }
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-        printf("%12s                    %5.0f%%%8.0f%10.6f%6.0f\n", 
+        char live[8] = "-";
+        if (live_util > 0)
+            snprintf(live, sizeof live, "%.0f%%", (live_util/n)*100.0);
+        printf("%12s                    %5.0f%%%5s%8.0f%10.6f%6.0f\n", 
                "Total       ",
                (util/n)*100.0,
+               live,
                ops, 
                secs,
                (ops/1e3)/secs);
     }
     else {
-        printf("%12s                    %6s%8s%10s%6s\n", 
+        printf("%12s                    %6s%5s%8s%10s%6s\n", 
                "Total       ",
                "-", 
                "-", 
                "-", 
+               "-", 
                "-");
     }
 
@@ -1242,9 +2753,86 @@ static void printresults_as_json(FILE *json, int n, char **tracefiles, stats_t *
             fprintf(json, "{ \"%s\": \"%s\"\n", "trace", tracefiles[i]);
             fprintf(json, ", \"valid\": true\n");
             fprintf(json, ", \"%s\": %f\n", "util", stats[i].util*100.0);
+            if (stats[i].live_util > 0)
+                fprintf(json, ", \"%s\": %f\n", "live_util", stats[i].live_util*100.0);
             fprintf(json, ", \"%s\": %f\n", "ops", stats[i].ops);
             fprintf(json, ", \"%s\": %f\n", "secs", stats[i].secs);
             fprintf(json, ", \"%s\": %f\n", "Kops", (stats[i].ops/1e3)/stats[i].secs);
+            if (stats[i].cache_hits + stats[i].cache_misses > 0) {
+                fprintf(json, ", \"%s\": %.0f\n", "cache_hits", stats[i].cache_hits);
+                fprintf(json, ", \"%s\": %.0f\n", "cache_misses", stats[i].cache_misses);
+            }
+            if (stats[i].latency != NULL) {
+                const char *sep = "";
+                fprintf(json, ", \"latency\": {");
+                for (int t = 0; t < NUM_OP_TYPES; t++) {
+                    const latency_t *l = &stats[i].latency[t];
+                    if (l->count == 0)
+                        continue;
+                    fprintf(json, "%s \"%s\": { \"count\": %.0f, \"p50\": %.0f, "
+                            "\"p99\": %.0f, \"p999\": %.0f, \"max\": %.0f }", sep,
+                            op_names[t], l->count, latency_quantile(l, .5),
+                            latency_quantile(l, .99), latency_quantile(l, .999), l->max);
+                    sep = ",\n";
+                }
+                fprintf(json, " }\n");
+            }
+            if (stats[i].counters != NULL) {
+                const char *sep = "";
+                fprintf(json, ", \"counters\": {");
+                for (int c = 0; c < NUM_PERFCTRS; c++) {
+                    if (stats[i].counters[c] < 0)
+                        continue;
+                    fprintf(json, "%s \"%s\": { \"total\": %.0f, \"per_op\": %f }", sep,
+                            perfctr_names[c], stats[i].counters[c],
+                            stats[i].counters[c] / stats[i].ops);
+                    sep = ",\n";
+                }
+                fprintf(json, " }\n");
+            }
+            if (stats[i].num_profile > 0) {
+                const struct heap_profile *h0 = &stats[i].profile[0].heap;
+                fprintf(json, ", \"profile\": { \"class_min\": [");
+                for (int c = 0; c < h0->num_classes; c++)
+                    fprintf(json, "%s%zu", c > 0 ? ", " : " ", h0->class_min[c]);
+                fprintf(json, " ],\n  \"samples\": [");
+                for (int k = 0; k < stats[i].num_profile; k++) {
+                    const profile_sample_t *ps = &stats[i].profile[k];
+                    const struct heap_profile *h = &ps->heap;
+                    fprintf(json, "%s{ \"op\": %d, \"heap\": %zu, \"live\": %.0f, \"used\": %zu, "
+                            "\"free\": %zu, \"largest_free\": %zu, \"ext_frag\": %f, "
+                            "\"int_frag\": %f, \"probes\": %f, \"free_by_class\": [",
+                            k > 0 ? ",\n   " : " ", ps->op, h->heap_bytes, ps->live, h->used_bytes,
+                            h->free_total, h->largest_free, external_frag(h),
+                            internal_frag(ps), ps->probes);
+                    for (int c = 0; c < h->num_classes; c++)
+                        fprintf(json, "%s%zu", c > 0 ? ", " : " ", h->free_bytes[c]);
+                    fprintf(json, " ] }");
+                }
+                fprintf(json, " ] }\n");
+            }
+            if (stats[i].num_sweep > 0) {
+                fprintf(json, ", \"sweep\": [");
+                for (int k = 0; k < stats[i].num_sweep; k++) {
+                    const sweep_point_t *pt = &stats[i].sweep[k];
+                    fprintf(json, "%s{ \"nthreads\": %d, \"secs\": %f, \"Kops\": %f, "
+                            "\"speedup\": %f, \"util\": %f }", k > 0 ? ",\n  " : " ",
+                            pt->nthreads, pt->secs, sweep_kops(&stats[i], k),
+                            sweep_kops(&stats[i], k) / sweep_kops(&stats[i], 0),
+                            pt->util*100.0);
+                }
+                fprintf(json, " ]\n");
+            }
+            if (stats[i].xfer_threads > 0) {
+                fprintf(json, ", \"xfer\": { \"nthreads\": %d", stats[i].xfer_threads);
+                for (int w = 0; w < NUM_XFER; w++) {
+                    const xfer_stats_t *xs = &stats[i].xfer[w];
+                    fprintf(json, ",\n  \"%s\": { \"ops\": %.0f, \"secs\": %f, "
+                            "\"Kops\": %f, \"peak_heap\": %.0f }",
+                            xfer_names[w], xs->ops, xs->secs, (xs->ops/1e3)/xs->secs, xs->peak);
+                }
+                fprintf(json, " }\n");
+            }
             fprintf(json, "}");
 
             secs += stats[i].secs;
@@ -1262,6 +2850,224 @@ static void printresults_as_json(FILE *json, int n, char **tracefiles, stats_t *
     fprintf(json, "]\n");
 }
 
+/*
+ * printcachestats - prints per-thread cache hits and misses for each trace
+ */
+static void printcachestats(int n, char ** tracefiles, stats_t *stats)
+{
+    int i;
+    double hits = 0;
+    double misses = 0;
+
+    printf("%5s%22s%11s%11s%7s\n",
+           "trace", " name", "hits", "misses", "hit%");
+    for (i=0; i < n; i++) {
+        double total = stats[i].cache_hits + stats[i].cache_misses;
+        if (stats[i].valid && total > 0) {
+            printf("%2d%25s%11.0f%11.0f%6.1f%%\n",
+                   i,
+                   tracefiles[i],
+                   stats[i].cache_hits,
+                   stats[i].cache_misses,
+                   100.0 * stats[i].cache_hits / total);
+            hits += stats[i].cache_hits;
+            misses += stats[i].cache_misses;
+        }
+        else {
+            printf("%2d%25s%11s%11s%7s\n", i, tracefiles[i], "-", "-", "-");
+        }
+    }
+    if (hits + misses > 0)
+        printf("%12s               %11.0f%11.0f%6.1f%%\n",
+               "Total       ", hits, misses, 100.0 * hits / (hits + misses));
+}
+
+/*
+ * printlatency - prints the latency quantiles of each op type for each trace
+ */
+static void printlatency(int n, char ** tracefiles, stats_t *stats)
+{
+    int i, t;
+
+    printf("%5s%22s%9s%9s%8s%8s%8s%10s\n",
+           "trace", " name", "op", "count", "p50", "p99", "p99.9", "max");
+    for (i=0; i < n; i++) {
+        if (!stats[i].valid || stats[i].latency == NULL) {
+            printf("%2d%25s%9s%9s%8s%8s%8s%10s\n",
+                   i, tracefiles[i], "-", "-", "-", "-", "-", "-");
+            continue;
+        }
+        for (t = 0; t < NUM_OP_TYPES; t++) {
+            const latency_t *l = &stats[i].latency[t];
+            if (l->count == 0)
+                continue;
+            printf("%2d%25s%9s%9.0f%8.0f%8.0f%8.0f%10.0f\n",
+                   i,
+                   tracefiles[i],
+                   op_names[t],
+                   l->count,
+                   latency_quantile(l, .5),
+                   latency_quantile(l, .99),
+                   latency_quantile(l, .999),
+                   l->max);
+        }
+    }
+}
+
+/*
+ * printcounters - prints the hardware counts per op for each trace,
+ *     with "-" for counters the machine lacks
+ */
+static void printcounters(int n, char ** tracefiles, stats_t *stats)
+{
+    static const char *heads[NUM_PERFCTRS] = { "cyc", "instr", "L1D", "LLC", "dTLB", "br" };
+    int i, c;
+
+    printf("%5s%22s", "trace", " name");
+    for (c = 0; c < NUM_PERFCTRS; c++)
+        printf("%9s", heads[c]);
+    printf("%7s\n", "IPC");
+    for (i=0; i < n; i++) {
+        const double *cnt = stats[i].counters;
+        printf("%2d%25s", i, tracefiles[i]);
+        for (c = 0; c < NUM_PERFCTRS; c++) {
+            if (stats[i].valid && cnt != NULL && cnt[c] >= 0)
+                printf("%9.2f", cnt[c] / stats[i].ops);
+            else
+                printf("%9s", "-");
+        }
+        if (stats[i].valid && cnt != NULL && cnt[PC_CYCLES] > 0 && cnt[PC_INSTRUCTIONS] >= 0)
+            printf("%7.2f\n", cnt[PC_INSTRUCTIONS] / cnt[PC_CYCLES]);
+        else
+            printf("%7s\n", "-");
+    }
+}
+
+/*
+ * printprofile - prints the averages of each trace's heap profile, and
+ *     the heap and largest free block in the sample with the most live bytes
+ */
+static void printprofile(int n, char ** tracefiles, stats_t *stats)
+{
+    int i, k;
+
+    printf("%5s%22s%8s%9s%9s%9s%8s%12s%9s\n",
+           "trace", " name", "samples", "ext avg", "ext max", "int avg", "probes", "peak KB", "lfree KB");
+    for (i=0; i < n; i++) {
+        if (stats[i].num_profile == 0) {
+            printf("%2d%25s%8s%9s%9s%9s%8s%12s%9s\n",
+                   i, tracefiles[i], "-", "-", "-", "-", "-", "-", "-");
+            continue;
+        }
+        double ext = 0, ext_max = 0, internal = 0, probes = 0, calls = 0;
+        const profile_sample_t *peak = &stats[i].profile[0];
+        for (k = 0; k < stats[i].num_profile; k++) {
+            const profile_sample_t *ps = &stats[i].profile[k];
+            ext += external_frag(&ps->heap);
+            if (external_frag(&ps->heap) > ext_max)
+                ext_max = external_frag(&ps->heap);
+            internal += internal_frag(ps);
+            if (ps->live > peak->live)
+                peak = ps;
+        }
+        const struct heap_profile *last = &stats[i].profile[stats[i].num_profile - 1].heap;
+        calls = last->fit_calls;
+        probes = last->fit_probes;
+        printf("%2d%25s%8d%8.1f%%%8.1f%%%8.1f%%%8.2f%12.0f%9.0f\n",
+               i,
+               tracefiles[i],
+               stats[i].num_profile,
+               100.0 * ext / stats[i].num_profile,
+               100.0 * ext_max,
+               100.0 * internal / stats[i].num_profile,
+               calls > 0 ? probes / calls : 0,
+               peak->heap.heap_bytes / 1024.0,
+               peak->heap.largest_free / 1024.0);
+    }
+}
+
+/*
+ * printsweep - prints throughput, speedup and utilization at each
+ *     thread count of a -M sweep
+ */
+static void printsweep(int n, char ** tracefiles, stats_t *stats)
+{
+    int i, k;
+
+    printf("%5s%22s%8s%10s%9s%6s\n",
+           "trace", " name", "threads", "Kops", "speedup", "util");
+    for (i=0; i < n; i++) {
+        if (stats[i].num_sweep == 0) {
+            printf("%2d%25s%8s%10s%9s%6s\n", i, tracefiles[i], "-", "-", "-", "-");
+            continue;
+        }
+        double base = sweep_kops(&stats[i], 0);
+        for (k = 0; k < stats[i].num_sweep; k++) {
+            sweep_point_t *pt = &stats[i].sweep[k];
+            printf("%2d%25s%8d%10.0f%9.2f%5.0f%%\n",
+                   i,
+                   tracefiles[i],
+                   pt->nthreads,
+                   sweep_kops(&stats[i], k),
+                   sweep_kops(&stats[i], k) / base,
+                   pt->util*100.0);
+        }
+    }
+}
+
+/*
+ * printxfer - prints the results of the cross-thread workloads
+ */
+static void printxfer(int n, char ** tracefiles, stats_t *stats)
+{
+    int i, w;
+
+    printf("%5s%22s%9s%9s%10s%8s%10s\n",
+           "trace", " name", "workload", "ops", "secs", "Kops", "peak KB");
+    for (i=0; i < n; i++) {
+        if (stats[i].xfer_threads == 0) {
+            printf("%2d%25s%9s%9s%10s%8s%10s\n", i, tracefiles[i], "-", "-", "-", "-", "-");
+            continue;
+        }
+        for (w = 0; w < NUM_XFER; w++) {
+            const xfer_stats_t *xs = &stats[i].xfer[w];
+            printf("%2d%25s%9s%9.0f%10.6f%8.0f%10.0f\n",
+                   i,
+                   tracefiles[i],
+                   xfer_names[w],
+                   xs->ops,
+                   xs->secs,
+                   (xs->ops/1e3)/xs->secs,
+                   xs->peak/1024);
+        }
+    }
+}
+
+/*
+ * printsynthetic - prints each live-set size of a -G workload
+ */
+static void printsynthetic(const synth_point_t *pts, int n)
+{
+    printf("%10s%12s%10s%8s%7s%12s%12s%6s\n",
+           "live", "ops", "secs", "Kops", "ns/op", "max live KB", "peak KB", "util");
+    for (int k = 0; k < n; k++) {
+        const synth_point_t *pt = &pts[k];
+        if (!pt->valid) {
+            printf("%10ld%12s%10s%8s%7s%12s%12s%6s\n", pt->live, "-", "-", "-", "-", "-", "-", "-");
+            continue;
+        }
+        printf("%10ld%12.0f%10.6f%8.0f%7.1f%12.0f%12.0f%5.0f%%\n",
+               pt->live,
+               pt->ops,
+               pt->secs,
+               (pt->ops/1e3)/pt->secs,
+               1e9*pt->secs/pt->ops,
+               pt->max_live/1024,
+               pt->peak/1024,
+               100.0 * pt->max_live / pt->peak);
+    }
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1294,7 +3100,7 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-shvVal] [-f <file>] [-m <t>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-shvValLPH] [-f <file>] [-p <n>] [-m <t>] [-M <t>] [-x <t>] [-j <n>] [-c <n>] [-b <file>] [-G <spec>] [-t <dir>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
@@ -1305,6 +3111,22 @@ static void usage(void)
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
     fprintf(stderr, "\t-n         Don't randomize addresses.\n");
+    fprintf(stderr, "\t-H         Back the heap with huge pages, prefaulted as it grows.\n");
     fprintf(stderr, "\t-s         Vary amplitude of each trace.\n");
     fprintf(stderr, "\t-m <t>     Run with multiple threads (mdriver-ts only).\n");
+    fprintf(stderr, "\t-c <n>     Run mm_checkheap() every <n> operations.\n");
+    fprintf(stderr, "\t-b <file>  Write the -f trace to <file> in binary form and exit.\n");
+    fprintf(stderr, "\t-L         Report the latency quantiles of each kind of op.\n");
+    fprintf(stderr, "\t-p <n>     Profile fragmentation every <n> ops (mdriver-profile only).\n");
+    fprintf(stderr, "\t-P         Report cycles, instructions, cache, TLB and branch misses per op.\n");
+    fprintf(stderr, "\t-M <t>     Sweep 1, 2, 4, ... threads up to <t>, 0 for one per CPU\n");
+    fprintf(stderr, "\t           (mdriver-ts only).\n");
+    fprintf(stderr, "\t-x <t>     Run <t> threads that free each other's blocks (mdriver-ts only).\n");
+    fprintf(stderr, "\t-j <n>     Run each trace, at each -s size, in a process of its own,\n");
+    fprintf(stderr, "\t           <n> at a time on CPUs of their own (isolated ones if any),\n");
+    fprintf(stderr, "\t           0 for one per CPU.\n");
+    fprintf(stderr, "\t-G <spec>  Run a generated workload instead of the traces, e.g.\n");
+    fprintf(stderr, "\t           size=zipf:16:4096,life=exp,live=1e3..1e6,realloc=.1:1.5,ops=1e8,seed=1\n");
+    fprintf(stderr, "\t           (size: uniform|zipf|bimodal|pow2:<lo>:<hi>[:<s|p>],\n");
+    fprintf(stderr, "\t           life: exp|uniform|fixed, touch=1 writes each block).\n");
 }
@@ -0,0 +1,39 @@
+/*
+ * mdtrace.h - the binary trace format read by mdriver (see -b) and
+ *             written by the libMallocTrace.so capture library.
+ *
+ * A binary trace is a bintrace_header_t followed by num_ops traceop_t
+ * records, in the byte order of the machine that wrote it.
+ */
+#ifndef __MDTRACE_H
+#define __MDTRACE_H
+
+#include <stdint.h>
+
+#define BINTRACE_MAGIC "MDTRACE1" /* first bytes of a binary trace file */
+
+/* Request types.  A CALLOC op asks for size zeroed bytes, a MEMALIGN
+ * op for size bytes aligned to 1 << align_log2. */
+enum {ALLOC, FREE, REALLOC, CALLOC, MEMALIGN};
+
+/* Characterizes a single trace operation (allocator request).  Binary
+ * traces store these as they are, so the fields have fixed widths.
+ * type and align_log2 used to be one int32_t type; on a little-endian
+ * machine, traces written back then read the same. */
+typedef struct {
+    int16_t type;                     /* type of request */
+    uint16_t align_log2;              /* MEMALIGN only, otherwise 0 */
+    int32_t index;                    /* index for free() to use later */
+    int32_t size;                     /* byte size of alloc/realloc request */
+    int32_t thread;                   /* thread that made it; 0 in .rep traces */
+} traceop_t;
+
+typedef struct {
+    char magic[8];       /* BINTRACE_MAGIC, not NUL-terminated */
+    int32_t sugg_heapsize;
+    int32_t num_ids;
+    int32_t num_ops;
+    int32_t weight;
+} bintrace_header_t;
+
+#endif /* __MDTRACE_H */
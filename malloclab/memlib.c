@@ -10,26 +10,112 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <stddef.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/* Regions handed out by mem_map(), kept in address order.  They are
+ * carved downward from the top of the reservation, so the brk heap and
+ * the mapped area grow toward each other. */
+struct mem_region {
+    char *lo;                   /* first byte, page aligned */
+    size_t size;                /* in bytes, a multiple of the page size */
+    int mapped;                 /* 0 if this is a hole left by mem_unmap() */
+    struct mem_region *next;
+};
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
-static int use_mmap;         /* Use mmap instead of malloc */
+static int mem_mode;         /* how the reservation was made, MEM_* */
 static void * mmap_addr = (void *)0x58000000;
+static char *mem_map_lo;     /* lowest byte of the mapped area; brk may not pass it */
+static struct mem_region *mem_regions;  /* mapped area, lowest region first */
+static size_t mem_mapped;    /* bytes in regions currently mapped */
+static size_t mem_peak;      /* largest heapsize + mem_mapped seen */
+static struct mem_region *region_pool;  /* unused region records */
+static char *mem_huge_base;  /* MEM_HUGEPAGE: the mapping, before alignment */
+static size_t mem_huge_size; /* MEM_HUGEPAGE: and its length */
+static char *mem_prefaulted; /* MEM_HUGEPAGE: pages below this are resident */
+static char *mem_fresh;      /* the highest break since mem_init() */
+static char *mem_map_min;    /* the lowest byte mem_map() handed out since the last reset */
+
+static void mem_reset_regions(void);
+
+/*
+ * mem_reserve_huge - reserve MAX_HEAP bytes on a HUGE_PAGE boundary.
+ *    Tries hugetlbfs pages first; the kernel reserves those at mmap()
+ *    time, so without a big enough pool (vm.nr_hugepages) this fails
+ *    cleanly and we fall back to asking for transparent huge pages.
+ */
+static char *mem_reserve_huge(void)
+{
+    char *p = mmap(NULL, MAX_HEAP, PROT_READ|PROT_WRITE,
+                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        mem_huge_base = p;
+        mem_huge_size = MAX_HEAP;
+        return p;
+    }
+
+    /* over-reserve by a huge page so that an aligned start fits */
+    mem_huge_size = MAX_HEAP + HUGE_PAGE;
+    p = mmap(NULL, mem_huge_size, PROT_READ|PROT_WRITE,
+             MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mem_init_vm: mmap error:");
+        exit(1);
+    }
+    mem_huge_base = p;
+    p = (char *)(((unsigned long)p + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+    if (madvise(p, MAX_HEAP, MADV_HUGEPAGE))
+        perror("mem_init_vm: madvise(MADV_HUGEPAGE)");
+    return p;
+}
+
+/*
+ * mem_prefault - make [mem_prefaulted, hi) resident, hi rounded up to
+ *    a huge page, so that the allocator's first touch of fresh heap
+ *    does not take a page fault per 4 KB page.
+ */
+static void mem_prefault(char *hi)
+{
+    hi = (char *)(((unsigned long)hi + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+    if (hi > mem_map_lo)
+        hi = mem_map_lo;
+    if (hi <= mem_prefaulted)
+        return;
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(mem_prefaulted, hi - mem_prefaulted, MADV_POPULATE_WRITE) == 0) {
+        mem_prefaulted = hi;
+        return;
+    }
+#endif
+    /* older kernels: touch every page, keeping what is there */
+    size_t pagesize = mem_pagesize();
+    for (volatile char *q = mem_prefaulted; q < hi; q += pagesize)
+        *q = *q;
+    mem_prefaulted = hi;
+}
 
 /* 
  * mem_init - initialize the memory system model
  */
-void mem_init(int _use_mmap)
+void mem_init(int mode)
 {
-    use_mmap = _use_mmap;
+    mem_mode = mode;
 
     /* allocate the storage we will use to model the available VM */
-    if (use_mmap) {
+    if (mem_mode == MEM_MMAP_ANYWHERE) {
+        mem_start_brk = (char *)mmap(NULL, MAX_HEAP, PROT_READ|PROT_WRITE,
+                                 MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        if (mem_start_brk == MAP_FAILED) {
+            perror("mem_init_vm: mmap error:");
+            exit(1);
+        }
+    } else if (mem_mode == MEM_MMAP_FIXED) {
         mem_start_brk = (char *)mmap(mmap_addr, MAX_HEAP, PROT_READ|PROT_WRITE, 
                                  MAP_FIXED | MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
         if (mem_start_brk == MAP_FAILED) {
@@ -43,8 +129,13 @@ void mem_init(int _use_mmap)
                 mmap_addr);
             exit(1);
         }
+    } else if (mem_mode == MEM_HUGEPAGE) {
+        mem_start_brk = mem_reserve_huge();
     } else {
-        if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+        /* calloc() so that it reads zero, see mem_heap_fresh(); for
+         * this size it comes from mmap() and is not cleared again, and
+         * MADV_DONTNEED gives back zero pages as for the other modes */
+        if ((mem_start_brk = (char *)calloc(1, MAX_HEAP)) == NULL) {
             fprintf(stderr, "mem_init_vm: malloc error\n");
             exit(1);
         }
@@ -52,6 +143,10 @@ void mem_init(int _use_mmap)
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_prefaulted = mem_start_brk;
+    mem_fresh = mem_start_brk;
+    mem_map_min = NULL;
+    mem_reset_regions();
 }
 
 /* 
@@ -59,7 +154,11 @@ void mem_init(int _use_mmap)
  */
 void mem_deinit(void)
 {
-    if (use_mmap) {
+    mem_reset_regions();
+    if (mem_mode == MEM_HUGEPAGE) {
+        if (munmap(mem_huge_base, mem_huge_size))
+            perror("munmap");
+    } else if (mem_mode != MEM_MALLOC) {
         if (munmap(mem_start_brk, MAX_HEAP))
             perror("munmap");
     } else {
@@ -73,27 +172,251 @@ void mem_deinit(void)
 void mem_reset_brk()
 {
     mem_brk = mem_start_brk;
+    mem_reset_regions();
+}
+
+/*
+ * region_new, region_delete - region records come from a pool of pages
+ *    of their own rather than from malloc(), so that memlib can sit
+ *    underneath a malloc() that is itself built on mm.c.
+ */
+static struct mem_region *region_new(void)
+{
+    if (region_pool == NULL) {
+        size_t pagesize = mem_pagesize();
+        struct mem_region *page = mmap(NULL, pagesize, PROT_READ|PROT_WRITE,
+                                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (page == MAP_FAILED)
+            return NULL;
+        for (size_t i = 0; i < pagesize / sizeof *page; i++) {
+            page[i].next = region_pool;
+            region_pool = &page[i];
+        }
+    }
+    struct mem_region *r = region_pool;
+    region_pool = r->next;
+    return r;
+}
+
+static void region_delete(struct mem_region *r)
+{
+    r->next = region_pool;
+    region_pool = r;
+}
+
+/*
+ * mem_reset_regions - forget all mapped regions, and drop their pages
+ *    so that mem_map() hands out zeroed memory again
+ */
+static void mem_reset_regions(void)
+{
+    while (mem_regions != NULL) {
+        struct mem_region *r = mem_regions;
+        mem_regions = r->next;
+        region_delete(r);
+    }
+    mem_map_lo = (char *)((unsigned long)mem_max_addr & ~(mem_pagesize() - 1));
+    if (mem_map_min != NULL && mem_map_min < mem_map_lo)
+        if (madvise(mem_map_min, mem_map_lo - mem_map_min, MADV_DONTNEED))
+            memset(mem_map_min, 0, mem_map_lo - mem_map_min);
+    mem_map_min = mem_map_lo;
+    mem_mapped = 0;
+    mem_peak = 0;
+}
+
+/* note a new footprint for mem_peak_footprint() */
+static void mem_update_peak(void)
+{
+    size_t footprint = mem_heapsize() + mem_mapped;
+    if (footprint > mem_peak)
+        mem_peak = footprint;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area.
+ *    A negative incr shrinks the heap instead.  As with the rest of
+ *    this model, the pages above the break stay resident; it is the
+ *    footprint seen by mem_heapsize() and mem_footprint() that drops.
+ *    Only a MEM_MMAP_ANYWHERE heap, which is a real process's, gives
+ *    the whole pages above the new break back to the OS.  A
+ *    MEM_HUGEPAGE heap is prefaulted a huge page ahead of the break.
  */
-void *mem_sbrk(int incr) 
+void *mem_sbrk(intptr_t incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ( (incr < 0 && (mem_brk - mem_start_brk) < -incr) ||
+         (incr > 0 && (mem_map_lo - mem_brk) < incr)) {
 	errno = ENOMEM;
-	fprintf(stderr, "ERROR: mem_sbrk(%d) failed. Ran out of memory...\n", incr);
+	fprintf(stderr, "ERROR: mem_sbrk(%ld) failed. Ran out of memory...\n", (long)incr);
 	return NULL;
     }
     mem_brk += incr;
+    if (mem_brk > mem_fresh)
+        mem_fresh = mem_brk;
+    if (incr < 0 && mem_mode == MEM_MMAP_ANYWHERE) {
+        size_t pagesize = mem_pagesize();
+        char *lo = (char *)(((unsigned long)mem_brk + pagesize - 1) & ~(pagesize - 1));
+        if (lo < old_brk)
+            madvise(lo, old_brk - lo, MADV_DONTNEED);
+    }
+    if (mem_mode == MEM_HUGEPAGE && mem_brk > mem_prefaulted)
+        mem_prefault(mem_brk);
+    mem_update_peak();
     getpid();           // perform a nullish sys call to add some cost
     return (void *)old_brk;
 }
 
+/*
+ * mem_map - model of mmap() for large blocks.  Returns a page-aligned,
+ *    zeroed region of at least size bytes from the top of the
+ *    reservation, reusing a hole left by mem_unmap() if one fits, or NULL.
+ */
+void *mem_map(size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    struct mem_region *r;
+
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+    for (r = mem_regions; r != NULL; r = r->next) {
+        if (!r->mapped && r->size >= size)
+            break;
+    }
+
+    if (r != NULL && r->size > size) {
+        /* split the hole; the mapped part is its upper end */
+        struct mem_region *rest = region_new();
+        if (rest == NULL)
+            return NULL;
+        rest->lo = r->lo;
+        rest->size = r->size - size;
+        rest->mapped = 0;
+        rest->next = r;
+        r->lo += rest->size;
+        r->size = size;
+        struct mem_region **pp = &mem_regions;
+        while (*pp != r)
+            pp = &(*pp)->next;
+        *pp = rest;
+    } else if (r == NULL) {
+        if (size > (size_t)(mem_map_lo - mem_brk)) {
+            errno = ENOMEM;
+            fprintf(stderr, "ERROR: mem_map(%zu) failed. Ran out of memory...\n", size);
+            return NULL;
+        }
+        if ((r = region_new()) == NULL)
+            return NULL;
+        mem_map_lo -= size;
+        if (mem_map_lo < mem_map_min)
+            mem_map_min = mem_map_lo;
+        r->lo = mem_map_lo;
+        r->size = size;
+        r->next = mem_regions;
+        mem_regions = r;
+    }
+
+    r->mapped = 1;
+    mem_mapped += size;
+    mem_update_peak();
+    getpid();           // as in mem_sbrk, the real thing is a system call
+    return r->lo;
+}
+
+/*
+ * mem_unmap - give back a region returned by mem_map().  Its pages are
+ *    released to the OS at once; neighbouring holes are merged, and a
+ *    hole at the bottom of the mapped area is returned to the brk heap.
+ */
+void mem_unmap(void *addr, size_t size)
+{
+    struct mem_region **pp, *r;
+
+    for (pp = &mem_regions; (r = *pp) != NULL; pp = &r->next) {
+        if (r->lo == addr && r->mapped)
+            break;
+    }
+    assert(r != NULL && size <= r->size);
+
+    if (madvise(r->lo, r->size, MADV_DONTNEED))
+        memset(r->lo, 0, r->size);    /* e.g. hugetlbfs pages, on older kernels */
+    r->mapped = 0;
+    mem_mapped -= r->size;
+
+    /* merge with the hole above, then with the one below */
+    struct mem_region *next = r->next;
+    if (next != NULL && !next->mapped) {
+        r->size += next->size;
+        r->next = next->next;
+        region_delete(next);
+    }
+    if (pp != &mem_regions) {
+        struct mem_region *prev = (struct mem_region *)
+            ((char *)pp - offsetof(struct mem_region, next));
+        if (!prev->mapped) {
+            prev->size += r->size;
+            prev->next = r->next;
+            region_delete(r);
+            r = prev;
+        }
+    }
+    if (r == mem_regions) {
+        mem_map_lo += r->size;
+        mem_regions = r->next;
+        region_delete(r);
+    }
+}
+
+/*
+ * mem_heap_fresh - returns the highest break since mem_init().  The heap
+ *    above it has never been handed out, so what mem_sbrk() extends the
+ *    heap by from there on reads as zero.  mem_reset_brk() does not
+ *    lower it, since the old heap is not cleared.
+ */
+void *mem_heap_fresh(void)
+{
+    return mem_fresh;
+}
+
+/*
+ * mem_is_mapped - is [lo, hi] inside a region currently mapped?
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    struct mem_region *r;
+
+    for (r = mem_regions; r != NULL; r = r->next) {
+        if (r->mapped && (char *)lo >= r->lo && (char *)hi < r->lo + r->size)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * mem_mapped_bytes - returns the bytes in currently mapped regions
+ */
+size_t mem_mapped_bytes(void)
+{
+    return mem_mapped;
+}
+
+/*
+ * mem_footprint - returns the heap size plus mapped bytes right now
+ */
+size_t mem_footprint(void)
+{
+    return mem_heapsize() + mem_mapped;
+}
+
+/*
+ * mem_peak_footprint - returns the largest heap size plus mapped bytes
+ *    seen since the last reset.  Without mem_map() this is the heap size.
+ */
+size_t mem_peak_footprint(void)
+{
+    return mem_peak;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
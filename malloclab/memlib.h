@@ -1,11 +1,32 @@
 #include <unistd.h>
 
-void mem_init(int use_mmap);               
+/* where mem_init() gets the MAX_HEAP bytes it models */
+enum {
+    MEM_MALLOC,          /* from malloc() */
+    MEM_MMAP_FIXED,      /* mmap()ed at a fixed address, for mdriver -n */
+    MEM_MMAP_ANYWHERE,   /* a reservation wherever the kernel puts it; for
+                            use as a real process's heap, see mmpreload.c */
+    MEM_HUGEPAGE,        /* mmap()ed on a HUGE_PAGE boundary, backed by huge
+                            pages where the kernel allows, for mdriver -H */
+};
+
+#define HUGE_PAGE (2UL << 20)   /* x86-64 and arm64 with 4 KB base pages */
+
+void mem_init(int mode);
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+void *mem_heap_fresh(void);
+
+/* page-granular regions inside the same reservation, for large blocks */
+void *mem_map(size_t size);
+void mem_unmap(void *addr, size_t size);
+int mem_is_mapped(void *lo, void *hi);
+size_t mem_mapped_bytes(void);
+size_t mem_footprint(void);
+size_t mem_peak_footprint(void);
 
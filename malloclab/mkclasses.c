@@ -0,0 +1,268 @@
+/*
+ * mkclasses - fit mm.c's small size classes to the request sizes of
+ *     a set of traces, and write them out as a header for
+ *     mm.c -DPGO_CLASSES:
+ *
+ *         ./mkclasses [-n classes] trace... > size_classes.h
+ *
+ *     The traces may be .rep files or binary traces (see mdtrace.h).
+ *     Every malloc, calloc, memalign and realloc counts its block size
+ *     once, in the block size mm.c gives it (see blocktag.h).  Block
+ *     sizes below 1 << PGO_TABLE_SHIFT units (of ALIGNMENT bytes) get -n
+ *     classes between them, by default as many as mm.c's built-in
+ *     layout has there; the log-spaced classes above are left as they
+ *     are.
+ *
+ *     Each size that takes at least HOT_SHARE of the requests gets a
+ *     class of its own, up to HOT_MAX of them.  The sizes between
+ *     those share the other classes, as many per run as its share of
+ *     the requests allows, and are split where the requests add up to
+ *     equal parts.  A thread-cache refill takes more blocks of a class
+ *     that is asked for more often.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "blocktag.h"
+#include "mdtrace.h"
+
+#define PGO_TABLE_SHIFT 8         /* the table covers blocks below 4 KiB */
+#define TABLE_UNITS (1 << PGO_TABLE_SHIFT)
+/* mm.c's built-in classes below the table's limit: one per size below
+ * 1 << 4 units, then 4 per power of two */
+#define BUILTIN_CLASSES ((1 << 4) - MIN_BLOCK_UNITS + ((PGO_TABLE_SHIFT - 4) << 2))
+#define HOT_SHARE 0.01            /* of the requests, for a class of its own */
+#define HOT_MAX 14                /* sizes with a class of their own */
+#define BATCH_MIN 4               /* blocks per refill of an unused class */
+#define BATCH_MAX 32              /* ... and of the busiest one, TCACHE_MAX */
+#define TCACHE_LIMIT_UNITS (2048 / ALIGNMENT) /* mm_ts.c caches blocks up to 2 KiB */
+
+static double counts[TABLE_UNITS];   /* requests per block size, in units */
+static double total;                 /* requests of all sizes */
+
+/* Count a request of size bytes, in units of the block mm.c makes for
+ * it: room for the header, aligned, and at least a minimum block */
+static void count_request(long size)
+{
+    if (size <= 0)
+        return; /* no block at all */
+    long units = (size + WSIZE + ALIGNMENT - 1) / ALIGNMENT;
+    if (units < MIN_BLOCK_UNITS)
+        units = MIN_BLOCK_UNITS;
+    if (units < TABLE_UNITS)
+        counts[units]++;
+    total++;
+}
+
+/* Count the requests of one trace file */
+static void read_trace(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    char magic[sizeof BINTRACE_MAGIC - 1];
+    if (fread(magic, 1, sizeof magic, f) == sizeof magic &&
+        memcmp(magic, BINTRACE_MAGIC, sizeof magic) == 0) {
+        bintrace_header_t hdr;
+        traceop_t op;
+        rewind(f);
+        if (fread(&hdr, sizeof hdr, 1, f) != 1) {
+            fprintf(stderr, "%s: truncated header\n", path);
+            exit(1);
+        }
+        for (int i = 0; i < hdr.num_ops && fread(&op, sizeof op, 1, f) == 1; i++)
+            if (op.type != FREE)
+                count_request(op.size);
+        fclose(f);
+        return;
+    }
+
+    rewind(f);
+    int heapsize, num_ids, num_ops, weight;
+    if (fscanf(f, "%d %d %d %d", &heapsize, &num_ids, &num_ops, &weight) != 4) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        exit(1);
+    }
+    char type[2];
+    long id, a, b;
+    while (fscanf(f, "%1s", type) == 1) {
+        switch (type[0]) {
+        case 'a':
+        case 'r':
+        case 'c':
+            if (fscanf(f, "%ld %ld", &id, &a) != 2)
+                goto bad;
+            count_request(a);
+            break;
+        case 'm':
+            if (fscanf(f, "%ld %ld %ld", &id, &a, &b) != 3)
+                goto bad;
+            count_request(b);
+            break;
+        case 'f':
+            if (fscanf(f, "%ld", &id) != 1)
+                goto bad;
+            break;
+        default:
+            goto bad;
+        }
+    }
+    fclose(f);
+    return;
+bad:
+    fprintf(stderr, "%s: bad request line\n", path);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int nclasses = BUILTIN_CLASSES;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:h")) != EOF) {
+        switch (c) {
+        case 'n':
+            nclasses = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n classes] trace...\n", argv[0]);
+            exit(c == 'h' ? 0 : 1);
+        }
+    }
+    if (optind == argc || nclasses < 2 * HOT_MAX + 1 || nclasses > 48) {
+        fprintf(stderr, "Usage: %s [-n classes] trace..., with %d <= classes <= 48\n",
+                argv[0], 2 * HOT_MAX + 1);
+        exit(1);
+    }
+    for (int i = optind; i < argc; i++)
+        read_trace(argv[i]);
+
+    /* the hot sizes */
+    int nhot = 0;
+    char is_hot[TABLE_UNITS] = { 0 };
+    while (nhot < HOT_MAX) {
+        int best = 0;
+        for (int u = MIN_BLOCK_UNITS; u < TABLE_UNITS; u++)
+            if (!is_hot[u] && counts[u] > counts[best])
+                best = u;
+        if (best == 0 || counts[best] < HOT_SHARE * total)
+            break;
+        is_hot[best] = 1;
+        nhot++;
+    }
+
+    /* the runs of sizes between them, and their requests */
+    int run_lo[HOT_MAX + 1], run_hi[HOT_MAX + 1], run_classes[HOT_MAX + 1];
+    double run_count[HOT_MAX + 1];
+    int nruns = 0;
+    for (int u = MIN_BLOCK_UNITS; u < TABLE_UNITS; u++) {
+        if (is_hot[u])
+            continue;
+        if (nruns == 0 || run_hi[nruns - 1] != u - 1) {
+            run_lo[nruns] = u;
+            run_count[nruns] = 0;
+            run_classes[nruns] = 1;
+            nruns++;
+        }
+        run_hi[nruns - 1] = u;
+        run_count[nruns - 1] += counts[u];
+    }
+
+    /* hand out the classes left, one at a time, to the run with the
+     * most requests per class; a run can't have more than its sizes */
+    for (int left = nclasses - nhot - nruns; left > 0; left--) {
+        int best = -1;
+        for (int r = 0; r < nruns; r++) {
+            if (run_classes[r] > run_hi[r] - run_lo[r])
+                continue;
+            if (best < 0 || run_count[r] / run_classes[r] > run_count[best] / run_classes[best])
+                best = r;
+        }
+        if (best < 0)
+            break;
+        run_classes[best]++;
+    }
+
+    /* the smallest size of every class, in order; sizes below
+     * MIN_BLOCK_UNITS never occur and go to the first class */
+    int class_lo[64], num = 0;
+    double class_count[64] = { 0 };
+    for (int u = MIN_BLOCK_UNITS, r = 0; u < TABLE_UNITS; ) {
+        if (is_hot[u]) {
+            class_lo[num++] = u++;
+            continue;
+        }
+        /* split run r where its requests add up to equal parts */
+        double share = run_count[r] / run_classes[r], seen = 0;
+        int k = 0;
+        class_lo[num++] = u;
+        for (; u <= run_hi[r]; u++) {
+            if (u > class_lo[num - 1] && seen >= (k + 1) * share && k + 1 < run_classes[r] &&
+                run_hi[r] - u >= run_classes[r] - k - 2) {
+                class_lo[num++] = u;
+                k++;
+            }
+            seen += counts[u];
+        }
+        r++;
+    }
+
+    int unit_class[TABLE_UNITS];
+    int tcache_classes = 0;
+    double busiest = 0;
+    for (int u = 0, k = 0; u < TABLE_UNITS; u++) {
+        while (k + 1 < num && class_lo[k + 1] <= u)
+            k++;
+        unit_class[u] = k;
+        class_count[k] += counts[u];
+    }
+    for (int k = 0; k < num; k++) {
+        int hi = k + 1 < num ? class_lo[k + 1] - 1 : TABLE_UNITS - 1;
+        if (hi <= TCACHE_LIMIT_UNITS)
+            tcache_classes = k + 1;
+        if (class_count[k] > busiest)
+            busiest = class_count[k];
+    }
+
+    printf("/* Generated by mkclasses from %d trace%s, %.0f requests; do not edit. */\n",
+           argc - optind, argc - optind == 1 ? "" : "s", total);
+    printf("#define PGO_TABLE_SHIFT %d\n", PGO_TABLE_SHIFT);
+    printf("#define PGO_TABLE_CLASSES %d\n", num);
+    printf("#define PGO_TCACHE_CLASSES %d\n", tcache_classes);
+
+    uint64_t exact = 0;
+    for (int k = 0; k < num; k++)
+        if ((k + 1 < num ? class_lo[k + 1] : TABLE_UNITS) - class_lo[k] == 1)
+            exact |= 1ULL << k;
+    printf("#define PGO_EXACT_CLASSES 0x%016llxULL /* bit k: class k holds one size */\n\n",
+           (unsigned long long)exact);
+
+    printf("/* the class of a block of u units, for u < 1 << PGO_TABLE_SHIFT */\n");
+    printf("static const unsigned char pgo_unit_class[1 << PGO_TABLE_SHIFT] = {");
+    for (int u = 0; u < TABLE_UNITS; u++)
+        printf("%s%2d,", u % 16 ? " " : "\n    ", unit_class[u]);
+    printf("\n};\n\n");
+
+    printf("/* the largest block of each class, in units */\n");
+    printf("static const unsigned short pgo_class_max_units[PGO_TABLE_CLASSES] __attribute__((unused)) = {");
+    for (int k = 0; k < num; k++)
+        printf("%s%3d,", k % 12 ? " " : "\n    ", k + 1 < num ? class_lo[k + 1] - 1 : TABLE_UNITS - 1);
+    printf("\n};\n\n");
+
+    printf("/* blocks a thread-cache miss takes at once, by class */\n");
+    printf("static const unsigned char pgo_refill_batch[PGO_TABLE_CLASSES] __attribute__((unused)) = {");
+    for (int k = 0; k < num; k++) {
+        int batch = busiest > 0 ? (int)(BATCH_MAX * class_count[k] / busiest + .5) : BATCH_MIN;
+        if (batch < BATCH_MIN)
+            batch = BATCH_MIN;
+        printf("%s%2d,", k % 12 ? " " : "\n    ", batch);
+    }
+    printf("\n};\n");
+    return 0;
+}
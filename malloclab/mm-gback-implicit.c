@@ -287,8 +287,9 @@ void *mm_realloc(void *ptr, size_t size)
 /* 
  * checkheap - We don't check anything right now. 
  */
-void mm_checkheap(int verbose)
+int mm_checkheap(int verbose)
 { 
+    return 0;
 }
 
 /* 
@@ -1,36 +1,70 @@
 /*
 Header for P3 - malloc
 Jackson Small(jackson02@vt.edu) and Kyle Peterson(kyle913@vt.edu)
-Our implementation is a segregated free list with a max block size of 4096 and a minimum block size of 8.
+Our implementation is a segregated free list with a minimum block size of 8 words.
 The free blocks are organized into seperate explicit free lists based on their size, this allows for more efficient searching than a typical
 explicit free list design.
 
 The block structure is as follows:
-    - Each block consists of a header, payload, and footer
+    - Each block consists of a header and payload; free blocks also carry a footer
     - The header and footer are boundary tags that contain the size of the block and whether the block is in use
+    - Allocated blocks drop the footer; instead every header has a prev-inuse bit saying whether the block
+      before it is allocated, so coalescing only reads a footer when that block is known to be free
     - free blocks are organized into segregated  free lists based on their size
 
 The free list structure is as follows:
-    - There are multiple free lists, each with a different size range
-    - free blocks are added to the free list based on their size
+    - There are NUM_SIZE_CLASSES free lists kept in a flat array, each with a different size range
+    - small sizes get one exact class each, larger sizes are split into log-spaced classes
+      (SUBCLASSES classes per power of two), and the last class holds everything above that
+    - when built with -DPGO_CLASSES, the classes below 4 KiB come from size_classes.h instead, which
+      mkclasses fits to the request sizes of a set of traces: the sizes asked for most get an exact
+      class each, and the rest are split where the requests fall
+    - a bitmap records which lists are non-empty, so the first usable class is found with one bit scan
+    - the lists belong to an arena; a THREAD_SAFE build may have NUM_ARENAS of them, each growing
+      its own chunks of the heap, and the arena that owns a block is recorded in its boundary tags
+    - requests of MMAP_THRESHOLD bytes or more get a page-aligned region of their own from mem_map();
+      such blocks are marked mapped and go straight back with mem_unmap() when freed.  The word in front
+      of a mapped block's header says how far into its region the header is, which mm_memalign() makes
+      as far as the alignment takes
+    - when built with -DDEFER_COALESCE, freed blocks of the exact classes are parked in per-class quick
+      bins without coalescing, and are only merged into the lists when a fit fails or too many pile up
+    - when built with -DUSE_RBTREE, classes from TREE_MIN_CLASS up are kept in one red-black tree
+      ordered by size and then address instead, so large requests get a true best fit in O(log n)
+    - when built with -DHEAP_PROFILE, the fit searches count the free blocks they look at, and
+      mm_heap_profile() walks the heap for its free bytes per class and its largest free block
+    - when built with -DUSE_SLABS, requests of up to SLAB_MAX bytes come from slabs instead: SLAB_SIZE
+      pages, aligned to their size and allocated from the heap like any block, that each hold objects
+      of one size class without headers.  A bitmap in the slab's header says which slots are in use;
+      the first free one is found with a bit scan.  mm_free() finds the slab of a pointer by masking
+      its address, once a bitmap of heap pages has said the pointer is in a slab at all.  A slab
+      that becomes empty goes back to the heap, unless it is the last one of its class with room
+    - free blocks are added to the front of the free list for their size class
     - free blocks are removed from the free list when they are allocated
-    - free blocks are added to the free list when they are freed
-    - the free lists are organized in decreasing order of size, with largest block sizes at the front of the list
 
 Allocation:
     - When a block is allocated, the free list is searched for a block that is large enough to hold the requested size
     - If a block is found, it is removed from the free list and allocated
     - If a block is not found, the heap is extended and the new block is allocated
+    - mm_memalign() looks for a block with room for the padding too, and frees the padding in front of the
+      aligned payload as a block of its own
+    - mm_calloc() only clears what may not be zero: mapped blocks come zeroed, and of a block carved from
+      heap that memlib had never handed out before, only the words the heap code wrote itself are cleared
 
 Freeing:
     - When a block is freed, it is marked as free and added to the free list
     - If the previous or next block is free, the blocks are coalesced into a single block
     - The new block is then added to the appropriate free list
+    - A free block of more than the arena's trim threshold at the top of the heap is cut back to TRIM_PAD
+      words with a negative mem_sbrk().  The threshold starts at TRIM_THRESHOLD and doubles whenever the
+      heap has to grow again after a trim, so a program that keeps cycling through a burst stops trimming
 
 Reallocation:
-    - The realloc() function attempts to resize an existing allocated block.
-    - It first checks if the block can be extended by coalescing with adjacent free blocks.
-    - If extension is not possible, a new block is allocated, and the data is copied from the old block to the new one.
+    - The realloc() function attempts to resize an existing allocated block without copying.
+    - A shrinking block keeps its payload in place and gives back its tail.
+    - A growing block absorbs a free right neighbour, or moves the break if it is the last block in the heap.
+    - Failing that, the payload is slid down into a free left neighbour with memmove.
+    - Only then is a new block allocated and the data copied over.
+    - Grown blocks keep about a quarter of slack, so repeated growth is amortized.
 */
 #include <stdio.h>
 #include <string.h>
@@ -44,18 +78,16 @@ Reallocation:
 #include "memlib.h"
 #include "config.h"
 
+#include "blocktag.h"
 #include "list.h"
-
-struct boundary_tag
-{
-    size_t inuse : 1; // inuse bit
-    size_t size : 63; // size of block, in words
-                      // block size
-};
+#ifdef USE_RBTREE
+#include "tree.h"
+#endif
 
 /* FENCE is used for heap prologue/epilogue. */
 const struct boundary_tag FENCE = {
     .inuse = -1,
+    .prev_inuse = -1,
     .size = 0};
 
 /* A C struct describing the beginning of each block.
@@ -69,27 +101,78 @@ struct block
 {
     struct boundary_tag header; /* offset 0, at address 12 mod 16 */
     char payload[0];            /* offset 4, at address 0 mod 16 */
-    struct list_elem elem;      /* this is the list elem we use to add the block to the free list*/
-};
-
-struct free_block_list
-{
-    struct list free_block_list; // list of free blocks
-    struct list_elem elem;       // list elem to add to free list
-    size_t list_size;            // size of the list
+    union
+    {
+        struct list_elem elem; /* this is the list elem we use to add the block to the free list*/
+#ifdef USE_RBTREE
+        RB_ENTRY(block) node; /* links large free blocks into large_blocks */
+#endif
+    };
 };
 
-/* Basic constants and macros */
-#define WSIZE sizeof(struct boundary_tag) /* Word and header/footer size (bytes) */
-#define MIN_BLOCK_SIZE_WORDS 8            /* Minimum block size in words */
+/* Basic constants and macros; WSIZE and the minimum block size are in blocktag.h */
 #define CHUNKSIZE (1 << 10)               /* Extend heap by this amount (words) */
-#define MAX_BLOCK 4096                    /* Maximum block size*/
+#define MMAP_THRESHOLD (128 * 1024)       /* blocks this big (bytes) get their own region */
+#define TRIM_THRESHOLD (1 << 15)          /* initially, give back a free heap top above this (words) */
+#define TRIM_PAD (1 << 13)                /* ... keeping this much of it (words) */
+
+#ifndef NUM_ARENAS
+#define NUM_ARENAS 1 /* independent heaps; more than one needs THREAD_SAFE */
+#endif
+#if NUM_ARENAS > (1 << ARENA_BITS)
+#error "NUM_ARENAS does not fit in the arena field of struct boundary_tag"
+#endif
+
+/* Size classes are computed in units of ALIGNMENT bytes (UNIT_WORDS words each) */
+#define SUBCLASS_BITS 2                                      /* log2 of classes per power of two */
+#define SUBCLASSES (1 << SUBCLASS_BITS)
+#define EXACT_LIMIT_SHIFT 4                                  /* exact classes below 1 << 4 units */
+#define NUM_EXACT_CLASSES ((1 << EXACT_LIMIT_SHIFT) - MIN_BLOCK_UNITS)
+#define NUM_SIZE_CLASSES 64                                  /* one bit each in free_lists_nonempty */
+#ifdef PGO_CLASSES
+#include "size_classes.h" /* made by mkclasses */
+#define SMALL_CLASS_SHIFT PGO_TABLE_SHIFT /* table lookup below 1 << PGO_TABLE_SHIFT units */
+#define NUM_SMALL_CLASSES PGO_TABLE_CLASSES
+#define class_exact(c) ((c) < NUM_SMALL_CLASSES && (PGO_EXACT_CLASSES >> (c) & 1))
+#else
+#define SMALL_CLASS_SHIFT EXACT_LIMIT_SHIFT
+#define NUM_SMALL_CLASSES NUM_EXACT_CLASSES
+#define class_exact(c) ((c) < NUM_EXACT_CLASSES) /* holds blocks of one size only */
+#endif
+#ifdef DEFER_COALESCE
+#define QUICK_LIMIT 4096 /* consolidate once this many blocks sit in quick bins */
+#endif
+#ifdef USE_SLABS
+#ifdef THREAD_SAFE
+#error "slab objects have no headers, which the thread caches and remote frees need"
+#endif
+#define SLAB_SIZE 4096                        /* bytes; slabs are aligned to their size */
+#define SLAB_MAX 64                           /* requests up to this many bytes go to slabs */
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)   /* object sizes ALIGNMENT, 2 * ALIGNMENT, ... */
+#define SLAB_BITMAP_WORDS 4                   /* room for the smallest objects */
+#define SLAB_PAGES (MAX_HEAP / SLAB_SIZE + 1) /* heap pages that may hold a slab */
+#endif
+#ifdef USE_RBTREE
+#define TREE_MIN_SHIFT 8 /* blocks of 1 << 8 units (4 KiB) and up go into the tree */
+#define TREE_MIN_CLASS (NUM_SMALL_CLASSES + ((TREE_MIN_SHIFT - SMALL_CLASS_SHIFT) << SUBCLASS_BITS))
+#endif
+
+#ifdef HEAP_PROFILE
+#define COUNT_PROBES(n) (arena->fit_probes += (n))
+#else
+#define COUNT_PROBES(n) ((void)0)
+#endif
 
 static inline size_t max(size_t x, size_t y)
 {
     return x > y ? x : y;
 }
 
+static inline size_t min(size_t x, size_t y)
+{
+    return x < y ? x : y;
+}
+
 static size_t align(size_t size)
 {
     return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
@@ -101,10 +184,90 @@ static bool is_aligned(size_t size)
     return size % ALIGNMENT == 0;
 }
 
+#ifdef USE_RBTREE
+RB_HEAD(large_tree, block);
+#endif
+
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#define ARENA_LOCAL __thread
+#else
+#define ARENA_LOCAL
+#endif
+
+/* An arena is a set of free lists together with the heap chunks its
+ * blocks are carved from.  Chunks are contiguous runs of the memlib
+ * heap bounded by a prologue and an epilogue fence.  An arena grows
+ * its last chunk in place while nobody else has moved the break since,
+ * and opens a new chunk otherwise. */
+struct arena
+{
+    struct list free_lists[NUM_SIZE_CLASSES]; /* segregated free lists, one per size class */
+    uint64_t free_lists_nonempty;            /* bit i is set iff free_lists[i] is not empty */
+#ifdef USE_RBTREE
+    struct large_tree large_blocks; /* free blocks in classes >= TREE_MIN_CLASS */
+#endif
+    struct boundary_tag *epilogue; /* epilogue of the last chunk, NULL if none yet */
+    size_t trim_threshold;         /* free heap top (words) above which trim_heap gives it back */
+    size_t trimmed;                /* words given back since the heap last grew */
+#ifdef DEFER_COALESCE
+    struct block *quick_bins[NUM_SMALL_CLASSES]; /* freed blocks still marked in use */
+    size_t quick_count;                          /* blocks in all quick bins */
+#endif
+#ifdef USE_SLABS
+    struct list slabs[SLAB_CLASSES]; /* slabs with free slots, per object size */
+#endif
+#ifdef HEAP_PROFILE
+    unsigned long fit_calls;  /* find_fit() calls since mm_init() */
+    unsigned long fit_probes; /* free blocks they looked at */
+#endif
+#ifdef THREAD_SAFE
+    pthread_mutex_t lock;  /* protects everything above */
+    void *remote_frees;    /* blocks freed by other threads, see mm_ts.c */
+#endif
+};
+
 /* Global variables */
 static struct block *heap_listp = 0; /* Pointer to first block */
 int count = 0;
-static struct list free_blocks;
+static struct arena arenas[NUM_ARENAS];
+/* The arena the heap routines below work on.  In a THREAD_SAFE build each
+ * thread sets its own and holds that arena's lock while it is in use. */
+static ARENA_LOCAL struct arena *arena = &arenas[0];
+#ifdef HEAP_PROFILE
+static size_t mapped_bytes; /* in mem_map() regions, under the sbrk lock */
+#endif
+
+#ifdef USE_SLABS
+/* The header at the start of a slab; its objects follow */
+struct slab
+{
+    struct list_elem elem;              /* in its arena's slabs list while it has room */
+    unsigned short class;               /* objects are (class + 1) * ALIGNMENT bytes */
+    unsigned short used;                /* slots in use */
+    unsigned short slots;               /* slots in this slab */
+    uint64_t bitmap[SLAB_BITMAP_WORDS]; /* bit i is set iff slot i is in use (or past the end) */
+};
+#define SLAB_HEADER ((sizeof(struct slab) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+static uint64_t slab_pages[(SLAB_PAGES + 63) / 64]; /* bit i is set iff heap page i is a slab */
+#endif
+
+#ifdef USE_RBTREE
+/* Orders large free blocks by size; ties are broken by address so that
+ * no two blocks compare equal and best fit prefers the lowest block. */
+static int compare_size(struct block *a, struct block *b)
+{
+    if (a->header.size < b->header.size)
+        return -1;
+    else if (a->header.size > b->header.size)
+        return 1;
+    else
+        return a < b ? -1 : a > b;
+}
+
+RB_GENERATE_STATIC(large_tree, block, node, compare_size);
+#endif
 
 /* Function prototypes for internal helper routines */
 static struct block *extend_heap(size_t words);
@@ -113,6 +276,26 @@ static struct block *find_fit(size_t asize);
 static struct block *coalesce(struct block *bp);
 /* our internal helper functions*/
 static void add_free_block(struct block *bp);
+static void remove_free_block(struct block *bp);
+static void trim_block(struct block *bp, size_t keep);
+static void trim_heap(struct block *bp);
+static struct block *map_block(size_t words, size_t alignment);
+static void unmap_block(struct block *bp);
+static void *realloc_mapped(void *ptr, size_t awords, size_t keep);
+#ifdef DEFER_COALESCE
+static bool quick_free(struct block *bp);
+static struct block *quick_alloc(size_t asize);
+static void consolidate(void);
+#endif
+static int size_class(size_t words);
+static int check_failed(void *where, const char *problem);
+#ifdef USE_SLABS
+static bool is_slab_object(void *ptr);
+static size_t slab_object_size(void *ptr);
+static void *slab_alloc(size_t size);
+static void slab_free(void *ptr);
+static int check_slab(struct slab *s, struct arena *a);
+#endif
 
 /* Given a block, obtain previous's block footer.
    Works for left-most block also. */
@@ -134,7 +317,8 @@ static size_t blk_size(struct block *blk)
 }
 
 /* Given a block, obtain pointer to previous block.
-   Not meaningful for left-most block. */
+   Only meaningful if the previous block is free, since
+   allocated blocks have no footer. */
 static struct block *prev_blk(struct block *blk)
 {
     struct boundary_tag *prevfooter = prev_blk_footer(blk);
@@ -156,26 +340,56 @@ static struct boundary_tag *get_footer(struct block *blk)
     return ((void *)blk + WSIZE * blk->header.size) - sizeof(struct boundary_tag);
 }
 
-/* Set a block's size and inuse bit in header and footer */
-static void set_header_and_footer(struct block *blk, int size, int inuse)
+/* Set a block's size and inuse bit in its header, keeping its prev-inuse bit */
+static void set_header(struct block *blk, size_t size, int inuse)
 {
     blk->header.inuse = inuse;
+    blk->header.mapped = 0;
+    blk->header.arena = arena - arenas;
     blk->header.size = size;
-    *get_footer(blk) = blk->header; /* Copy header to footer */
 }
 
-/* Mark a block as used and set its size. */
-static void mark_block_used(struct block *blk, int size)
+/* Mark a block as used and set its size.
+   Used blocks have no footer; the next block's prev-inuse bit replaces it. */
+static void mark_block_used(struct block *blk, size_t size)
 {
-    set_header_and_footer(blk, size, 1);
+    set_header(blk, size, 1);
+    next_blk(blk)->header.prev_inuse = 1;
 }
 
 /* Mark a block as free and set its size. */
-static void mark_block_free(struct block *blk, int size)
+static void mark_block_free(struct block *blk, size_t size)
+{
+    set_header(blk, size, 0);
+    *get_footer(blk) = blk->header; /* Copy header to footer */
+    next_blk(blk)->header.prev_inuse = 0;
+}
+
+/* Extra words a growing realloc block may keep beyond what it needs */
+static size_t realloc_slack(size_t words)
 {
-    set_header_and_footer(blk, size, 0);
+    return (words / 4) & ~(size_t)(UNIT_WORDS - 1);
+}
+
+/* Block size in words needed for a request of size bytes,
+   or 0 if there is none (size 0 or overflow). */
+static size_t request_words(size_t size)
+{
+    if (size == 0)
+        return 0;
+
+    /* Adjust block size to include overhead and alignment reqs. */
+    size_t bsize = align(size + sizeof(struct boundary_tag)); /* account for the header */
+    if (bsize < size)
+        return 0; /* integer overflow */
+
+    return max(MIN_BLOCK_SIZE_WORDS, bsize / WSIZE); /* respect minimum size */
 }
 
+/* With -DTHREAD_SAFE, wrap the entry points below in a lock and
+   per-thread caches. */
+#include "mm_ts.c"
+
 /*
  * mm_init - Initialize the memory manager
  */
@@ -184,35 +398,42 @@ int mm_init(void)
     assert(offsetof(struct block, payload) == 4);
     assert(sizeof(struct boundary_tag) == 4);
 
-    // init all free lists
-    list_init(&free_blocks);
-    // start with biggest works to smallest
-    for (int i = MAX_BLOCK; i >= MIN_BLOCK_SIZE_WORDS; i /= 2)
+    // init all free lists of every arena; their heaps start out empty
+    for (struct arena *a = arenas; a < arenas + NUM_ARENAS; a++)
     {
-        struct free_block_list *b = mem_sbrk(sizeof(struct free_block_list));
-        list_init(&b->free_block_list);
-        b->list_size = i;
-        list_push_back(&free_blocks, &b->elem);
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+            list_init(&a->free_lists[i]);
+        a->free_lists_nonempty = 0;
+#ifdef USE_RBTREE
+        RB_INIT(&a->large_blocks);
+#endif
+        a->epilogue = NULL;
+        a->trim_threshold = TRIM_THRESHOLD;
+        a->trimmed = 0;
+#ifdef DEFER_COALESCE
+        memset(a->quick_bins, 0, sizeof a->quick_bins);
+        a->quick_count = 0;
+#endif
+#ifdef HEAP_PROFILE
+        a->fit_calls = a->fit_probes = 0;
+#endif
+#ifdef THREAD_SAFE
+        a->remote_frees = NULL;
+#endif
+#ifdef USE_SLABS
+        for (int i = 0; i < SLAB_CLASSES; i++)
+            list_init(&a->slabs[i]);
+#endif
     }
-
-    /* Create the initial empty heap */
-    struct boundary_tag *initial = mem_sbrk(2 * sizeof(struct boundary_tag));
-    if (initial == NULL)
-        return -1;
-
-    /* We use a slightly different strategy than suggested in the book.
-     * Rather than placing a min-sized prologue block at the beginning
-     * of the heap, we simply place two fences.
-     * The consequence is that coalesce() must call prev_blk_footer()
-     * and not prev_blk() because prev_blk() cannot be called on the
-     * left-most block.
-     */
-    initial[0] = FENCE; /* Prologue footer */
-    heap_listp = (struct block *)&initial[1];
-    initial[0] = FENCE; /* Epilogue header */
-
-    /* Extend the empty heap with a free block of CHUNKSIZE bytes */
-    if (extend_heap(CHUNKSIZE) == NULL)
+#ifdef HEAP_PROFILE
+    mapped_bytes = 0;
+#endif
+#ifdef USE_SLABS
+    memset(slab_pages, 0, sizeof slab_pages);
+#endif
+
+    /* Extend the empty heap with a free block of CHUNKSIZE words */
+    if ((heap_listp = extend_heap(CHUNKSIZE)) == NULL)
         return -1;
     return 0;
 }
@@ -225,9 +446,10 @@ void *mm_malloc(size_t size)
     // declare block pointer
     struct block *bp;
 
-    /* Ignore spurious requests */
-    if (size == 0)
-        return NULL;
+    /* Adjusted block size in words */
+    size_t awords = request_words(size);
+    if (awords == 0)
+        return NULL; /* Ignore spurious or impossible requests */
 
     // if heap hasn't been initialized
     if (heap_listp == 0)
@@ -235,17 +457,36 @@ void *mm_malloc(size_t size)
         mm_init();
     }
 
-    /* Adjust block size to include overhead and alignment reqs. */
-    size_t bsize = align(size + 2 * sizeof(struct boundary_tag)); /* account for tags */
-    if (bsize < size)
-        return NULL; /* integer overflow */
+#ifdef USE_SLABS
+    if (size <= SLAB_MAX)
+        return slab_alloc(size);
+#endif
 
-    /* Adjusted block size in words */
-    size_t awords = max(MIN_BLOCK_SIZE_WORDS, bsize / WSIZE); /* respect minimum size */
+    /* large requests get a region of their own */
+    if (awords * WSIZE >= MMAP_THRESHOLD)
+    {
+        bp = map_block(awords, ALIGNMENT);
+        return bp != NULL ? bp->payload : NULL;
+    }
+
+#ifdef DEFER_COALESCE
+    /* a block of exactly this size may be waiting in a quick bin */
+    if ((bp = quick_alloc(awords)) != NULL)
+        return bp->payload;
+#endif
 
     /* case 1 - there is a block in the free list we can use*/
     /* Search the free list for a fit */
-    if ((bp = find_fit(awords)) != NULL)
+    bp = find_fit(awords);
+#ifdef DEFER_COALESCE
+    /* merge the quick bins back before growing the heap */
+    if (bp == NULL && arena->quick_count > 0)
+    {
+        consolidate();
+        bp = find_fit(awords);
+    }
+#endif
+    if (bp != NULL)
     {
         place(bp, awords);
         return bp->payload;
@@ -270,12 +511,28 @@ void mm_free(void *bp)
     assert(heap_listp != 0);
     if (bp == 0)
         return;
+#ifdef USE_SLABS
+    if (is_slab_object(bp))
+    {
+        slab_free(bp);
+        return;
+    }
+#endif
 
     /* Find block from user pointer */
     struct block *blk = bp - offsetof(struct block, payload);
 
+    if (blk->header.mapped)
+    {
+        unmap_block(blk);
+        return;
+    }
+#ifdef DEFER_COALESCE
+    if (quick_free(blk))
+        return;
+#endif
     mark_block_free(blk, blk_size(blk)); // set the current block to free
-    coalesce(blk);                       // coalesce the block if possible
+    trim_heap(coalesce(blk));            // coalesce, and shrink the heap if it ends free
 }
 
 /*
@@ -283,7 +540,7 @@ void mm_free(void *bp)
  */
 static struct block *coalesce(struct block *bp)
 {
-    bool prev_alloc = prev_blk_footer(bp)->inuse; /* is previous block allocated? */
+    bool prev_alloc = bp->header.prev_inuse;   /* is previous block allocated? */
     bool next_alloc = !blk_free(next_blk(bp));    /* is next block allocated? */
     size_t size = blk_size(bp);
 
@@ -299,7 +556,7 @@ static struct block *coalesce(struct block *bp)
         //  combine this block and next block by extending it
         struct block *next = next_blk(bp);
         // remove next block from free list
-        list_remove(&next->elem);
+        remove_free_block(next);
         // combine and then the new block is added to free list
         mark_block_free(bp, size + blk_size(next)); // or next_blk(bp)
         add_free_block(bp);
@@ -311,7 +568,7 @@ static struct block *coalesce(struct block *bp)
         // combine previous and this block by extending previous
         struct block *prev = prev_blk(bp);
         // remove previous block from free list
-        list_remove(&prev->elem);
+        remove_free_block(prev);
         // combine and then the new block is added to free list
         mark_block_free(prev, size + blk_size(prev));
         add_free_block(prev);
@@ -324,8 +581,8 @@ static struct block *coalesce(struct block *bp)
         struct block *prev = prev_blk(bp);
         struct block *next = next_blk(bp);
         // remove both blocks from free list
-        list_remove(&prev->elem);
-        list_remove(&next->elem);
+        remove_free_block(prev);
+        remove_free_block(next);
         // combine and then the new block is added to free list
         mark_block_free(prev, size + blk_size(prev) + blk_size(next));
         add_free_block(prev);
@@ -335,7 +592,7 @@ static struct block *coalesce(struct block *bp)
 }
 
 /*
- * mm_realloc - Naive implementation of realloc
+ * mm_realloc - Resize a block, in place whenever the heap allows it
  */
 void *mm_realloc(void *ptr, size_t size)
 {
@@ -352,77 +609,531 @@ void *mm_realloc(void *ptr, size_t size)
         return mm_malloc(size);
     }
 
-    void *newptr;
-    size_t bytesize;
+    size_t awords = request_words(size);
+    if (awords == 0)
+        return NULL; /* integer overflow */
+
+#ifdef USE_SLABS
+    if (is_slab_object(ptr))
+    {
+        size_t objsize = slab_object_size(ptr);
+        if (size <= objsize)
+            return ptr;
+        void *newptr = mm_malloc(size);
+        if (newptr == NULL)
+            return NULL;
+        memcpy(newptr, ptr, objsize);
+        slab_free(ptr);
+        return newptr;
+    }
+#endif
 
-    // Find pointer to old block and then essentially coalesce
     struct block *oldblk = ptr - offsetof(struct block, payload);
-    bool prev_alloc = prev_blk_footer(oldblk)->inuse;
-    bool next_alloc = !blk_free(next_blk(oldblk));
+    size_t oldsize = blk_size(oldblk);
+    size_t keep = awords + realloc_slack(awords); /* what a grown block may hold on to */
+
+    if (oldblk->header.mapped)
+        return realloc_mapped(ptr, awords, keep);
+
+    // shrinking, or growing into slack left by an earlier realloc
+    if (awords <= oldsize)
+    {
+        trim_block(oldblk, keep);
+        return ptr;
+    }
 
-    // right block
-    if (!next_alloc)
+    // right block: grow in place if it is free and big enough
+    struct block *next = next_blk(oldblk);
+    bool next_free = blk_free(next);
+    size_t avail = oldsize + (next_free ? blk_size(next) : 0);
+    if (next_free && avail >= awords)
     {
-        struct block *right;
-        right = next_blk(oldblk);
-        list_remove(&right->elem);
-        mark_block_used(oldblk, blk_size(oldblk) + blk_size(next_blk(oldblk)));
+        remove_free_block(next);
+        mark_block_used(oldblk, avail);
+        trim_block(oldblk, keep);
+        return ptr;
+    }
+
+    // at the end of the heap: move the break and grow into the new space,
+    // unless that takes as much new memory as a request that would get a
+    // region of its own
+    struct boundary_tag *end = next_free ? &next_blk(next)->header : &next->header;
+    if (end == arena->epilogue && (awords - avail) * WSIZE < MMAP_THRESHOLD)
+    {
+        struct block *ext = extend_heap(max(keep - avail, MIN_BLOCK_SIZE_WORDS)); /* swallows next if free */
+        if (ext != NULL && ext == next_blk(oldblk))
+        {
+            remove_free_block(ext);
+            mark_block_used(oldblk, oldsize + blk_size(ext));
+            trim_block(oldblk, keep);
+            return ptr;
+        }
+        // no more memory, or the heap grew elsewhere (another arena moved
+        // the break); ext stays on the free lists and we fall back to
+        // moving the block
     }
 
-    if (blk_size(oldblk) >= size)
-        return oldblk->payload;
+    size_t oldbytes = oldsize * WSIZE - sizeof(struct boundary_tag); /* old payload */
 
-    // left block
-    if (!prev_alloc)
+    // left block: slide the payload down, which is the one case that needs memmove
+    bool prev_free = !oldblk->header.prev_inuse;
+    if (prev_free && blk_size(prev_blk(oldblk)) + avail >= awords)
     {
-        struct block *left;
-        left = prev_blk(oldblk);
-        list_remove(&left->elem);
-        mark_block_used(left, blk_size(oldblk) + blk_size(left));
-        oldblk = left;
+        struct block *prev = prev_blk(oldblk);
+        remove_free_block(prev);
+        if (next_free)
+            remove_free_block(next);
+        mark_block_used(prev, blk_size(prev) + avail);
+        memmove(prev->payload, ptr, oldbytes);
+        trim_block(prev, keep);
+        return prev->payload;
     }
 
-    // new block is greater than og, we can return but have to copy mem
-    if (blk_size(oldblk) >= size)
+    // not able to grow in place, and big enough now for a region of its own
+    if (keep * WSIZE >= MMAP_THRESHOLD)
     {
-        bytesize = blk_size(oldblk) * WSIZE;
-        if (size < bytesize)
-            bytesize = size;
-        memcpy(oldblk->payload, ptr, bytesize);
-        return oldblk->payload;
+        struct block *newblk = map_block(keep, ALIGNMENT);
+        if (newblk == NULL)
+            return 0;
+        memcpy(newblk->payload, ptr, oldbytes);
+        mm_free(ptr);
+        return newblk->payload;
     }
 
-    // not able to coalesce
-    newptr = mm_malloc(size);
+    // not able to grow in place: move to a block with some slack.  If
+    // nothing fits, end the new block exactly at the epilogue, so that
+    // the next growth can just move the break
+    struct block *newblk = find_fit(keep);
+    if (newblk == NULL)
+    {
+        struct boundary_tag *epilogue = arena->epilogue;
+        size_t tail = epilogue->prev_inuse ? 0 : (epilogue - 1)->size; /* free last block */
+        newblk = extend_heap(max(keep - tail, MIN_BLOCK_SIZE_WORDS));
 
-    // malloc didn't work either so leave original block
-    if (!newptr)
-        return 0;
+        // another arena moved the break, so this started a new chunk
+        if (newblk != NULL && blk_size(newblk) < keep)
+            newblk = extend_heap(keep);
+
+        // no more memory, so leave original block
+        if (newblk == NULL)
+            return 0;
+    }
+    place(newblk, keep);
+
+    memcpy(newblk->payload, ptr, oldbytes);
+    mm_free(ptr);
 
-    // copy over the data
-    struct block *copyblk = ptr - offsetof(struct block, payload);
-    bytesize = blk_size(copyblk) * WSIZE; // find number of BYTES, not words
-    if (size < bytesize)
-        bytesize = size;
-    memcpy(newptr, ptr, bytesize);
+    return newblk->payload;
+}
+
+/*
+ * realloc_mapped - realloc for a block with a region of its own.  It stays
+ *                  put while the request fits and is still large enough
+ *                  to deserve a region; otherwise it moves.
+ */
+static void *realloc_mapped(void *ptr, size_t awords, size_t keep)
+{
+    struct block *oldblk = ptr - offsetof(struct block, payload);
+    size_t oldsize = blk_size(oldblk);
+    if (awords <= oldsize && awords * WSIZE >= MMAP_THRESHOLD / 2)
+        return ptr;
 
-    mm_free(oldblk->payload);
+    size_t want = awords <= oldsize ? awords : keep; /* slack only when growing */
+    void *newptr = mm_malloc(want * WSIZE - sizeof(struct boundary_tag));
+    if (newptr == NULL)
+        return NULL;
 
+    memcpy(newptr, ptr, (min(oldsize, want)) * WSIZE - sizeof(struct boundary_tag));
+    unmap_block(oldblk);
     return newptr;
 }
 
 /*
- * checkheap - We don't check anything right now.
+ * mm_memalign - Allocate a block whose payload is aligned to alignment,
+ *               a power of two.  A block with room for the padding is
+ *               found as usual; the padding in front of the aligned
+ *               payload is split off as a free block of its own, and
+ *               place() gives back the tail.  Requests of MMAP_THRESHOLD
+ *               bytes or more get a region of their own, with the header
+ *               as far into it as the alignment takes.
+ */
+void *mm_memalign(size_t alignment, size_t size)
+{
+    if (alignment <= ALIGNMENT)
+        return mm_malloc(size);
+
+    size_t awords = request_words(size);
+    if (awords == 0 || (alignment & (alignment - 1)) != 0)
+        return NULL;
+
+    if (heap_listp == 0)
+    {
+        mm_init();
+    }
+
+    if (awords * WSIZE >= MMAP_THRESHOLD)
+    {
+        struct block *bp = map_block(awords, alignment);
+        return bp != NULL ? bp->payload : NULL;
+    }
+
+    /* enough for the request plus padding of at least a minimum block */
+    size_t want = awords + (alignment + MIN_BLOCK_SIZE_WORDS * WSIZE) / WSIZE;
+    struct block *bp = find_fit(want);
+    if (bp == NULL && (bp = extend_heap(max(want, CHUNKSIZE))) == NULL)
+        return NULL;
+
+    uintptr_t payload = (uintptr_t)bp->payload;
+    if (payload % alignment != 0)
+    {
+        uintptr_t aligned = (payload + MIN_BLOCK_SIZE_WORDS * WSIZE + alignment - 1) & ~(alignment - 1);
+        size_t lead = (aligned - payload) / WSIZE;
+        size_t csize = blk_size(bp);
+        struct block *abp = (void *)bp + lead * WSIZE;
+
+        remove_free_block(bp);
+        mark_block_free(abp, csize - lead);
+        mark_block_free(bp, lead); /* also clears abp's prev-inuse bit */
+        add_free_block(bp);
+        add_free_block(abp);
+        bp = abp;
+    }
+    place(bp, awords);
+    return bp->payload;
+}
+
+/*
+ * mm_aligned_alloc - C11 aligned_alloc(): mm_memalign(), but only for an
+ *                    alignment that is a power of two
+ */
+void *mm_aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+        return NULL;
+    return mm_memalign(alignment, size);
+}
+
+/*
+ * mm_calloc - Allocate a zeroed array of nmemb objects of size bytes,
+ *             or return NULL if its size does not fit in a size_t.
+ *             Mapped blocks come zeroed from mem_map().  So does the
+ *             heap above mem_heap_fresh() as it was before the call:
+ *             of a block that extend_heap() got from there, only the
+ *             part that was in the heap before, the free block's links
+ *             at the front of the payload and its footer are cleared.
+ */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes))
+        return NULL;
+
+    sbrk_lock();
+    char *fresh = mem_heap_fresh();
+    sbrk_unlock();
+
+    char *p = mm_malloc(bytes);
+    if (p == NULL)
+        return NULL;
+#ifdef USE_SLABS
+    if (is_slab_object(p))
+    {
+        memset(p, 0, bytes);
+        return p;
+    }
+#endif
+    struct block *blk = (void *)p - offsetof(struct block, payload);
+    if (blk->header.mapped)
+        return p;
+
+    char *end = p + mm_usable_size(p);
+    if (fresh >= end)
+    {
+        memset(p, 0, bytes);
+        return p;
+    }
+    char *lo = p + (sizeof(struct block) - offsetof(struct block, payload));
+    if (lo < fresh)
+        lo = fresh;
+    if (lo > end - WSIZE)
+        lo = end - WSIZE;
+    memset(p, 0, lo - p);
+    memset(end - WSIZE, 0, WSIZE);
+    return p;
+}
+
+/*
+ * mm_usable_size - Return the payload bytes of an allocated block, which
+ *                  may be more than were asked for
+ */
+size_t mm_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+        return 0;
+#ifdef USE_SLABS
+    if (is_slab_object(ptr))
+        return slab_object_size(ptr);
+#endif
+
+    struct block *blk = ptr - offsetof(struct block, payload);
+    return blk_size(blk) * WSIZE - sizeof(struct boundary_tag);
+}
+
+/*
+ * mm_checkheap - Check the heap for consistency, printing each problem
+ *                found, and return how many there were.  Walks every
+ *                chunk block by block, then every arena's free lists
+ *                (and quick bins), so it takes time linear in the number
+ *                of blocks.  Mapped blocks are not reachable and are not
+ *                checked.  With verbose set, every block is printed.
+ */
+int mm_checkheap(int verbose)
+{
+    int problems = 0;
+    size_t free_blocks[NUM_ARENAS] = {0};    /* free blocks found by the walk */
+    bool epilogue_seen[NUM_ARENAS] = {false};
+
+    /* The heap is a run of chunks: a prologue fence, blocks, an epilogue fence */
+    struct boundary_tag *tag = mem_heap_lo();
+    struct boundary_tag *end = mem_heap_hi() + 1;
+    while (tag < end)
+    {
+        if (tag->size != 0 || !tag->inuse)
+            return problems + check_failed(tag, "chunk does not start with a prologue fence");
+
+        struct block *bp = (struct block *)(tag + 1);
+        size_t owner = bp->header.arena;
+        bool prev_free = false;
+        for (; bp->header.size != 0; bp = next_blk(bp))
+        {
+            size_t size = blk_size(bp);
+            if (size < MIN_BLOCK_SIZE_WORDS || size % UNIT_WORDS != 0)
+                return problems + check_failed(bp, "bad block size");
+            if ((void *)get_footer(bp) >= (void *)end)
+                return problems + check_failed(bp, "block runs past the end of the heap");
+            if (verbose)
+                printf("%p: %s block of %zu words, arena %d\n", (void *)bp,
+                       blk_free(bp) ? "free" : "used", size, bp->header.arena);
+
+            if (!is_aligned((uintptr_t)bp->payload))
+                problems += check_failed(bp, "payload is not aligned");
+            if (bp->header.mapped)
+                problems += check_failed(bp, "heap block is marked mapped");
+            if (bp->header.arena != owner || owner >= NUM_ARENAS)
+                return problems + check_failed(bp, "block is not owned by its chunk's arena");
+            if (bp->header.prev_inuse != !prev_free)
+                problems += check_failed(bp, "prev-inuse bit disagrees with the previous block");
+            if (blk_free(bp))
+            {
+                struct boundary_tag *footer = get_footer(bp);
+                if (footer->size != size || footer->inuse)
+                    problems += check_failed(bp, "header and footer disagree");
+                if (prev_free)
+                    problems += check_failed(bp, "two free blocks in a row");
+                free_blocks[owner]++;
+            }
+#ifdef USE_SLABS
+            else if (is_slab_object(bp->payload))
+                problems += check_slab((struct slab *)bp->payload, &arenas[owner]);
+#endif
+            prev_free = blk_free(bp);
+        }
+
+        /* bp is at the chunk's epilogue */
+        if (!bp->header.inuse)
+            problems += check_failed(bp, "epilogue is not marked in use");
+        if (bp->header.prev_inuse != !prev_free)
+            problems += check_failed(bp, "prev-inuse bit of the epilogue disagrees with the last block");
+        if (owner < NUM_ARENAS && &bp->header == arenas[owner].epilogue)
+            epilogue_seen[owner] = true;
+        tag = &bp->header + 1;
+    }
+
+    for (struct arena *a = arenas; a < arenas + NUM_ARENAS; a++)
+    {
+        size_t index = a - arenas;
+        if (a->epilogue != NULL && !epilogue_seen[index])
+            problems += check_failed(a->epilogue, "arena's epilogue is not the end of one of its chunks");
+
+        /* every free block found above must be listed exactly once, in the right place */
+        size_t listed = 0;
+        for (int class = 0; class < NUM_SIZE_CLASSES; class++)
+        {
+            struct list *l = &a->free_lists[class];
+            if (list_empty(l) == ((a->free_lists_nonempty >> class) & 1))
+                problems += check_failed(l, "non-empty bit disagrees with its free list");
+            for (struct list_elem *e = list_begin(l); e != list_end(l); e = list_next(e))
+            {
+                struct block *bp = list_entry(e, struct block, elem);
+                if (++listed > free_blocks[index])
+                    return problems + check_failed(bp, "more blocks listed than there are free blocks");
+                if ((void *)bp < mem_heap_lo() || (void *)bp >= (void *)end)
+                    return problems + check_failed(bp, "listed block is outside the heap");
+                if (!blk_free(bp))
+                    problems += check_failed(bp, "listed block is not free");
+                if (bp->header.arena != index)
+                    problems += check_failed(bp, "block is listed in another arena");
+                if (size_class(blk_size(bp)) != class)
+                    problems += check_failed(bp, "block is in the wrong size class");
+#ifdef USE_RBTREE
+                if (class >= TREE_MIN_CLASS)
+                    problems += check_failed(bp, "block of a tree class is in a list");
+#endif
+            }
+        }
+#ifdef USE_RBTREE
+        struct block *bp;
+        RB_FOREACH(bp, large_tree, &a->large_blocks)
+        {
+            if (++listed > free_blocks[index])
+                return problems + check_failed(bp, "more blocks listed than there are free blocks");
+            if (!blk_free(bp))
+                problems += check_failed(bp, "block in the tree is not free");
+            if (bp->header.arena != index)
+                problems += check_failed(bp, "block is in another arena's tree");
+            if (size_class(blk_size(bp)) < TREE_MIN_CLASS)
+                problems += check_failed(bp, "block in the tree is too small for it");
+        }
+#endif
+        if (listed != free_blocks[index])
+            problems += check_failed(a, "free blocks are missing from the free lists");
+
+#ifdef DEFER_COALESCE
+        /* quick-bin blocks are still marked in use */
+        size_t parked = 0;
+        for (int class = 0; class < NUM_SMALL_CLASSES; class++)
+        {
+            for (struct block *bp = a->quick_bins[class]; bp != NULL; bp = *(struct block **)bp->payload)
+            {
+                if (++parked > a->quick_count)
+                    return problems + check_failed(bp, "more blocks in quick bins than counted");
+                if ((void *)bp < mem_heap_lo() || (void *)bp >= (void *)end)
+                    return problems + check_failed(bp, "quick-bin block is outside the heap");
+                if (blk_free(bp))
+                    problems += check_failed(bp, "quick-bin block is marked free");
+                if (size_class(blk_size(bp)) != class)
+                    problems += check_failed(bp, "block is in the wrong quick bin");
+            }
+        }
+        if (parked != a->quick_count)
+            problems += check_failed(a, "quick_count disagrees with the quick bins");
+#endif
+#ifdef USE_SLABS
+        /* the slabs themselves were checked in the walk */
+        for (int class = 0; class < SLAB_CLASSES; class++)
+        {
+            struct list *l = &a->slabs[class];
+            for (struct list_elem *e = list_begin(l); e != list_end(l); e = list_next(e))
+            {
+                struct slab *s = list_entry(e, struct slab, elem);
+                if ((void *)s < mem_heap_lo() || (void *)s >= (void *)end || !is_slab_object(s))
+                    return problems + check_failed(s, "listed slab is not a slab in the heap");
+                if (s->class != class)
+                    problems += check_failed(s, "slab is listed under another class");
+                if (s->used == s->slots)
+                    problems += check_failed(s, "full slab is listed as having room");
+            }
+        }
+#endif
+    }
+    return problems;
+}
+
+#ifdef HEAP_PROFILE
+/*
+ * mm_heap_profile - Describe how the heap is fragmented.  Walks every
+ *                   chunk like mm_checkheap(), adding each free block
+ *                   to its size class.  Blocks parked in quick bins
+ *                   count as free; blocks in thread caches look used.
  */
-void mm_checkheap(int verbose)
+void mm_heap_profile(struct heap_profile *profile)
 {
-    // DECIDED TO NOT IMPLEMENT THIS
+    memset(profile, 0, sizeof(*profile));
+    profile->num_classes = NUM_SIZE_CLASSES;
+    for (size_t units = MIN_BLOCK_UNITS, class = 0; class < NUM_SIZE_CLASSES; units++)
+        if (size_class(units * UNIT_WORDS) == class)
+            profile->class_min[class++] = units * ALIGNMENT;
+
+    struct boundary_tag *tag = mem_heap_lo();
+    struct boundary_tag *end = mem_heap_hi() + 1;
+    while (tag < end)
+    {
+        struct block *bp = (struct block *)(tag + 1);
+        for (; bp->header.size != 0; bp = next_blk(bp))
+        {
+            size_t bytes = blk_size(bp) * WSIZE;
+            if (!blk_free(bp))
+            {
+                profile->used_bytes += bytes;
+                continue;
+            }
+            profile->free_bytes[size_class(blk_size(bp))] += bytes;
+            profile->free_total += bytes;
+            profile->largest_free = max(profile->largest_free, bytes);
+        }
+        tag = &bp->header + 1;
+    }
+
+    for (struct arena *a = arenas; a < arenas + NUM_ARENAS; a++)
+    {
+#ifdef DEFER_COALESCE
+        for (int class = 0; class < NUM_SMALL_CLASSES; class++)
+            for (struct block *bp = a->quick_bins[class]; bp != NULL; bp = *(struct block **)bp->payload)
+            {
+                size_t bytes = blk_size(bp) * WSIZE;
+                profile->used_bytes -= bytes;
+                profile->free_bytes[class] += bytes;
+                profile->free_total += bytes;
+                profile->largest_free = max(profile->largest_free, bytes);
+            }
+#endif
+        profile->fit_calls += a->fit_calls;
+        profile->fit_probes += a->fit_probes;
+    }
+
+    profile->used_bytes += mapped_bytes;
+    profile->heap_bytes = mem_footprint();
 }
+#endif
 
 /*
  * The remaining routines are internal helper routines
  */
 
+/*
+ * check_failed - Report a problem mm_checkheap found at where; returns 1
+ */
+static int check_failed(void *where, const char *problem)
+{
+    fprintf(stderr, "mm_checkheap: %p: %s\n", where, problem);
+    return 1;
+}
+
+/*
+ * size_class - map a block size in words to the index of its free list.
+ * Sizes below 1 << EXACT_LIMIT_SHIFT units have one class each (with
+ * -DPGO_CLASSES, sizes below 1 << PGO_TABLE_SHIFT units are looked up in
+ * pgo_unit_class instead); above that, each power of two is split into
+ * SUBCLASSES classes using the bits just below the leading one.  Sizes
+ * past the last class share it.
+ */
+static int size_class(size_t words)
+{
+    size_t units = words / UNIT_WORDS;
+#ifdef PGO_CLASSES
+    if (units < (1 << PGO_TABLE_SHIFT))
+        return pgo_unit_class[units];
+#else
+    if (units < (1 << EXACT_LIMIT_SHIFT))
+        return units - MIN_BLOCK_UNITS;
+#endif
+
+    int log2 = 63 - __builtin_clzl(units);
+    int sub = (units >> (log2 - SUBCLASS_BITS)) & (SUBCLASSES - 1);
+    int class = NUM_SMALL_CLASSES + ((log2 - SMALL_CLASS_SHIFT) << SUBCLASS_BITS) + sub;
+    return class < NUM_SIZE_CLASSES ? class : NUM_SIZE_CLASSES - 1;
+}
+
 /*
  * adds an free block into list
  */
@@ -430,24 +1141,37 @@ static void add_free_block(struct block *bp)
 {
     // make sure block is not null
     assert(bp != 0);
-    struct list_elem *e;
-    // if free blocks list is empty we add it to the list
-    if (list_empty(&free_blocks))
+    int class = size_class(blk_size(bp));
+#ifdef USE_RBTREE
+    if (class >= TREE_MIN_CLASS)
     {
-        list_push_back(&free_blocks, &bp->elem);
+        RB_INSERT(large_tree, &arena->large_blocks, bp);
         return;
     }
-    // iterate through free blocks list and place it appropriately
-    for (e = list_begin(&free_blocks); e != list_end(&free_blocks); e = list_next(e))
+#endif
+    list_push_front(&arena->free_lists[class], &bp->elem);
+    arena->free_lists_nonempty |= 1ULL << class;
+}
+
+/*
+ * removes a free block from its list; must be called before
+ * the block's size changes, since the size determines the list
+ */
+static void remove_free_block(struct block *bp)
+{
+    int class = size_class(blk_size(bp));
+#ifdef USE_RBTREE
+    if (class >= TREE_MIN_CLASS)
     {
-        struct free_block_list *b = list_entry(e, struct free_block_list, elem);
-        // if this block size >= min block size
-        if (b->list_size <= blk_size(bp))
-        {
-            list_push_back(&b->free_block_list, &bp->elem);
-            return;
-        }
+        RB_REMOVE(large_tree, &arena->large_blocks, bp);
+        return;
     }
+#endif
+    list_remove(&bp->elem);
+    /* same test as list_empty(), without the out-of-line calls */
+    struct list *l = &arena->free_lists[class];
+    if (l->head.next == &l->tail)
+        arena->free_lists_nonempty &= ~(1ULL << class);
 }
 
 /*
@@ -455,24 +1179,149 @@ static void add_free_block(struct block *bp)
  */
 static struct block *extend_heap(size_t words)
 {
-    /* Allocate an even number of words to maintain alignment */
-    void *bp = mem_sbrk(words * WSIZE);
+    struct block *blk;
 
-    /* don't allocate more space if it is not needed - bp is null*/
-    if (bp == NULL)
-        return NULL;
+    if (words > MAX_HEAP / WSIZE)
+        return NULL; /* more than the heap could ever hold */
+
+    /* growing back after a trim: take it all back at once, and be slower to trim next time */
+    if (arena->trimmed)
+    {
+        words = max(words, arena->trimmed);
+        arena->trim_threshold *= 2;
+        arena->trimmed = 0;
+    }
+
+    sbrk_lock();
+    if (arena->epilogue != NULL && (void *)(arena->epilogue + 1) == mem_heap_hi() + 1)
+    {
+        /* Allocate an even number of words to maintain alignment */
+        void *bp = mem_sbrk((intptr_t)(words * WSIZE));
 
-    /* Initialize free block header/footer and the epilogue header.
-     * Note that we overwrite the previous epilogue here. */
-    struct block *blk = bp - sizeof(FENCE);
+        /* don't allocate more space if it is not needed - bp is null*/
+        if (bp == NULL)
+        {
+            sbrk_unlock();
+            return NULL;
+        }
+
+        /* Note that we overwrite the previous epilogue here. */
+        blk = bp - sizeof(FENCE);
+    }
+    else
+    {
+        /* Start a new chunk.  We use a slightly different strategy than
+         * suggested in the book.  Rather than placing a min-sized
+         * prologue block at the beginning of the chunk, we simply place
+         * a fence, whose inuse bit the first block inherits as its
+         * prev-inuse bit, so coalesce() never calls prev_blk() on it.
+         */
+        struct boundary_tag *initial = mem_sbrk((intptr_t)((words + 2) * WSIZE));
+        if (initial == NULL)
+        {
+            sbrk_unlock();
+            return NULL;
+        }
+        initial[0] = FENCE; /* Prologue footer */
+        initial[1] = FENCE; /* becomes blk's header, with prev_inuse set */
+        blk = (struct block *)&initial[1];
+    }
+    sbrk_unlock();
+
+    /* Initialize free block header/footer and the epilogue header. */
     mark_block_free(blk, words); // make sure the new space is all marked free
 
-    next_blk(blk)->header = FENCE;
+    arena->epilogue = &next_blk(blk)->header;
+    *arena->epilogue = FENCE;
+    arena->epilogue->prev_inuse = 0; /* blk is free */
 
     /* Coalesce if the previous block was free */
     return coalesce(blk);
 }
 
+/*
+ * trim_heap - Shrink the heap if free block bp ends it and exceeds
+ *             the arena's trim threshold, leaving TRIM_PAD words free
+ */
+static void trim_heap(struct block *bp)
+{
+    size_t size = blk_size(bp);
+    if (size <= arena->trim_threshold || &next_blk(bp)->header != arena->epilogue)
+        return;
+
+    sbrk_lock();
+    /* only the chunk at the break can shrink */
+    if ((void *)(arena->epilogue + 1) == mem_heap_hi() + 1)
+    {
+        size_t release = (size - TRIM_PAD) & ~(UNIT_WORDS - 1);
+        remove_free_block(bp);
+        mem_sbrk(-(intptr_t)(release * WSIZE));
+        mark_block_free(bp, size - release);
+        add_free_block(bp);
+
+        arena->epilogue = &next_blk(bp)->header;
+        *arena->epilogue = FENCE;
+        arena->epilogue->prev_inuse = 0;
+        arena->trimmed = release;
+    }
+    sbrk_unlock();
+}
+
+/* A mapped block's header is this many bytes into its region, as the
+ * word in front of the header records */
+static size_t *mapped_lead(struct block *blk)
+{
+    return (size_t *)blk - 1;
+}
+
+/*
+ * map_block - Give a block of at least words words, with its payload
+ *             aligned to alignment, a region of its own outside the
+ *             arenas' chunks, or return NULL if there is no room
+ */
+static struct block *map_block(size_t words, size_t alignment)
+{
+    size_t pagesize = mem_pagesize();
+    /* regions are page-aligned, so a smaller alignment needs an exact lead */
+    size_t max_lead = alignment <= pagesize ? alignment - WSIZE : alignment + WSIZE;
+    if (words > (MAX_HEAP - max_lead) / WSIZE)
+        return NULL;
+    size_t bytes = (max_lead + words * WSIZE + pagesize - 1) & ~(pagesize - 1);
+
+    sbrk_lock();
+    void *region = mem_map(bytes);
+#ifdef HEAP_PROFILE
+    if (region != NULL)
+        mapped_bytes += bytes;
+#endif
+    sbrk_unlock();
+    if (region == NULL)
+        return NULL;
+
+    uintptr_t payload = ((uintptr_t)region + 2 * WSIZE + alignment - 1) & ~(alignment - 1);
+    struct block *blk = (void *)payload - offsetof(struct block, payload);
+    size_t lead = (void *)blk - region;
+    *mapped_lead(blk) = lead;
+    set_header(blk, (bytes - lead) / WSIZE, 1);
+    blk->header.mapped = 1;
+    blk->header.prev_inuse = 1; /* nothing before it to coalesce with */
+    return blk;
+}
+
+/*
+ * unmap_block - Return a mapped block's region right away
+ */
+static void unmap_block(struct block *bp)
+{
+    size_t lead = *mapped_lead(bp);
+    sbrk_lock();
+    mem_unmap((void *)bp - lead, blk_size(bp) * WSIZE + lead);
+#ifdef HEAP_PROFILE
+    mapped_bytes -= blk_size(bp) * WSIZE + lead;
+#endif
+    sbrk_unlock();
+}
+
 /*
  * place - Place block of asize words at start of free block bp
  *         and split if remainder would be at least minimum block size
@@ -481,11 +1330,12 @@ static void place(struct block *bp, size_t asize)
 {
     size_t csize = blk_size(bp);
     // case 1 - we can split the block
+    // the block must leave its free list while it still has its old size
+    remove_free_block(bp);
     if ((csize - asize) >= MIN_BLOCK_SIZE_WORDS)
     {
         // split the block and set the new block to used
         mark_block_used(bp, asize);
-        list_remove(&bp->elem);
         // split the block and set the new block to free and add to free list
         struct block *t = next_blk(bp);
         mark_block_free(t, csize - asize);
@@ -493,57 +1343,279 @@ static void place(struct block *bp, size_t asize)
     }
     else // case 2 - we cannot split the block
     {
-        // set the block to used and remove from free list
+        // set the block to used
         mark_block_used(bp, csize);
-        list_remove(&bp->elem);
     }
 }
 
+#ifdef USE_RBTREE
+/*
+ * tree_fit - Return the smallest large block of at least asize words,
+ *            the lowest-addressed one among equal sizes, or NULL.
+ *            This is RB_NFIND, but keyed on the size alone.
+ */
+static struct block *tree_fit(size_t asize)
+{
+    struct block *fit = NULL;
+    struct block *n = RB_ROOT(&arena->large_blocks);
+    while (n != NULL)
+    {
+        COUNT_PROBES(1);
+        if (blk_size(n) >= asize)
+        {
+            fit = n;
+            n = RB_LEFT(n, node);
+        }
+        else
+            n = RB_RIGHT(n, node);
+    }
+    return fit;
+}
+#endif
+
+/*
+ * trim_block - Shrink an allocated block to keep words and free the rest,
+ *              if the rest is big enough to be a block of its own
+ */
+static void trim_block(struct block *bp, size_t keep)
+{
+    size_t csize = blk_size(bp);
+    if (keep >= csize || csize - keep < MIN_BLOCK_SIZE_WORDS)
+        return;
+
+    mark_block_used(bp, keep);
+    struct block *rest = next_blk(bp);
+    mark_block_free(rest, csize - keep);
+    coalesce(rest);
+}
+
+#ifdef DEFER_COALESCE
+/*
+ * quick_free - Park a small block in the quick bin for its size.
+ *              It stays marked in use, so its neighbours never coalesce
+ *              with it, and is linked through its payload.  Returns
+ *              false if the block is too big for the quick bins.
+ */
+static bool quick_free(struct block *bp)
+{
+    int class = size_class(blk_size(bp));
+    if (!class_exact(class))
+        return false;
+
+    *(struct block **)bp->payload = arena->quick_bins[class];
+    arena->quick_bins[class] = bp;
+    if (++arena->quick_count > QUICK_LIMIT)
+        consolidate();
+    return true;
+}
+
+/*
+ * quick_alloc - Take a block of exactly asize words from its quick bin,
+ *               or return NULL
+ */
+static struct block *quick_alloc(size_t asize)
+{
+    int class = size_class(asize);
+    if (!class_exact(class) || arena->quick_bins[class] == NULL)
+        return NULL;
+
+    struct block *bp = arena->quick_bins[class];
+    arena->quick_bins[class] = *(struct block **)bp->payload;
+    arena->quick_count--;
+    return bp;
+}
+
+/*
+ * consolidate - Free every block in the quick bins for real,
+ *               coalescing each with its neighbours
+ */
+static void consolidate(void)
+{
+    for (int class = 0; class < NUM_SMALL_CLASSES; class++)
+    {
+        struct block *bp = arena->quick_bins[class];
+        while (bp != NULL)
+        {
+            struct block *next = *(struct block **)bp->payload;
+            mark_block_free(bp, blk_size(bp));
+            coalesce(bp);
+            bp = next;
+        }
+        arena->quick_bins[class] = NULL;
+    }
+    arena->quick_count = 0;
+}
+#endif
+
+#ifdef USE_SLABS
+/* The bit of slab_pages for the heap page ptr is in */
+static size_t slab_page(void *ptr)
+{
+    return (uintptr_t)ptr / SLAB_SIZE - (uintptr_t)mem_heap_lo() / SLAB_SIZE;
+}
+
+/*
+ * is_slab_object - Return whether ptr, from mm_malloc(), is in a slab.
+ *                  Mapped blocks lie outside the heap.
+ */
+static bool is_slab_object(void *ptr)
+{
+    if (ptr < mem_heap_lo() || ptr > mem_heap_hi())
+        return false;
+    size_t page = slab_page(ptr);
+    return (slab_pages[page / 64] >> (page % 64)) & 1;
+}
+
+/* The slab holding ptr, found by masking its address */
+static struct slab *slab_of(void *ptr)
+{
+    return (struct slab *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static size_t slab_object_size(void *ptr)
+{
+    return (slab_of(ptr)->class + 1) * ALIGNMENT;
+}
+
+/*
+ * slab_new - Make a slab for objects of class from a block of the heap,
+ *            and list it as having room.  Returns NULL if out of memory.
+ */
+static struct slab *slab_new(int class)
+{
+    struct slab *s = mm_memalign(SLAB_SIZE, SLAB_SIZE);
+    if (s == NULL)
+        return NULL;
+
+    size_t page = slab_page(s);
+    slab_pages[page / 64] |= 1ULL << (page % 64);
+    s->class = class;
+    s->used = 0;
+    s->slots = (SLAB_SIZE - SLAB_HEADER) / ((class + 1) * ALIGNMENT);
+    memset(s->bitmap, 0, sizeof s->bitmap);
+    for (int i = s->slots; i < SLAB_BITMAP_WORDS * 64; i++)
+        s->bitmap[i / 64] |= 1ULL << (i % 64); /* so the bit scan never picks them */
+    list_push_front(&arena->slabs[class], &s->elem);
+    return s;
+}
+
+/*
+ * slab_alloc - Allocate size bytes, 0 < size <= SLAB_MAX, from the first
+ *              slab of their class that has room
+ */
+static void *slab_alloc(size_t size)
+{
+    int class = (size - 1) / ALIGNMENT;
+    struct list *l = &arena->slabs[class];
+    struct slab *s = list_empty(l) ? slab_new(class) : list_entry(list_front(l), struct slab, elem);
+    if (s == NULL)
+        return NULL;
+
+    int w = 0;
+    while (~s->bitmap[w] == 0)
+        w++;
+    int slot = w * 64 + __builtin_ctzll(~s->bitmap[w]);
+    s->bitmap[w] |= 1ULL << (slot % 64);
+    if (++s->used == s->slots)
+        list_remove(&s->elem); /* full */
+    return (char *)s + SLAB_HEADER + slot * (class + 1) * ALIGNMENT;
+}
+
+/* Whether slab list l, which holds at least one slab, holds another
+ * one too; list_size() would walk all of them */
+static bool slab_list_has_others(struct list *l)
+{
+    return list_begin(l) != list_rbegin(l);
+}
+
+/*
+ * slab_free - Free a slab object.  A slab that becomes empty goes back
+ *             to the heap unless no other slab of its class has room.
+ */
+static void slab_free(void *ptr)
+{
+    struct slab *s = slab_of(ptr);
+    int slot = ((char *)ptr - (char *)s - SLAB_HEADER) / ((s->class + 1) * ALIGNMENT);
+    s->bitmap[slot / 64] &= ~(1ULL << (slot % 64));
+
+    struct list *l = &arena->slabs[s->class];
+    if (s->used-- == s->slots)
+        list_push_front(l, &s->elem); /* has room again */
+    if (s->used == 0 && slab_list_has_others(l))
+    {
+        list_remove(&s->elem);
+        size_t page = slab_page(s);
+        slab_pages[page / 64] &= ~(1ULL << (page % 64));
+        mm_free(s);
+    }
+}
+
+/*
+ * check_slab - Check the header of slab s of arena a; returns the number
+ *              of problems
+ */
+static int check_slab(struct slab *s, struct arena *a)
+{
+    int problems = 0;
+    if ((uintptr_t)s % SLAB_SIZE != 0)
+        return check_failed(s, "slab is not aligned to its size");
+    if (s->class >= SLAB_CLASSES || s->slots != (SLAB_SIZE - SLAB_HEADER) / ((s->class + 1) * ALIGNMENT))
+        return check_failed(s, "slab has a bad class");
+
+    int in_use = 0;
+    for (int w = 0; w < SLAB_BITMAP_WORDS; w++)
+        in_use += __builtin_popcountll(s->bitmap[w]);
+    if (in_use - (SLAB_BITMAP_WORDS * 64 - s->slots) != s->used)
+        problems += check_failed(s, "slab's bitmap disagrees with its count of used slots");
+    if (s->used == 0 && slab_list_has_others(&a->slabs[s->class]))
+        problems += check_failed(s, "empty slab was not given back");
+    return problems;
+}
+#endif
+
 /*
  * find_fit - Find a fit for a block with asize words
  */
 static struct block *find_fit(size_t asize)
 {
-    struct list_elem *e;
-
-    for (e = list_begin(&free_blocks); e != list_end(&free_blocks); e = list_next(e))
+    int class = size_class(asize);
+#ifdef HEAP_PROFILE
+    arena->fit_calls++;
+#endif
+#ifdef USE_RBTREE
+    if (class >= TREE_MIN_CLASS)
+        return tree_fit(asize);
+#endif
+
+    // blocks in an exact class all have the same size, but a log-spaced
+    // class also holds blocks smaller than asize, so search it first-fit
+    if (!class_exact(class))
     {
-        struct free_block_list *b = list_entry(e, struct free_block_list, elem);
-        if (!list_empty(&b->free_block_list) && (b->list_size >= asize || list_prev(e) == list_end(&free_blocks)))
+        struct list *l = &arena->free_lists[class];
+        for (struct list_elem *e = list_begin(l); e != list_end(l); e = list_next(e))
         {
-            struct list_elem *elem1;
-            struct list_elem *elem2 = list_begin(&b->free_block_list);
-
-            // look through free list to find a block that fits
-            // two blocks start at same time and meet in middle
-            // is efficient
-            for (elem1 = list_rbegin(&b->free_block_list); elem1 != list_rend(&b->free_block_list);
-                 elem1 = list_prev(elem1))
-            {
-                struct block *block1 = list_entry(elem1, struct block, elem);
-                struct block *block2 = list_entry(elem2, struct block, elem);
-
-                // good block
-                if (blk_size(block1) >= asize)
-                {
-                    return block1;
-                }
-                else if (blk_size(block2) >= asize)
-                {
-                    return block2;
-                }
-
-                // stops if list_entries meet in middle or next to each other
-                elem2 = list_next(elem2);
-                if (elem1 == elem2 || list_next(elem1) == elem2)
-                {
-                    return NULL;
-                }
-            }
+            struct block *bp = list_entry(e, struct block, elem);
+            COUNT_PROBES(1);
+            if (blk_size(bp) >= asize)
+                return bp;
         }
+        if (++class == NUM_SIZE_CLASSES)
+            return NULL;
     }
 
-    return NULL; /* No fit */
+    // any block in a non-empty class at or above this one fits;
+    // the bit scan finds the smallest such class in one step
+    uint64_t candidates = arena->free_lists_nonempty & (~0ULL << class);
+    if (candidates == 0)
+#ifdef USE_RBTREE
+        return tree_fit(asize); /* only the large blocks are left */
+#else
+        return NULL; /* No fit */
+#endif
+
+    struct list *l = &arena->free_lists[__builtin_ctzll(candidates)];
+    COUNT_PROBES(1);
+    return list_entry(list_front(l), struct block, elem);
 }
 
 team_t team = {
@@ -4,6 +4,36 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern int mm_checkheap(int verbose);
+
+/* Beyond the mdriver interface, for use as a process's malloc
+ * (see mmpreload.c); only mm.c provides these. */
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern size_t mm_usable_size(void *ptr);
+
+/* Optional: packages with per-thread caches report their hit and
+ * miss counts since the last mm_init(). */
+extern void mm_thread_cache_stats(unsigned long *hits, unsigned long *misses)
+    __attribute__((weak));
+
+/* Optional: a snapshot of how the heap is fragmented, which mm.c
+ * provides when built with -DHEAP_PROFILE.  The heap must be quiet
+ * while it is taken; it walks every block. */
+#define MM_PROFILE_CLASSES 64
+struct heap_profile {
+    int num_classes;                            /* size classes in use below */
+    size_t class_min[MM_PROFILE_CLASSES];       /* smallest block of each class, bytes */
+    size_t free_bytes[MM_PROFILE_CLASSES];      /* free bytes in each class */
+    size_t free_total;                          /* free bytes in all classes */
+    size_t largest_free;                        /* largest free block, bytes */
+    size_t used_bytes;                          /* allocated blocks, headers included */
+    size_t heap_bytes;                          /* the heap and mapped regions */
+    unsigned long fit_calls;                    /* free-list searches since mm_init() */
+    unsigned long fit_probes;                   /* free blocks they looked at */
+};
+extern void mm_heap_profile(struct heap_profile *profile) __attribute__((weak));
 
 
 /* 
@@ -1,47 +1,479 @@
 /*
  * Thread-safety wrapper.
- * To be included in mm.c - you may assume this file exists, or else
- * (better!) implement your own version.
+ * To be included in mm.c, after the block helpers and before the
+ * definitions of mm_init, mm_malloc, mm_free, mm_realloc, mm_memalign,
+ * mm_aligned_alloc and mm_calloc.
+ *
+ * Each arena has its own lock.  A thread is given a home arena, either
+ * round-robin when it first allocates or, with -DARENA_BY_CPU, the one
+ * for the CPU it is running on.  Blocks remember their arena.  Freeing
+ * a block of another arena pushes it onto that arena's remote_frees
+ * stack without taking any lock; the owner drains the stack the next
+ * time it takes its own lock.  Only mem_sbrk() itself is serialized
+ * across arenas, by sbrk_mutex.
+ *
+ * In front of the arena locks, every thread
+ * keeps a bounded cache of free blocks for each of the first
+ * TCACHE_CLASSES size classes.  Cached blocks stay marked in use in
+ * the heap, so the heap code never coalesces them, and they are chained
+ * through the first word of their payload.  A malloc served from the
+ * cache and a free that finds room in it never take the lock.
+ * A miss refills up to tcache_batch(c) blocks under one lock acquisition
+ * (TCACHE_BATCH, or more for the busy classes of a -DPGO_CLASSES build),
+ * and a free into a full bin flushes TCACHE_BATCH blocks back at once.
+ * Cached blocks may come from any arena; flushing routes each one home.
+ *
+ * Every cached block in bin c is at least tcache_class_words(c) words,
+ * the largest size in its class, so any request in class c can take
+ * the first one without looking at its size.
+ *
+ * mm_init() starts a new heap epoch.  A cache left over from an
+ * earlier epoch points into a heap that no longer exists and is
+ * dropped rather than flushed.  A thread's cache is flushed back to
+ * the heap when the thread exits.
  *
  * Generally, #including .c files is fragile and not good style.
  * This is just a stop-gap solution.
  */
 #include <pthread.h>
 #ifdef THREAD_SAFE
-static pthread_mutex_t malloc_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef ARENA_BY_CPU
+#include <sched.h> /* sched_getcpu() needs _GNU_SOURCE */
+#endif
+#ifdef PGO_CLASSES
+#define TCACHE_CLASSES PGO_TCACHE_CLASSES
+#else
+#define TCACHE_CLASSES 24 /* cache classes below this; blocks up to 2 KiB */
+#endif
+#define TCACHE_MAX 32     /* most blocks a thread keeps per class */
+#define TCACHE_BATCH 16   /* blocks moved per refill or flush */
+
+static pthread_mutex_t sbrk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+#ifndef ARENA_BY_CPU
+static unsigned next_arena;               /* round-robin counter */
+static __thread struct arena *home_arena; /* NULL until first chosen */
+#endif
+
+struct thread_cache
+{
+    void *bins[TCACHE_CLASSES]; /* cached payloads, linked through their first word */
+    int counts[TCACHE_CLASSES]; /* number of blocks in each bin */
+    unsigned epoch;             /* heap_epoch the bins belong to, 0 if never used */
+    unsigned long hits;         /* mallocs served from the cache */
+    unsigned long misses;       /* mallocs that had to take the lock */
+};
+
+static __thread struct thread_cache tcache;
+static unsigned heap_epoch = 1; /* bumped by mm_init() */
+
+/* Counters of threads that exited during this epoch, updated atomically. */
+static unsigned long tcache_hits, tcache_misses;
+
+static pthread_key_t tcache_key; /* its destructor flushes an exiting thread's cache */
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
 
+int _mm_init_thread_unsafe(void);
 void *_mm_malloc_thread_unsafe(size_t size);
 void _mm_free_thread_unsafe(void *bp);
 void *_mm_realloc_thread_unsafe(void *ptr, size_t size);
+void *_mm_memalign_thread_unsafe(size_t alignment, size_t size);
+void *_mm_aligned_alloc_thread_unsafe(size_t alignment, size_t size);
+void *_mm_calloc_thread_unsafe(size_t nmemb, size_t size);
+int _mm_checkheap_thread_unsafe(int verbose);
+#ifdef HEAP_PROFILE
+void _mm_heap_profile_thread_unsafe(struct heap_profile *profile);
+#endif
+
+/* Largest block size, in words, that falls into a cached size class. */
+static size_t tcache_class_words(int class)
+{
+#ifdef PGO_CLASSES
+    if (class < NUM_SMALL_CLASSES)
+        return pgo_class_max_units[class] * UNIT_WORDS;
+#else
+    if (class < NUM_EXACT_CLASSES)
+        return (class + MIN_BLOCK_UNITS) * UNIT_WORDS;
+#endif
+
+    int log2 = SMALL_CLASS_SHIFT + ((class - NUM_SMALL_CLASSES) >> SUBCLASS_BITS);
+    int sub = (class - NUM_SMALL_CLASSES) & (SUBCLASSES - 1);
+    size_t step = (size_t)1 << (log2 - SUBCLASS_BITS);
+    return ((SUBCLASSES + sub + 1) * step - 1) * UNIT_WORDS;
+}
+
+/* Blocks a miss in this class takes from the heap at once. */
+static int tcache_batch(int class)
+{
+#ifdef PGO_CLASSES
+    return pgo_refill_batch[class];
+#else
+    (void)class;
+    return TCACHE_BATCH;
+#endif
+}
+
+static void sbrk_lock(void)
+{
+    pthread_mutex_lock(&sbrk_mutex);
+}
+
+static void sbrk_unlock(void)
+{
+    pthread_mutex_unlock(&sbrk_mutex);
+}
+
+static void init_arena_locks(void)
+{
+    for (int i = 0; i < NUM_ARENAS; i++)
+        pthread_mutex_init(&arenas[i].lock, NULL);
+}
+
+/* Return the arena owning the block with payload bp. */
+static struct arena *block_arena(void *bp)
+{
+    struct block *blk = bp - offsetof(struct block, payload);
+    return &arenas[blk->header.arena];
+}
+
+/* Return the calling thread's home arena. */
+static struct arena *get_home_arena(void)
+{
+#ifdef ARENA_BY_CPU
+    int cpu = sched_getcpu();
+    return &arenas[(cpu < 0 ? 0 : cpu) % NUM_ARENAS];
+#else
+    if (home_arena == NULL)
+        home_arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % NUM_ARENAS];
+    return home_arena;
+#endif
+}
+
+/* Lock a and make it the arena the heap routines work on.  Blocks other
+ * threads freed into a meanwhile are given back to its lists first. */
+static void lock_arena(struct arena *a)
+{
+    pthread_once(&arenas_once, init_arena_locks);
+    pthread_mutex_lock(&a->lock);
+    arena = a;
+
+    void *p = __atomic_exchange_n(&a->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (p != NULL)
+    {
+        void *next = *(void **)p;
+        _mm_free_thread_unsafe(p);
+        p = next;
+    }
+}
+
+static void unlock_arena(void)
+{
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/* Hand a block to another arena without taking its lock: push it
+ * onto a Treiber stack that owner drains wholesale in lock_arena(). */
+static void remote_free(struct arena *owner, void *bp)
+{
+    void *head = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+    do
+        *(void **)bp = head;
+    while (!__atomic_compare_exchange_n(&owner->remote_frees, &head, bp, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Free a block while holding the current arena's lock. */
+static void free_locked(void *bp)
+{
+    struct arena *owner = block_arena(bp);
+    if (owner == arena)
+        _mm_free_thread_unsafe(bp);
+    else
+        remote_free(owner, bp);
+}
+
+/* Return n blocks from a bin to their arenas.  Caller holds an arena lock. */
+static void tcache_flush_locked(struct thread_cache *tc, int class, int n)
+{
+    while (n-- > 0 && tc->bins[class] != NULL)
+    {
+        void *p = tc->bins[class];
+        tc->bins[class] = *(void **)p;
+        tc->counts[class]--;
+        free_locked(p);
+    }
+}
+
+/* pthread_key destructor: give an exiting thread's blocks back. */
+static void tcache_exit(void *arg)
+{
+    struct thread_cache *tc = arg;
+
+    if (tc->epoch == heap_epoch)
+    {
+        lock_arena(get_home_arena());
+        for (int class = 0; class < TCACHE_CLASSES; class++)
+            tcache_flush_locked(tc, class, tc->counts[class]);
+        unlock_arena();
+        __atomic_fetch_add(&tcache_hits, tc->hits, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&tcache_misses, tc->misses, __ATOMIC_RELAXED);
+    }
+}
+
+static void tcache_make_key(void)
+{
+    pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/* Return this thread's cache, emptied first if it belongs to an old heap. */
+static struct thread_cache *get_tcache(void)
+{
+    struct thread_cache *tc = &tcache;
+    unsigned epoch = __atomic_load_n(&heap_epoch, __ATOMIC_RELAXED);
+
+    if (tc->epoch != epoch)
+    {
+        if (tc->epoch == 0)
+        {
+            pthread_once(&tcache_key_once, tcache_make_key);
+            pthread_setspecific(tcache_key, tc);
+        }
+        memset(tc, 0, sizeof *tc);
+        tc->epoch = epoch;
+    }
+    return tc;
+}
+
+/* Allocate one block of the class's largest size for the caller and
+ * cache up to tcache_batch(class) - 1 more, all under one lock acquisition. */
+static void *tcache_refill(struct thread_cache *tc, int class)
+{
+    size_t size = tcache_class_words(class) * WSIZE - sizeof(struct boundary_tag);
+
+    lock_arena(get_home_arena());
+    void *p = _mm_malloc_thread_unsafe(size);
+    int batch = tcache_batch(class);
+    for (int i = 1; p != NULL && i < batch && tc->counts[class] < TCACHE_MAX; i++)
+    {
+        void *q = _mm_malloc_thread_unsafe(size);
+        if (q == NULL)
+            break;
+        *(void **)q = tc->bins[class];
+        tc->bins[class] = q;
+        tc->counts[class]++;
+    }
+    unlock_arena();
+    return p;
+}
+
+int mm_init(void)
+{
+    pthread_once(&arenas_once, init_arena_locks);
+    for (int i = 0; i < NUM_ARENAS; i++)
+        pthread_mutex_lock(&arenas[i].lock);
+
+    arena = get_home_arena();
+    int r = _mm_init_thread_unsafe();
+    __atomic_store_n(&heap_epoch, heap_epoch + 1, __ATOMIC_RELAXED);
+    tcache_hits = tcache_misses = 0;
+
+    for (int i = NUM_ARENAS - 1; i >= 0; i--)
+        pthread_mutex_unlock(&arenas[i].lock);
+    return r;
+}
+
+/* Initialize the heap on first use if mm_init() was never called. */
+static void lazy_init(void)
+{
+    mm_init();
+}
 
 void *mm_malloc(size_t size)
 {
-    pthread_mutex_lock(&malloc_lock);
+    if (heap_listp == NULL)
+        pthread_once(&heap_once, lazy_init);
+
+    size_t awords = request_words(size);
+    if (awords != 0 && awords <= tcache_class_words(TCACHE_CLASSES - 1))
+    {
+        int class = size_class(awords);
+        struct thread_cache *tc = get_tcache();
+        void *p = tc->bins[class];
+        if (p != NULL)
+        {
+            tc->bins[class] = *(void **)p;
+            tc->counts[class]--;
+            tc->hits++;
+            return p;
+        }
+        tc->misses++;
+        return tcache_refill(tc, class);
+    }
+
+    lock_arena(get_home_arena());
     void * p = _mm_malloc_thread_unsafe(size);
-    pthread_mutex_unlock(&malloc_lock);
+    unlock_arena();
     return p;
 }
 
 void mm_free(void *bp)
 {
-    pthread_mutex_lock(&malloc_lock);
+    if (bp == NULL)
+        return;
+
+    struct block *blk = bp - offsetof(struct block, payload);
+    size_t words = blk_size(blk);
+    int class = size_class(words);
+    if (class < TCACHE_CLASSES && words >= tcache_class_words(class))
+    {
+        struct thread_cache *tc = get_tcache();
+        if (tc->counts[class] == TCACHE_MAX)
+        {
+            lock_arena(get_home_arena());
+            tcache_flush_locked(tc, class, TCACHE_BATCH);
+            unlock_arena();
+        }
+        *(void **)bp = tc->bins[class];
+        tc->bins[class] = bp;
+        tc->counts[class]++;
+        return;
+    }
+
+    struct arena *owner = block_arena(bp);
+    if (owner != get_home_arena())
+    {
+        remote_free(owner, bp);
+        return;
+    }
+    lock_arena(owner);
     _mm_free_thread_unsafe(bp);
-    pthread_mutex_unlock(&malloc_lock);
+    unlock_arena();
 }
 
+/* realloc works on the block's neighbours, so it runs in the owning arena. */
 void *mm_realloc(void *ptr, size_t size)
 {
-    pthread_mutex_lock(&malloc_lock);
+    if (ptr == NULL)
+        return mm_malloc(size);
+    if (size == 0)
+    {
+        mm_free(ptr);
+        return NULL;
+    }
+
+    lock_arena(block_arena(ptr));
     void * p = _mm_realloc_thread_unsafe(ptr, size);
-    pthread_mutex_unlock(&malloc_lock);
+    unlock_arena();
+    return p;
+}
+
+/* Aligned blocks bypass the thread cache, whose bins cannot promise
+ * any alignment beyond ALIGNMENT. */
+void *mm_memalign(size_t alignment, size_t size)
+{
+    if (alignment <= ALIGNMENT)
+        return mm_malloc(size);
+    if (heap_listp == NULL)
+        pthread_once(&heap_once, lazy_init);
+
+    lock_arena(get_home_arena());
+    void *p = _mm_memalign_thread_unsafe(alignment, size);
+    unlock_arena();
+    return p;
+}
+
+void *mm_aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+        return NULL;
+    return mm_memalign(alignment, size);
+}
+
+/* A request the thread cache may serve is cleared in full, since a
+ * cached block was in use.  Larger ones are never cached, so they go to
+ * the arena as a whole: under its lock, _mm_calloc_thread_unsafe() asks
+ * mem_heap_fresh() what still needs clearing, and leaves the mapped
+ * blocks that mem_map() zeroed alone. */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes))
+        return NULL;
+
+    size_t awords = request_words(bytes);
+    if (awords != 0 && awords <= tcache_class_words(TCACHE_CLASSES - 1))
+    {
+        void *p = mm_malloc(bytes);
+        if (p != NULL)
+            memset(p, 0, bytes);
+        return p;
+    }
+
+    if (heap_listp == NULL)
+        pthread_once(&heap_once, lazy_init);
+    lock_arena(get_home_arena());
+    void *p = _mm_calloc_thread_unsafe(nmemb, size);
+    unlock_arena();
     return p;
 }
 
+/* The checker walks every arena, so it holds all of their locks.  Blocks
+ * in thread caches look allocated to it. */
+int mm_checkheap(int verbose)
+{
+    for (int i = 0; i < NUM_ARENAS; i++)
+        lock_arena(&arenas[i]);
+
+    int problems = _mm_checkheap_thread_unsafe(verbose);
+
+    for (int i = NUM_ARENAS - 1; i >= 0; i--)
+        pthread_mutex_unlock(&arenas[i].lock);
+    return problems;
+}
+
+#ifdef HEAP_PROFILE
+/* So does the heap profile. */
+void mm_heap_profile(struct heap_profile *profile)
+{
+    for (int i = 0; i < NUM_ARENAS; i++)
+        lock_arena(&arenas[i]);
+
+    _mm_heap_profile_thread_unsafe(profile);
+
+    for (int i = NUM_ARENAS - 1; i >= 0; i--)
+        pthread_mutex_unlock(&arenas[i].lock);
+}
+#endif
+
+/* Report cache hits and misses for the current heap: those of exited
+ * threads plus the calling thread's own. */
+void mm_thread_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+    struct thread_cache *tc = get_tcache();
+
+    *hits = __atomic_load_n(&tcache_hits, __ATOMIC_RELAXED) + tc->hits;
+    *misses = __atomic_load_n(&tcache_misses, __ATOMIC_RELAXED) + tc->misses;
+}
+
+#define mm_init _mm_init_thread_unsafe
 #define mm_malloc _mm_malloc_thread_unsafe
 #define mm_free _mm_free_thread_unsafe
 #define mm_realloc _mm_realloc_thread_unsafe
+#define mm_memalign _mm_memalign_thread_unsafe
+#define mm_aligned_alloc _mm_aligned_alloc_thread_unsafe
+#define mm_calloc _mm_calloc_thread_unsafe
+#define mm_checkheap _mm_checkheap_thread_unsafe
+#ifdef HEAP_PROFILE
+#define mm_heap_profile _mm_heap_profile_thread_unsafe
+#endif
 
 #else
 /* If THREAD_SAFE is not defined, we leave it as is in order
  * to avoid the locking overhead. */
+#if NUM_ARENAS > 1
+#error "NUM_ARENAS > 1 requires THREAD_SAFE"
+#endif
+static void sbrk_lock(void) {}
+static void sbrk_unlock(void) {}
 #endif /* THREAD_SAFE */
@@ -0,0 +1,161 @@
+/*
+ * mmpreload.c - Exports the C allocation functions on top of mm.c, so
+ *     that real programs can run on it:
+ *
+ *         LD_PRELOAD=./libMallocMM.so <command>
+ *
+ *     The library is built from the thread-safe, multi-arena mm.c, and
+ *     memlib reserves MAX_HEAP bytes of address space for it with
+ *     MEM_MMAP_ANYWHERE, touching pages only as the break moves.  Only
+ *     malloc and friends are exported; everything else is hidden, so
+ *     the program's own symbols cannot collide with mm.c's or memlib's.
+ *
+ *     free() and realloc() of a pointer outside the reservation ignore
+ *     it, or abort, respectively; such a pointer can only come from an
+ *     allocator this library does not know about.  A fork() while
+ *     another thread is inside the allocator may leave the child with a
+ *     lock held, so forking programs should be single-threaded.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "config.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+static char *heap_lo;   /* the reservation, once made */
+
+static void heap_init(void)
+{
+    mem_init(MEM_MMAP_ANYWHERE);
+    mm_init();
+    __atomic_store_n(&heap_lo, (char *)mem_heap_lo(), __ATOMIC_RELEASE);
+}
+
+/* Make the heap on first use. */
+static inline void heap_ready(void)
+{
+    if (__builtin_expect(__atomic_load_n(&heap_lo, __ATOMIC_ACQUIRE) == NULL, 0))
+        pthread_once(&heap_once, heap_init);
+}
+
+/* Did ptr come from us? */
+static inline int is_ours(void *ptr)
+{
+    return heap_lo != NULL && (char *)ptr >= heap_lo && (char *)ptr < heap_lo + MAX_HEAP;
+}
+
+static void *check_alloc(void *p)
+{
+    if (p == NULL)
+        errno = ENOMEM;
+    return p;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    heap_ready();
+    /* malloc(0) returns a unique pointer, as glibc's does */
+    return check_alloc(mm_malloc(size ? size : 1));
+}
+
+EXPORT void free(void *ptr)
+{
+    if (is_ours(ptr))
+        mm_free(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    heap_ready();
+    return check_alloc(bytes ? mm_calloc(nmemb, size) : mm_malloc(1));
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return malloc(size);
+    if (!is_ours(ptr)) {
+        static const char msg[] = "mmpreload: realloc() of a pointer not from mm_malloc\n";
+        write(2, msg, sizeof msg - 1);
+        abort();
+    }
+    if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    }
+    return check_alloc(mm_realloc(ptr, size));
+}
+
+EXPORT void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, bytes);
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    if ((alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    heap_ready();
+    return check_alloc(mm_memalign(alignment, size ? size : 1));
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+
+    heap_ready();
+    void *p = mm_memalign(alignment, size ? size : 1);
+    if (p == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    heap_ready();
+    return check_alloc(mm_aligned_alloc(alignment, size ? size : 1));
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return memalign(mem_pagesize(), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    return memalign(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    return is_ours(ptr) ? mm_usable_size(ptr) : 0;
+}
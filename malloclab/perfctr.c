@@ -0,0 +1,108 @@
+/*
+ * perfctr.c - hardware performance counters, through perf_event_open(2)
+ */
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#include "perfctr.h"
+
+const char *perfctr_names[NUM_PERFCTRS] = {
+    "cycles", "instructions", "L1D_misses", "LLC_misses", "dTLB_misses", "branch_misses"
+};
+
+static int fds[NUM_PERFCTRS] = { -1, -1, -1, -1, -1, -1 };
+
+#ifdef __linux__
+
+#define CACHE_READ_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct { uint32_t type; uint64_t config; } events[NUM_PERFCTRS] = {
+    [PC_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [PC_INSTRUCTIONS]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [PC_L1D_MISSES]    = { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    [PC_LLC_MISSES]    = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [PC_DTLB_MISSES]   = { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+    [PC_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+int perfctr_open(void)
+{
+    int n = 0;
+    for (int c = 0; c < NUM_PERFCTRS; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[c].type;
+        attr.config = events[c].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[c] >= 0)
+            n++;
+    }
+    return n;
+}
+
+void perfctr_start(void)
+{
+    for (int c = 0; c < NUM_PERFCTRS; c++)
+        if (fds[c] >= 0) {
+            ioctl(fds[c], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[c], PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+void perfctr_stop(double counts[NUM_PERFCTRS])
+{
+    for (int c = 0; c < NUM_PERFCTRS; c++)
+        if (fds[c] >= 0)
+            ioctl(fds[c], PERF_EVENT_IOC_DISABLE, 0);
+
+    for (int c = 0; c < NUM_PERFCTRS; c++) {
+        uint64_t v[3];  /* value, time enabled, time running */
+        counts[c] = -1;
+        if (fds[c] < 0 || read(fds[c], v, sizeof(v)) != sizeof(v))
+            continue;
+        if (v[2] == 0)  /* never got a hardware counter */
+            continue;
+        counts[c] = v[2] < v[1] ? (double)v[0] * v[1] / v[2] : (double)v[0];
+    }
+}
+
+#else /* !__linux__ */
+
+int perfctr_open(void)
+{
+    return 0;
+}
+
+void perfctr_start(void)
+{
+}
+
+void perfctr_stop(double counts[NUM_PERFCTRS])
+{
+    for (int c = 0; c < NUM_PERFCTRS; c++)
+        counts[c] = -1;
+}
+
+#endif
+
+void perfctr_close(void)
+{
+    for (int c = 0; c < NUM_PERFCTRS; c++)
+        if (fds[c] >= 0) {
+            close(fds[c]);
+            fds[c] = -1;
+        }
+}
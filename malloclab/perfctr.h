@@ -0,0 +1,28 @@
+/*
+ * perfctr.h - hardware performance counters, through perf_event_open(2)
+ *
+ * Counters count this thread only, in user mode only, so that they work
+ * at the default perf_event_paranoid level.  Any that the kernel or the
+ * machine cannot provide (in a VM, say) are left out.
+ */
+#ifndef __PERFCTR_H
+#define __PERFCTR_H
+
+enum { PC_CYCLES, PC_INSTRUCTIONS, PC_L1D_MISSES, PC_LLC_MISSES,
+       PC_DTLB_MISSES, PC_BRANCH_MISSES, NUM_PERFCTRS };
+
+extern const char *perfctr_names[NUM_PERFCTRS];
+
+/* Open the counters; returns how many are available */
+int perfctr_open(void);
+
+/* Zero the counters and start them */
+void perfctr_start(void);
+
+/* Stop them and read them into counts, scaled up if the kernel had to
+ * multiplex them; counts the machine lacks are negative */
+void perfctr_stop(double counts[NUM_PERFCTRS]);
+
+void perfctr_close(void);
+
+#endif /* __PERFCTR_H */
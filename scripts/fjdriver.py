@@ -9,9 +9,10 @@
 version = "$Format:%H committed by %cn$"
 
 #
-import getopt, sys, os, subprocess, signal, re, json, resource, time, socket
+import getopt, sys, os, subprocess, signal, re, json, resource, time, socket, math, statistics, threading
 from datetime import datetime
 from collections import namedtuple, defaultdict
+from concurrent.futures import ThreadPoolExecutor
 
 # add location of this script to python sys.path
 # add directory in which script is located to python path
@@ -35,18 +36,12 @@ verbose = False
 silent = False
 list_tests = False
 grade_mode = False
+instrument = False
+efficiency = False
 benchmark_runs = 1
-
-# Benchmark info
-
-# Times of serial runs for benchmarked tests
-# XXX these are out of date currently and ultimately not used.
-benchmark_times = {
-    'nqueens 14':      17.158,
-    'quicksort large': 19.81442,
-    'mergesort large': 22.33417,
-    'fibonacci 41':    5.000,
-}
+warmup_runs = None      # default: 1 if runs are repeated, else 0
+parallel_jobs = 1
+print_lock = threading.Lock()
 
 tests = load_test_module('standard')
 
@@ -66,14 +61,24 @@ Usage: %s [options]
     -p threadpool   Location of threadpool implementation, default ./threadpool.c
     -o output       Destination of benchmark output, default full-results.json
     -g              Enable grading mode
+    -e              Report throughput and CPU-seconds per run and thread count
+    -i              Build the pool with -DTHREADPOOL_INSTRUMENT and record
+                    its per-worker counters in the results
     -B number       Repeat tests this number of times (only in grading mode)
+    -W number       Discard this many warm-up runs before the repeated ones,
+                    default 1 if -B is more than 1
+    -j number       Run this many tests that are not benchmarked at the same
+                    time, each on its own share of the CPUs.  The per-user
+                    thread limit then leaves room for the other runs, so
+                    it checks the number of threads a pool starts less
+                    strictly.
     -l              List available tests
     -t list         Filter tests by name, given as a comma separated list
                     e.g.: -t basic1,psum
     """ % (sys.argv[0]))
 
 try:
-    opts, args = getopt.getopt(sys.argv[1:], "Varvhlp:t:o:B:gL", ["verbose", "help", "list-tests"])
+    opts, args = getopt.getopt(sys.argv[1:], "Varvhlp:t:o:B:W:j:geiL", ["verbose", "help", "list-tests"])
 except getopt.GetoptError as err:
     print (str(err)) # will print something like "option -a not recognized"
     usage()
@@ -105,8 +110,16 @@ for opt, arg in opts:
         results_file = arg
     elif opt == '-B':
         benchmark_runs = int(arg)
+    elif opt == '-W':
+        warmup_runs = int(arg)
+    elif opt == '-j':
+        parallel_jobs = max(1, int(arg))
     elif opt == '-g':
         grade_mode = True
+    elif opt == '-e':
+        efficiency = True
+    elif opt == '-i':
+        instrument = True
     elif opt == '-t':
         filtered = arg.split(',')
         for _filter in filtered:
@@ -154,6 +167,12 @@ def setup_working_directory():
         sys.exit(2)
 
     copyfile(poolfile, workdir + "/threadpool.c")
+    if instrument:
+        # whatever CFLAGS the tests' Makefile uses
+        with open(workdir + "/threadpool.c", "r+") as f:
+            source = f.read()
+            f.seek(0)
+            f.write("#define THREADPOOL_INSTRUMENT 1\n" + source)
 
     flist = open(filelist, 'r')
     for file in flist:
@@ -264,6 +283,62 @@ def wait_for_load_to_go_down():
 # result: expected output + exit code(?)
 #
 
+#
+# CPU topology
+#
+# The pool pins its workers if it has no more of them than CPUs, one per
+# physical core first and filling one socket before the next.  Record how
+# many sockets each run used, so speedups can be compared per socket
+# configuration.
+#
+def read_cpu_topology():
+    """
+    Returns a list of (package, core, cpu) for the CPUs this process
+    may run on, in the order the pool places its workers on them.
+    """
+    def read_id(cpu, name, default):
+        try:
+            with open("/sys/devices/system/cpu/cpu%d/topology/%s" % (cpu, name)) as f:
+                return int(f.read())
+        except (OSError, ValueError):
+            return default
+
+    seen = defaultdict(int)
+    cpus = []
+    for cpu in sorted(os.sched_getaffinity(0)):
+        package = read_id(cpu, "physical_package_id", 0)
+        core = read_id(cpu, "core_id", cpu)
+        smt = seen[(package, core)]
+        seen[(package, core)] += 1
+        cpus.append((smt, package, core, cpu))
+    return [(package, core, cpu) for smt, package, core, cpu in sorted(cpus)]
+
+def describe_topology(topology):
+    sockets = sorted(set(package for package, core, cpu in topology))
+    cores = set((package, core) for package, core, cpu in topology)
+    return {
+        'sockets': len(sockets),
+        'cores': len(cores),
+        'cpus': len(topology),
+    }
+
+def socket_config(nthreads):
+    """
+    Returns how nthreads workers are spread over the sockets, e.g.
+    '1x8', '2x16', or '16+8'; 'unpinned' if there are more than CPUs.
+    """
+    if nthreads > len(cpu_topology):
+        return 'unpinned'
+    per_socket = defaultdict(int)
+    for package, core, cpu in cpu_topology[:nthreads]:
+        per_socket[package] += 1
+    counts = sorted(per_socket.values(), reverse=True)
+    if len(set(counts)) == 1:
+        return '%dx%d' % (len(counts), counts[0])
+    return '+'.join(map(str, counts))
+
+cpu_topology = read_cpu_topology()
+
 def set_threadlimit(nthreads):
     def limit_threads():
         resource.setrlimit(resource.RLIMIT_NPROC, (nthreads, nthreads))
@@ -275,17 +350,73 @@ def decode(output):
     except UnicodeDecodeError as e:
         return e
 
-def run_single_test(test, run, threads):
+def read_pool_stats(statsfile):
+    """
+    Sum the counters the pools of one run appended to statsfile,
+    one JSON object per pool (see THREADPOOL_STATS in threadpool.c)
+    """
+    if not os.access(statsfile, os.R_OK):
+        return {}
+    tasks = 0
+    allocations = 0
+    pools = []
+    with open(statsfile, 'r') as f:
+        for line in f:
+            pool = json.loads(line)
+            tasks += pool['tasks']
+            allocations += pool['allocations']
+            pools.append(pool)
+    os.unlink(statsfile)
+    stats = {
+        'pool_tasks': tasks,
+        'pool_allocations': allocations
+    }
+    if tasks > 0:
+        stats['allocations_per_task'] = allocations / tasks
+
+    # per-worker counters, if built with -DTHREADPOOL_INSTRUMENT
+    workers = [w for pool in pools for w in pool.get('workers', [])]
+    if workers:
+        stats['pools'] = pools
+        for k in ['executed', 'steals', 'failed_steals', 'idle_s', 'parked_s']:
+            stats['pool_' + k] = sum(w[k] for w in workers)
+        stats['pool_deque_max'] = max(w['deque_max'] for w in workers)
+        durations = defaultdict(int)
+        for w in workers:
+            for bucket, count in enumerate(w['durations_log2_ns']):
+                durations[bucket] += count
+        stats['pool_durations_log2_ns'] = [durations[b] for b in range(max(durations) + 1)] \
+            if durations else []
+    return stats
+
+def run_single_test(test, run, threads, cpus=None, extra_threads=0):
+    """
+    Run one test once.  If cpus is given, it runs on those CPUs only, next
+    to other runs that may have up to extra_threads threads between them,
+    and it reports all at once when done.
+    """
     cmdline = ['timeout', str(run.timeout), test.command, '-n', str(threads)] + run.args
     rundata = {
         'command' : ' '.join(cmdline),
-        'nthreads' : threads
+        'nthreads' : threads,
+        'socket_config' : socket_config(threads)
     }
     def addrundata(d):
         for k, v in d.items():
             rundata[k] = v
 
-    if not silent:
+    inline = cpus is None
+    def report(mark, error=None):
+        if silent:
+            return
+        with print_lock:
+            if not inline:
+                print ('Running:', ' '.join(cmdline), end=' ')
+            print (mark)
+            if error and (verbose or grade_mode):
+                print (error)
+
+    if not silent and inline:
         print ('Running:', ' '.join(cmdline), end=' ')
         sys.stdout.flush()
     infile = None
@@ -295,11 +426,17 @@ def run_single_test(test, run, threads):
     # we set it to #threads + 1 (for the main thread)
     # plus existing procs
     starttime = time.time()
-    preexec_fn = set_threadlimit(threads + 2 + number_of_existing_processes) if test.limit_threads \
-                else (lambda : None)
+    limit_threads = set_threadlimit(threads + 2 + number_of_existing_processes + extra_threads) \
+                if test.limit_threads else (lambda : None)
+    def preexec_fn():
+        limit_threads()
+        if cpus is not None:
+            os.sched_setaffinity(0, cpus)
+    statsfile = 'poolstats.%d.%d.json' % (os.getpid(), time.monotonic_ns())
+    env = dict(os.environ, THREADPOOL_STATS=statsfile)
     proc = subprocess.Popen(cmdline, stdout=subprocess.PIPE,
                             stderr=subprocess.PIPE, stdin=infile,
-                            preexec_fn=preexec_fn)
+                            preexec_fn=preexec_fn, env=env)
 
     stdout, stderr = proc.communicate()
     if grade_mode:
@@ -309,6 +446,7 @@ def run_single_test(test, run, threads):
 
     if infile:
         infile.close()
+    addrundata(read_pool_stats(statsfile))
 
     signames = dict((k, v) for v, k in signal.__dict__.items() if v.startswith('SIG'))
     signum = proc.returncode - 128
@@ -329,10 +467,7 @@ def run_single_test(test, run, threads):
         addrundata({
             'error': error
         })
-        if not silent:
-            print ('[ ]')
-            if verbose or grade_mode:
-                print (error)
+        report('[ ]', error)
 
     elif proc.returncode > 0:
         # non-zero exit code
@@ -352,14 +487,10 @@ def run_single_test(test, run, threads):
         addrundata({
             'error': error
         })
-        if not silent:
-            print ('[ ]')
-            if verbose or grade_mode:
-                print (error)
+        report('[ ]', error)
 
     else:
-        if not silent:
-            print ('[+]')
+        report('[+]')
 
         outfile = 'runresult.%d.json' % (proc.pid)
         addrundata({'stdout': decode(stdout)})
@@ -381,7 +512,8 @@ def run_single_test(test, run, threads):
 def average_run(runs):
     data = {
         'nthreads': runs[0]['nthreads'],
-        'command': runs[0]['command']
+        'command': runs[0]['command'],
+        'socket_config': runs[0]['socket_config']
     }
     totalrtime = 0.0
     totalstime = 0.0
@@ -408,20 +540,119 @@ def average_run(runs):
         data['ru_utime'] = totalutime / len(runs)
         data['run_count'] = len(runs)
         data['passed'] = passed
+        if data['realtime'] > 0:
+            data['throughput'] = 1.0 / data['realtime']
+        realtimes = [run['realtime'] for run in runs]
+        data['realtime_median'] = statistics.median(realtimes)
+        if len(realtimes) > 1:
+            data['realtime_stdev'] = statistics.stdev(realtimes)
+            data['realtime_ci95'] = confidence_interval(realtimes)
+
+    if all('allocations_per_task' in run for run in runs):
+        data['allocations_per_task'] = sum(run['allocations_per_task'] for run in runs) / len(runs)
 
     return data
 
-def benchmark_speedup(data, testname):
-    if 'realtime' not in data or 'cputime' not in data:
+# two-sided 95% quantiles of Student's t, by degrees of freedom
+t_quantiles = [12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+               2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+               2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042]
+
+def confidence_interval(samples):
+    """
+    Returns the 95% confidence interval (low, high) of the mean of samples
+    """
+    n = len(samples)
+    mean = statistics.mean(samples)
+    t = t_quantiles[n - 2] if n - 2 < len(t_quantiles) else 1.960
+    half = t * statistics.stdev(samples) / math.sqrt(n)
+    return [mean - half, mean + half]
+
+def benchmark_speedup(data, baseline):
+    """
+    Speedup over a 1-thread run of the same program on this host, by
+    median, and the efficiency that is per thread
+    """
+    if 'realtime_median' not in data or 'cputime' not in data:
         return
-    serial_time = benchmark_times[testname]
-    data['speedup'] = serial_time / data['realtime']
+    data['serial_baseline'] = baseline
+    data['speedup'] = baseline / data['realtime_median']
+    data['efficiency'] = data['speedup'] / data['nthreads']
     data['cpu_overuse'] = data['cputime'] / data['realtime']
 
+def run_repeated(test, run, threads, cpus=None, extra_threads=0):
+    """
+    Run one configuration as often as the mode asks, after warm-up runs
+    whose results are discarded, and summarize it
+    """
+    repeats = 1
+    if grade_mode and (test.is_required or run.is_benchmarked):
+        repeats = benchmark_runs
+    warmups = warmup_runs if warmup_runs is not None else (1 if repeats > 1 else 0)
+    for warmup in range(warmups):
+        run_single_test(test, run, threads, cpus, extra_threads)
+    runs = [run_single_test(test, run, threads, cpus, extra_threads) for repeat in range(repeats)]
+    rundata = average_run(runs)
+    rundata['runs'] = runs
+    if warmups > 0:
+        rundata['warmup_runs'] = warmups
+    return rundata
+
+def split_cpus(n):
+    """
+    Split the CPUs we may use into n disjoint sets, each as compact as
+    the topology allows
+    """
+    cpus = [cpu for package, core, cpu in sorted(cpu_topology)]
+    n = min(n, len(cpus))
+    share = len(cpus) // n
+    return [set(cpus[i * share:(i + 1) * share]) for i in range(n)]
+
+def job_key(job):
+    test, run, threads = job
+    return (test.name, run.name, threads)
+
+def run_concurrently(jobs):
+    """
+    Run independent (test, run, threads) jobs at the same time on
+    disjoint sets of CPUs.  Returns their results by job.
+    """
+    cpusets = split_cpus(parallel_jobs)
+    free_cpusets = list(cpusets)
+    # every other run may have one thread per CPU of its share, plus its
+    # main thread and timeout
+    extra_threads = (len(cpusets) - 1) * (len(cpusets[0]) + 3)
+    lock = threading.Lock()
+
+    def run_job(job):
+        with lock:
+            cpus = free_cpusets.pop()
+        try:
+            return run_repeated(*job, cpus=cpus, extra_threads=extra_threads)
+        finally:
+            with lock:
+                free_cpusets.append(cpus)
+
+    with ThreadPoolExecutor(max_workers=len(cpusets)) as executor:
+        return dict(zip(map(job_key, jobs), executor.map(run_job, jobs)))
+
 def run_tests(tests):
     results = defaultdict(dict)
 
-    summary = {}
+    # Tests that are not benchmarked run first, several at a time if -j
+    # asks for it; they are small, and their timing does not count.
+    jobs = [(test, run, threads) for test in tests if runfilter(test)
+            for run in test.runs for threads in run.thread_count]
+    done = {}
+    if parallel_jobs > 1:
+        cpus_per_job = len(split_cpus(parallel_jobs)[0])
+        small = [job for job in jobs if not job[1].is_benchmarked and job[2] <= cpus_per_job]
+        if small and not silent:
+            print ('')
+            print ('Running %d small tests, %d at a time' % (len(small), len(split_cpus(parallel_jobs))))
+            print ('=' * 80)
+        done = run_concurrently(small)
+
     for test in tests:
         if not runfilter(test):
             if verbose:
@@ -439,21 +670,18 @@ def run_tests(tests):
             results[test.name][run.name] = perthreadresults
 
             for threads in run.thread_count:
-                if grade_mode:
-                    repeats = benchmark_runs if test.is_required or run.is_benchmarked else 1
-                    runs = []
-                    for repeat in range(repeats):
-                        runs.append(run_single_test(test, run, threads))
-                    rundata = average_run(runs)
-                    rundata['runs'] = runs
-                    if run.is_benchmarked:
-                        benchmark_speedup(rundata, run.name)
-                    perthreadresults.append(rundata)
-                else:
-                    runs = [run_single_test(test, run, threads)]
-                    rundata = average_run(runs)
-                    rundata['runs'] = runs
-                    perthreadresults.append(rundata)
+                job = (test, run, threads)
+                key = job_key(job)
+                perthreadresults.append(done[key] if key in done else run_repeated(*job))
+
+            if grade_mode and run.is_benchmarked:
+                # the serial baseline: this program with 1 thread, here
+                baseline = find_thread_run(perthreadresults, 1)
+                if baseline is None:
+                    baseline = run_repeated(test, run, 1)
+                if 'realtime_median' in baseline:
+                    for rundata in perthreadresults:
+                        benchmark_speedup(rundata, baseline['realtime_median'])
     return results
 
 def print_results(results):
@@ -489,6 +717,8 @@ def print_grade_table(results, tests):
     # report the results of running each tests with
     thread_headers = [1, 2, 4, 8, 16, 32]
     print ('')
+    print ('Machine: %(sockets)d socket(s), %(cores)d core(s), %(cpus)d CPU(s)' % describe_topology(cpu_topology))
+    print ('Sockets:' + (18 * ' ') + ''.join(map(lambda x: '%-10s' % socket_config(x), thread_headers)))
     print ('Test name:' + (16 * ' ') + ''.join(map(lambda x: '%-10s' % str(x), thread_headers)))
     print ('='*80)
     minimum_requirements = True
@@ -531,6 +761,45 @@ def print_grade_table(results, tests):
     else:
         print ('You did not meet minimum requirements; your performance score will be zero.')
 
+def print_speedup_table(results, tests):
+    # speedup and efficiency curves of the benchmarked runs
+    print ('')
+    print ('%-23s %8s %10s %22s %8s %10s' % ('Benchmark', 'threads', 'median', '95% CI of mean', 'speedup', 'efficiency'))
+    print ('='*80)
+    for test in tests:
+        if not runfilter(test) or test.name not in results:
+            continue
+        for run in test.runs:
+            if not run.is_benchmarked:
+                continue
+            for data in results[test.name][run.name]:
+                if 'speedup' not in data:
+                    print ('%-23s %8d %10s' % (run.name, data['nthreads'], 'failed'))
+                    continue
+                ci = '[%.3f, %.3f]' % tuple(data['realtime_ci95']) if 'realtime_ci95' in data else '-'
+                print ('%-23s %8d %9.3fs %22s %8.2f %10.2f' % (run.name, data['nthreads'],
+                    data['realtime_median'], ci, data['speedup'], data['efficiency']))
+    print ('='*80)
+
+def print_efficiency_table(results, tests):
+    # what each run costs in CPU time for how fast it finishes: a pool
+    # that spins finishes no sooner, but burns CPU-seconds while idle
+    print ('')
+    print ('%-23s %8s %10s %12s %10s %10s' % ('Run', 'threads', 'realtime', 'runs/s', 'cpu_s', 'cpu/real'))
+    print ('='*80)
+    for test in tests:
+        if not runfilter(test) or test.name not in results:
+            continue
+        for run in test.runs:
+            for data in results[test.name][run.name]:
+                if 'throughput' not in data:
+                    print ('%-23s %8d %10s' % (run.name, data['nthreads'], 'failed'))
+                    continue
+                print ('%-23s %8d %9.3fs %12.3f %10.3f %10.2f' % (run.name, data['nthreads'],
+                    data['realtime'], data['throughput'], data['cputime'],
+                    data['cputime'] / data['realtime']))
+    print ('='*80)
+
 
 setup_working_directory()
 check_software_engineering("threadpool.o", allowedsymbols)
@@ -546,6 +815,10 @@ if verbose:
     print_results(results)
 if not silent:
     print_grade_table(results, tests)
+    if grade_mode:
+        print_speedup_table(results, tests)
+if efficiency:
+    print_efficiency_table(results, tests)
 
 write_results_to_json(results_file)
 print ("Wrote full results to %s/%s" % (workdir, results_file))
@@ -0,0 +1,943 @@
+/*
+ * threadpool.c - a work-stealing fork/join thread pool.
+ *
+ * Each worker owns a Chase-Lev deque.  A task submitted by a worker is
+ * pushed onto the bottom of that worker's deque, and the worker pops
+ * from the bottom (LIFO), so it runs its most recently forked, and
+ * usually smallest, subtask next, on warm caches.  A worker whose deque
+ * is empty takes a task submitted from outside the pool, from the pool's
+ * global queue, or else steals from the top of another worker's deque
+ * (FIFO), where the oldest and usually largest tasks are.
+ *
+ * future_get() from within a worker never blocks: until the future is
+ * done, the worker keeps running other tasks, its own first.  A future
+ * that has not been stolen is therefore found at the bottom of the
+ * worker's own deque and run right there (work-first).  A thread from
+ * outside the pool sleeps until the future is done.
+ *
+ * A worker that runs out of work keeps looking for a while, backing off
+ * exponentially between looks, and then parks on a futex of its own.
+ * How long it looks adapts: it looks longer after looking paid off, and
+ * shorter after it had to park anyway.  New work wakes exactly one
+ * parked worker, the nearest to the submitter.  All state is per pool,
+ * so several pools may be used at the same time.
+ *
+ * Placement.  Unless there are more workers than CPUs, each worker is
+ * pinned to a CPU of its own, one per physical core first, filling the
+ * socket of the thread that created the pool before moving on to the
+ * next.  A thief then looks for work close by first: on its own core,
+ * then on its own socket, and only then on the other sockets, so that
+ * subtasks stay near the data their parents touched.  Each worker
+ * allocates its own deque once pinned, so it lands on the local node.
+ *
+ * Futures.  A worker takes the futures it submits from a free list of
+ * its own, refilled FUTURE_CHUNK at a time, so fine-grained tasks do not
+ * call malloc each.  A future freed by its owner goes back on that list;
+ * one freed by another thread is collected in a batch of that thread's
+ * and handed back to the owner's return list, which the owner takes over
+ * whole when its free list runs dry.  Chunks come from malloc, or from
+ * mm_malloc if built with -DTHREADPOOL_MM (see ../malloclab).  Futures of
+ * tasks submitted from outside the pool are malloc'd one by one.
+ *
+ * If THREADPOOL_STATS names a file in the environment, each pool appends
+ * one line of JSON with its task and allocation counts to it when it is
+ * destroyed; fjdriver reads it.  Built with -DTHREADPOOL_INSTRUMENT, it
+ * also writes per-worker counters: tasks run, steals that succeeded and
+ * that found nothing, time spent looking for work and asleep, the
+ * deque's high-water mark, and a histogram of task durations.
+ *
+ * Chase-Lev deque after: N. M. Lê, A. Pop, A. Cohen, F. Zappa Nardelli,
+ * "Correct and Efficient Work-Stealing for Weak Memory Models",
+ * PPoPP 2013.
+ */
+#define _GNU_SOURCE 1
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "threadpool.h"
+#ifdef THREADPOOL_MM
+#include "mm.h"
+#define chunk_malloc mm_malloc
+#define chunk_free mm_free
+#else
+#define chunk_malloc malloc
+#define chunk_free free
+#endif
+
+#define CACHE_LINE 64
+#define DEQUE_INITIAL_SIZE 256  /* slots; a power of 2 */
+#define MIN_SPINS 4             /* tries to find work before parking... */
+#define MAX_SPINS 32            /* ...adapting between these */
+#define BACKOFF_SHIFT 10        /* spin up to 2^this pauses, then yield */
+#define FUTURE_CHUNK 64         /* futures a worker allocates at a time */
+#define FREE_BATCH 32           /* foreign futures freed before handing back */
+#define DURATION_BUCKETS 32     /* log2 of nanoseconds */
+
+#ifndef THREADPOOL_INSTRUMENT
+#define THREADPOOL_INSTRUMENT 0
+#endif
+/* Keep statistics, if built to; otherwise compiled out */
+#define INSTRUMENT(stmt) do { if (THREADPOOL_INSTRUMENT) { stmt; } } while (0)
+
+enum future_state {
+    PENDING,
+    WAITING,                    /* PENDING, and a thread outside the pool waits for it */
+    DONE,
+};
+
+struct future {
+    fork_join_task_t task;
+    void *data;
+    void *result;
+    struct thread_pool *pool;
+    struct future *next;        /* in the pool's global queue, or a free list */
+    struct worker *owner;       /* whose free list it returns to, or NULL */
+    atomic_int state;
+};
+
+/* The circular array of a deque.  When a deque grows, its old array
+ * may still be read by a thief, so it is kept until the pool goes. */
+struct deque_array {
+    long size;
+    struct deque_array *retired;        /* the array this one replaced */
+    _Atomic(struct future *) slots[];
+};
+
+struct deque {
+    atomic_long top;            /* where thieves steal */
+    char pad[CACHE_LINE - sizeof(atomic_long)];
+    atomic_long bottom;         /* where the owner pushes and pops */
+    _Atomic(struct deque_array *) array;
+    long high_water;            /* the most tasks it held */
+};
+
+/* Where a CPU sits in the machine */
+struct cpu_info {
+    int cpu;
+    int package;                /* socket */
+    int core;                   /* physical core within the socket */
+    int smt;                    /* which hardware thread of the core */
+};
+
+/* How close one worker's CPU is to another's, for stealing */
+enum {
+    SAME_CORE,
+    SAME_SOCKET,
+    REMOTE,
+    NLEVELS
+};
+
+/* What a worker did, for -DTHREADPOOL_INSTRUMENT */
+struct worker_stats {
+    unsigned long executed;     /* tasks run */
+    unsigned long steals;       /* tasks taken from other deques */
+    unsigned long failed_steals;        /* looks at a deque that gave nothing */
+    uint64_t idle_ns;           /* looking for work, without any */
+    uint64_t parked_ns;         /* asleep */
+    /* tasks that took [2^i, 2^(i+1)) ns, including the subtasks they ran
+     * while waiting for others */
+    unsigned long durations[DURATION_BUCKETS];
+};
+
+struct worker {
+    struct deque deque;
+    struct thread_pool *pool;
+    pthread_t thread;
+    unsigned int seed;          /* for picking victims */
+    int cpu;                    /* pinned to, or -1 */
+    int *victims;               /* the other workers, nearest first */
+    int level_end[NLEVELS];     /* where each level of victims ends */
+
+    struct future *free_futures;        /* only this worker touches these */
+    struct future_chunk *chunks;        /* everything allocated for them */
+    struct future *batch;               /* foreign futures freed here... */
+    struct future *batch_tail;
+    struct worker *batch_owner;         /* ...which all belong to this one */
+    int batch_size;
+    unsigned long tasks;                /* futures submitted by this worker */
+    unsigned long allocations;          /* calls to chunk_malloc for them */
+    struct worker_stats stats;
+
+    int spin_limit;             /* tries before parking, adapted */
+
+    /* What other threads write to, on a line of its own: futures of
+     * ours they freed, and the futex we park on. */
+    _Alignas(CACHE_LINE) _Atomic(struct future *) returned;
+    atomic_int parked;          /* 1 while parked; whoever clears it wakes us */
+} __attribute__((aligned(CACHE_LINE)));
+
+struct future_chunk {
+    struct future_chunk *next;
+    struct future futures[FUTURE_CHUNK];
+};
+
+struct thread_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t done;        /* outside threads wait for futures here */
+    struct future *queue_head;  /* tasks submitted from outside the pool */
+    struct future *queue_tail;
+    atomic_long queued;         /* the length of that queue */
+    atomic_int sleepers;        /* workers parked, or about to be */
+    atomic_uint next_wake;      /* where outside submitters look for one */
+    atomic_bool shutdown;
+    int nworkers;
+    struct worker *workers;
+    pthread_barrier_t started; /* all workers have set up their deques */
+    atomic_ulong outside_tasks; /* submitted from outside the pool */
+};
+
+/* The worker the calling thread is, or NULL if none */
+static __thread struct worker *current_worker;
+
+/* Deque operations. */
+
+static struct deque_array *
+deque_array_new(long size)
+{
+    struct deque_array *a = malloc(sizeof *a + size * sizeof a->slots[0]);
+    if (a == NULL)
+        abort();
+    a->size = size;
+    a->retired = NULL;
+    return a;
+}
+
+static void
+deque_init(struct deque *d)
+{
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    atomic_init(&d->array, deque_array_new(DEQUE_INITIAL_SIZE));
+    d->high_water = 0;
+}
+
+static void
+deque_destroy(struct deque *d)
+{
+    struct deque_array *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    while (a != NULL) {
+        struct deque_array *retired = a->retired;
+        free(a);
+        a = retired;
+    }
+}
+
+/* Double the array of d, which holds the tasks from top to bottom */
+static struct deque_array *
+deque_grow(struct deque *d, struct deque_array *a, long top, long bottom)
+{
+    struct deque_array *bigger = deque_array_new(2 * a->size);
+    for (long i = top; i < bottom; i++) {
+        struct future *f = atomic_load_explicit(&a->slots[i & (a->size - 1)], memory_order_relaxed);
+        atomic_store_explicit(&bigger->slots[i & (bigger->size - 1)], f, memory_order_relaxed);
+    }
+    bigger->retired = a;
+    atomic_store_explicit(&d->array, bigger, memory_order_release);
+    return bigger;
+}
+
+/* Push f onto the bottom.  Only the owner may call this. */
+static void
+deque_push(struct deque *d, struct future *f)
+{
+    long bottom = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    struct deque_array *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    if (bottom - top > a->size - 1)
+        a = deque_grow(d, a, top, bottom);
+    atomic_store_explicit(&a->slots[bottom & (a->size - 1)], f, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, bottom + 1, memory_order_relaxed);
+    INSTRUMENT(if (bottom + 1 - top > d->high_water) d->high_water = bottom + 1 - top);
+}
+
+/* Pop from the bottom, or return NULL if empty.  Only the owner may
+ * call this. */
+static struct future *
+deque_pop(struct deque *d)
+{
+    long bottom = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    struct deque_array *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&d->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    struct future *f = atomic_load_explicit(&a->slots[bottom & (a->size - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // The last task: race the thieves for it.
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed))
+            f = NULL;
+        atomic_store_explicit(&d->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return f;
+}
+
+/* Steal from the top.  Returns NULL if empty; sets *contended if it
+ * lost a race with another thief or the owner, so may try again. */
+static struct future *
+deque_steal(struct deque *d, bool *contended)
+{
+    long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (top >= bottom)
+        return NULL;
+
+    struct deque_array *a = atomic_load_explicit(&d->array, memory_order_acquire);
+    struct future *f = atomic_load_explicit(&a->slots[top & (a->size - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        *contended = true;
+        return NULL;
+    }
+    return f;
+}
+
+static bool
+deque_is_empty(struct deque *d)
+{
+    long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    long bottom = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    return top >= bottom;
+}
+
+/* Future allocation. */
+
+static struct future *
+future_alloc(struct worker *w)
+{
+    if (w == NULL) {
+        struct future *f = malloc(sizeof *f);
+        if (f != NULL)
+            f->owner = NULL;
+        return f;
+    }
+
+    w->tasks++;
+    struct future *f = w->free_futures;
+    if (f == NULL)
+        f = atomic_exchange_explicit(&w->returned, NULL, memory_order_acquire);
+    if (f == NULL) {
+        struct future_chunk *c = chunk_malloc(sizeof *c);
+        if (c == NULL)
+            return NULL;
+        w->allocations++;
+        c->next = w->chunks;
+        w->chunks = c;
+        for (int i = 0; i < FUTURE_CHUNK; i++) {
+            c->futures[i].owner = w;
+            c->futures[i].next = i + 1 < FUTURE_CHUNK ? &c->futures[i + 1] : NULL;
+        }
+        f = &c->futures[0];
+    }
+    w->free_futures = f->next;
+    return f;
+}
+
+/* Push the list first..last onto the return list of its owner */
+static void
+future_return(struct worker *owner, struct future *first, struct future *last)
+{
+    struct future *head = atomic_load_explicit(&owner->returned, memory_order_relaxed);
+    do
+        last->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&owner->returned, &head, first,
+                                                  memory_order_release, memory_order_relaxed));
+}
+
+/* Hand the futures w collected back to their owner */
+static void
+flush_batch(struct worker *w)
+{
+    if (w->batch != NULL)
+        future_return(w->batch_owner, w->batch, w->batch_tail);
+    w->batch = w->batch_tail = NULL;
+    w->batch_owner = NULL;
+    w->batch_size = 0;
+}
+
+/* Finding and running tasks. */
+
+/* Take the oldest task submitted from outside, or NULL if none */
+static struct future *
+take_queued(struct thread_pool *pool)
+{
+    if (atomic_load_explicit(&pool->queued, memory_order_relaxed) == 0)
+        return NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    struct future *f = pool->queue_head;
+    if (f != NULL) {
+        pool->queue_head = f->next;
+        if (pool->queue_head == NULL)
+            pool->queue_tail = NULL;
+        atomic_fetch_sub_explicit(&pool->queued, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return f;
+}
+
+/* Steal from the other workers, the nearest ones first, starting at
+ * a random one within each level */
+static struct future *
+steal_task(struct worker *w)
+{
+    struct thread_pool *pool = w->pool;
+    bool contended;
+    do {
+        contended = false;
+        int begin = 0;
+        for (int level = 0; level < NLEVELS; level++) {
+            int end = w->level_end[level];
+            int n = end - begin;
+            int start = n > 1 ? rand_r(&w->seed) % n : 0;
+            for (int i = 0; i < n; i++) {
+                struct worker *victim = &pool->workers[w->victims[begin + (start + i) % n]];
+                struct future *f = deque_steal(&victim->deque, &contended);
+                if (f != NULL) {
+                    INSTRUMENT(w->stats.steals++);
+                    return f;
+                }
+                INSTRUMENT(w->stats.failed_steals++);
+            }
+            begin = end;
+        }
+    } while (contended);
+    return NULL;
+}
+
+/* Find a task for w to run: its own newest, else one from outside,
+ * else another worker's oldest.  Returns NULL if there is none. */
+static struct future *
+find_task(struct worker *w)
+{
+    struct future *f = deque_pop(&w->deque);
+    if (f == NULL)
+        f = take_queued(w->pool);
+    if (f == NULL)
+        f = steal_task(w);
+    return f;
+}
+
+/* The time, for statistics only */
+static uint64_t
+stats_clock(void)
+{
+    if (!THREADPOOL_INSTRUMENT)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+record_duration(struct worker *w, uint64_t ns)
+{
+    int bucket = ns > 0 ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= DURATION_BUCKETS)
+        bucket = DURATION_BUCKETS - 1;
+    w->stats.executed++;
+    w->stats.durations[bucket]++;
+}
+
+/* Run f on worker w.  Once f is DONE, whoever waits for it may free
+ * it at once, so f is not touched after that. */
+static void
+run_task(struct worker *w, struct future *f)
+{
+    struct thread_pool *pool = f->pool;
+    uint64_t start = stats_clock();
+    f->result = f->task(pool, f->data);
+    INSTRUMENT(record_duration(w, stats_clock() - start));
+    if (atomic_exchange(&f->state, DONE) == WAITING) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* Whether any task is waiting to be run */
+static bool
+have_work(struct thread_pool *pool)
+{
+    if (atomic_load(&pool->queued) > 0)
+        return true;
+    for (int i = 0; i < pool->nworkers; i++)
+        if (!deque_is_empty(&pool->workers[i].deque))
+            return true;
+    return false;
+}
+
+static void
+futex_wait(atomic_int *addr, int value)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void
+futex_wake(atomic_int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Wake w if it is parked.  Returns whether it was. */
+static bool
+unpark(struct thread_pool *pool, struct worker *w)
+{
+    int expected = 1;
+    if (atomic_load_explicit(&w->parked, memory_order_relaxed) != 1
+        || !atomic_compare_exchange_strong(&w->parked, &expected, 0))
+        return false;
+    atomic_fetch_sub(&pool->sleepers, 1);
+    futex_wake(&w->parked);
+    return true;
+}
+
+/* Wake up one parked worker, if there is one, after new work came in:
+ * the one nearest to the submitter w, or any if w is NULL */
+static void
+wake_worker(struct thread_pool *pool, struct worker *w)
+{
+    // Pairs with the increment of sleepers before a worker's last look
+    // for work: either it sees the new task, or we see it is parked.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->sleepers, memory_order_relaxed) == 0)
+        return;
+
+    int n = pool->nworkers;
+    if (w != NULL) {
+        for (int i = 0; i < n - 1; i++)
+            if (unpark(pool, &pool->workers[w->victims[i]]))
+                return;
+        return;
+    }
+    unsigned int start = atomic_fetch_add_explicit(&pool->next_wake, 1, memory_order_relaxed);
+    for (int i = 0; i < n; i++)
+        if (unpark(pool, &pool->workers[(start + i) % n]))
+            return;
+}
+
+/* Wait a little before the next look for work, the longer the more
+ * looks came up empty */
+static void
+relax(int spins)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (spins < BACKOFF_SHIFT) {
+        for (int i = 0; i < 1 << spins; i++)
+            __builtin_ia32_pause();
+        return;
+    }
+#endif
+    (void) spins;
+    sched_yield();
+}
+
+/* Park w until another thread unparks it, unless work came in or the
+ * pool shut down before it got to sleep */
+static void
+park(struct thread_pool *pool, struct worker *w)
+{
+    atomic_store(&w->parked, 1);
+    atomic_fetch_add(&pool->sleepers, 1);
+    if (have_work(pool) || atomic_load(&pool->shutdown)) {
+        // Take it back, unless a waker beat us to it.
+        int expected = 1;
+        if (atomic_compare_exchange_strong(&w->parked, &expected, 0))
+            atomic_fetch_sub(&pool->sleepers, 1);
+        return;
+    }
+    uint64_t since = stats_clock();
+    while (atomic_load(&w->parked) == 1)
+        futex_wait(&w->parked, 1);
+    INSTRUMENT(w->stats.parked_ns += stats_clock() - since);
+}
+
+static void *
+worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct thread_pool *pool = w->pool;
+    current_worker = w;
+
+    if (w->cpu != -1) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    }
+    deque_init(&w->deque);
+    pthread_barrier_wait(&pool->started);
+
+    while (!atomic_load_explicit(&pool->shutdown, memory_order_relaxed)) {
+        struct future *f = find_task(w);
+        if (f == NULL) {
+            uint64_t since = stats_clock();
+            for (int spins = 0; f == NULL && spins < w->spin_limit; spins++) {
+                relax(spins);
+                f = find_task(w);
+            }
+            INSTRUMENT(w->stats.idle_ns += stats_clock() - since);
+            // Look longer next time if it paid off, shorter if not.
+            if (f != NULL && w->spin_limit < MAX_SPINS)
+                w->spin_limit *= 2;
+            else if (f == NULL && w->spin_limit > MIN_SPINS)
+                w->spin_limit /= 2;
+        }
+        if (f != NULL) {
+            run_task(w, f);
+            continue;
+        }
+
+        // Before parking, so other workers may reuse what we freed.
+        flush_batch(w);
+        park(pool, w);
+    }
+    return NULL;
+}
+
+/* Topology. */
+
+/* Read a number from the topology directory of cpu in sysfs, or -1 */
+static int
+read_topology(int cpu, const char *name)
+{
+    char path[96];
+    snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    int value;
+    if (fscanf(f, "%d", &value) != 1)
+        value = -1;
+    fclose(f);
+    return value;
+}
+
+/* For qsort_r; home is the package to put first */
+static int
+compare_placement(const void *a, const void *b, void *home)
+{
+    const struct cpu_info *x = a, *y = b;
+    int home_package = *(int *)home;
+    if (x->smt != y->smt)
+        return x->smt - y->smt;
+    if ((x->package != home_package) != (y->package != home_package))
+        return x->package != home_package ? 1 : -1;
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+/*
+ * Find the CPUs this thread may run on, in the order workers are placed
+ * on them: the first hardware thread of every core before any second
+ * one, and within that the cores of the caller's own socket first.
+ * Returns how many there are.
+ */
+static int
+discover_cpus(struct cpu_info **cpus)
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof set, &set) != 0)
+        return 0;
+
+    int n = 0;
+    *cpus = malloc(CPU_COUNT(&set) * sizeof **cpus);
+    if (*cpus == NULL)
+        return 0;
+    int me = sched_getcpu();
+    int home_package = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set))
+            continue;
+        struct cpu_info *c = &(*cpus)[n++];
+        c->cpu = cpu;
+        c->package = read_topology(cpu, "physical_package_id");
+        c->core = read_topology(cpu, "core_id");
+        if (c->package == -1)
+            c->package = 0;
+        if (c->core == -1)
+            c->core = cpu;
+        c->smt = 0;
+        for (struct cpu_info *d = *cpus; d < c; d++)
+            if (d->package == c->package && d->core == c->core)
+                c->smt++;
+        if (cpu == me)
+            home_package = c->package;
+    }
+    qsort_r(*cpus, n, sizeof **cpus, compare_placement, &home_package);
+    return n;
+}
+
+/* Order each worker's victims by how close they are */
+static void
+order_victims(struct thread_pool *pool, const struct cpu_info *placed)
+{
+    int n = pool->nworkers;
+    for (int i = 0; i < n; i++) {
+        struct worker *w = &pool->workers[i];
+        w->victims = malloc((n > 1 ? n - 1 : 1) * sizeof *w->victims);
+        if (w->victims == NULL)
+            abort();
+
+        int k = 0;
+        for (int level = 0; level < NLEVELS; level++) {
+            for (int j = 0; j < n; j++) {
+                if (j == i)
+                    continue;
+                int l = REMOTE;
+                if (placed == NULL)
+                    l = REMOTE;         /* unpinned: all the same */
+                else if (placed[j].package == placed[i].package)
+                    l = placed[j].core == placed[i].core ? SAME_CORE : SAME_SOCKET;
+                if (l == level)
+                    w->victims[k++] = j;
+            }
+            w->level_end[level] = k;
+        }
+    }
+}
+
+/* Append this pool's counters to the file path, one line per pool */
+static void
+write_stats(struct thread_pool *pool, const char *path)
+{
+    unsigned long tasks = atomic_load(&pool->outside_tasks), allocations = tasks;
+    for (int i = 0; i < pool->nworkers; i++) {
+        tasks += pool->workers[i].tasks;
+        allocations += pool->workers[i].allocations;
+    }
+
+    FILE *f = fopen(path, "a");
+    if (f == NULL)
+        return;
+    fprintf(f, "{\"nthreads\": %d, \"tasks\": %lu, \"allocations\": %lu",
+            pool->nworkers, tasks, allocations);
+    if (THREADPOOL_INSTRUMENT) {
+        fprintf(f, ", \"workers\": [");
+        for (int i = 0; i < pool->nworkers; i++) {
+            struct worker *w = &pool->workers[i];
+            struct worker_stats *st = &w->stats;
+            fprintf(f, "%s{\"cpu\": %d, \"executed\": %lu, \"steals\": %lu, "
+                    "\"failed_steals\": %lu, \"idle_s\": %.6f, \"parked_s\": %.6f, "
+                    "\"deque_max\": %ld, \"durations_log2_ns\": [",
+                    i > 0 ? ", " : "", w->cpu, st->executed, st->steals,
+                    st->failed_steals, st->idle_ns / 1e9, st->parked_ns / 1e9,
+                    w->deque.high_water);
+            int n = DURATION_BUCKETS;
+            while (n > 0 && st->durations[n - 1] == 0)
+                n--;
+            for (int b = 0; b < n; b++)
+                fprintf(f, "%s%lu", b > 0 ? ", " : "", st->durations[b]);
+            fprintf(f, "]}");
+        }
+        fprintf(f, "]");
+    }
+    fprintf(f, "}\n");
+    fclose(f);
+}
+
+/* The public interface. */
+
+struct thread_pool *
+thread_pool_new(int nthreads)
+{
+    if (nthreads < 1)
+        nthreads = 1;
+
+    struct thread_pool *pool = malloc(sizeof *pool);
+    if (pool == NULL)
+        return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->queue_head = pool->queue_tail = NULL;
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->sleepers, 0);
+    atomic_init(&pool->next_wake, 0);
+    atomic_init(&pool->shutdown, false);
+    pool->nworkers = nthreads;
+    if (posix_memalign((void **) &pool->workers, CACHE_LINE, nthreads * sizeof *pool->workers) != 0)
+        abort();
+
+    // Pin only if every worker can have a CPU to itself.
+    struct cpu_info *cpus = NULL;
+    int ncpus = discover_cpus(&cpus);
+    bool pin = ncpus > 1 && nthreads <= ncpus;
+    for (int i = 0; i < nthreads; i++) {
+        struct worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->seed = i * 2654435761u + 1;
+        w->cpu = pin ? cpus[i].cpu : -1;
+        w->free_futures = NULL;
+        w->chunks = NULL;
+        w->batch = w->batch_tail = NULL;
+        w->batch_owner = NULL;
+        w->batch_size = 0;
+        w->tasks = w->allocations = 0;
+        w->stats = (struct worker_stats) { 0 };
+        atomic_init(&w->returned, NULL);
+        atomic_init(&w->parked, 0);
+        w->spin_limit = MIN_SPINS;
+    }
+    order_victims(pool, pin ? cpus : NULL);
+    free(cpus);
+
+    // Return only once all deques exist, as the workers steal from
+    // each other and submissions may go to any of them.
+    atomic_init(&pool->outside_tasks, 0);
+    pthread_barrier_init(&pool->started, NULL, nthreads + 1);
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]);
+    pthread_barrier_wait(&pool->started);
+    return pool;
+}
+
+void
+thread_pool_shutdown_and_destroy(struct thread_pool *pool)
+{
+    atomic_store(&pool->shutdown, true);
+    for (int i = 0; i < pool->nworkers; i++)
+        unpark(pool, &pool->workers[i]);
+
+    for (int i = 0; i < pool->nworkers; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    const char *stats = getenv("THREADPOOL_STATS");
+    if (stats != NULL && *stats != '\0')
+        write_stats(pool, stats);
+    for (int i = 0; i < pool->nworkers; i++) {
+        struct worker *w = &pool->workers[i];
+        deque_destroy(&w->deque);
+        free(w->victims);
+        while (w->chunks != NULL) {
+            struct future_chunk *c = w->chunks;
+            w->chunks = c->next;
+            chunk_free(c);
+        }
+    }
+    pthread_barrier_destroy(&pool->started);
+
+    free(pool->workers);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+struct future *
+thread_pool_submit(struct thread_pool *pool, fork_join_task_t task, void *data)
+{
+    struct worker *w = current_worker;
+    if (w != NULL && w->pool != pool)
+        w = NULL;
+    if (w == NULL)
+        atomic_fetch_add_explicit(&pool->outside_tasks, 1, memory_order_relaxed);
+    struct future *f = future_alloc(w);
+    if (f == NULL)
+        return NULL;
+    f->task = task;
+    f->data = data;
+    f->pool = pool;
+    f->next = NULL;
+    atomic_init(&f->state, PENDING);
+
+    if (w != NULL) {
+        deque_push(&w->deque, f);
+        wake_worker(pool, w);
+        return f;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->queue_tail != NULL)
+        pool->queue_tail->next = f;
+    else
+        pool->queue_head = f;
+    pool->queue_tail = f;
+    atomic_fetch_add_explicit(&pool->queued, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&pool->lock);
+    wake_worker(pool, NULL);
+    return f;
+}
+
+void *
+future_get(struct future *f)
+{
+    struct worker *w = current_worker;
+    if (w != NULL && w->pool == f->pool) {
+        // Help: run other tasks until this one is done.  If nobody stole
+        // it, it is at the bottom of our own deque and comes first.
+        int spins = 0;
+        uint64_t since = 0;
+        while (atomic_load_explicit(&f->state, memory_order_acquire) != DONE) {
+            struct future *g = find_task(w);
+            if (g != NULL) {
+                INSTRUMENT(if (spins > 0) w->stats.idle_ns += stats_clock() - since);
+                run_task(w, g);
+                spins = 0;
+            } else {
+                INSTRUMENT(if (spins == 0) since = stats_clock());
+                relax(spins++);
+            }
+        }
+        INSTRUMENT(if (spins > 0) w->stats.idle_ns += stats_clock() - since);
+        return f->result;
+    }
+
+    if (atomic_load_explicit(&f->state, memory_order_acquire) != DONE) {
+        // Say so under the lock, so that the worker's broadcast cannot
+        // come between the check and the wait.  If the task finished
+        // meanwhile, the exchange fails on DONE and there is no wait.
+        struct thread_pool *pool = f->pool;
+        int expected = PENDING;
+        pthread_mutex_lock(&pool->lock);
+        atomic_compare_exchange_strong(&f->state, &expected, WAITING);
+        while (atomic_load(&f->state) != DONE)
+            pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return f->result;
+}
+
+void
+future_free(struct future *f)
+{
+    struct worker *owner = f->owner;
+    if (owner == NULL) {
+        free(f);
+        return;
+    }
+
+    struct worker *w = current_worker;
+    if (w == owner) {
+        f->next = w->free_futures;
+        w->free_futures = f;
+    } else if (w == NULL || w->pool != owner->pool) {
+        f->next = NULL;
+        future_return(owner, f, f);
+    } else {
+        if (w->batch_owner != owner || w->batch_size == FREE_BATCH)
+            flush_batch(w);
+        f->next = w->batch;
+        w->batch = f;
+        if (w->batch_tail == NULL)
+            w->batch_tail = f;
+        w->batch_owner = owner;
+        w->batch_size++;
+    }
+}